@@ -15,7 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <pthread.h>
+#include <stdint.h>
 
 #include "ws_ctube.h"
 #include "simulation.h"
@@ -26,13 +26,16 @@ int main()
 	fflush(stdout);
 
 	/* ws_ctube server parameters */
-	int port = 9743;
-	int max_nclient = 100;
-	int timeout_ms = 0; // disable timeout
-	double max_broadcast_fps = 24;
+	struct ws_ctube_opts opts;
+	ws_ctube_opts_init(&opts);
+	opts.port = 9743;
+	opts.max_nclient = 100;
+	opts.timeout_ms = 0; // disable timeout
+	opts.max_broadcast_fps = 24;
+	opts.prealloc_size = SIMULATION_IMG_BYTES; // prefault buffers for images
 
 	/* create websocket ctube server */
-	struct ws_ctube *ctube = ws_ctube_open(port, max_nclient, timeout_ms, max_broadcast_fps);
+	struct ws_ctube *ctube = ws_ctube_open_opts(&opts);
 	if (ctube == NULL) {
 		fprintf(stderr, "websocket ctube failed to start\n");
 		return -1;
@@ -41,23 +44,24 @@ int main()
 	fflush(stdout);
 
 	/* start example simulation */
-	pthread_mutex_t *example_data_mutex;
-	void *data;
-	size_t data_bytes;
-	if (simulation_init(&example_data_mutex) != 0) {
+	if (simulation_init() != 0) {
 		fprintf(stderr, "demo simulation failed to init\n");
 		return -1;
 	}
 
 	/* example simulation main loop */
 	for (unsigned i = 0;; i++) {
-		simulation_step(&data, &data_bytes);
+		simulation_step();
 
-		/* periodically broadcast data to connected clients via websocket ctube */
+		/* periodically broadcast data to connected clients via websocket
+		 * ctube: render the image directly into memory owned by ctube so
+		 * that no extra copy is made */
 		if (i % 10 == 0) {
-			pthread_mutex_lock(example_data_mutex);
-			ws_ctube_broadcast(ctube, data, data_bytes);
-			pthread_mutex_unlock(example_data_mutex);
+			uint8_t *img_data = (uint8_t *)ws_ctube_reserve(ctube, SIMULATION_IMG_BYTES);
+			if (img_data != NULL) {
+				simulation_mkimg(img_data);
+				ws_ctube_commit(ctube, img_data);
+			}
 		}
 	}
 
@@ -28,14 +28,12 @@
 
 static float t; // time
 static float *grid, *prev_grid; // simulation grid
-static pthread_mutex_t example_mutex; // example mutex to protect img_data (not actually needed in this case)
-static uint8_t *img_data; // simulation grid mapped to image rgb [0,255]
 
 const int low_temperature = 600; // for color mapping
 const int high_temperature = 3000; // for color mapping
 struct blackbody_RGB_8_table blackbody_color_table; // physically computed blackbody sRGB
 
-int simulation_init(pthread_mutex_t **mutex)
+int simulation_init()
 {
 	grid = (typeof(grid))malloc(GRID_SIDE*GRID_SIDE*sizeof(*grid));
 	if (grid == NULL)
@@ -45,16 +43,9 @@ int simulation_init(pthread_mutex_t **mutex)
 	if (prev_grid == NULL)
 		goto err_noprevgrid;
 
-	img_data = (typeof(img_data))malloc(3*GRID_SIDE*GRID_SIDE*sizeof(*img_data));
-	if (img_data == NULL)
-		goto err_noimgdata;
-
 	if (blackbody_RGB_8_table_init(&blackbody_color_table, low_temperature, high_temperature) != 0)
 		goto err_nocolor;
 
-	pthread_mutex_init(&example_mutex, NULL);
-	*mutex = &example_mutex;
-
 	/* simulation var init */
 	t = 0;
 	for (int i = 0; i < GRID_SIDE*GRID_SIDE; i++) {
@@ -65,8 +56,6 @@ int simulation_init(pthread_mutex_t **mutex)
 	return 0;
 
 err_nocolor:
-	free(img_data);
-err_noimgdata:
 	free(prev_grid);
 err_noprevgrid:
 	free(grid);
@@ -79,9 +68,7 @@ void simulation_destroy()
 {
 	free(grid);
 	free(prev_grid);
-	free(img_data);
 	blackbody_RGB_8_table_destroy(&blackbody_color_table);
-	pthread_mutex_destroy(&example_mutex);
 }
 
 static float heat_src(float t, int i, int j)
@@ -92,9 +79,7 @@ static float heat_src(float t, int i, int j)
 		* expf(-(SQR(i - icenter) + SQR(j - jcenter)) / (2 * SQR(GRID_SIDE/25)));
 }
 
-static void mkimg();
-
-void simulation_step(void **data, size_t *data_bytes)
+void simulation_step()
 {
 	/* heat diffusion */
 	for (int i = 1; i < GRID_SIDE - 1; i++) {
@@ -115,8 +100,6 @@ void simulation_step(void **data, size_t *data_bytes)
 		}
 	}
 
-	mkimg();
-
 	/* swap grids */
 	float *tmp = grid;
 	grid = prev_grid;
@@ -129,9 +112,6 @@ void simulation_step(void **data, size_t *data_bytes)
 	sleep_time.tv_sec = 0;
 	sleep_time.tv_nsec = 2000000;
 	nanosleep(&sleep_time, NULL);
-
-	*data = (void *)img_data;
-	*data_bytes = 3*GRID_SIDE*GRID_SIDE;
 }
 
 static int clip(int x, int min, int max)
@@ -143,17 +123,21 @@ static int clip(int x, int min, int max)
 	return x;
 }
 
-/** map cell data to physically computed sRGB blackbody color */
-static void mkimg()
+/**
+ * map cell data to physically computed sRGB blackbody color
+ *
+ * @param img_data SIMULATION_IMG_BYTES of rgb [0,255] to write into
+ */
+void simulation_mkimg(uint8_t *img_data)
 {
 	struct color_RGB_8 *srgb;
 	const float min = 0;
 	const float max = GRID_SIDE / 4;
 
-	pthread_mutex_lock(&example_mutex);
+	/* latest step is in prev_grid after swapping */
 	for (int i = 0; i < GRID_SIDE*GRID_SIDE; i++) {
 		/* linearly map simulation grid data to a temperature */
-		int temperature = (grid[i] - min) * (high_temperature - low_temperature) / (max - min) + low_temperature;
+		int temperature = (prev_grid[i] - min) * (high_temperature - low_temperature) / (max - min) + low_temperature;
 		temperature = clip(temperature, low_temperature, high_temperature);
 
 		/* img_data to blackbody color corresponding to temperature */
@@ -162,5 +146,4 @@ static void mkimg()
 		img_data[3*i + 1] = srgb->RGB[1];
 		img_data[3*i + 2] = srgb->RGB[2];
 	}
-	pthread_mutex_unlock(&example_mutex);
 }
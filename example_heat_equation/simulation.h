@@ -9,12 +9,17 @@
 #ifndef SIMULATION_H
 #define SIMULATION_H
 
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define GRID_SIDE 100
 
-int simulation_init(pthread_mutex_t **data_mutex);
+/** bytes of rgb image made by simulation_mkimg() */
+#define SIMULATION_IMG_BYTES (3*GRID_SIDE*GRID_SIDE)
+
+int simulation_init();
 void simulation_destroy();
-void simulation_step(void **data, size_t *data_bytes);
+void simulation_step();
+void simulation_mkimg(uint8_t *img_data);
 
 #endif /* SIMULATION_H */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief memory allocation through user supplied ws_ctube_allocator hooks
+ */
+
+#ifndef WS_CTUBE_ALLOC_H
+#define WS_CTUBE_ALLOC_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "ws_ctube_api.h"
+
+/** alignment of payload buffers */
+#define WS_CTUBE_PAYLOAD_ALIGN 64
+
+/** allocators used by a ws_ctube */
+struct ws_ctube_mem {
+	/* small control objects: the ctube, descriptors, slabs, tables */
+	struct ws_ctube_allocator ctrl;
+	/* broadcast data buffers */
+	struct ws_ctube_allocator payload;
+};
+
+/** whether the hooks of allocator are set (both or neither must be) */
+static inline int ws_ctube_allocator_is_custom(const struct ws_ctube_allocator *allocator)
+{
+	return allocator->alloc != NULL;
+}
+
+/** allocate size bytes aligned to align (a power of 2) with allocator or malloc() */
+static void *ws_ctube_mem_alloc(const struct ws_ctube_allocator *allocator, size_t size, size_t align)
+{
+	void *ptr;
+
+	if (ws_ctube_allocator_is_custom(allocator)) {
+		return allocator->alloc(size, align, allocator->user);
+	}
+
+	if (align <= __alignof__(max_align_t)) {
+		return malloc(size);
+	}
+	if (posix_memalign(&ptr, align, size) != 0) {
+		return NULL;
+	}
+	return ptr;
+}
+
+/** free ptr from ws_ctube_mem_alloc() called with the same allocator, size and align */
+static void ws_ctube_mem_free(const struct ws_ctube_allocator *allocator, void *ptr, size_t size, size_t align)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (ws_ctube_allocator_is_custom(allocator)) {
+		allocator->free(ptr, size, align, allocator->user);
+	} else {
+		free(ptr);
+	}
+}
+
+#endif /* WS_CTUBE_ALLOC_H */
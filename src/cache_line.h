@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief cache line alignment to avoid false sharing between threads
+ */
+
+#ifndef WS_CTUBE_CACHE_LINE_H
+#define WS_CTUBE_CACHE_LINE_H
+
+/** bytes per cache line (x86-64 and most arm64) */
+#define WS_CTUBE_CACHE_LINE 64
+
+/**
+ * start a struct member (and the members following it) on a new cache line,
+ * so that it does not share a line with members written by other threads
+ */
+#define ws_ctube_cache_aligned __attribute__((aligned(WS_CTUBE_CACHE_LINE)))
+
+#endif /* WS_CTUBE_CACHE_LINE_H */
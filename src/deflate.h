@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief permessage-deflate (RFC 7692) compression of whole messages
+ *
+ * each message is compressed on its own (no context takeover): raw deflate
+ * ending in a sync flush, without the final 0x00 0x00 0xff 0xff
+ */
+
+#ifndef WS_CTUBE_DEFLATE_H
+#define WS_CTUBE_DEFLATE_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * define WS_CTUBE_DEFLATE 1 before including ws_ctube.h to offer
+ * permessage-deflate to clients (and link with -lz)
+ */
+#ifndef WS_CTUBE_DEFLATE
+#define WS_CTUBE_DEFLATE 0
+#endif /* WS_CTUBE_DEFLATE */
+
+/** zlib compression level of broadcasts (1 fastest to 9 smallest) */
+#ifndef WS_CTUBE_DEFLATE_LEVEL
+#define WS_CTUBE_DEFLATE_LEVEL 1
+#endif /* WS_CTUBE_DEFLATE_LEVEL */
+
+/** bytes at the end of a compressed message that are not sent */
+#define WS_CTUBE_DEFLATE_TAIL 4
+/** bytes ws_ctube_deflate_part() may need for size bytes that do not compress */
+#define WS_CTUBE_DEFLATE_BOUND(size) ((size) + ((size) >> 8) + 64)
+
+#if WS_CTUBE_DEFLATE
+# include <zlib.h>
+#endif /* WS_CTUBE_DEFLATE */
+
+/**
+ * compress part of a message for permessage-deflate, on its own. The parts
+ * compressed in order and concatenated, without the last
+ * WS_CTUBE_DEFLATE_TAIL bytes (always 0x00 0x00 0xff 0xff), are the message
+ * to send
+ *
+ * @param out receives the compressed part
+ * @param max bytes available at out
+ * @param in part of the message
+ * @param size bytes of the part (less than UINT_MAX)
+ *
+ * @return bytes of compressed part, or (size_t)-1 if it needs more than max
+ * bytes (or deflate is not compiled in)
+ */
+static size_t ws_ctube_deflate_part(char *out, size_t max, const char *in, size_t size)
+{
+#if WS_CTUBE_DEFLATE
+	static const unsigned char tail[WS_CTUBE_DEFLATE_TAIL] = {0x00, 0x00, 0xff, 0xff};
+	z_stream zs;
+	size_t retval = (size_t)-1;
+
+	if (size >= UINT_MAX || max >= UINT_MAX) {
+		return retval;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, WS_CTUBE_DEFLATE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return retval;
+	}
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = (uInt)size;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = (uInt)max;
+
+	/* output left over means the flush did not complete */
+	if (deflate(&zs, Z_SYNC_FLUSH) == Z_OK && zs.avail_in == 0 && zs.avail_out > 0) {
+		const size_t n = max - zs.avail_out;
+		if (n >= WS_CTUBE_DEFLATE_TAIL && memcmp(out + n - WS_CTUBE_DEFLATE_TAIL, tail, WS_CTUBE_DEFLATE_TAIL) == 0) {
+			retval = n;
+		}
+	}
+
+	deflateEnd(&zs);
+	return retval;
+#else /* WS_CTUBE_DEFLATE */
+	(void)out;
+	(void)max;
+	(void)in;
+	(void)size;
+	return (size_t)-1;
+#endif /* WS_CTUBE_DEFLATE */
+}
+
+/**
+ * decompress a message received with permessage-deflate
+ *
+ * @param out receives the message
+ * @param max bytes available at out
+ * @param in compressed message
+ * @param size bytes of compressed message
+ *
+ * @return bytes of message, or (size_t)-1 if it is corrupt or longer than max
+ * bytes (or deflate is not compiled in)
+ */
+static size_t ws_ctube_inflate(char *out, size_t max, const char *in, size_t size)
+{
+#if WS_CTUBE_DEFLATE
+	static const unsigned char tail[WS_CTUBE_DEFLATE_TAIL] = {0x00, 0x00, 0xff, 0xff};
+	z_stream zs;
+	size_t retval = (size_t)-1;
+	int ret;
+
+	if (size >= UINT_MAX || max >= UINT_MAX) {
+		return retval;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		return retval;
+	}
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = (uInt)size;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = (uInt)max;
+
+	/* the message, then the tail the sender stripped */
+	ret = inflate(&zs, Z_SYNC_FLUSH);
+	if ((ret == Z_OK || ret == Z_BUF_ERROR) && zs.avail_in == 0 && zs.avail_out > 0) {
+		zs.next_in = (Bytef *)tail;
+		zs.avail_in = WS_CTUBE_DEFLATE_TAIL;
+		ret = inflate(&zs, Z_SYNC_FLUSH);
+	}
+	if (ret == Z_STREAM_END || (ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0)) {
+		retval = max - zs.avail_out;
+	}
+
+	inflateEnd(&zs);
+	return retval;
+#else /* WS_CTUBE_DEFLATE */
+	(void)out;
+	(void)max;
+	(void)in;
+	(void)size;
+	return (size_t)-1;
+#endif /* WS_CTUBE_DEFLATE */
+}
+
+#endif /* WS_CTUBE_DEFLATE_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief XOR delta encoding between successive broadcasts
+ *
+ * a delta from prev to cur (of equal size) is a sequence of runs, each:
+ * LEB128 number of unchanged bytes to skip, LEB128 number of changed bytes,
+ * then those bytes of prev XOR cur. Unchanged bytes at the end are not
+ * encoded, so identical frames give an empty delta. Frames can be encoded in
+ * parts that are then concatenated
+ */
+
+#ifndef WS_CTUBE_DELTA_H
+#define WS_CTUBE_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** unchanged gaps shorter than this are sent with the changed bytes around them */
+#define WS_CTUBE_DELTA_MIN_SKIP 8
+/** bytes of one LEB128 encoded size_t at most */
+#define WS_CTUBE_DELTA_LEN_MAX 10
+
+/* compiled to the widest vector compare available (e.g. one AVX2 op) */
+typedef uint64_t _ws_ctube_delta_vec __attribute__((vector_size(32)));
+
+/** index of the first byte from pos on where prev and cur differ, or size */
+static size_t _ws_ctube_delta_next_diff(const char *prev, const char *cur, size_t pos, size_t size)
+{
+	_ws_ctube_delta_vec a, b, x;
+
+	/* skip unchanged blocks a vector at a time */
+	for (; pos + sizeof(a) <= size; pos += sizeof(a)) {
+		memcpy(&a, prev + pos, sizeof(a));
+		memcpy(&b, cur + pos, sizeof(b));
+		x = a ^ b;
+		if ((x[0] | x[1] | x[2] | x[3]) != 0) {
+			break;
+		}
+	}
+
+	while (pos < size && prev[pos] == cur[pos]) {
+		pos++;
+	}
+	return pos;
+}
+
+/** index of the first byte from pos on where prev and cur are equal, or size */
+static inline size_t _ws_ctube_delta_next_same(const char *prev, const char *cur, size_t pos, size_t size)
+{
+	while (pos < size && prev[pos] != cur[pos]) {
+		pos++;
+	}
+	return pos;
+}
+
+/** write len LEB128 encoded to out: @return bytes written */
+static inline size_t _ws_ctube_delta_put_len(char *out, size_t len)
+{
+	size_t n = 0;
+
+	while (len >= 0x80) {
+		out[n++] = (char)(0x80 | (len & 0x7f));
+		len >>= 7;
+	}
+	out[n++] = (char)len;
+	return n;
+}
+
+/**
+ * encode the part of the delta from prev to cur that covers bytes begin to
+ * size - 1 of the frames. Unless it is the last part, it ends with a run of
+ * no changed bytes if needed, so that the next part can start at size
+ *
+ * @param out receives the part of the delta
+ * @param max bytes available at out
+ * @param prev earlier frame
+ * @param cur current frame
+ * @param begin first byte of the frames covered
+ * @param size one past the last byte of the frames covered
+ * @param last whether size is the end of the frames
+ *
+ * @return bytes written to out, or (size_t)-1 if it needs more than max bytes
+ */
+static size_t ws_ctube_delta_encode_part(char *out, size_t max, const char *prev, const char *cur, size_t begin, size_t size, int last)
+{
+	size_t n = 0;
+	size_t pos = begin;
+	size_t start, end, next;
+
+	for (;;) {
+		start = _ws_ctube_delta_next_diff(prev, cur, pos, size);
+		if (start == size) {
+			break;
+		}
+
+		/* extend the run of changed bytes over short unchanged gaps */
+		end = start;
+		for (;;) {
+			end = _ws_ctube_delta_next_same(prev, cur, end, size);
+			next = _ws_ctube_delta_next_diff(prev, cur, end, size);
+			if (next == size || next - end >= WS_CTUBE_DELTA_MIN_SKIP) {
+				break;
+			}
+			end = next;
+		}
+
+		const size_t len = end - start;
+		if (n + 2 * WS_CTUBE_DELTA_LEN_MAX + len > max) {
+			return (size_t)-1;
+		}
+		n += _ws_ctube_delta_put_len(out + n, start - pos);
+		n += _ws_ctube_delta_put_len(out + n, len);
+
+		char *xor_out = out + n;
+		const char *p = prev + start;
+		const char *c = cur + start;
+		for (size_t i = 0; i < len; i++) {
+			xor_out[i] = p[i] ^ c[i];
+		}
+		n += len;
+		pos = end;
+	}
+
+	if (!last && pos < size) {
+		if (n + 2 * WS_CTUBE_DELTA_LEN_MAX > max) {
+			return (size_t)-1;
+		}
+		n += _ws_ctube_delta_put_len(out + n, size - pos);
+		n += _ws_ctube_delta_put_len(out + n, 0);
+	}
+
+	return n;
+}
+
+/**
+ * encode the delta from prev to cur
+ *
+ * @param out receives the delta
+ * @param max bytes available at out
+ * @param prev earlier frame of size bytes
+ * @param cur current frame of size bytes
+ * @param size bytes of each frame
+ *
+ * @return bytes of delta written to out, or (size_t)-1 if it needs more than
+ * max bytes
+ */
+static inline size_t ws_ctube_delta_encode(char *out, size_t max, const char *prev, const char *cur, size_t size)
+{
+	return ws_ctube_delta_encode_part(out, max, prev, cur, 0, size, 1);
+}
+
+#endif /* WS_CTUBE_DELTA_H */
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief worker pool that encodes large broadcasts in parallel
+ *
+ * an encode job is split into independent chunks. The thread that runs the
+ * job and the pool's workers take chunks until none are left, then that
+ * thread waits for the chunks still being encoded. Each chunk writes its own
+ * part of the output, so the result is in order whoever encoded what
+ */
+
+#ifndef WS_CTUBE_ENCODER_H
+#define WS_CTUBE_ENCODER_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "container_of.h"
+#include "list.h"
+
+/** most encoder threads of a ws_ctube */
+#define WS_CTUBE_ENCODE_MAXTHREAD 64
+/** payloads are split into chunks of at least this many bytes */
+#define WS_CTUBE_ENCODE_CHUNK ((size_t)256 << 10)
+/** and into at most this many chunks */
+#define WS_CTUBE_ENCODE_MAXCHUNK 256
+
+struct ws_ctube_encode_job;
+
+typedef void (*ws_ctube_encode_fn)(struct ws_ctube_encode_job *job, int chunk);
+
+/** including this in a larger struct allows it to be encoded by a ws_ctube_encoder */
+struct ws_ctube_encode_job {
+	/* called once for each chunk, on any thread */
+	ws_ctube_encode_fn encode;
+	int nchunk;
+	/* next chunk to take */
+	int next;
+	/* workers taking chunks of the job, under the encoder mutex */
+	int nworker;
+	/* in the encoder's list while it may have chunks left */
+	struct ws_ctube_list_node lnode;
+};
+
+struct ws_ctube_encoder {
+	/* jobs for the workers; the list mutex also guards nworker */
+	struct ws_ctube_list jobs;
+	/* signalled when a job is queued */
+	pthread_cond_t work_cond;
+	/* broadcast when a worker leaves a job */
+	pthread_cond_t done_cond;
+
+	int nthread;
+	pthread_t tids[WS_CTUBE_ENCODE_MAXTHREAD];
+};
+
+static int ws_ctube_encoder_init(struct ws_ctube_encoder *encoder)
+{
+	ws_ctube_list_init(&encoder->jobs);
+	pthread_cond_init(&encoder->work_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+	encoder->nthread = 0;
+	return 0;
+}
+
+static void ws_ctube_encoder_destroy(struct ws_ctube_encoder *encoder)
+{
+	ws_ctube_list_destroy(&encoder->jobs);
+	pthread_cond_destroy(&encoder->work_cond);
+	pthread_cond_destroy(&encoder->done_cond);
+	encoder->nthread = 0;
+}
+
+/**
+ * split size bytes into chunks
+ *
+ * @param chunk_size set to the bytes of each chunk (the last may be smaller)
+ *
+ * @return number of chunks, at least 1
+ */
+static inline int ws_ctube_encode_nchunk(size_t size, size_t *chunk_size)
+{
+	size_t chunk = WS_CTUBE_ENCODE_CHUNK;
+
+	if (size > chunk * WS_CTUBE_ENCODE_MAXCHUNK) {
+		chunk = (size + WS_CTUBE_ENCODE_MAXCHUNK - 1) / WS_CTUBE_ENCODE_MAXCHUNK;
+	}
+	*chunk_size = chunk;
+	return size > chunk ? (int)((size + chunk - 1) / chunk) : 1;
+}
+
+/** encode chunks of job until none are left to take */
+static void _ws_ctube_encode_chunks(struct ws_ctube_encode_job *job)
+{
+	int chunk;
+
+	while ((chunk = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunk) {
+		job->encode(job, chunk);
+	}
+}
+
+/** take job out of the workers' reach; jobs.mutex must be held */
+static inline void _ws_ctube_encoder_unlink(struct ws_ctube_encoder *encoder, struct ws_ctube_encode_job *job)
+{
+	if (job->lnode.next != NULL) {
+		_ws_ctube_list_node_unlink(&job->lnode);
+		encoder->jobs.len--;
+	}
+}
+
+/**
+ * call encode(job, chunk) for every chunk from 0 to nchunk - 1, on this
+ * thread and on the encoder's workers (if encoder is not NULL), and return
+ * once all are done. Not a cancellation point
+ */
+static void ws_ctube_encoder_run(struct ws_ctube_encoder *encoder, struct ws_ctube_encode_job *job, ws_ctube_encode_fn encode, int nchunk)
+{
+	const int shared = encoder != NULL && encoder->nthread > 0 && nchunk > 1;
+	int oldstate, statevar;
+
+	job->encode = encode;
+	job->nchunk = nchunk;
+	job->next = 0;
+	job->nworker = 0;
+	ws_ctube_list_node_init(&job->lnode);
+
+	if (shared) {
+		pthread_mutex_lock(&encoder->jobs.mutex);
+		_ws_ctube_list_add_after(encoder->jobs.head.prev, &job->lnode);
+		encoder->jobs.len++;
+		pthread_mutex_unlock(&encoder->jobs.mutex);
+		pthread_cond_broadcast(&encoder->work_cond);
+	}
+
+	_ws_ctube_encode_chunks(job);
+	if (!shared) {
+		return;
+	}
+
+	/* job is on this stack: wait for every worker to be done with it */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	pthread_mutex_lock(&encoder->jobs.mutex);
+	_ws_ctube_encoder_unlink(encoder, job);
+	while (job->nworker > 0) {
+		pthread_cond_wait(&encoder->done_cond, &encoder->jobs.mutex);
+	}
+	pthread_mutex_unlock(&encoder->jobs.mutex);
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+static void _ws_ctube_encoder_cleanup_unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void *ws_ctube_encoder_main(void *arg)
+{
+	struct ws_ctube_encoder *encoder = (struct ws_ctube_encoder *)arg;
+	struct ws_ctube_encode_job *job;
+	int oldstate, statevar;
+
+	for (;;) {
+		pthread_mutex_lock(&encoder->jobs.mutex);
+		pthread_cleanup_push(_ws_ctube_encoder_cleanup_unlock, &encoder->jobs.mutex);
+		while (encoder->jobs.len == 0) {
+			pthread_cond_wait(&encoder->work_cond, &encoder->jobs.mutex);
+		}
+		job = ws_ctube_container_of(encoder->jobs.head.next, typeof(*job), lnode);
+		job->nworker++;
+		pthread_mutex_unlock(&encoder->jobs.mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_encoder_cleanup_unlock */
+
+		/* the job's thread is waiting for us: finish before cancelling */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		_ws_ctube_encode_chunks(job);
+
+		pthread_mutex_lock(&encoder->jobs.mutex);
+		_ws_ctube_encoder_unlink(encoder, job);
+		job->nworker--;
+		pthread_mutex_unlock(&encoder->jobs.mutex);
+		pthread_cond_broadcast(&encoder->done_cond);
+		pthread_setcancelstate(oldstate, &statevar);
+	}
+
+	return NULL;
+}
+
+/** stop the first nthread workers of encoder */
+static void _ws_ctube_encoder_cancel(struct ws_ctube_encoder *encoder, int nthread)
+{
+	for (int i = 0; i < nthread; i++) {
+		pthread_cancel(encoder->tids[i]);
+	}
+	for (int i = 0; i < nthread; i++) {
+		pthread_join(encoder->tids[i], NULL);
+	}
+}
+
+/** start nthread workers (at most WS_CTUBE_ENCODE_MAXTHREAD, may be 0) */
+static int ws_ctube_encoder_start(struct ws_ctube_encoder *encoder, int nthread)
+{
+	for (int i = 0; i < nthread; i++) {
+		if (pthread_create(&encoder->tids[i], NULL, ws_ctube_encoder_main, (void *)encoder) != 0) {
+			_ws_ctube_encoder_cancel(encoder, i);
+			return -1;
+		}
+	}
+	encoder->nthread = nthread;
+	return 0;
+}
+
+/** stop the workers: no job may be running */
+static void ws_ctube_encoder_stop(struct ws_ctube_encoder *encoder)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	_ws_ctube_encoder_cancel(encoder, encoder->nthread);
+	encoder->nthread = 0;
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+#endif /* WS_CTUBE_ENCODER_H */
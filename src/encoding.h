@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief encodings of broadcasts that clients can ask for
+ *
+ * a client picks an encoding by name, as its WebSocket subprotocol or with
+ * "?encoding=<name>" in the request path. Every message in an encoding other
+ * than raw starts with a tag byte telling what follows it
+ */
+
+#ifndef WS_CTUBE_ENCODING_H
+#define WS_CTUBE_ENCODING_H
+
+#include <stddef.h>
+#include <string.h>
+
+enum ws_ctube_encoding {
+	/* the data as broadcast, without a tag */
+	WS_CTUBE_ENCODING_RAW,
+	/* XOR deltas from the last frame sent, see delta.h */
+	WS_CTUBE_ENCODING_DELTA,
+	/* raw deflate streams, see deflate.h */
+	WS_CTUBE_ENCODING_DEFLATE,
+	WS_CTUBE_NENCODING
+};
+
+/** names of the encodings, in the order of enum ws_ctube_encoding */
+static const char *const ws_ctube_encoding_names[WS_CTUBE_NENCODING] = {
+	"raw",
+	"delta",
+	"deflate",
+};
+
+/** tag byte: the rest of the message is the data as a raw client gets it */
+#define WS_CTUBE_TAG_FRAME 0
+/** tag byte: a delta from the last frame follows */
+#define WS_CTUBE_TAG_DELTA 1
+/** tag byte: a complete raw deflate stream of the data follows */
+#define WS_CTUBE_TAG_DEFLATE 2
+
+/** @return the encoding called name (len bytes), or -1 if there is none */
+static int ws_ctube_encoding_find(const char *name, size_t len)
+{
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		if (strlen(ws_ctube_encoding_names[i]) == len && strncmp(ws_ctube_encoding_names[i], name, len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+#endif /* WS_CTUBE_ENCODING_H */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief layout of published grids and their downsampled levels
+ *
+ * a published grid is stored packed (row-major) and followed by its levels,
+ * each packed too: level l + 1 is built from level l by combining each 2x2
+ * (or 2, or 2x2x2) block of elements into one
+ */
+
+#ifndef WS_CTUBE_GRID_H
+#define WS_CTUBE_GRID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "ws_ctube_api.h"
+
+/** set packed (row-major) strides for grid */
+static void ws_ctube_grid_pack_strides(struct ws_ctube_grid *grid)
+{
+	size_t stride = grid->elem_size;
+
+	for (int i = grid->ndim - 1; i >= 0; i--) {
+		grid->strides[i] = stride;
+		stride *= grid->dims[i];
+	}
+}
+
+/** bytes of grid if packed, not counting levels */
+static inline size_t ws_ctube_grid_size(const struct ws_ctube_grid *grid)
+{
+	size_t size = grid->elem_size;
+
+	for (int i = 0; i < grid->ndim; i++) {
+		size *= grid->dims[i];
+	}
+	return size;
+}
+
+/** the next level down from view: half as many elements along each axis */
+static void _ws_ctube_grid_halve(struct ws_ctube_grid *view)
+{
+	for (int i = 0; i < view->ndim; i++) {
+		view->dims[i] = (view->dims[i] + 1) / 2;
+	}
+	ws_ctube_grid_pack_strides(view);
+}
+
+/** number of levels of grid worth building: at most grid->nlevel, until 1 element */
+static int ws_ctube_grid_nlevel(const struct ws_ctube_grid *grid)
+{
+	struct ws_ctube_grid view = *grid;
+	int nlevel = 0;
+
+	while (nlevel < grid->nlevel && ws_ctube_grid_size(&view) > view.elem_size) {
+		_ws_ctube_grid_halve(&view);
+		nlevel++;
+	}
+	return nlevel;
+}
+
+/**
+ * layout of a level of the pyramid of packed grid (level 0 is grid itself)
+ *
+ * @param view set to the packed layout of that level
+ * @return offset of the level in bytes from the start of the grid
+ */
+static size_t ws_ctube_grid_level(const struct ws_ctube_grid *grid, int level, struct ws_ctube_grid *view)
+{
+	size_t offset = 0;
+
+	*view = *grid;
+	view->nlevel = 0;
+	ws_ctube_grid_pack_strides(view);
+	for (int l = 0; l < level; l++) {
+		offset += ws_ctube_grid_size(view);
+		_ws_ctube_grid_halve(view);
+	}
+	return offset;
+}
+
+/** copy the grid at src with layout grid into packed dst */
+static void ws_ctube_grid_pack(char *dst, const char *src, const struct ws_ctube_grid *grid)
+{
+	const int pad = WS_CTUBE_GRID_MAXDIM - grid->ndim;
+	const size_t elem_size = grid->elem_size;
+	size_t dims[WS_CTUBE_GRID_MAXDIM];
+	size_t stride[WS_CTUBE_GRID_MAXDIM];
+
+	/* as a 3D grid whose leading axes have length 1 */
+	for (int i = 0; i < WS_CTUBE_GRID_MAXDIM; i++) {
+		dims[i] = 1;
+		stride[i] = 0;
+	}
+	for (int i = 0; i < grid->ndim; i++) {
+		dims[pad + i] = grid->dims[i];
+		stride[pad + i] = grid->strides[i];
+	}
+
+	const size_t row_size = dims[2] * elem_size;
+	for (size_t z = 0; z < dims[0]; z++) {
+		for (size_t y = 0; y < dims[1]; y++) {
+			const char *row = src + z * stride[0] + y * stride[1];
+			if (stride[2] == elem_size) {
+				memcpy(dst, row, row_size);
+			} else {
+				for (size_t x = 0; x < dims[2]; x++) {
+					memcpy(dst + x * elem_size, row + x * stride[2], elem_size);
+				}
+			}
+			dst += row_size;
+		}
+	}
+}
+
+/*
+ * row kernels: combine pairs of elements of 2 (2D) or 4 (3D) input rows of
+ * n_in elements into one output row of (n_in + 1) / 2 elements. The loops
+ * are kept simple enough for the compiler to vectorize; an odd last element
+ * is combined with itself. Integer means round to nearest for unsigned types
+ * and toward zero for signed ones.
+ */
+#define _WS_CTUBE_GRID_MIN(a, b) ((b) < (a) ? (b) : (a))
+#define _WS_CTUBE_GRID_MAX(a, b) ((a) < (b) ? (b) : (a))
+
+#define _WS_CTUBE_GRID_KERNELS(name, T, ACC, ROUND) \
+static void _ws_ctube_grid_row2_##name(T *__restrict dst, const T *r0, const T *r1, size_t n_in, enum ws_ctube_lod_filter filter) \
+{ \
+	const size_t n = n_in / 2; \
+	size_t x; \
+\
+	switch (filter) { \
+	case WS_CTUBE_LOD_MIN: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MIN(r0[2 * x], r0[2 * x + 1]); \
+			const T b = _WS_CTUBE_GRID_MIN(r1[2 * x], r1[2 * x + 1]); \
+			dst[x] = _WS_CTUBE_GRID_MIN(a, b); \
+		} \
+		break; \
+	case WS_CTUBE_LOD_MAX: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MAX(r0[2 * x], r0[2 * x + 1]); \
+			const T b = _WS_CTUBE_GRID_MAX(r1[2 * x], r1[2 * x + 1]); \
+			dst[x] = _WS_CTUBE_GRID_MAX(a, b); \
+		} \
+		break; \
+	default: \
+		for (x = 0; x < n; x++) { \
+			const ACC sum = (ACC)r0[2 * x] + (ACC)r0[2 * x + 1] + (ACC)r1[2 * x] + (ACC)r1[2 * x + 1]; \
+			dst[x] = (T)((sum + 2 * (ROUND)) / 4); \
+		} \
+		break; \
+	} \
+\
+	if (n_in % 2 != 0) { \
+		const T tail[2][2] = {{r0[n_in - 1], r0[n_in - 1]}, {r1[n_in - 1], r1[n_in - 1]}}; \
+		_ws_ctube_grid_row2_##name(dst + n, tail[0], tail[1], 2, filter); \
+	} \
+} \
+\
+static void _ws_ctube_grid_row4_##name(T *__restrict dst, const T *r0, const T *r1, const T *r2, const T *r3, size_t n_in, enum ws_ctube_lod_filter filter) \
+{ \
+	const size_t n = n_in / 2; \
+	size_t x; \
+\
+	switch (filter) { \
+	case WS_CTUBE_LOD_MIN: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MIN(_WS_CTUBE_GRID_MIN(r0[2 * x], r0[2 * x + 1]), _WS_CTUBE_GRID_MIN(r1[2 * x], r1[2 * x + 1])); \
+			const T b = _WS_CTUBE_GRID_MIN(_WS_CTUBE_GRID_MIN(r2[2 * x], r2[2 * x + 1]), _WS_CTUBE_GRID_MIN(r3[2 * x], r3[2 * x + 1])); \
+			dst[x] = _WS_CTUBE_GRID_MIN(a, b); \
+		} \
+		break; \
+	case WS_CTUBE_LOD_MAX: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MAX(_WS_CTUBE_GRID_MAX(r0[2 * x], r0[2 * x + 1]), _WS_CTUBE_GRID_MAX(r1[2 * x], r1[2 * x + 1])); \
+			const T b = _WS_CTUBE_GRID_MAX(_WS_CTUBE_GRID_MAX(r2[2 * x], r2[2 * x + 1]), _WS_CTUBE_GRID_MAX(r3[2 * x], r3[2 * x + 1])); \
+			dst[x] = _WS_CTUBE_GRID_MAX(a, b); \
+		} \
+		break; \
+	default: \
+		for (x = 0; x < n; x++) { \
+			const ACC sum = (ACC)r0[2 * x] + (ACC)r0[2 * x + 1] + (ACC)r1[2 * x] + (ACC)r1[2 * x + 1] \
+				+ (ACC)r2[2 * x] + (ACC)r2[2 * x + 1] + (ACC)r3[2 * x] + (ACC)r3[2 * x + 1]; \
+			dst[x] = (T)((sum + 4 * (ROUND)) / 8); \
+		} \
+		break; \
+	} \
+\
+	if (n_in % 2 != 0) { \
+		const T tail[4][2] = { \
+			{r0[n_in - 1], r0[n_in - 1]}, {r1[n_in - 1], r1[n_in - 1]}, \
+			{r2[n_in - 1], r2[n_in - 1]}, {r3[n_in - 1], r3[n_in - 1]}}; \
+		_ws_ctube_grid_row4_##name(dst + n, tail[0], tail[1], tail[2], tail[3], 2, filter); \
+	} \
+}
+
+_WS_CTUBE_GRID_KERNELS(u8, uint8_t, unsigned, 1)
+_WS_CTUBE_GRID_KERNELS(i8, int8_t, int, 0)
+_WS_CTUBE_GRID_KERNELS(u16, uint16_t, unsigned, 1)
+_WS_CTUBE_GRID_KERNELS(i16, int16_t, int, 0)
+_WS_CTUBE_GRID_KERNELS(u32, uint32_t, uint64_t, 1)
+_WS_CTUBE_GRID_KERNELS(i32, int32_t, int64_t, 0)
+_WS_CTUBE_GRID_KERNELS(f32, float, float, 0)
+_WS_CTUBE_GRID_KERNELS(f64, double, double, 0)
+
+#define _WS_CTUBE_GRID_ROW_CASE(TYPE, name, T) \
+	case TYPE: \
+		if (nrow == 4) { \
+			_ws_ctube_grid_row4_##name((T *)dst, (const T *)rows[0], (const T *)rows[1], (const T *)rows[2], (const T *)rows[3], n_in, filter); \
+		} else { \
+			_ws_ctube_grid_row2_##name((T *)dst, (const T *)rows[0], (const T *)rows[1], n_in, filter); \
+		} \
+		break;
+
+/** combine nrow (2 or 4) rows of n_in elements of grid into dst */
+static void _ws_ctube_grid_row(const struct ws_ctube_grid *grid, void *dst, const char *const *rows, int nrow, size_t n_in)
+{
+	const enum ws_ctube_lod_filter filter = grid->filter;
+
+	switch (grid->type) {
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_U8, u8, uint8_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_I8, i8, int8_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_U16, u16, uint16_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_I16, i16, int16_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_U32, u32, uint32_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_I32, i32, int32_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_F32, f32, float)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_F64, f64, double)
+	default:
+		/* unknown type: keep the first element of each block */
+		for (size_t x = 0; 2 * x < n_in; x++) {
+			memcpy((char *)dst + x * grid->elem_size, rows[0] + 2 * x * grid->elem_size, grid->elem_size);
+		}
+		break;
+	}
+}
+
+/**
+ * build the level after a packed level of a grid
+ *
+ * @param dst receives the next level, packed
+ * @param src the level with layout view, from ws_ctube_grid_level()
+ * @param view the layout of src (type and filter from the grid)
+ */
+static void ws_ctube_grid_downsample(char *dst, const char *src, const struct ws_ctube_grid *view)
+{
+	const int pad = WS_CTUBE_GRID_MAXDIM - view->ndim;
+	const char *rows[4];
+	size_t dims[WS_CTUBE_GRID_MAXDIM];
+
+	/* as a 3D grid whose leading axes have length 1 */
+	for (int i = 0; i < WS_CTUBE_GRID_MAXDIM; i++) {
+		dims[i] = i < pad ? 1 : view->dims[i - pad];
+	}
+
+	const size_t row_size = dims[2] * view->elem_size;
+	const size_t out_row_size = (dims[2] + 1) / 2 * view->elem_size;
+	for (size_t z = 0; 2 * z < dims[0]; z++) {
+		const size_t z1 = 2 * z + 1 < dims[0] ? 2 * z + 1 : 2 * z;
+		for (size_t y = 0; 2 * y < dims[1]; y++) {
+			const size_t y1 = 2 * y + 1 < dims[1] ? 2 * y + 1 : 2 * y;
+
+			rows[0] = src + (2 * z * dims[1] + 2 * y) * row_size;
+			rows[1] = src + (2 * z * dims[1] + y1) * row_size;
+			rows[2] = src + (z1 * dims[1] + 2 * y) * row_size;
+			rows[3] = src + (z1 * dims[1] + y1) * row_size;
+
+			/* 1D grids combine a row with itself */
+			_ws_ctube_grid_row(view, dst, rows, view->ndim == 3 ? 4 : 2, dims[2]);
+			dst += out_row_size;
+		}
+	}
+}
+
+#endif /* WS_CTUBE_GRID_H */
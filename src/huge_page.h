@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief allocation of large buffers backed by huge pages
+ *
+ * tries explicit huge pages (MAP_HUGETLB, needs pages reserved by the admin),
+ * then a 2 MB aligned anonymous mapping advised for transparent huge pages;
+ * callers fall back to ordinary allocation if both fail
+ */
+
+#ifndef WS_CTUBE_HUGE_PAGE_H
+#define WS_CTUBE_HUGE_PAGE_H
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define WS_CTUBE_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/** 2 MB aligned anonymous mapping of size bytes advised for transparent huge pages */
+static void *_ws_ctube_huge_mmap_thp(size_t size)
+{
+	char *map;
+	char *aligned;
+	size_t head;
+	const size_t map_size = size + WS_CTUBE_HUGE_PAGE_SIZE;
+
+	map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* trim to an aligned range so that every 2 MB is huge page eligible */
+	aligned = (char *)(((uintptr_t)map + WS_CTUBE_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(WS_CTUBE_HUGE_PAGE_SIZE - 1));
+	head = aligned - map;
+	if (head > 0) {
+		munmap(map, head);
+	}
+	munmap(aligned + size, map_size - head - size);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+/**
+ * allocate size bytes backed by huge pages
+ *
+ * @return buffer to give back with ws_ctube_huge_free() or NULL if huge pages
+ * are unavailable or size is not a whole number of huge pages
+ */
+static void *ws_ctube_huge_alloc(size_t size)
+{
+	void *buf;
+
+	if (size == 0 || size % WS_CTUBE_HUGE_PAGE_SIZE != 0) {
+		return NULL;
+	}
+
+#ifdef MAP_HUGETLB
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buf != MAP_FAILED) {
+		return buf;
+	}
+#endif
+
+	return _ws_ctube_huge_mmap_thp(size);
+}
+
+static void ws_ctube_huge_free(void *buf, size_t size)
+{
+	if (buf != NULL) {
+		munmap(buf, size);
+	}
+}
+
+#endif /* WS_CTUBE_HUGE_PAGE_H */
@@ -22,14 +22,12 @@
 struct ws_ctube_list_node {
 	struct ws_ctube_list_node *prev;
 	struct ws_ctube_list_node *next;
-	pthread_mutex_t mutex;
 };
 
 static int ws_ctube_list_node_init(struct ws_ctube_list_node *node)
 {
 	node->prev = NULL;
 	node->next = NULL;
-	pthread_mutex_init(&node->mutex, NULL);
 	return 0;
 }
 
@@ -37,10 +35,9 @@ static void ws_ctube_list_node_destroy(struct ws_ctube_list_node *node)
 {
 	node->prev = NULL;
 	node->next = NULL;
-	pthread_mutex_destroy(&node->mutex);
 }
 
-/** thread-safe circular doubly-linked list */
+/** thread-safe circular doubly-linked list: nodes are protected by the list mutex */
 struct ws_ctube_list {
 	struct ws_ctube_list_node head;
 	int len;
@@ -82,10 +79,8 @@ static void _ws_ctube_list_node_unlink(struct ws_ctube_list_node *node)
 static inline void ws_ctube_list_unlink(struct ws_ctube_list *l, struct ws_ctube_list_node *node)
 {
 	pthread_mutex_lock(&l->mutex);
-	pthread_mutex_lock(&node->mutex);
 	_ws_ctube_list_node_unlink(node);
 	l->len--;
-	pthread_mutex_unlock(&node->mutex);
 	pthread_mutex_unlock(&l->mutex);
 }
 
@@ -93,7 +88,6 @@ static inline int ws_ctube_list_push_front(struct ws_ctube_list *l, struct ws_ct
 {
 	int retval = 0;
 	pthread_mutex_lock(&l->mutex);
-	pthread_mutex_lock(&node->mutex);
 
 	if (node->next != NULL || node->prev != NULL) {
 		retval = -1;
@@ -103,7 +97,6 @@ static inline int ws_ctube_list_push_front(struct ws_ctube_list *l, struct ws_ct
 	l->len++;
 
 out:
-	pthread_mutex_unlock(&node->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return retval;
 }
@@ -112,7 +105,6 @@ static inline int ws_ctube_list_push_back(struct ws_ctube_list *l, struct ws_ctu
 {
 	int retval = 0;
 	pthread_mutex_lock(&l->mutex);
-	pthread_mutex_lock(&node->mutex);
 
 	if (node->next != NULL || node->prev != NULL) {
 		retval = -1;
@@ -122,7 +114,6 @@ static inline int ws_ctube_list_push_back(struct ws_ctube_list *l, struct ws_ctu
 	l->len++;
 
 out:
-	pthread_mutex_unlock(&node->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return retval;
 }
@@ -137,12 +128,10 @@ static inline struct ws_ctube_list_node *ws_ctube_list_pop_front(struct ws_ctube
 		return NULL;
 	}
 	front = l->head.next;
-	pthread_mutex_lock(&front->mutex);
 
 	_ws_ctube_list_node_unlink(front);
 	l->len--;
 
-	pthread_mutex_unlock(&front->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return front;
 }
@@ -157,12 +146,10 @@ static inline struct ws_ctube_list_node *ws_ctube_list_pop_back(struct ws_ctube_
 		return NULL;
 	}
 	back = l->head.prev;
-	pthread_mutex_lock(&back->mutex);
 
 	_ws_ctube_list_node_unlink(back);
 	l->len--;
 
-	pthread_mutex_unlock(&back->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return back;
 }
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief lock-free intrusive multi-producer single-consumer FIFO queue
+ *
+ * Dmitry Vyukov's non-intrusive MPSC node-based queue made intrusive: push is
+ * one atomic exchange and never blocks; pop must only be called by one
+ * consumer at a time and may return NULL while a producer is mid-push (the
+ * producer completes the push right after, so the consumer should be woken
+ * again by whatever signalling follows the push)
+ */
+
+#ifndef WS_CTUBE_MPSC_QUEUE_H
+#define WS_CTUBE_MPSC_QUEUE_H
+
+#include <stddef.h>
+#include "container_of.h"
+#include "cache_line.h"
+
+/** including this in a larger struct allows it to be in a mpsc_queue */
+struct ws_ctube_mpsc_node {
+	struct ws_ctube_mpsc_node *next;
+};
+
+struct ws_ctube_mpsc_queue {
+	/* producers: most recently pushed node */
+	struct ws_ctube_mpsc_node *head ws_ctube_cache_aligned;
+	/* consumer: next node to pop */
+	struct ws_ctube_mpsc_node *tail ws_ctube_cache_aligned;
+	struct ws_ctube_mpsc_node stub;
+};
+
+static int ws_ctube_mpsc_queue_init(struct ws_ctube_mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	__atomic_store_n(&q->head, &q->stub, __ATOMIC_RELAXED);
+	q->tail = &q->stub;
+	return 0;
+}
+
+static void ws_ctube_mpsc_queue_destroy(struct ws_ctube_mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = NULL;
+	q->tail = NULL;
+}
+
+/** thread-safe, lock-free */
+static inline void ws_ctube_mpsc_queue_push(struct ws_ctube_mpsc_queue *q, struct ws_ctube_mpsc_node *node)
+{
+	struct ws_ctube_mpsc_node *prev;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/** single consumer only: @return oldest node or NULL if (momentarily) empty */
+static inline struct ws_ctube_mpsc_node *ws_ctube_mpsc_queue_pop(struct ws_ctube_mpsc_queue *q)
+{
+	struct ws_ctube_mpsc_node *tail = q->tail;
+	struct ws_ctube_mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	/* skip over stub */
+	if (tail == &q->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* tail is the last node unless a producer is mid-push */
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	/* re-insert stub so that tail can be popped */
+	ws_ctube_mpsc_queue_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+#endif /* WS_CTUBE_MPSC_QUEUE_H */
@@ -18,9 +18,23 @@ DEST_HEADER = "../ws_ctube.h"
 file_list = [
     "likely.h",
     "container_of.h",
+    "cache_line.h",
 
     "ref_count.h",
     "list.h",
+    "mpsc_queue.h",
+    "reclaim.h",
+    "record.h",
+    "shm.h",
+    "encoder.h",
+    "alloc.h",
+    "slab.h",
+    "huge_page.h",
+    "grid.h",
+    "quant.h",
+    "encoding.h",
+    "delta.h",
+    "deflate.h",
 
     "crypt.h",
     "socket.h",
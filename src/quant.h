@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief lossy conversion of floating-point arrays for ws_ctube_publish_quantized()
+ *
+ * a quantized message is a struct ws_ctube_quant_header followed by the
+ * converted values, in the byte order of the host like any other data
+ */
+
+#ifndef WS_CTUBE_QUANT_H
+#define WS_CTUBE_QUANT_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "ws_ctube_api.h"
+
+/** starts every quantized message (24 bytes, so the values stay aligned) */
+struct ws_ctube_quant_header {
+	/* enum ws_ctube_quant_format */
+	uint8_t format;
+	uint8_t reserved[7];
+	/* range of the U8 and U16 formats: value = min + q * (max - min) / qmax */
+	double min;
+	double max;
+};
+
+/** bytes per value of format */
+static inline size_t ws_ctube_quant_elem_size(enum ws_ctube_quant_format format)
+{
+	return format == WS_CTUBE_QUANT_U8 ? 1 : 2;
+}
+
+/** bytes of the message quantizing count values to format */
+static inline size_t ws_ctube_quant_size(enum ws_ctube_quant_format format, size_t count)
+{
+	return sizeof(struct ws_ctube_quant_header) + count * ws_ctube_quant_elem_size(format);
+}
+
+/*
+ * scalar conversions, branch-free so that the loops below vectorize: each
+ * case is computed and one is selected
+ */
+
+/** float to IEEE half precision, rounding to nearest even */
+static inline uint16_t _ws_ctube_f16(float x)
+{
+	uint32_t f, sign, denorm_bits;
+	float denorm;
+
+	memcpy(&f, &x, sizeof(f));
+	sign = f & 0x80000000u;
+	f ^= sign;
+
+	/* NaN stays NaN, too large becomes infinity */
+	const uint32_t special = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+	/* too small for a normal half: let float addition round it off */
+	memcpy(&denorm, &f, sizeof(denorm));
+	denorm += 0.5f;
+	memcpy(&denorm_bits, &denorm, sizeof(denorm_bits));
+	denorm_bits -= 0x3f000000u;
+	/* rebias the exponent and round the mantissa */
+	const uint32_t normal = (f + 0xc8000fffu + ((f >> 13) & 1)) >> 13;
+
+	/* selected with masks: a branch here would keep the add above from
+	 * being vectorized (it could raise a floating-point exception) */
+	const uint32_t big = 0u - (f >= 0x47800000u);
+	const uint32_t small = 0u - (f < 0x38800000u);
+	const uint32_t o = (special & big) | (denorm_bits & small) | (normal & ~(big | small));
+	return (uint16_t)(o | sign >> 16);
+}
+
+/** float to bfloat16 (its upper 16 bits), rounding to nearest even */
+static inline uint16_t _ws_ctube_bf16(float x)
+{
+	uint32_t f;
+
+	memcpy(&f, &x, sizeof(f));
+	const uint32_t rounded = (f + 0x7fffu + ((f >> 16) & 1)) >> 16;
+	/* NaN stays NaN (quiet) instead of rounding to infinity */
+	return (uint16_t)((f & 0x7fffffffu) > 0x7f800000u ? (f >> 16) | 0x40 : rounded);
+}
+
+/*
+ * array kernels for input type T, whose bits are the signed integer type K
+ * with exponent bits EXP. Only finite values count towards the range, which
+ * is found on integer keys ordered like the values (floating-point min and
+ * max do not vectorize without -ffast-math). NaN quantizes to 0 and values
+ * outside the range are clamped
+ */
+#define _WS_CTUBE_QUANT_KERNELS(name, T, K, K_MIN, K_MAX, EXP) \
+static void _ws_ctube_quant_range_##name(const T *in, size_t n, double *min, double *max) \
+{ \
+	K lo = K_MAX; \
+	K hi = K_MIN; \
+	T lo_val, hi_val; \
+\
+	for (size_t i = 0; i < n; i++) { \
+		K bits; \
+		memcpy(&bits, &in[i], sizeof(bits)); \
+		const K key = bits ^ ((bits >> (8 * sizeof(K) - 1)) & K_MAX); \
+		const K inf = (K)0 - (K)((bits & (EXP)) == (EXP)); \
+		const K a = (key & ~inf) | (K_MAX & inf); \
+		const K b = (key & ~inf) | (K_MIN & inf); \
+		lo = a < lo ? a : lo; \
+		hi = b > hi ? b : hi; \
+	} \
+	if (lo > hi) { \
+		/* nothing finite */ \
+		*min = 0; \
+		*max = 0; \
+		return; \
+	} \
+\
+	lo ^= (lo >> (8 * sizeof(K) - 1)) & K_MAX; \
+	hi ^= (hi >> (8 * sizeof(K) - 1)) & K_MAX; \
+	memcpy(&lo_val, &lo, sizeof(lo_val)); \
+	memcpy(&hi_val, &hi, sizeof(hi_val)); \
+	*min = (double)lo_val; \
+	*max = (double)hi_val; \
+} \
+\
+static void _ws_ctube_quant_f16_##name(uint16_t *__restrict out, const T *in, size_t n) \
+{ \
+	for (size_t i = 0; i < n; i++) { \
+		out[i] = _ws_ctube_f16((float)in[i]); \
+	} \
+} \
+\
+static void _ws_ctube_quant_bf16_##name(uint16_t *__restrict out, const T *in, size_t n) \
+{ \
+	for (size_t i = 0; i < n; i++) { \
+		out[i] = _ws_ctube_bf16((float)in[i]); \
+	} \
+} \
+\
+static void _ws_ctube_quant_u8_##name(uint8_t *__restrict out, const T *in, size_t n, double min, double max) \
+{ \
+	const T offset = (T)min; \
+	const T scale = max > min ? (T)(UINT8_MAX / (max - min)) : 0; \
+\
+	for (size_t i = 0; i < n; i++) { \
+		T q = (in[i] - offset) * scale + (T)0.5; \
+		q = q > 0 ? q : 0; \
+		q = q < UINT8_MAX ? q : UINT8_MAX; \
+		out[i] = (uint8_t)q; \
+	} \
+} \
+\
+static void _ws_ctube_quant_u16_##name(uint16_t *__restrict out, const T *in, size_t n, double min, double max) \
+{ \
+	const T offset = (T)min; \
+	const T scale = max > min ? (T)(UINT16_MAX / (max - min)) : 0; \
+\
+	for (size_t i = 0; i < n; i++) { \
+		T q = (in[i] - offset) * scale + (T)0.5; \
+		q = q > 0 ? q : 0; \
+		q = q < UINT16_MAX ? q : UINT16_MAX; \
+		out[i] = (uint16_t)q; \
+	} \
+}
+
+_WS_CTUBE_QUANT_KERNELS(f32, float, int32_t, INT32_MIN, INT32_MAX, 0x7f800000)
+_WS_CTUBE_QUANT_KERNELS(f64, double, int64_t, INT64_MIN, INT64_MAX, INT64_C(0x7ff0000000000000))
+
+#define _WS_CTUBE_QUANT_CASE(name, T) \
+	switch (quant->format) { \
+	case WS_CTUBE_QUANT_F16: \
+		_ws_ctube_quant_f16_##name((uint16_t *)values, (const T *)in, count); \
+		break; \
+	case WS_CTUBE_QUANT_BF16: \
+		_ws_ctube_quant_bf16_##name((uint16_t *)values, (const T *)in, count); \
+		break; \
+	case WS_CTUBE_QUANT_U8: \
+	case WS_CTUBE_QUANT_U16: \
+		if (hdr.min == 0 && hdr.max == 0) { \
+			_ws_ctube_quant_range_##name((const T *)in, count, &hdr.min, &hdr.max); \
+		} \
+		if (quant->format == WS_CTUBE_QUANT_U8) { \
+			_ws_ctube_quant_u8_##name((uint8_t *)values, (const T *)in, count, hdr.min, hdr.max); \
+		} else { \
+			_ws_ctube_quant_u16_##name((uint16_t *)values, (const T *)in, count, hdr.min, hdr.max); \
+		} \
+		break; \
+	}
+
+/**
+ * write the quantized message of count values (of quant->type, F32 or F64)
+ *
+ * @param out receives ws_ctube_quant_size() bytes, aligned to 8 bytes
+ * @param in the values
+ * @param count number of values
+ * @param quant how to convert them
+ *
+ * Not inlined: its callers use pthread_cleanup_push(), whose setjmp() keeps
+ * the loops of a function from being vectorized
+ */
+static __attribute__((noinline)) void ws_ctube_quantize(char *out, const void *in, size_t count, const struct ws_ctube_quant *quant)
+{
+	struct ws_ctube_quant_header hdr;
+	char *values = out + sizeof(hdr);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.format = (uint8_t)quant->format;
+	if (quant->format == WS_CTUBE_QUANT_U8 || quant->format == WS_CTUBE_QUANT_U16) {
+		hdr.min = quant->min;
+		hdr.max = quant->max;
+	}
+
+	if (quant->type == WS_CTUBE_ELEM_F64) {
+		_WS_CTUBE_QUANT_CASE(f64, double)
+	} else {
+		_WS_CTUBE_QUANT_CASE(f32, float)
+	}
+
+	memcpy(out, &hdr, sizeof(hdr));
+}
+
+#endif /* WS_CTUBE_QUANT_H */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief background thread for deferred reclamation
+ *
+ * objects whose final release is expensive (large free()/munmap(), joining
+ * threads, user release callbacks) are pushed lock-free to the reclaimer and
+ * reclaimed on its own thread, off the caller's hot path
+ */
+
+#ifndef WS_CTUBE_RECLAIM_H
+#define WS_CTUBE_RECLAIM_H
+
+#include <pthread.h>
+#include "cache_line.h"
+#include "mpsc_queue.h"
+
+struct ws_ctube_reclaim_node;
+
+typedef void (*ws_ctube_reclaim_fn)(struct ws_ctube_reclaim_node *node);
+
+/** including this in a larger struct allows it to be reclaimed in the background */
+struct ws_ctube_reclaim_node {
+	struct ws_ctube_mpsc_node qnode;
+	/* called on the reclaimer thread with this node */
+	ws_ctube_reclaim_fn reclaim;
+};
+
+struct ws_ctube_reclaimer {
+	struct ws_ctube_mpsc_queue queue;
+	/* set to wake the reclaimer thread */
+	int pred ws_ctube_cache_aligned;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* nodes are reclaimed by the caller of push if the thread is not running */
+	int running;
+	pthread_t tid;
+};
+
+static int ws_ctube_reclaimer_init(struct ws_ctube_reclaimer *reclaimer)
+{
+	ws_ctube_mpsc_queue_init(&reclaimer->queue);
+	reclaimer->pred = 0;
+	pthread_mutex_init(&reclaimer->mutex, NULL);
+	pthread_cond_init(&reclaimer->cond, NULL);
+	reclaimer->running = 0;
+	return 0;
+}
+
+static void ws_ctube_reclaimer_destroy(struct ws_ctube_reclaimer *reclaimer)
+{
+	ws_ctube_mpsc_queue_destroy(&reclaimer->queue);
+	reclaimer->pred = 0;
+	pthread_mutex_destroy(&reclaimer->mutex);
+	pthread_cond_destroy(&reclaimer->cond);
+	reclaimer->running = 0;
+}
+
+/** reclaim all queued nodes: only one thread at a time may drain */
+static void _ws_ctube_reclaimer_drain(struct ws_ctube_reclaimer *reclaimer)
+{
+	struct ws_ctube_mpsc_node *qnode;
+	struct ws_ctube_reclaim_node *node;
+
+	while ((qnode = ws_ctube_mpsc_queue_pop(&reclaimer->queue)) != NULL) {
+		node = ws_ctube_container_of(qnode, typeof(*node), qnode);
+		node->reclaim(node);
+	}
+}
+
+/** thread-safe, lock-free: have reclaim(node) called on the reclaimer thread */
+static void ws_ctube_reclaimer_push(struct ws_ctube_reclaimer *reclaimer, struct ws_ctube_reclaim_node *node, ws_ctube_reclaim_fn reclaim)
+{
+	node->reclaim = reclaim;
+
+	if (!__atomic_load_n(&reclaimer->running, __ATOMIC_SEQ_CST)) {
+		reclaim(node);
+		return;
+	}
+
+	ws_ctube_mpsc_queue_push(&reclaimer->queue, &node->qnode);
+
+	/* wake reclaimer unless a wakeup is already pending */
+	if (!__atomic_exchange_n(&reclaimer->pred, (int)1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&reclaimer->mutex);
+		pthread_mutex_unlock(&reclaimer->mutex);
+		pthread_cond_signal(&reclaimer->cond);
+	}
+}
+
+static void _ws_ctube_reclaimer_cleanup_unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void *ws_ctube_reclaimer_main(void *arg)
+{
+	struct ws_ctube_reclaimer *reclaimer = (struct ws_ctube_reclaimer *)arg;
+	int oldstate, statevar;
+
+	for (;;) {
+		pthread_mutex_lock(&reclaimer->mutex);
+		pthread_cleanup_push(_ws_ctube_reclaimer_cleanup_unlock, &reclaimer->mutex);
+		while (!__atomic_load_n(&reclaimer->pred, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&reclaimer->cond, &reclaimer->mutex);
+		}
+		pthread_mutex_unlock(&reclaimer->mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_reclaimer_cleanup_unlock */
+
+		/* cleared before draining: pushes from now on wake us again */
+		__atomic_store_n(&reclaimer->pred, (int)0, __ATOMIC_SEQ_CST);
+
+		/* reclaim callbacks are not cancellation safe */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		_ws_ctube_reclaimer_drain(reclaimer);
+		pthread_setcancelstate(oldstate, &statevar);
+	}
+
+	return NULL;
+}
+
+static int ws_ctube_reclaimer_start(struct ws_ctube_reclaimer *reclaimer)
+{
+	__atomic_store_n(&reclaimer->running, (int)1, __ATOMIC_SEQ_CST);
+	if (pthread_create(&reclaimer->tid, NULL, ws_ctube_reclaimer_main, (void *)reclaimer) != 0) {
+		__atomic_store_n(&reclaimer->running, (int)0, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	return 0;
+}
+
+/** stop the reclaimer thread and reclaim everything still queued */
+static void ws_ctube_reclaimer_stop(struct ws_ctube_reclaimer *reclaimer)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	pthread_cancel(reclaimer->tid);
+	pthread_join(reclaimer->tid, NULL);
+
+	__atomic_store_n(&reclaimer->running, (int)0, __ATOMIC_SEQ_CST);
+	_ws_ctube_reclaimer_drain(reclaimer);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+#endif /* WS_CTUBE_RECLAIM_H */
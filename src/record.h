@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief background thread that appends broadcasts to a log on disk
+ *
+ * producers push records lock-free to the recorder, which copies them on its
+ * own thread into memory-mapped segment files <path>.<n> (n = 000000,
+ * 000001, ...). A segment is a struct ws_ctube_record_segment followed by
+ * records, each a struct ws_ctube_record_header, the struct
+ * ws_ctube_record_grid of a grid (if WS_CTUBE_RECORD_GRID is set), the
+ * channel name and the payload, padded to 8 bytes. A record whose magic is 0
+ * ends the segment.
+ * <path>.index is a sparse time index: a struct ws_ctube_record_index for the
+ * first record of each segment and at most one per
+ * WS_CTUBE_RECORD_INDEX_INTERVAL_NS after that. All integers are in the byte
+ * order of the host
+ */
+
+#ifndef WS_CTUBE_RECORD_H
+#define WS_CTUBE_RECORD_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "cache_line.h"
+#include "container_of.h"
+#include "mpsc_queue.h"
+#include "ws_ctube_api.h"
+
+/** nanoseconds between entries of the time index (at most) */
+#ifndef WS_CTUBE_RECORD_INDEX_INTERVAL_NS
+#define WS_CTUBE_RECORD_INDEX_INTERVAL_NS ((int64_t)1000000000)
+#endif /* WS_CTUBE_RECORD_INDEX_INTERVAL_NS */
+
+/** magic of a segment file, including the terminating null */
+#define WS_CTUBE_RECORD_SEGMENT_MAGIC "WSCTUBE"
+/** magic of a complete record ("WSCR" in little-endian byte order) */
+#define WS_CTUBE_RECORD_MAGIC 0x52435357u
+#define WS_CTUBE_RECORD_VERSION 2
+/** flag of a record whose payload is a grid */
+#define WS_CTUBE_RECORD_GRID 0x1u
+
+/** starts every segment file */
+struct ws_ctube_record_segment {
+	char magic[8];
+	uint32_t version;
+	/* n of the file name */
+	uint32_t segment;
+	/* CLOCK_REALTIME when the segment was started */
+	int64_t time_ns;
+	uint64_t reserved;
+};
+
+/** starts every record */
+struct ws_ctube_record_header {
+	/* WS_CTUBE_RECORD_MAGIC, written last */
+	uint32_t magic;
+	/* bytes of the channel name that follows (0 for the default channel) */
+	uint32_t channel_len;
+	/* bytes of the payload that follows the name */
+	uint64_t size;
+	/* sequence number of the broadcast, increasing across channels */
+	uint64_t id;
+	/* CLOCK_REALTIME when it was broadcast */
+	int64_t time_ns;
+	/* WS_CTUBE_RECORD_GRID or 0 */
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/**
+ * layout of a grid record: its payload is the grid packed, without levels,
+ * like ws_ctube_publish_grid() makes it
+ */
+struct ws_ctube_record_grid {
+	uint32_t ndim;
+	/* enum ws_ctube_elem_type */
+	uint32_t type;
+	/* asked for, as in struct ws_ctube_grid */
+	uint32_t nlevel;
+	/* enum ws_ctube_lod_filter */
+	uint32_t filter;
+	uint64_t elem_size;
+	uint64_t dims[WS_CTUBE_GRID_MAXDIM];
+};
+
+/** entry of the time index */
+struct ws_ctube_record_index {
+	int64_t time_ns;
+	uint64_t id;
+	uint32_t segment;
+	uint32_t reserved;
+	/* of the record's header in the segment file */
+	uint64_t offset;
+};
+
+struct ws_ctube_record_node;
+
+/**
+ * copy the payload of node to payload (node->size bytes), or only let go of it
+ * if payload is NULL (it could not be recorded)
+ */
+typedef void (*ws_ctube_record_fn)(struct ws_ctube_record_node *node, char *payload);
+
+/** including this in a larger struct allows it to be recorded */
+struct ws_ctube_record_node {
+	struct ws_ctube_mpsc_node qnode;
+	/* called on the recorder thread with this node */
+	ws_ctube_record_fn record;
+
+	/* the record, set by the producer */
+	uint64_t id;
+	int64_t time_ns;
+	/* must stay valid until the recorder is stopped */
+	const char *channel;
+	size_t size;
+	/* layout of the payload if it is a grid, else NULL; must stay valid
+	 * until record() is called */
+	const struct ws_ctube_grid *grid;
+};
+
+struct ws_ctube_recorder {
+	struct ws_ctube_mpsc_queue queue;
+	/* set to wake the recorder thread */
+	int pred ws_ctube_cache_aligned;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* payload bytes queued: records are dropped rather than queued past
+	 * max_backlog (unless nothing is queued) */
+	size_t backlog ws_ctube_cache_aligned;
+	size_t max_backlog;
+	unsigned long nrecorded;
+	unsigned long ndropped;
+
+	/* records are only pushed while the thread is running */
+	int running;
+	pthread_t tid;
+
+	/* recorder thread only: the open segment (fd -1 if none) and index */
+	char path[PATH_MAX];
+	size_t segment_size;
+	uint32_t segment;
+	int fd;
+	char *map;
+	size_t map_size;
+	size_t used;
+	int index_fd;
+	int64_t index_time_ns;
+};
+
+static int ws_ctube_recorder_init(struct ws_ctube_recorder *recorder)
+{
+	ws_ctube_mpsc_queue_init(&recorder->queue);
+	recorder->pred = 0;
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+
+	recorder->backlog = 0;
+	recorder->max_backlog = 0;
+	recorder->nrecorded = 0;
+	recorder->ndropped = 0;
+	recorder->running = 0;
+
+	recorder->path[0] = '\0';
+	recorder->segment_size = 0;
+	recorder->segment = 0;
+	recorder->fd = -1;
+	recorder->map = NULL;
+	recorder->map_size = 0;
+	recorder->used = 0;
+	recorder->index_fd = -1;
+	recorder->index_time_ns = 0;
+	return 0;
+}
+
+static void ws_ctube_recorder_destroy(struct ws_ctube_recorder *recorder)
+{
+	ws_ctube_mpsc_queue_destroy(&recorder->queue);
+	recorder->pred = 0;
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->cond);
+	recorder->running = 0;
+}
+
+/** @return 0 if name fits in PATH_MAX bytes, -1 otherwise */
+static int _ws_ctube_recorder_name(const struct ws_ctube_recorder *recorder, char *name, const char *suffix, uint32_t segment)
+{
+	int len;
+
+	if (suffix != NULL) {
+		len = snprintf(name, PATH_MAX, "%s.%s", recorder->path, suffix);
+	} else {
+		len = snprintf(name, PATH_MAX, "%s.%06lu", recorder->path, (unsigned long)segment);
+	}
+	return len > 0 && len < PATH_MAX ? 0 : -1;
+}
+
+/** write the time index entry of the record at offset of the open segment */
+static void _ws_ctube_recorder_index(struct ws_ctube_recorder *recorder, const struct ws_ctube_record_header *hdr, size_t offset)
+{
+	struct ws_ctube_record_index entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.time_ns = hdr->time_ns;
+	entry.id = hdr->id;
+	entry.segment = recorder->segment;
+	entry.offset = offset;
+
+	/* a short write leaves the index sparser, not the log broken */
+	if (write(recorder->index_fd, &entry, sizeof(entry)) != (ssize_t)sizeof(entry)) {
+		fprintf(stderr, "ws_ctube_recorder: error: index write failed\n");
+		fflush(stderr);
+	}
+	recorder->index_time_ns = hdr->time_ns;
+}
+
+/** trim the open segment to what was written and close it */
+static void _ws_ctube_recorder_segment_close(struct ws_ctube_recorder *recorder)
+{
+	if (recorder->fd < 0) {
+		return;
+	}
+
+	munmap(recorder->map, recorder->map_size);
+	if (ftruncate(recorder->fd, (off_t)recorder->used) != 0) {
+		fprintf(stderr, "ws_ctube_recorder: error: segment truncate failed\n");
+		fflush(stderr);
+	}
+	close(recorder->fd);
+
+	recorder->fd = -1;
+	recorder->map = NULL;
+	recorder->map_size = 0;
+	recorder->used = 0;
+	recorder->segment++;
+}
+
+/**
+ * start segment recorder->segment, with room for a record of at least need
+ * bytes. Its disk space is allocated up front so that writing to the mapping
+ * cannot fail (with SIGBUS) once the disk fills up
+ */
+static int _ws_ctube_recorder_segment_open(struct ws_ctube_recorder *recorder, size_t need, int64_t time_ns)
+{
+	char name[PATH_MAX];
+	struct ws_ctube_record_segment seg;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = recorder->segment_size;
+	int err;
+
+	if (size < sizeof(seg) + need) {
+		size = sizeof(seg) + need;
+	}
+	size = (size + page - 1) & ~(page - 1);
+
+	if (_ws_ctube_recorder_name(recorder, name, NULL, recorder->segment) != 0) {
+		goto out_noname;
+	}
+	recorder->fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (recorder->fd < 0) {
+		goto out_noopen;
+	}
+	err = posix_fallocate(recorder->fd, 0, (off_t)size);
+	if (err != 0) {
+		errno = err;
+		goto out_noalloc;
+	}
+	recorder->map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0);
+	if (recorder->map == MAP_FAILED) {
+		goto out_nomap;
+	}
+
+	memset(&seg, 0, sizeof(seg));
+	memcpy(seg.magic, WS_CTUBE_RECORD_SEGMENT_MAGIC, sizeof(seg.magic));
+	seg.version = WS_CTUBE_RECORD_VERSION;
+	seg.segment = recorder->segment;
+	seg.time_ns = time_ns;
+	memcpy(recorder->map, &seg, sizeof(seg));
+
+	recorder->map_size = size;
+	recorder->used = sizeof(seg);
+	return 0;
+
+out_nomap:
+	recorder->map = NULL;
+out_noalloc:
+	err = errno;
+	close(recorder->fd);
+	unlink(name);
+	recorder->fd = -1;
+	errno = err;
+out_noopen:
+	fprintf(stderr, "ws_ctube_recorder: error: cannot create %s: %s\n", name, strerror(errno));
+	fflush(stderr);
+out_noname:
+	return -1;
+}
+
+static inline size_t _ws_ctube_record_size(const struct ws_ctube_record_node *node, size_t channel_len)
+{
+	const size_t grid_len = node->grid != NULL ? sizeof(struct ws_ctube_record_grid) : 0;
+
+	return (sizeof(struct ws_ctube_record_header) + grid_len + channel_len + node->size + 7) & ~(size_t)7;
+}
+
+/** the layout block of a grid record */
+static void _ws_ctube_record_grid(struct ws_ctube_record_grid *out, const struct ws_ctube_grid *grid)
+{
+	memset(out, 0, sizeof(*out));
+	out->ndim = (uint32_t)grid->ndim;
+	out->type = (uint32_t)grid->type;
+	out->nlevel = (uint32_t)grid->nlevel;
+	out->filter = (uint32_t)grid->filter;
+	out->elem_size = grid->elem_size;
+	for (int i = 0; i < grid->ndim; i++) {
+		out->dims[i] = grid->dims[i];
+	}
+}
+
+/**
+ * write node to the open segment (starting another if it does not fit)
+ *
+ * @return 0 on success, -1 if it could not be recorded
+ */
+static int _ws_ctube_recorder_write(struct ws_ctube_recorder *recorder, struct ws_ctube_record_node *node)
+{
+	struct ws_ctube_record_header hdr;
+	struct ws_ctube_record_grid grid;
+	const size_t channel_len = strlen(node->channel);
+	const size_t size = _ws_ctube_record_size(node, channel_len);
+	char *rec, *p;
+
+	if (recorder->fd >= 0 && recorder->used + size > recorder->map_size) {
+		_ws_ctube_recorder_segment_close(recorder);
+	}
+	if (recorder->fd < 0 && _ws_ctube_recorder_segment_open(recorder, size, node->time_ns) != 0) {
+		node->record(node, NULL);
+		return -1;
+	}
+
+	rec = recorder->map + recorder->used;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.channel_len = (uint32_t)channel_len;
+	hdr.size = node->size;
+	hdr.id = node->id;
+	hdr.time_ns = node->time_ns;
+	hdr.flags = node->grid != NULL ? WS_CTUBE_RECORD_GRID : 0;
+	memcpy(rec, &hdr, sizeof(hdr));
+	p = rec + sizeof(hdr);
+	if (node->grid != NULL) {
+		_ws_ctube_record_grid(&grid, node->grid);
+		memcpy(p, &grid, sizeof(grid));
+		p += sizeof(grid);
+	}
+	memcpy(p, node->channel, channel_len);
+	node->record(node, p + channel_len);
+
+	/* complete: readers of the mapping may follow it */
+	__atomic_store_n((uint32_t *)rec, (uint32_t)WS_CTUBE_RECORD_MAGIC, __ATOMIC_RELEASE);
+	if (recorder->used == sizeof(struct ws_ctube_record_segment)
+	    || hdr.time_ns - recorder->index_time_ns >= WS_CTUBE_RECORD_INDEX_INTERVAL_NS) {
+		_ws_ctube_recorder_index(recorder, &hdr, recorder->used);
+	}
+	recorder->used += size;
+	return 0;
+}
+
+/** record all queued nodes: only one thread at a time may drain */
+static void _ws_ctube_recorder_drain(struct ws_ctube_recorder *recorder)
+{
+	struct ws_ctube_mpsc_node *qnode;
+	struct ws_ctube_record_node *node;
+	size_t size;
+
+	while ((qnode = ws_ctube_mpsc_queue_pop(&recorder->queue)) != NULL) {
+		node = ws_ctube_container_of(qnode, typeof(*node), qnode);
+		/* node is let go of while being written */
+		size = node->size;
+		if (_ws_ctube_recorder_write(recorder, node) == 0) {
+			__atomic_add_fetch(&recorder->nrecorded, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_add_fetch(&recorder->ndropped, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_sub_fetch(&recorder->backlog, size, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * thread-safe, lock-free: have node recorded on the recorder thread
+ *
+ * @return 0 if queued (record(node, ...) will be called), -1 if it was
+ * dropped because the recorder is not running or too far behind
+ */
+static int ws_ctube_recorder_push(struct ws_ctube_recorder *recorder, struct ws_ctube_record_node *node, ws_ctube_record_fn record)
+{
+	size_t backlog;
+
+	if (!__atomic_load_n(&recorder->running, __ATOMIC_SEQ_CST)) {
+		return -1;
+	}
+
+	/* never wait for the disk: drop instead */
+	backlog = __atomic_fetch_add(&recorder->backlog, node->size, __ATOMIC_RELAXED);
+	if (backlog > 0 && recorder->max_backlog > 0 && backlog + node->size > recorder->max_backlog) {
+		__atomic_sub_fetch(&recorder->backlog, node->size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&recorder->ndropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	node->record = record;
+	ws_ctube_mpsc_queue_push(&recorder->queue, &node->qnode);
+
+	/* wake recorder unless a wakeup is already pending */
+	if (!__atomic_exchange_n(&recorder->pred, (int)1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&recorder->mutex);
+		pthread_mutex_unlock(&recorder->mutex);
+		pthread_cond_signal(&recorder->cond);
+	}
+	return 0;
+}
+
+static void _ws_ctube_recorder_cleanup_unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void *ws_ctube_recorder_main(void *arg)
+{
+	struct ws_ctube_recorder *recorder = (struct ws_ctube_recorder *)arg;
+	int oldstate, statevar;
+
+	for (;;) {
+		pthread_mutex_lock(&recorder->mutex);
+		pthread_cleanup_push(_ws_ctube_recorder_cleanup_unlock, &recorder->mutex);
+		while (!__atomic_load_n(&recorder->pred, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+		}
+		pthread_mutex_unlock(&recorder->mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_recorder_cleanup_unlock */
+
+		/* cleared before draining: pushes from now on wake us again */
+		__atomic_store_n(&recorder->pred, (int)0, __ATOMIC_SEQ_CST);
+
+		/* a record is not left half written */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		_ws_ctube_recorder_drain(recorder);
+		pthread_setcancelstate(oldstate, &statevar);
+	}
+
+	return NULL;
+}
+
+/**
+ * open the log at path (appending segments after those already there) and
+ * start the recorder thread
+ *
+ * @param segment_size bytes of each segment file (larger for a record that
+ * does not fit)
+ * @param max_backlog payload bytes that may be queued, or 0 for no limit
+ */
+static int ws_ctube_recorder_start(struct ws_ctube_recorder *recorder, const char *path, size_t segment_size, size_t max_backlog)
+{
+	char name[PATH_MAX];
+
+	if (strlen(path) >= sizeof(recorder->path) - 16) {
+		fprintf(stderr, "ws_ctube_recorder: error: path too long\n");
+		fflush(stderr);
+		goto out_noindex;
+	}
+	strcpy(recorder->path, path);
+	recorder->segment_size = segment_size;
+	recorder->max_backlog = max_backlog;
+
+	/* keep what earlier runs recorded */
+	recorder->segment = 0;
+	while (_ws_ctube_recorder_name(recorder, name, NULL, recorder->segment) == 0 && access(name, F_OK) == 0) {
+		recorder->segment++;
+	}
+
+	if (_ws_ctube_recorder_name(recorder, name, "index", 0) != 0) {
+		goto out_noindex;
+	}
+	recorder->index_fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (recorder->index_fd < 0) {
+		fprintf(stderr, "ws_ctube_recorder: error: cannot open %s: %s\n", name, strerror(errno));
+		fflush(stderr);
+		goto out_noindex;
+	}
+
+	__atomic_store_n(&recorder->running, (int)1, __ATOMIC_SEQ_CST);
+	if (pthread_create(&recorder->tid, NULL, ws_ctube_recorder_main, (void *)recorder) != 0) {
+		__atomic_store_n(&recorder->running, (int)0, __ATOMIC_SEQ_CST);
+		goto out_nothread;
+	}
+	return 0;
+
+out_nothread:
+	close(recorder->index_fd);
+	recorder->index_fd = -1;
+out_noindex:
+	return -1;
+}
+
+/** stop the recorder thread, record everything still queued and close the log */
+static void ws_ctube_recorder_stop(struct ws_ctube_recorder *recorder)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	if (!__atomic_load_n(&recorder->running, __ATOMIC_SEQ_CST)) {
+		goto out;
+	}
+
+	pthread_cancel(recorder->tid);
+	pthread_join(recorder->tid, NULL);
+
+	__atomic_store_n(&recorder->running, (int)0, __ATOMIC_SEQ_CST);
+	_ws_ctube_recorder_drain(recorder);
+
+	_ws_ctube_recorder_segment_close(recorder);
+	close(recorder->index_fd);
+	recorder->index_fd = -1;
+
+out:
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+#endif /* WS_CTUBE_RECORD_H */
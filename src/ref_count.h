@@ -16,14 +16,25 @@
  *
  * release with ws_ctube_ref_count_release and provide the routine that can free
  * the object if the ref count goes to 0
+ *
+ * acquiring only needs relaxed ordering since the caller already holds a
+ * reference (or the lock protecting the object); releasing has release
+ * ordering and the routine that frees the object runs after an acquire fence,
+ * so it sees every write made through the released references
+ *
+ * ws_ctube_sharded_ref_count spreads the count over per-thread shards for
+ * objects acquired and released by many threads at once; see
+ * ws_ctube_sharded_ref_count_share()
  */
 
 #ifndef WS_CTUBE_REF_COUNT_H
 #define WS_CTUBE_REF_COUNT_H
 
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include "likely.h"
+#include "cache_line.h"
 
 /** including this in a larger struct allows it to be reference counted */
 struct ws_ctube_ref_count {
@@ -32,24 +43,45 @@ struct ws_ctube_ref_count {
 
 static int ws_ctube_ref_count_init(struct ws_ctube_ref_count *ref_count)
 {
-	__atomic_store_n(&ref_count->refc, (int)0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ref_count->refc, (int)0, __ATOMIC_RELAXED);
 	return 0;
 }
 
 static void ws_ctube_ref_count_destroy(struct ws_ctube_ref_count *ref_count)
 {
-	__atomic_store_n(&ref_count->refc, (int)(-1), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ref_count->refc, (int)(-1), __ATOMIC_RELAXED);
+}
+
+/** current count: only exact if no other thread can acquire concurrently */
+static inline int ws_ctube_ref_count_load(struct ws_ctube_ref_count *ref_count)
+{
+	return __atomic_load_n(&ref_count->refc, __ATOMIC_ACQUIRE);
+}
+
+static inline void _ws_ctube_ref_count_inc(struct ws_ctube_ref_count *ref_count)
+{
+	__atomic_add_fetch(&ref_count->refc, (int)1, __ATOMIC_RELAXED);
+}
+
+/** @return the remaining count: if 0, the caller may free the object */
+static inline int _ws_ctube_ref_count_dec(struct ws_ctube_ref_count *ref_count)
+{
+	const int refc = __atomic_sub_fetch(&ref_count->refc, (int)1, __ATOMIC_RELEASE);
+	if (refc == 0) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	return refc;
 }
 
 #ifndef __cplusplus
 #define ws_ctube_ref_count_acquire(ptr, ref_count_member) do { \
 		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_ref_count), "type mismatch in ws_ctube_ref_count_acquire()"); \
-		__atomic_add_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		_ws_ctube_ref_count_inc(&(ptr)->ref_count_member); \
 	} while (0);
 
 #define ws_ctube_ref_count_release(ptr, ref_count_member, release_routine) do { \
 		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_ref_count), "type mismatch in ws_ctube_ref_count_release()"); \
-		const int _ws_ctube_ref_count_refc = __atomic_sub_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		const int _ws_ctube_ref_count_refc = _ws_ctube_ref_count_dec(&(ptr)->ref_count_member); \
 		if (_ws_ctube_ref_count_refc <= 0) { \
 			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
 				release_routine(ptr); \
@@ -60,11 +92,11 @@ static void ws_ctube_ref_count_destroy(struct ws_ctube_ref_count *ref_count)
 	} while (0);
 #else /* __cplusplus */
 #define ws_ctube_ref_count_acquire(ptr, ref_count_member) do { \
-		__atomic_add_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		_ws_ctube_ref_count_inc(&(ptr)->ref_count_member); \
 	} while (0);
 
 #define ws_ctube_ref_count_release(ptr, ref_count_member, release_routine) do { \
-		const int _ws_ctube_ref_count_refc = __atomic_sub_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		const int _ws_ctube_ref_count_refc = _ws_ctube_ref_count_dec(&(ptr)->ref_count_member); \
 		if (_ws_ctube_ref_count_refc <= 0) { \
 			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
 				release_routine(ptr); \
@@ -75,4 +107,242 @@ static void ws_ctube_ref_count_destroy(struct ws_ctube_ref_count *ref_count)
 	} while (0);
 #endif /* __cplusplus */
 
+#ifndef WS_CTUBE_REF_COUNT_NSHARD
+#define WS_CTUBE_REF_COUNT_NSHARD 16
+#endif /* WS_CTUBE_REF_COUNT_NSHARD */
+
+/* a drained shard holds about this value: its threads count in central */
+#define WS_CTUBE_REF_COUNT_DRAINED (LONG_MIN / 2)
+/* added to central while shared so that it cannot reach 0 */
+#define WS_CTUBE_REF_COUNT_BIAS (LONG_MAX / 2)
+
+/**
+ * reference count split into per-thread shards on their own cache lines
+ *
+ * it starts (and ends) in atomic mode where every thread counts in central,
+ * exactly like ws_ctube_ref_count. While shared, threads count in their own
+ * shard without contending and central is biased so that no release can see
+ * 0. Unsharing drains every shard back into central and removes the bias,
+ * after which the last release frees the object as usual.
+ */
+struct ws_ctube_sharded_ref_count {
+	long central ws_ctube_cache_aligned;
+	struct {
+		long count ws_ctube_cache_aligned;
+	} shard[WS_CTUBE_REF_COUNT_NSHARD];
+};
+
+/* threads are given shards round-robin the first time they count */
+static unsigned _ws_ctube_ref_count_nthread;
+static __thread unsigned _ws_ctube_ref_count_shard_idx;
+
+static inline unsigned _ws_ctube_ref_count_shard(void)
+{
+	unsigned idx = _ws_ctube_ref_count_shard_idx;
+
+	if (ws_ctube_unlikely(idx == 0)) {
+		idx = 1 + __atomic_fetch_add(&_ws_ctube_ref_count_nthread, 1u, __ATOMIC_RELAXED) % WS_CTUBE_REF_COUNT_NSHARD;
+		_ws_ctube_ref_count_shard_idx = idx;
+	}
+	return idx - 1;
+}
+
+static inline int ws_ctube_sharded_ref_count_init(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	__atomic_store_n(&ref_count->central, (long)0, __ATOMIC_RELAXED);
+	for (int i = 0; i < WS_CTUBE_REF_COUNT_NSHARD; i++) {
+		__atomic_store_n(&ref_count->shard[i].count, (long)WS_CTUBE_REF_COUNT_DRAINED, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static inline void ws_ctube_sharded_ref_count_destroy(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	__atomic_store_n(&ref_count->central, (long)(-1), __ATOMIC_RELAXED);
+}
+
+/**
+ * switch to sharded counting: the caller must hold a reference and
+ * share/unshare calls on the same count must not run concurrently
+ */
+static inline void ws_ctube_sharded_ref_count_share(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	__atomic_add_fetch(&ref_count->central, (long)WS_CTUBE_REF_COUNT_BIAS, __ATOMIC_RELAXED);
+	for (int i = 0; i < WS_CTUBE_REF_COUNT_NSHARD; i++) {
+		__atomic_exchange_n(&ref_count->shard[i].count, (long)0, __ATOMIC_ACQ_REL);
+	}
+}
+
+/** switch back to atomic counting: same requirements as sharing */
+static inline void ws_ctube_sharded_ref_count_unshare(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	long sum = 0;
+
+	for (int i = 0; i < WS_CTUBE_REF_COUNT_NSHARD; i++) {
+		sum += __atomic_exchange_n(&ref_count->shard[i].count, (long)WS_CTUBE_REF_COUNT_DRAINED, __ATOMIC_ACQ_REL);
+	}
+	__atomic_add_fetch(&ref_count->central, sum - (long)WS_CTUBE_REF_COUNT_BIAS, __ATOMIC_RELEASE);
+}
+
+/** current count: only exact while not shared and nobody acquires concurrently */
+static inline long ws_ctube_sharded_ref_count_load(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	return __atomic_load_n(&ref_count->central, __ATOMIC_ACQUIRE);
+}
+
+static inline void _ws_ctube_sharded_ref_count_inc(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	const long old = __atomic_fetch_add(&ref_count->shard[_ws_ctube_ref_count_shard()].count, (long)1, __ATOMIC_RELAXED);
+	if (ws_ctube_unlikely(old <= WS_CTUBE_REF_COUNT_DRAINED / 2)) {
+		__atomic_add_fetch(&ref_count->central, (long)1, __ATOMIC_RELAXED);
+	}
+}
+
+/** @return the remaining count (positive while shared): if 0, the caller may free */
+static inline long _ws_ctube_sharded_ref_count_dec(struct ws_ctube_sharded_ref_count *ref_count)
+{
+	long refc;
+	const long old = __atomic_fetch_sub(&ref_count->shard[_ws_ctube_ref_count_shard()].count, (long)1, __ATOMIC_RELEASE);
+	if (ws_ctube_likely(old > WS_CTUBE_REF_COUNT_DRAINED / 2)) {
+		return 1;
+	}
+
+	refc = __atomic_sub_fetch(&ref_count->central, (long)1, __ATOMIC_RELEASE);
+	if (refc == 0) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	return refc;
+}
+
+#ifndef __cplusplus
+#define ws_ctube_sharded_ref_count_acquire(ptr, ref_count_member) do { \
+		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_sharded_ref_count), "type mismatch in ws_ctube_sharded_ref_count_acquire()"); \
+		_ws_ctube_sharded_ref_count_inc(&(ptr)->ref_count_member); \
+	} while (0);
+
+#define ws_ctube_sharded_ref_count_release(ptr, ref_count_member, release_routine) do { \
+		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_sharded_ref_count), "type mismatch in ws_ctube_sharded_ref_count_release()"); \
+		const long _ws_ctube_ref_count_refc = _ws_ctube_sharded_ref_count_dec(&(ptr)->ref_count_member); \
+		if (_ws_ctube_ref_count_refc <= 0) { \
+			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
+				release_routine(ptr); \
+			} else { \
+				raise(SIGSEGV); \
+			} \
+		} \
+	} while (0);
+#else /* __cplusplus */
+#define ws_ctube_sharded_ref_count_acquire(ptr, ref_count_member) do { \
+		_ws_ctube_sharded_ref_count_inc(&(ptr)->ref_count_member); \
+	} while (0);
+
+#define ws_ctube_sharded_ref_count_release(ptr, ref_count_member, release_routine) do { \
+		const long _ws_ctube_ref_count_refc = _ws_ctube_sharded_ref_count_dec(&(ptr)->ref_count_member); \
+		if (_ws_ctube_ref_count_refc <= 0) { \
+			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
+				release_routine(ptr); \
+			} else { \
+				raise(SIGSEGV); \
+			} \
+		} \
+	} while (0);
+
+extern "C++" {
+/**
+ * ws_ctube_ref - owning handle to one reference of a T counted by its
+ * ws_ctube_ref_count member, like boost::intrusive_ptr
+ *
+ * copying acquires another reference; moving hands the reference over
+ * without touching the count; the destructor releases with release_routine
+ */
+template <typename T, struct ws_ctube_ref_count T::*ref_count_member, void (*release_routine)(T *)>
+class ws_ctube_ref {
+public:
+	ws_ctube_ref() noexcept : ptr(nullptr) {}
+
+	/** acquire a new reference to p (may be NULL) */
+	explicit ws_ctube_ref(T *p) noexcept : ptr(p)
+	{
+		if (ptr != nullptr) {
+			_ws_ctube_ref_count_inc(&(ptr->*ref_count_member));
+		}
+	}
+
+	/** take over a reference to p already held by the caller */
+	static ws_ctube_ref adopt(T *p) noexcept
+	{
+		ws_ctube_ref ref;
+		ref.ptr = p;
+		return ref;
+	}
+
+	ws_ctube_ref(const ws_ctube_ref &other) noexcept : ws_ctube_ref(other.ptr) {}
+
+	ws_ctube_ref(ws_ctube_ref &&other) noexcept : ptr(other.ptr)
+	{
+		other.ptr = nullptr;
+	}
+
+	ws_ctube_ref &operator=(const ws_ctube_ref &other) noexcept
+	{
+		ws_ctube_ref(other).swap(*this);
+		return *this;
+	}
+
+	ws_ctube_ref &operator=(ws_ctube_ref &&other) noexcept
+	{
+		ws_ctube_ref(static_cast<ws_ctube_ref &&>(other)).swap(*this);
+		return *this;
+	}
+
+	~ws_ctube_ref()
+	{
+		reset();
+	}
+
+	/** release the held reference, if any */
+	void reset() noexcept
+	{
+		T *p = ptr;
+		ptr = nullptr;
+		if (p == nullptr) {
+			return;
+		}
+
+		const int refc = _ws_ctube_ref_count_dec(&(p->*ref_count_member));
+		if (refc <= 0) {
+			if (ws_ctube_likely(refc == 0)) {
+				release_routine(p);
+			} else {
+				raise(SIGSEGV);
+			}
+		}
+	}
+
+	/** give the held reference back to the caller */
+	T *detach() noexcept
+	{
+		T *p = ptr;
+		ptr = nullptr;
+		return p;
+	}
+
+	void swap(ws_ctube_ref &other) noexcept
+	{
+		T *p = ptr;
+		ptr = other.ptr;
+		other.ptr = p;
+	}
+
+	T *get() const noexcept { return ptr; }
+	T &operator*() const noexcept { return *ptr; }
+	T *operator->() const noexcept { return ptr; }
+	explicit operator bool() const noexcept { return ptr != nullptr; }
+
+private:
+	T *ptr;
+};
+} /* extern "C++" */
+#endif /* __cplusplus */
+
 #endif /* WS_CTUBE_REF_COUNT_H */
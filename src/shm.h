@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ring of broadcasts in shared memory for processes on the same host
+ *
+ * the file is a struct ws_ctube_shm_header followed by the ring. Records are
+ * a struct ws_ctube_shm_record, the channel name and the payload, padded to 8
+ * bytes; a record never wraps around the end of the ring (the rest of it is
+ * skipped, marked by a WS_CTUBE_SHM_PAD record if there is room for one).
+ *
+ * Positions count bytes written since the start, not wrapped. The writer
+ * publishes intent (how far it is about to write) when it reserves room for
+ * a record and head (the end of what it wrote) once the record is copied in;
+ * records reserved concurrently by different channels are copied in
+ * parallel but head moves past them in order. A reader copies a record
+ * out, then checks intent again, as in a seqlock, and skips to the latest
+ * record if it was overtaken. Readers sleep on the futex word, which the
+ * writer only wakes (a system call) if nwaiter says someone is asleep. All
+ * integers are in the byte order of the host
+ */
+
+#ifndef WS_CTUBE_SHM_H
+#define WS_CTUBE_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "ws_ctube_api.h"
+
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif /* __linux__ */
+
+/** magic of the file, including the terminating null */
+#define WS_CTUBE_SHM_MAGIC "WSCSHM"
+#define WS_CTUBE_SHM_VERSION 1
+
+/** type of a record holding a broadcast */
+#define WS_CTUBE_SHM_DATA 1
+/** type of a record filling the end of the ring, to be skipped */
+#define WS_CTUBE_SHM_PAD 2
+
+/** starts the file (128 bytes: readers write only the second 64) */
+struct ws_ctube_shm_header {
+	char magic[8];
+	uint32_t version;
+	/* nonzero once the writer has stopped: nothing more will come */
+	uint32_t closed;
+	/* bytes of the ring that follows this header */
+	uint64_t size;
+	/* positions: up to which the ring may be being overwritten, the end
+	 * of the last complete record and its start */
+	uint64_t intent;
+	uint64_t head;
+	uint64_t last;
+	/* bumped after each record and when closing */
+	uint32_t futex;
+	uint32_t reserved;
+	uint64_t reserved2;
+
+	/* readers asleep on futex */
+	uint32_t nwaiter;
+	uint32_t reserved3[15];
+};
+
+/** starts every record */
+struct ws_ctube_shm_record {
+	/* number of the broadcast in the ring, from 0 */
+	uint64_t seq;
+	/* WS_CTUBE_SHM_DATA or WS_CTUBE_SHM_PAD */
+	uint32_t type;
+	/* bytes of the channel name that follows (0 for the default channel) */
+	uint32_t channel_len;
+	/* bytes of the payload that follows the name */
+	uint64_t size;
+	/* sequence number of the broadcast, increasing across channels */
+	uint64_t id;
+	/* CLOCK_REALTIME when it was broadcast */
+	int64_t time_ns;
+};
+
+static inline size_t _ws_ctube_shm_record_size(size_t channel_len, size_t size)
+{
+	return (sizeof(struct ws_ctube_shm_record) + channel_len + size + 7) & ~(size_t)7;
+}
+
+#ifdef __linux__
+static inline void _ws_ctube_shm_futex_wait(uint32_t *futex, uint32_t val, const struct timespec *timeout)
+{
+	syscall(SYS_futex, futex, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline void _ws_ctube_shm_futex_wake(uint32_t *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+/* no futex: readers poll every millisecond */
+static inline void _ws_ctube_shm_futex_wait(uint32_t *futex, uint32_t val, const struct timespec *timeout)
+{
+	struct timespec ms = {0, 1000000};
+
+	(void)futex;
+	(void)val;
+	if (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_nsec < ms.tv_nsec) {
+		ms.tv_nsec = timeout->tv_nsec;
+	}
+	nanosleep(&ms, NULL);
+}
+
+static inline void _ws_ctube_shm_futex_wake(uint32_t *futex)
+{
+	(void)futex;
+}
+#endif /* __linux__ */
+
+/** the writer, in the producer */
+struct ws_ctube_shm {
+	/* serializes reserving room in the ring for the channels */
+	pthread_mutex_t mutex;
+	struct ws_ctube_shm_header *hdr;
+	char *ring;
+	size_t size;
+	size_t map_size;
+	/* position and number of the next record to reserve */
+	uint64_t head;
+	uint64_t seq;
+
+	unsigned long nwritten;
+	/* broadcasts larger than the ring */
+	unsigned long ndropped;
+	/* broadcasts are only written while running */
+	int running;
+	char path[PATH_MAX];
+};
+
+static int ws_ctube_shm_init(struct ws_ctube_shm *shm)
+{
+	pthread_mutex_init(&shm->mutex, NULL);
+	shm->hdr = NULL;
+	shm->ring = NULL;
+	shm->size = 0;
+	shm->map_size = 0;
+	shm->head = 0;
+	shm->seq = 0;
+	shm->nwritten = 0;
+	shm->ndropped = 0;
+	shm->running = 0;
+	shm->path[0] = '\0';
+	return 0;
+}
+
+static void ws_ctube_shm_destroy(struct ws_ctube_shm *shm)
+{
+	pthread_mutex_destroy(&shm->mutex);
+	shm->running = 0;
+}
+
+/**
+ * create the file at path with a ring of at least size bytes. It is filled
+ * in under another name and renamed into place, so that readers of an
+ * earlier file keep their mapping of it and never see a partial header
+ */
+static int ws_ctube_shm_start(struct ws_ctube_shm *shm, const char *path, size_t size)
+{
+	char tmp[PATH_MAX];
+	struct ws_ctube_shm_header *hdr;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int fd, err;
+
+	if (strlen(path) >= sizeof(shm->path) - 32) {
+		fprintf(stderr, "ws_ctube_shm: error: path too long\n");
+		fflush(stderr);
+		return -1;
+	}
+	strcpy(shm->path, path);
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+	shm->map_size = (sizeof(*hdr) + size + page - 1) & ~(page - 1);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		goto out_noopen;
+	}
+	/* allocated up front: writing to the mapping of a full tmpfs would
+	 * raise SIGBUS instead of failing here */
+	err = posix_fallocate(fd, 0, (off_t)shm->map_size);
+	if (err != 0) {
+		errno = err;
+		goto out_nomap;
+	}
+	hdr = (struct ws_ctube_shm_header *)mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		goto out_nomap;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, WS_CTUBE_SHM_MAGIC, sizeof(WS_CTUBE_SHM_MAGIC));
+	hdr->version = WS_CTUBE_SHM_VERSION;
+	hdr->size = (shm->map_size - sizeof(*hdr)) & ~(uint64_t)7;
+	if (rename(tmp, path) != 0) {
+		goto out_norename;
+	}
+	close(fd);
+
+	shm->hdr = hdr;
+	shm->ring = (char *)hdr + sizeof(*hdr);
+	shm->size = (size_t)hdr->size;
+	shm->head = 0;
+	shm->seq = 0;
+	__atomic_store_n(&shm->running, (int)1, __ATOMIC_SEQ_CST);
+	return 0;
+
+out_norename:
+	err = errno;
+	munmap(hdr, shm->map_size);
+	errno = err;
+out_nomap:
+	err = errno;
+	close(fd);
+	unlink(tmp);
+	errno = err;
+out_noopen:
+	fprintf(stderr, "ws_ctube_shm: error: cannot create %s: %s\n", path, strerror(errno));
+	fflush(stderr);
+	return -1;
+}
+
+/** tell readers nothing more will come, then unmap and remove the file */
+static void ws_ctube_shm_stop(struct ws_ctube_shm *shm)
+{
+	if (!__atomic_load_n(&shm->running, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	__atomic_store_n(&shm->running, (int)0, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&shm->mutex);
+	__atomic_store_n(&shm->hdr->closed, (uint32_t)1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&shm->hdr->futex, 1, __ATOMIC_SEQ_CST);
+	_ws_ctube_shm_futex_wake(&shm->hdr->futex);
+	pthread_mutex_unlock(&shm->mutex);
+
+	/* readers keep their mappings */
+	munmap(shm->hdr, shm->map_size);
+	unlink(shm->path);
+	shm->hdr = NULL;
+	shm->ring = NULL;
+}
+
+/** room for a record, from ws_ctube_shm_reserve() */
+struct ws_ctube_shm_slot {
+	/* where the record goes in the ring */
+	char *rec;
+	/* end of the record reserved before it: head once that is published */
+	uint64_t prev_end;
+	/* position of the record (after any pad) and of its end */
+	uint64_t start;
+	uint64_t end;
+	uint64_t seq;
+};
+
+/**
+ * reserve room for a record of len bytes, overwriting the oldest ones. Only
+ * this is serialized between the channels: the record is copied in without
+ * holding the mutex
+ */
+static void ws_ctube_shm_reserve(struct ws_ctube_shm *shm, size_t len, struct ws_ctube_shm_slot *slot)
+{
+	struct ws_ctube_shm_header *hdr = shm->hdr;
+	struct ws_ctube_shm_record rec;
+	uint64_t head;
+	size_t off, pad;
+
+	pthread_mutex_lock(&shm->mutex);
+	head = shm->head;
+	off = (size_t)(head % shm->size);
+	pad = shm->size - off < len ? shm->size - off : 0;
+
+	/* readers learn the space is reused before it is */
+	__atomic_store_n(&hdr->intent, head + pad + len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (pad >= sizeof(rec)) {
+		memset(&rec, 0, sizeof(rec));
+		rec.seq = shm->seq;
+		rec.type = WS_CTUBE_SHM_PAD;
+		rec.size = pad - sizeof(rec);
+		memcpy(shm->ring + off, &rec, sizeof(rec));
+	}
+
+	slot->prev_end = head;
+	slot->start = head + pad;
+	slot->end = head + pad + len;
+	slot->seq = shm->seq;
+	slot->rec = shm->ring + (size_t)(slot->start % shm->size);
+	shm->head = slot->end;
+	shm->seq++;
+	pthread_mutex_unlock(&shm->mutex);
+}
+
+/** make a reserved record, copied in, visible to readers and wake them */
+static void ws_ctube_shm_commit(struct ws_ctube_shm *shm, const struct ws_ctube_shm_slot *slot)
+{
+	struct ws_ctube_shm_header *hdr = shm->hdr;
+
+	/* in the order reserved: the records before it may still be being
+	 * copied in by other channels */
+	while (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != slot->prev_end) {
+		sched_yield();
+	}
+	__atomic_store_n(&hdr->last, slot->start, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->head, slot->end, __ATOMIC_RELEASE);
+
+	/* no system call unless a reader is asleep */
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->nwaiter, __ATOMIC_SEQ_CST) > 0) {
+		_ws_ctube_shm_futex_wake(&hdr->futex);
+	}
+}
+
+/**
+ * thread-safe: append a broadcast to the ring, overwriting the oldest
+ *
+ * @return 0 on success, -1 if it is larger than the ring
+ */
+static int ws_ctube_shm_write(struct ws_ctube_shm *shm, const char *channel, const void *data, size_t size, uint64_t id, int64_t time_ns)
+{
+	struct ws_ctube_shm_record rec;
+	struct ws_ctube_shm_slot slot;
+	const size_t channel_len = strlen(channel);
+	const size_t len = _ws_ctube_shm_record_size(channel_len, size);
+
+	if (len > shm->size) {
+		__atomic_add_fetch(&shm->ndropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	ws_ctube_shm_reserve(shm, len, &slot);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.seq = slot.seq;
+	rec.type = WS_CTUBE_SHM_DATA;
+	rec.channel_len = (uint32_t)channel_len;
+	rec.size = size;
+	rec.id = id;
+	rec.time_ns = time_ns;
+	memcpy(slot.rec, &rec, sizeof(rec));
+	memcpy(slot.rec + sizeof(rec), channel, channel_len);
+	memcpy(slot.rec + sizeof(rec) + channel_len, data, size);
+
+	ws_ctube_shm_commit(shm, &slot);
+
+	__atomic_add_fetch(&shm->nwritten, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/** a reader, in any process */
+struct ws_ctube_shm_reader {
+	struct ws_ctube_shm_header *hdr;
+	const char *ring;
+	size_t size;
+	size_t map_size;
+	/* position and number of the next record to read, once started */
+	uint64_t pos;
+	uint64_t seq;
+	int started;
+	int counting;
+	/* channel of the last record read (names are shorter than 64 bytes) */
+	char channel[64];
+};
+
+/** map the file at path, to start reading from its latest record */
+static int ws_ctube_shm_reader_init(struct ws_ctube_shm_reader *reader, const char *path)
+{
+	struct ws_ctube_shm_header *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		goto out_noopen;
+	}
+	if (fstat(fd, &st) != 0) {
+		goto out_nomap;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		errno = EINVAL;
+		goto out_nomap;
+	}
+	hdr = (struct ws_ctube_shm_header *)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		goto out_nomap;
+	}
+	if (memcmp(hdr->magic, WS_CTUBE_SHM_MAGIC, sizeof(WS_CTUBE_SHM_MAGIC)) != 0 || hdr->version != WS_CTUBE_SHM_VERSION
+	    || hdr->size == 0 || hdr->size > (uint64_t)st.st_size - sizeof(*hdr)) {
+		munmap(hdr, (size_t)st.st_size);
+		errno = EINVAL;
+		goto out_nomap;
+	}
+	close(fd);
+
+	reader->hdr = hdr;
+	reader->ring = (const char *)hdr + sizeof(*hdr);
+	reader->size = (size_t)hdr->size;
+	reader->map_size = (size_t)st.st_size;
+	reader->pos = 0;
+	reader->seq = 0;
+	reader->started = 0;
+	reader->counting = 0;
+	reader->channel[0] = '\0';
+	return 0;
+
+out_nomap:
+	close(fd);
+out_noopen:
+	fprintf(stderr, "ws_ctube_shm: error: cannot open %s: %s\n", path, strerror(errno));
+	fflush(stderr);
+	return -1;
+}
+
+static void ws_ctube_shm_reader_destroy(struct ws_ctube_shm_reader *reader)
+{
+	munmap(reader->hdr, reader->map_size);
+	reader->hdr = NULL;
+	reader->ring = NULL;
+}
+
+/**
+ * copy the next broadcast of the ring to buf
+ *
+ * @return its size (if more than max, nothing is copied and it stays next),
+ * 0 if there is none yet, -1 if there will be none (the writer stopped)
+ */
+static long ws_ctube_shm_reader_next(struct ws_ctube_shm_reader *reader, void *buf, size_t max, struct ws_ctube_shm_msg *msg)
+{
+	struct ws_ctube_shm_header *hdr = reader->hdr;
+	const size_t size = reader->size;
+	struct ws_ctube_shm_record rec;
+	uint32_t closed;
+	uint64_t head;
+	size_t off, avail;
+	int valid;
+
+	for (;;) {
+		closed = __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (reader->pos == head) {
+			return closed ? -1 : 0;
+		}
+		if (!reader->started || head - reader->pos > size) {
+			/* start at (or, overtaken, skip to) the latest */
+			reader->pos = __atomic_load_n(&hdr->last, __ATOMIC_RELAXED);
+			reader->started = 1;
+		}
+
+		off = (size_t)(reader->pos % size);
+		avail = size - off;
+		if (avail < sizeof(rec)) {
+			reader->pos += avail;
+			continue;
+		}
+		memcpy(&rec, reader->ring + off, sizeof(rec));
+		/* the name against what is left first, so that the remainder
+		 * the payload is checked against cannot wrap around */
+		valid = rec.type == WS_CTUBE_SHM_PAD
+			|| (rec.type == WS_CTUBE_SHM_DATA && rec.channel_len < sizeof(reader->channel)
+			    && rec.channel_len <= avail - sizeof(rec)
+			    && rec.size <= avail - sizeof(rec) - rec.channel_len);
+		if (valid && rec.type == WS_CTUBE_SHM_DATA && rec.size <= max) {
+			memcpy(reader->channel, reader->ring + off + sizeof(rec), rec.channel_len);
+			reader->channel[rec.channel_len] = '\0';
+			memcpy(buf, reader->ring + off + sizeof(rec) + rec.channel_len, rec.size);
+		}
+
+		/* whether the writer got to any of it meanwhile */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->intent, __ATOMIC_RELAXED) - reader->pos > size) {
+			reader->started = 0;
+			continue;
+		}
+
+		if (!valid) {
+			fprintf(stderr, "ws_ctube_shm: error: bad record\n");
+			fflush(stderr);
+			return -1;
+		}
+		if (rec.type == WS_CTUBE_SHM_PAD) {
+			reader->pos += avail;
+			continue;
+		}
+		if (rec.size > max) {
+			return (long)rec.size;
+		}
+
+		msg->channel = reader->channel;
+		msg->size = (size_t)rec.size;
+		msg->id = (unsigned long)rec.id;
+		msg->time_ns = (long long)rec.time_ns;
+		msg->nmissed = reader->counting ? (unsigned long)(rec.seq - reader->seq) : 0;
+		reader->seq = rec.seq + 1;
+		reader->counting = 1;
+		reader->pos += _ws_ctube_shm_record_size(rec.channel_len, (size_t)rec.size);
+		return (long)rec.size;
+	}
+}
+
+/** sleep until the futex word is no longer val, or for timeout (NULL for no limit) */
+static void ws_ctube_shm_reader_wait(struct ws_ctube_shm_reader *reader, uint32_t val, const struct timespec *timeout)
+{
+	__atomic_add_fetch(&reader->hdr->nwaiter, 1, __ATOMIC_SEQ_CST);
+	_ws_ctube_shm_futex_wait(&reader->hdr->futex, val, timeout);
+	__atomic_sub_fetch(&reader->hdr->nwaiter, 1, __ATOMIC_SEQ_CST);
+}
+
+#endif /* WS_CTUBE_SHM_H */
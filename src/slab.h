@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief thread-safe fixed-capacity object allocator
+ *
+ * all objects are allocated up front in one block; each object lives in its
+ * own slot (starting on its own cache line) and knows its slab and slot
+ * index, so ws_ctube_slab_free() can be used like free(). What an object
+ * keeps across uses (e.g. its mutexes) is set up once per slot by the
+ * slab's obj_init and torn down by obj_destroy
+ */
+
+#ifndef WS_CTUBE_SLAB_H
+#define WS_CTUBE_SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "alloc.h"
+#include "cache_line.h"
+
+#define WS_CTUBE_SLAB_ALIGN WS_CTUBE_CACHE_LINE
+
+struct ws_ctube_slab;
+
+/** called on each object once, when its slab is created or destroyed */
+typedef void (*ws_ctube_slab_obj_fn)(void *obj);
+
+/**
+ * precedes each object in its slot, padded to a whole cache line so that the
+ * object starts on one
+ */
+struct ws_ctube_slab_hdr {
+	struct ws_ctube_slab *slab;
+	int slot;
+} __attribute__((aligned(WS_CTUBE_SLAB_ALIGN)));
+
+struct ws_ctube_slab {
+	char *slots;
+	/** bytes per slot (header + object, rounded up to WS_CTUBE_SLAB_ALIGN) */
+	size_t slot_size;
+	int capacity;
+
+	/* stack of free slot indices */
+	int *free_slots;
+	int nfree;
+	pthread_mutex_t mutex;
+
+	/* slots and free_slots are allocated from this */
+	const struct ws_ctube_allocator *allocator;
+	/* may be NULL */
+	ws_ctube_slab_obj_fn obj_destroy;
+};
+
+static inline struct ws_ctube_slab_hdr *_ws_ctube_slab_hdr(const void *obj)
+{
+	return (struct ws_ctube_slab_hdr *)((char *)obj - sizeof(struct ws_ctube_slab_hdr));
+}
+
+/**
+ * @param obj_init if not NULL, called on every object now
+ * @param obj_destroy if not NULL, called on every object by ws_ctube_slab_destroy()
+ */
+static int ws_ctube_slab_init(struct ws_ctube_slab *slab, size_t obj_size, int capacity, const struct ws_ctube_allocator *allocator,
+			      ws_ctube_slab_obj_fn obj_init, ws_ctube_slab_obj_fn obj_destroy)
+{
+	struct ws_ctube_slab_hdr *hdr;
+
+	slab->slot_size = (sizeof(*hdr) + obj_size + WS_CTUBE_SLAB_ALIGN - 1) / WS_CTUBE_SLAB_ALIGN * WS_CTUBE_SLAB_ALIGN;
+	slab->capacity = capacity;
+	slab->allocator = allocator;
+	slab->obj_destroy = obj_destroy;
+
+	slab->slots = (typeof(slab->slots))ws_ctube_mem_alloc(allocator, slab->slot_size * capacity, WS_CTUBE_SLAB_ALIGN);
+	if (slab->slots == NULL) {
+		goto out_noslots;
+	}
+
+	slab->free_slots = (typeof(slab->free_slots))ws_ctube_mem_alloc(allocator, capacity * sizeof(*slab->free_slots), __alignof__(*slab->free_slots));
+	if (slab->free_slots == NULL) {
+		goto out_nofree;
+	}
+
+	/* hand out low slots first */
+	for (int i = 0; i < capacity; i++) {
+		hdr = (struct ws_ctube_slab_hdr *)(slab->slots + i * slab->slot_size);
+		hdr->slab = slab;
+		hdr->slot = i;
+		slab->free_slots[i] = capacity - 1 - i;
+		if (obj_init != NULL) {
+			obj_init((char *)hdr + sizeof(*hdr));
+		}
+	}
+	slab->nfree = capacity;
+
+	pthread_mutex_init(&slab->mutex, NULL);
+	return 0;
+
+out_nofree:
+	ws_ctube_mem_free(allocator, slab->slots, slab->slot_size * capacity, WS_CTUBE_SLAB_ALIGN);
+out_noslots:
+	return -1;
+}
+
+static void ws_ctube_slab_destroy(struct ws_ctube_slab *slab)
+{
+	if (slab->obj_destroy != NULL) {
+		for (int i = 0; i < slab->capacity; i++) {
+			slab->obj_destroy(slab->slots + i * slab->slot_size + sizeof(struct ws_ctube_slab_hdr));
+		}
+	}
+	slab->obj_destroy = NULL;
+	ws_ctube_mem_free(slab->allocator, slab->slots, slab->slot_size * slab->capacity, WS_CTUBE_SLAB_ALIGN);
+	slab->slots = NULL;
+	ws_ctube_mem_free(slab->allocator, slab->free_slots, slab->capacity * sizeof(*slab->free_slots), __alignof__(*slab->free_slots));
+	slab->free_slots = NULL;
+	slab->allocator = NULL;
+
+	slab->slot_size = 0;
+	slab->capacity = 0;
+	slab->nfree = 0;
+	pthread_mutex_destroy(&slab->mutex);
+}
+
+/** @return uninitialized object or NULL if all slots are in use */
+static void *ws_ctube_slab_alloc(struct ws_ctube_slab *slab)
+{
+	int slot;
+
+	pthread_mutex_lock(&slab->mutex);
+	if (slab->nfree == 0) {
+		pthread_mutex_unlock(&slab->mutex);
+		return NULL;
+	}
+	slot = slab->free_slots[--slab->nfree];
+	pthread_mutex_unlock(&slab->mutex);
+
+	return slab->slots + slot * slab->slot_size + sizeof(struct ws_ctube_slab_hdr);
+}
+
+/** return obj from ws_ctube_slab_alloc() to its slab */
+static void ws_ctube_slab_free(void *obj)
+{
+	struct ws_ctube_slab_hdr *hdr = _ws_ctube_slab_hdr(obj);
+	struct ws_ctube_slab *slab = hdr->slab;
+
+	pthread_mutex_lock(&slab->mutex);
+	slab->free_slots[slab->nfree++] = hdr->slot;
+	pthread_mutex_unlock(&slab->mutex);
+}
+
+/** slot index of obj: unique among allocated objects of its slab */
+static inline int ws_ctube_slab_slot(const void *obj)
+{
+	return _ws_ctube_slab_hdr(obj)->slot;
+}
+
+#endif /* WS_CTUBE_SLAB_H */
@@ -16,6 +16,7 @@
 #include <netinet/in.h>
 #include <pthread.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -69,32 +70,105 @@ int ws_ctube_ws_mkframe(char *frame, const char *msg, size_t msg_size, int first
 	return payld_size;
 }
 
-/** send data in data frames according to websocket standard */
-int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size)
+/** send part of a message in data frames, RSV1 set on the first if rsv1 */
+static int ws_send_frames(int conn, const char *msg, size_t msg_size, int first, int last, int rsv1)
 {
 	int payld_size;
 	char frame[WS_BUFLEN];
 
-	for (int first = 1; msg_size > 0; first = 0, msg += payld_size, msg_size -= payld_size) {
+	/* an empty part is sent as an empty frame so that it can end a message */
+	do {
 		payld_size = ws_ctube_ws_mkframe(frame, msg, msg_size, first);
+		if (!last) {
+			/* more parts follow: never set FIN */
+			frame[0] &= 0b01111111;
+		}
+		if (first && rsv1) {
+			frame[0] |= 0b01000000;
+		}
 		const int frame_len = payld_size + WS_CTUBE_FRAME_HDR_SIZE;
-		ws_print_frame("ws_ctube_ws_send()", frame, frame_len);
+		ws_print_frame("ws_ctube_ws_send_part()", frame, frame_len);
 		if (ws_ctube_socket_send_all(conn, frame, frame_len) != 0) {
 			return -1;
 		}
-	}
+		first = 0;
+		msg += payld_size;
+		msg_size -= payld_size;
+	} while (msg_size > 0);
 
 	return 0;
 }
 
-int ws_ctube_ws_recv(int conn, char *msg, int *msg_size, size_t max_msg_size)
+/** send part of a message in data frames according to websocket standard */
+int ws_ctube_ws_send_part(int conn, const char *msg, size_t msg_size, int first, int last)
 {
-	/* TODO */
-	(void)conn;
-	(void)msg;
-	(void)msg_size;
-	(void)max_msg_size;
-	return -1;
+	return ws_send_frames(conn, msg, msg_size, first, last, 0);
+}
+
+/** send a message compressed by ws_ctube_deflate_part() (RSV1 set) */
+int ws_ctube_ws_send_deflated(int conn, const char *msg, size_t msg_size)
+{
+	return ws_send_frames(conn, msg, msg_size, 1, 1, 1);
+}
+
+/** send data in data frames according to websocket standard */
+int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size)
+{
+	return ws_ctube_ws_send_part(conn, msg, msg_size, 1, 1);
+}
+
+/** receive frame according to websocket standard */
+int ws_ctube_ws_recv(int conn, int *opcode, int *fin, int *rsv1, char *msg, size_t *msg_size, size_t max_msg_size)
+{
+	unsigned char hdr[8];
+	unsigned char mask[4];
+	uint64_t payld_size;
+
+	if (ws_ctube_socket_recv_all(conn, (char *)hdr, 2, NULL) != 0) {
+		return -1;
+	}
+	ws_print_frame("ws_ctube_ws_recv()", (char *)hdr, 2);
+
+	*fin = hdr[0] >> 7;
+	*rsv1 = (hdr[0] >> 6) & 1;
+	*opcode = hdr[0] & 0x0f;
+
+	/* only permessage-deflate (RSV1) can be negotiated and clients must mask */
+	if ((hdr[0] & 0x30) != 0 || (hdr[1] & 0x80) == 0) {
+		return -1;
+	}
+
+	payld_size = hdr[1] & 0x7f;
+	if (payld_size == 126) {
+		if (ws_ctube_socket_recv_all(conn, (char *)hdr, 2, NULL) != 0) {
+			return -1;
+		}
+		payld_size = ((uint64_t)hdr[0] << 8) | hdr[1];
+	} else if (payld_size == 127) {
+		if (ws_ctube_socket_recv_all(conn, (char *)hdr, 8, NULL) != 0) {
+			return -1;
+		}
+		payld_size = 0;
+		for (int i = 0; i < 8; i++) {
+			payld_size = (payld_size << 8) | hdr[i];
+		}
+	}
+	if (payld_size > max_msg_size) {
+		return -1;
+	}
+
+	if (ws_ctube_socket_recv_all(conn, (char *)mask, 4, NULL) != 0) {
+		return -1;
+	}
+	if (ws_ctube_socket_recv_all(conn, msg, payld_size, NULL) != 0) {
+		return -1;
+	}
+	for (uint64_t i = 0; i < payld_size; i++) {
+		msg[i] ^= mask[i % 4];
+	}
+
+	*msg_size = payld_size;
+	return 0;
 }
 
 int ws_ctube_ws_is_ping(const char *msg, int msg_size)
@@ -114,6 +188,35 @@ int ws_ctube_ws_pong(int conn, const char *msg, int msg_size)
 	return 0;
 }
 
+/** copy the request path from the GET line of handshake */
+static int ws_request_path(const char *rbuf, char *path, size_t path_size)
+{
+	const char *begin, *end;
+	size_t len;
+
+	if (strncmp(rbuf, "GET ", strlen("GET ")) != 0) {
+		return -1;
+	}
+
+	begin = rbuf + strlen("GET ");
+	end = strpbrk(begin, " \r");
+	if (end == NULL) {
+		return -1;
+	}
+
+	len = end - begin;
+	if (len > path_size - 1) {
+		len = path_size - 1;
+	}
+	memcpy(path, begin, len);
+	path[len] = '\0';
+
+	if (WS_DEBUG) {
+		printf("path\n%s\n", path);
+	}
+	return 0;
+}
+
 /** extract the client key from handshake */
 static char *ws_client_key(char *rbuf)
 {
@@ -137,6 +240,125 @@ static char *ws_client_key(char *rbuf)
 	return client_key;
 }
 
+/** skip spaces around str, which is modified */
+static char *ws_trim(char *str)
+{
+	char *end;
+
+	while (*str == ' ' || *str == '\t') {
+		str++;
+	}
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+	*end = '\0';
+	return str;
+}
+
+/**
+ * whether the client offers permessage-deflate with parameters we can accept:
+ * every message is compressed on its own, with zlib's full window
+ */
+static int ws_deflate_offered(const char *rbuf)
+{
+	const char *ext, *ext_end;
+	char value[WS_BUFLEN];
+	char *offer, *param, *offer_save, *param_save;
+	size_t len;
+	int ok;
+
+	ext = strstr(rbuf, "Sec-WebSocket-Extensions: ");
+	if (ext == NULL) {
+		return 0;
+	}
+	ext += strlen("Sec-WebSocket-Extensions: ");
+	ext_end = strstr(ext, "\r");
+	if (ext_end == NULL) {
+		return 0;
+	}
+
+	len = ext_end - ext;
+	if (len > sizeof(value) - 1) {
+		len = sizeof(value) - 1;
+	}
+	memcpy(value, ext, len);
+	value[len] = '\0';
+
+	/* offers are separated by ',' and their parameters by ';' */
+	for (offer = strtok_r(value, ",", &offer_save); offer != NULL; offer = strtok_r(NULL, ",", &offer_save)) {
+		param = strtok_r(offer, ";", &param_save);
+		if (param == NULL || strcmp(ws_trim(param), "permessage-deflate") != 0) {
+			continue;
+		}
+
+		ok = 1;
+		while ((param = strtok_r(NULL, ";", &param_save)) != NULL) {
+			param = ws_trim(param);
+			if (strncmp(param, "server_max_window_bits=", strlen("server_max_window_bits=")) == 0) {
+				param += strlen("server_max_window_bits=");
+				param += param[0] == '"';
+				ok = ok && atoi(param) == 15;
+			} else if (strcmp(param, "server_no_context_takeover") != 0
+				   && strcmp(param, "client_no_context_takeover") != 0
+				   && strncmp(param, "client_max_window_bits", strlen("client_max_window_bits")) != 0) {
+				ok = 0;
+			}
+		}
+		if (ok) {
+			if (WS_DEBUG) {
+				printf("permessage-deflate\n");
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * the first subprotocol the client offers that is one of protocols
+ *
+ * @return its index in protocols, or -1 if there is none
+ */
+static int ws_protocol_offered(const char *rbuf, const char *const *protocols, int nprotocol)
+{
+	const char *hdr, *hdr_end;
+	char value[WS_BUFLEN];
+	char *offer, *offer_save;
+	size_t len;
+
+	hdr = strstr(rbuf, "Sec-WebSocket-Protocol: ");
+	if (hdr == NULL) {
+		return -1;
+	}
+	hdr += strlen("Sec-WebSocket-Protocol: ");
+	hdr_end = strstr(hdr, "\r");
+	if (hdr_end == NULL) {
+		return -1;
+	}
+
+	len = hdr_end - hdr;
+	if (len > sizeof(value) - 1) {
+		len = sizeof(value) - 1;
+	}
+	memcpy(value, hdr, len);
+	value[len] = '\0';
+
+	/* in the client's order of preference */
+	for (offer = strtok_r(value, ",", &offer_save); offer != NULL; offer = strtok_r(NULL, ",", &offer_save)) {
+		offer = ws_trim(offer);
+		for (int i = 0; i < nprotocol; i++) {
+			if (strcmp(offer, protocols[i]) == 0) {
+				if (WS_DEBUG) {
+					printf("protocol\n%s\n", offer);
+				}
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
 /** compute server response key per websocket standard */
 static int ws_server_response_key(char *server_key, const char *client_key)
 {
@@ -154,17 +376,23 @@ static int ws_server_response_key(char *server_key, const char *client_key)
 	return 0;
 }
 
-int ws_ctube_ws_handshake(int conn, const struct timeval *timeout)
+int ws_ctube_ws_handshake(int conn, const struct timeval *timeout, char *path, size_t path_size, int *deflate, const char *const *protocols, int nprotocol, int *protocol)
 {
 	char rbuf[WS_BUFLEN];
 	char *client_key;
 	char server_key[WS_BUFLEN];
-	char response[2*WS_BUFLEN];
+	char protocol_response[WS_BUFLEN];
+	char response[3*WS_BUFLEN];
 
 	const char *const response_fmt = "HTTP/1.1 101 Switching Protocols\r\n"
 				"Upgrade: websocket\r\n"
 				"Connection: Upgrade\r\n"
-				"Sec-WebSocket-Accept: %s\r\n\r\n";
+				"Sec-WebSocket-Accept: %s\r\n"
+				"%s%s\r\n";
+	/* clients must not keep context between messages either, so that
+	 * each control message can be decompressed on its own */
+	const char *const deflate_response = "Sec-WebSocket-Extensions: permessage-deflate; "
+				"server_no_context_takeover; client_no_context_takeover\r\n";
 
 	/* receive with timeout, but reset to old timeout afterwards */
 	struct timeval old_timeout;
@@ -189,6 +417,14 @@ int ws_ctube_ws_handshake(int conn, const struct timeval *timeout)
 		printf("get\n%s\n", rbuf);
 	}
 
+	if (ws_request_path(rbuf, path, path_size) != 0) {
+		goto err;
+	}
+
+	/* before ws_client_key() cuts rbuf short */
+	*deflate = *deflate && ws_deflate_offered(rbuf);
+	*protocol = ws_protocol_offered(rbuf, protocols, nprotocol);
+
 	client_key = ws_client_key(rbuf);
 	if (client_key == NULL) {
 		goto err;
@@ -197,7 +433,12 @@ int ws_ctube_ws_handshake(int conn, const struct timeval *timeout)
 		goto err;
 	}
 
-	snprintf(response, sizeof(response)/sizeof(response[0]), response_fmt, server_key);
+	protocol_response[0] = '\0';
+	if (*protocol >= 0) {
+		snprintf(protocol_response, sizeof(protocol_response), "Sec-WebSocket-Protocol: %s\r\n", protocols[*protocol]);
+	}
+
+	snprintf(response, sizeof(response)/sizeof(response[0]), response_fmt, server_key, *deflate ? deflate_response : "", protocol_response);
 	if (WS_DEBUG) {
 		printf("server response\n%s\n", response);
 	}
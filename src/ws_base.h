@@ -15,6 +15,14 @@
 #define WS_CTUBE_FRAME_HDR_SIZE 2
 #define WS_CTUBE_MAX_PAYLD_SIZE 125
 
+/* frame opcodes */
+#define WS_CTUBE_OP_CONT 0x0
+#define WS_CTUBE_OP_TEXT 0x1
+#define WS_CTUBE_OP_BINARY 0x2
+#define WS_CTUBE_OP_CLOSE 0x8
+#define WS_CTUBE_OP_PING 0x9
+#define WS_CTUBE_OP_PONG 0xa
+
 /**
  * make a websocket frame
  *
@@ -29,9 +37,67 @@
 int ws_ctube_ws_mkframe(char *frame, const char *msg, size_t msg_size, int first);
 
 int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size);
-int ws_ctube_ws_recv(int conn, char *msg, int *msg_size, size_t max_msg_size);
+
+/**
+ * send a message in several parts, each part as one or more data frames
+ *
+ * @param conn socket
+ * @param msg pointer to this part of the message (may be empty, e.g. to end it)
+ * @param msg_size bytes of this part
+ * @param first whether this is the first part of the message
+ * @param last whether this is the last part of the message
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int ws_ctube_ws_send_part(int conn, const char *msg, size_t msg_size, int first, int last);
+
+/**
+ * send a message compressed by ws_ctube_deflate_part() to a client that negotiated
+ * permessage-deflate
+ *
+ * @param conn socket
+ * @param msg compressed message
+ * @param msg_size bytes of compressed message
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int ws_ctube_ws_send_deflated(int conn, const char *msg, size_t msg_size);
+
+/**
+ * receive one frame from a client and unmask its payload
+ *
+ * @param conn socket
+ * @param opcode set to the opcode of the frame (WS_CTUBE_OP_*)
+ * @param fin set to whether this is the final frame of its message
+ * @param rsv1 set to whether RSV1 is set (a compressed message if first)
+ * @param msg buffer for the payload
+ * @param msg_size set to bytes of payload
+ * @param max_msg_size bytes available at msg
+ *
+ * @return 0 on success, -1 on error, closed connection, unmasked or RSV2/RSV3
+ * set, or payload larger than max_msg_size
+ */
+int ws_ctube_ws_recv(int conn, int *opcode, int *fin, int *rsv1, char *msg, size_t *msg_size, size_t max_msg_size);
 int ws_ctube_ws_is_ping(const char *msg, int msg_size);
 int ws_ctube_ws_pong(int conn, const char *msg, int msg_size);
-int ws_ctube_ws_handshake(int conn, const struct timeval *timeout);
+
+/**
+ * complete the server side of the websocket opening handshake
+ *
+ * @param conn socket
+ * @param timeout for receiving the request and sending the response
+ * @param path set to the request path of the GET line (including any query,
+ * truncated to path_size - 1 bytes and null terminated)
+ * @param path_size bytes available at path
+ * @param deflate on entry whether permessage-deflate may be negotiated, set
+ * to whether it was
+ * @param protocols names of the subprotocols the server speaks
+ * @param nprotocol number of protocols
+ * @param protocol set to the index in protocols of the subprotocol chosen
+ * (the first one the client offers), or -1 if none was
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int ws_ctube_ws_handshake(int conn, const struct timeval *timeout, char *path, size_t path_size, int *deflate, const char *const *protocols, int nprotocol, int *protocol);
 
 #endif /* WS_CTUBE_WS_BASE_H */
@@ -12,7 +12,10 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 
 #include <stdlib.h>
@@ -26,9 +29,16 @@
 #include "ws_base.h"
 #include "ws_ctube_struct.h"
 #include "socket.h"
+#include "grid.h"
 
 #define WS_CTUBE_DEBUG 0
 #define WS_CTUBE_BUFLEN 4096
+/* longer request paths are truncated (and name no channel) */
+#define WS_CTUBE_PATH_LEN 256
+/* ms the budget DROP policy waits for dropped clients to give memory back */
+#define WS_CTUBE_BUDGET_DROP_WAIT_MS 20
+/* times ws_ctube_replay() tries to publish a record, 1 ms apart */
+#define WS_CTUBE_REPLAY_RETRY 100
 
 typedef void (*cleanup_func)(void *);
 
@@ -41,13 +51,13 @@ static void _ws_ctube_cleanup_unlock_mutex(void *mutex)
 static int ws_ctube_connq_push(struct ws_ctube *ctube, struct ws_ctube_conn_struct *conn, enum ws_ctube_qaction act)
 {
 	int retval = 0;
-	struct ws_ctube_conn_qentry *qentry = (typeof(qentry))malloc(sizeof(*qentry));
+	struct ws_ctube_conn_qentry *qentry = (typeof(qentry))ws_ctube_slab_alloc(&ctube->qentry_slab);
 
 	if (qentry == NULL) {
 		retval = -1;
 		goto out_noalloc;
 	}
-	pthread_cleanup_push(free, qentry);
+	pthread_cleanup_push(ws_ctube_slab_free, qentry);
 
 	if (ws_ctube_conn_qentry_init(qentry, conn, act) != 0) {
 		retval = -1;
@@ -55,38 +65,362 @@ static int ws_ctube_connq_push(struct ws_ctube *ctube, struct ws_ctube_conn_stru
 	}
 	pthread_cleanup_push((cleanup_func)ws_ctube_conn_qentry_destroy, qentry);
 
-	ws_ctube_list_push_back(&ctube->connq, &qentry->lnode);
-	pthread_mutex_lock(&ctube->connq_mutex);
-	ctube->connq_pred = 1;
-	pthread_mutex_unlock(&ctube->connq_mutex);
-	pthread_cond_signal(&ctube->connq_cond);
+	ws_ctube_mpsc_queue_push(&ctube->connq, &qentry->qnode);
+
+	/* wake handler unless a wakeup is already pending */
+	if (!__atomic_exchange_n(&ctube->connq_pred, (int)1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ctube->connq_mutex);
+		pthread_mutex_unlock(&ctube->connq_mutex);
+		pthread_cond_signal(&ctube->connq_cond);
+	}
 
 	pthread_cleanup_pop(retval); /* conn_qentry_destory */
 out_noinit:
-	pthread_cleanup_pop(retval); /* free */
+	pthread_cleanup_pop(retval); /* ws_ctube_slab_free */
 out_noalloc:
 	return retval;
 }
 
+/**
+ * the open channel named by exactly the first len bytes of name (which need
+ * not be null terminated) or NULL; channel_list.mutex must be held
+ */
+static struct ws_ctube_channel *_ws_ctube_channel_find_locked(struct ws_ctube *ctube, const char *name, size_t len)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_channel *channel;
+
+	ws_ctube_list_for_each(&ctube->channel_list, node) {
+		channel = ws_ctube_container_of(node, typeof(*channel), lnode);
+		if (strlen(channel->name) == len && memcmp(channel->name, name, len) == 0) {
+			return channel;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * the channel named by a request path ("/<name>", optionally followed by a
+ * query), or the default channel if no such channel is open
+ */
+static struct ws_ctube_channel *_ws_ctube_channel_find(struct ws_ctube *ctube, const char *path)
+{
+	struct ws_ctube_channel *channel;
+	size_t len;
+
+	if (path[0] == '/') {
+		path++;
+	}
+	len = strcspn(path, "?#");
+	if (len == 0 || len >= WS_CTUBE_CHANNEL_NAME_LEN) {
+		return &ctube->channel;
+	}
+
+	pthread_mutex_lock(&ctube->channel_list.mutex);
+	channel = _ws_ctube_channel_find_locked(ctube, path, len);
+	pthread_mutex_unlock(&ctube->channel_list.mutex);
+
+	return channel != NULL ? channel : &ctube->channel;
+}
+
+/**
+ * find the parameter called name in the query of a request path
+ *
+ * @param value_len set to the bytes of its value (0 if it has none)
+ *
+ * @return its value (not null terminated), or NULL if there is no such
+ * parameter
+ */
+static const char *_ws_ctube_path_param(const char *path, const char *name, size_t *value_len)
+{
+	const size_t name_len = strlen(name);
+	const char *param = strchr(path, '?');
+	size_t len;
+
+	while (param != NULL) {
+		param++;
+		len = strcspn(param, "&=#");
+		if (len == name_len && strncmp(param, name, len) == 0) {
+			param += len;
+			param += *param == '=';
+			*value_len = strcspn(param, "&#");
+			return param;
+		}
+		param = strchr(param, '&');
+	}
+	return NULL;
+}
+
+/**
+ * the encoding a client asked for: its subprotocol (protocol, an encoding or
+ * -1 if none was negotiated), else "?encoding=<name>" in its request path,
+ * else delta if just "?delta" is there. Unknown names get raw
+ */
+static enum ws_ctube_encoding _ws_ctube_conn_encoding(const char *path, int protocol)
+{
+	const char *name;
+	size_t len;
+	int encoding;
+
+	if (protocol >= 0) {
+		return (enum ws_ctube_encoding)protocol;
+	}
+
+	name = _ws_ctube_path_param(path, "encoding", &len);
+	if (name != NULL) {
+		encoding = ws_ctube_encoding_find(name, len);
+		return encoding >= 0 ? (enum ws_ctube_encoding)encoding : WS_CTUBE_ENCODING_RAW;
+	}
+	if (_ws_ctube_path_param(path, "delta", &len) != NULL) {
+		return WS_CTUBE_ENCODING_DELTA;
+	}
+	return WS_CTUBE_ENCODING_RAW;
+}
+
+/**
+ * wake the writer of conn after its sub_gen was bumped, wherever it waits: on
+ * conn itself or for the next broadcast of channel (if not NULL)
+ */
+static void _ws_ctube_conn_wake_writer(struct ws_ctube_conn_struct *conn, struct ws_ctube_channel *channel)
+{
+	pthread_cond_signal(&conn->sub_cond);
+
+	if (channel != NULL) {
+		pthread_mutex_lock(&channel->out_data_mutex);
+		pthread_mutex_unlock(&channel->out_data_mutex);
+		pthread_cond_broadcast(&channel->out_data_cond);
+	}
+}
+
+/** change what conn is sent: channel (NULL to unsubscribe) and whether it is paused */
+static void _ws_ctube_conn_subscribe(struct ws_ctube_conn_struct *conn, struct ws_ctube_channel *channel, int paused)
+{
+	struct ws_ctube_channel *old;
+
+	pthread_mutex_lock(&conn->sub_mutex);
+	old = conn->channel;
+	__atomic_store_n(&conn->channel, channel, __ATOMIC_RELEASE);
+	conn->paused = paused;
+	__atomic_add_fetch(&conn->sub_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&conn->sub_mutex);
+
+	_ws_ctube_conn_wake_writer(conn, old);
+}
+
+/** what part of grids conn is sent */
+static void _ws_ctube_conn_get_roi(struct ws_ctube_conn_struct *conn, struct ws_ctube_roi *roi)
+{
+	pthread_mutex_lock(&conn->sub_mutex);
+	*roi = conn->roi;
+	pthread_mutex_unlock(&conn->sub_mutex);
+}
+
+/** change what part of grids conn is sent; it is sent the latest data again */
+static void _ws_ctube_conn_set_roi(struct ws_ctube_conn_struct *conn, const struct ws_ctube_roi *roi)
+{
+	struct ws_ctube_channel *channel;
+
+	pthread_mutex_lock(&conn->sub_mutex);
+	channel = conn->channel;
+	conn->roi = *roi;
+	__atomic_add_fetch(&conn->sub_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&conn->sub_mutex);
+
+	_ws_ctube_conn_wake_writer(conn, channel);
+}
+
+/**
+ * parse up to max decimal numbers separated by spaces
+ *
+ * @return how many numbers, or -1 if malformed
+ */
+static int _ws_ctube_parse_sizes(size_t *val, int max, const char *msg, size_t len)
+{
+	int n = 0;
+
+	for (;;) {
+		while (len > 0 && msg[0] == ' ') {
+			msg++;
+			len--;
+		}
+		if (len == 0) {
+			break;
+		}
+		if (n == max || msg[0] < '0' || msg[0] > '9') {
+			return -1;
+		}
+
+		val[n] = 0;
+		for (; len > 0 && msg[0] >= '0' && msg[0] <= '9'; msg++, len--) {
+			if (val[n] > ((size_t)-1 - 9) / 10) {
+				return -1;
+			}
+			val[n] = 10 * val[n] + (size_t)(msg[0] - '0');
+		}
+		if (len > 0 && msg[0] != ' ') {
+			return -1;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/** whether the len bytes of msg are keyword, or keyword then a space and more */
+static inline int _ws_ctube_control_is(const char *msg, size_t len, const char *keyword)
+{
+	const size_t n = strlen(keyword);
+
+	return len >= n && memcmp(msg, keyword, n) == 0 && (len == n || msg[n] == ' ');
+}
+
+/**
+ * apply a control message from a client: "subscribe <name>" (no name for
+ * the default channel; unknown names are ignored), "unsubscribe", "pause",
+ * "resume", or for grids "roi <lo0> <hi0> ..." (no numbers for whole
+ * grids), "lod <level>" or "fit <elements>" (0 to stop fitting)
+ */
+static void _ws_ctube_conn_control(struct ws_ctube_conn_struct *conn, const char *msg, size_t len)
+{
+	struct ws_ctube *ctube = conn->ctube;
+	struct ws_ctube_channel *channel;
+	struct ws_ctube_roi roi;
+	size_t val[2 * WS_CTUBE_GRID_MAXDIM];
+	int n;
+
+	/* ignore trailing whitespace, e.g. a newline */
+	while (len > 0 && (msg[len - 1] == ' ' || msg[len - 1] == '\n' || msg[len - 1] == '\r')) {
+		len--;
+	}
+
+	if (len == strlen("pause") && memcmp(msg, "pause", len) == 0) {
+		pthread_mutex_lock(&conn->sub_mutex);
+		channel = conn->channel;
+		pthread_mutex_unlock(&conn->sub_mutex);
+		_ws_ctube_conn_subscribe(conn, channel, 1);
+
+	} else if (len == strlen("resume") && memcmp(msg, "resume", len) == 0) {
+		pthread_mutex_lock(&conn->sub_mutex);
+		channel = conn->channel;
+		pthread_mutex_unlock(&conn->sub_mutex);
+		_ws_ctube_conn_subscribe(conn, channel, 0);
+
+	} else if (len == strlen("unsubscribe") && memcmp(msg, "unsubscribe", len) == 0) {
+		_ws_ctube_conn_subscribe(conn, NULL, 0);
+
+	} else if (_ws_ctube_control_is(msg, len, "subscribe")) {
+		msg += strlen("subscribe");
+		len -= strlen("subscribe");
+		while (len > 0 && msg[0] == ' ') {
+			msg++;
+			len--;
+		}
+		if (len > 0 && msg[0] == '/') {
+			msg++;
+			len--;
+		}
+
+		if (len == 0) {
+			channel = &ctube->channel;
+		} else if (len >= WS_CTUBE_CHANNEL_NAME_LEN || memchr(msg, '\0', len) != NULL) {
+			/* sent by the client: no channel has such a name */
+			channel = NULL;
+		} else {
+			pthread_mutex_lock(&ctube->channel_list.mutex);
+			channel = _ws_ctube_channel_find_locked(ctube, msg, len);
+			pthread_mutex_unlock(&ctube->channel_list.mutex);
+		}
+		if (channel != NULL) {
+			_ws_ctube_conn_subscribe(conn, channel, 0);
+		}
+
+	} else if (_ws_ctube_control_is(msg, len, "roi")) {
+		n = _ws_ctube_parse_sizes(val, 2 * WS_CTUBE_GRID_MAXDIM, msg + strlen("roi"), len - strlen("roi"));
+		if (n >= 0 && n % 2 == 0) {
+			_ws_ctube_conn_get_roi(conn, &roi);
+			roi.ndim = n / 2;
+			for (int i = 0; i < roi.ndim; i++) {
+				roi.lo[i] = val[2 * i];
+				roi.hi[i] = val[2 * i + 1];
+			}
+			_ws_ctube_conn_set_roi(conn, &roi);
+		}
+
+	} else if (_ws_ctube_control_is(msg, len, "lod")) {
+		n = _ws_ctube_parse_sizes(val, 1, msg + strlen("lod"), len - strlen("lod"));
+		if (n == 1) {
+			_ws_ctube_conn_get_roi(conn, &roi);
+			roi.level = val[0] < WS_CTUBE_GRID_MAXLEVEL ? (int)val[0] : WS_CTUBE_GRID_MAXLEVEL;
+			roi.fit = 0;
+			_ws_ctube_conn_set_roi(conn, &roi);
+		}
+
+	} else if (_ws_ctube_control_is(msg, len, "fit")) {
+		n = _ws_ctube_parse_sizes(val, 1, msg + strlen("fit"), len - strlen("fit"));
+		if (n == 1) {
+			_ws_ctube_conn_get_roi(conn, &roi);
+			roi.fit = val[0];
+			_ws_ctube_conn_set_roi(conn, &roi);
+		}
+	}
+}
+
 /** handles incoming data from client */
 static void *ws_ctube_reader_main(void *arg)
 {
 	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
 	struct ws_ctube *ctube = conn->ctube;
 	char buf[WS_CTUBE_BUFLEN];
-
+	char inflated[WS_CTUBE_BUFLEN];
+	size_t len = 0;
+	size_t frame_len, inflated_len;
+	int opcode, fin, rsv1;
+	int compressed = 0;
+
+	/* clients only send short control messages: longer ones (or any
+	 * protocol error) disconnect the client */
 	for (;;) {
-		/* TODO: handle ping/pong */
-		if (recv(conn->fd, buf, WS_CTUBE_BUFLEN, MSG_NOSIGNAL) < 1) {
-			ws_ctube_connq_push(ctube, conn, WS_CTUBE_CONN_STOP);
-			if (WS_CTUBE_DEBUG) {
-				printf("ws_ctube_reader_main(): disconnected client\n");
-				fflush(stdout);
+		/* a control frame may come between the frames of a message: its
+		 * payload lands after the message so far and is not kept */
+		if (ws_ctube_ws_recv(conn->fd, &opcode, &fin, &rsv1, buf + len, &frame_len, sizeof(buf) - len) != 0) {
+			break;
+		}
+		if (opcode == WS_CTUBE_OP_CLOSE) {
+			break;
+		}
+		if (opcode > WS_CTUBE_OP_CLOSE) {
+			/* TODO: answer pings (only the writer sends) */
+			continue;
+		}
+
+		/* only the first frame of a message says it is compressed */
+		if (opcode == WS_CTUBE_OP_CONT ? rsv1 : rsv1 && !conn->deflate) {
+			break;
+		}
+		if (opcode != WS_CTUBE_OP_CONT) {
+			compressed = rsv1;
+		}
+
+		len += frame_len;
+		if (fin) {
+			if (compressed) {
+				inflated_len = ws_ctube_inflate(inflated, sizeof(inflated), buf, len);
+				if (inflated_len == (size_t)-1) {
+					break;
+				}
+				_ws_ctube_conn_control(conn, inflated, inflated_len);
+			} else {
+				_ws_ctube_conn_control(conn, buf, len);
 			}
-			return NULL;
+			len = 0;
 		}
 	}
 
+	ws_ctube_connq_push(ctube, conn, WS_CTUBE_CONN_STOP);
+	if (WS_CTUBE_DEBUG) {
+		printf("ws_ctube_reader_main(): disconnected client\n");
+		fflush(stdout);
+	}
 	return NULL;
 }
 
@@ -94,38 +428,393 @@ static void *ws_ctube_reader_main(void *arg)
 static void _ws_ctube_cleanup_release_ws_ctube_data(void *arg)
 {
 	struct ws_ctube_data *ws_ctube_data = (struct ws_ctube_data *)arg;
-	ws_ctube_ref_count_release(ws_ctube_data, refc, ws_ctube_data_free);
+	ws_ctube_data_release(ws_ctube_data);
+}
+
+/**
+ * send live out_data chunk by chunk, taking copy-on-write snapshots into
+ * account, as a message (or the rest of one if !first)
+ */
+static int _ws_ctube_send_live(int fd, struct ws_ctube_data *out_data, int first)
+{
+	int retval = 0;
+	struct ws_ctube_live *live = out_data->live;
+	const char *base = (const char *)out_data->data;
+	char buf[WS_CTUBE_LIVE_CHUNK_SIZE];
+
+	for (size_t i = 0; i < live->nchunk; i++) {
+		const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+		size_t len = out_data->data_size - off;
+		if (len > WS_CTUBE_LIVE_CHUNK_SIZE) {
+			len = WS_CTUBE_LIVE_CHUNK_SIZE;
+		}
+
+		const char *chunk = ws_ctube_live_read_chunk(live, base, i, buf, len);
+		if (ws_ctube_ws_send_part(fd, chunk, len, first && i == 0, i == live->nchunk - 1) != 0) {
+			retval = -1;
+			break;
+		}
+	}
+
+	return retval;
+}
+
+/**
+ * clip roi (in indices of the full grid) to a level of the grid
+ *
+ * @param view layout of the level, from ws_ctube_grid_level()
+ * @param level which level
+ * @param lo set to the first index of the box along each axis of view
+ * @param hi set to one past the last index of the box along each axis of view
+ *
+ * @return 0 if the box is not empty, -1 otherwise
+ */
+static int _ws_ctube_roi_clip(const struct ws_ctube_grid *view, int level, const struct ws_ctube_roi *roi, size_t *lo, size_t *hi)
+{
+	for (int i = 0; i < view->ndim; i++) {
+		lo[i] = 0;
+		hi[i] = view->dims[i];
+		if (i < roi->ndim) {
+			/* widened to whole elements of the level */
+			const size_t roi_lo = roi->lo[i] >> level;
+			const size_t roi_hi = (roi->hi[i] >> level) + ((roi->hi[i] & (((size_t)1 << level) - 1)) != 0);
+			lo[i] = roi_lo < hi[i] ? roi_lo : hi[i];
+			hi[i] = roi_hi < hi[i] ? roi_hi : hi[i];
+		}
+		if (lo[i] >= hi[i]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * the level of grid to send for roi: roi->level, or with roi->fit the finest
+ * level at which the box has at most roi->fit elements along every axis
+ */
+static int _ws_ctube_roi_level(const struct ws_ctube_grid *grid, const struct ws_ctube_roi *roi)
+{
+	struct ws_ctube_grid view;
+	size_t lo[WS_CTUBE_GRID_MAXDIM];
+	size_t hi[WS_CTUBE_GRID_MAXDIM];
+	int level;
+
+	if (roi->fit == 0) {
+		return roi->level < grid->nlevel ? roi->level : grid->nlevel;
+	}
+
+	for (level = 0; level < grid->nlevel; level++) {
+		ws_ctube_grid_level(grid, level, &view);
+		if (_ws_ctube_roi_clip(&view, level, roi, lo, hi) != 0) {
+			break;
+		}
+
+		int fits = 1;
+		for (int i = 0; i < view.ndim; i++) {
+			fits = fits && hi[i] - lo[i] <= roi->fit;
+		}
+		if (fits) {
+			break;
+		}
+	}
+	return level;
+}
+
+/**
+ * send the grid in out_data at the level and box asked for by roi as a
+ * message (or the rest of one if !first), row by row straight from the shared
+ * buffer. An empty box is not sent unless it ends a message
+ */
+static int _ws_ctube_send_grid(int fd, const struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi, int first)
+{
+	struct ws_ctube_grid view;
+	size_t lo[WS_CTUBE_GRID_MAXDIM];
+	size_t hi[WS_CTUBE_GRID_MAXDIM];
+	size_t stride[WS_CTUBE_GRID_MAXDIM];
+
+	const int level = _ws_ctube_roi_level(&out_data->grid, roi);
+	const char *base = (const char *)out_data->data + ws_ctube_grid_level(&out_data->grid, level, &view);
+	const int pad = WS_CTUBE_GRID_MAXDIM - view.ndim;
+
+	if (roi->ndim == 0) {
+		return ws_ctube_ws_send_part(fd, base, ws_ctube_grid_size(&view), first, 1);
+	}
+	if (_ws_ctube_roi_clip(&view, level, roi, lo + pad, hi + pad) != 0) {
+		return first ? 0 : ws_ctube_ws_send_part(fd, base, 0, 0, 1);
+	}
+
+	/* as a 3D grid whose leading axes have length 1 */
+	for (int i = 0; i < WS_CTUBE_GRID_MAXDIM; i++) {
+		if (i < pad) {
+			lo[i] = 0;
+			hi[i] = 1;
+			stride[i] = 0;
+		} else {
+			stride[i] = view.strides[i - pad];
+		}
+	}
+
+	/* rows are contiguous in the packed grid */
+	const size_t row_size = (hi[2] - lo[2]) * view.elem_size;
+	for (size_t z = lo[0]; z < hi[0]; z++) {
+		for (size_t y = lo[1]; y < hi[1]; y++) {
+			const char *row = base + z * stride[0] + y * stride[1] + lo[2] * stride[2];
+			const int first_row = z == lo[0] && y == lo[1];
+			const int last_row = z == hi[0] - 1 && y == hi[1] - 1;
+			if (ws_ctube_ws_send_part(fd, row, row_size, first && first_row, last_row) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * send what a client asking for roi gets of out_data, without deltas, as a
+ * message (or the rest of one if !first)
+ */
+static int _ws_ctube_send_whole(int fd, struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi, int first)
+{
+	if (out_data->live != NULL) {
+		return _ws_ctube_send_live(fd, out_data, first);
+	} else if (out_data->grid.ndim > 0) {
+		return _ws_ctube_send_grid(fd, out_data, roi, first);
+	}
+	return ws_ctube_ws_send_part(fd, (const char *)out_data->data, out_data->data_size, first, 1);
+}
+
+/** bytes a client not in delta mode would be sent of out_data as a whole */
+static inline size_t _ws_ctube_frame_size(const struct ws_ctube_data *out_data)
+{
+	if (out_data->grid.ndim > 0) {
+		/* without the levels */
+		return ws_ctube_grid_size(&out_data->grid);
+	}
+	return out_data->data_size;
+}
+
+/** forget the last frame sent in delta mode: the next one is a keyframe */
+static void _ws_ctube_drop_delta_base(struct ws_ctube_conn_struct *conn)
+{
+	if (conn->delta_base != NULL) {
+		ws_ctube_data_release(conn->delta_base);
+		conn->delta_base = NULL;
+		conn->delta_base_id = 0;
+	}
+}
+
+/**
+ * whether a client asking for roi is sent the frame of out_data as is (the
+ * first _ws_ctube_frame_size() bytes of its buffer), so that deltas and
+ * compression can be computed once for all such clients
+ */
+static int _ws_ctube_sends_frame(const struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi)
+{
+	if (out_data->live != NULL) {
+		/* copy-on-write chunks are read as they are sent */
+		return 0;
+	}
+	if (out_data->grid.ndim > 0) {
+		return roi->ndim == 0 && _ws_ctube_roi_level(&out_data->grid, roi) == 0;
+	}
+	return 1;
+}
+
+/**
+ * send out_data to a client in the raw encoding: compressed once for all
+ * clients that negotiated permessage-deflate, if that makes it smaller
+ */
+static int _ws_ctube_send_maybe_deflated(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi)
+{
+	const struct ws_ctube_encoded *deflated;
+
+	if (conn->deflate && _ws_ctube_sends_frame(out_data, roi)) {
+		deflated = ws_ctube_data_get_encoded(out_data, WS_CTUBE_ENCODING_DEFLATE, _ws_ctube_frame_size(out_data), &conn->ctube->encoder);
+		if (deflated != NULL) {
+			return ws_ctube_ws_send_deflated(conn->fd, deflated->buf, deflated->size);
+		}
+	}
+	return _ws_ctube_send_whole(conn->fd, out_data, roi, 1);
+}
+
+/**
+ * send out_data to a client in the deflate encoding: one message of a 1 byte
+ * tag, then either a raw deflate stream of the frame, made once for all
+ * clients (tag WS_CTUBE_TAG_DEFLATE), or what _ws_ctube_send_whole() sends
+ * (tag WS_CTUBE_TAG_FRAME) if compressing does not make it smaller
+ */
+static int _ws_ctube_send_deflate_stream(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi)
+{
+	/* an empty final block: decompressors expect the stream to end */
+	static const char final_block[] = {0x03, 0x00};
+	const struct ws_ctube_encoded *deflated = NULL;
+	char tag = WS_CTUBE_TAG_FRAME;
+	int retval;
+
+	if (_ws_ctube_sends_frame(out_data, roi)) {
+		deflated = ws_ctube_data_get_encoded(out_data, WS_CTUBE_ENCODING_DEFLATE, _ws_ctube_frame_size(out_data), &conn->ctube->encoder);
+	}
+	if (deflated != NULL) {
+		tag = WS_CTUBE_TAG_DEFLATE;
+	}
+
+	retval = ws_ctube_ws_send_part(conn->fd, &tag, 1, 1, 0);
+	if (retval != 0) {
+		return retval;
+	}
+	if (deflated == NULL) {
+		return _ws_ctube_send_whole(conn->fd, out_data, roi, 0);
+	}
+
+	/* with the sync flush tail that permessage-deflate leaves out */
+	retval = ws_ctube_ws_send_part(conn->fd, deflated->buf, deflated->size + WS_CTUBE_DEFLATE_TAIL, 0, 0);
+	if (retval == 0) {
+		retval = ws_ctube_ws_send_part(conn->fd, final_block, sizeof(final_block), 0, 1);
+	}
+	return retval;
+}
+
+/**
+ * send out_data in delta mode: one message of a 1 byte tag, then either what
+ * _ws_ctube_send_whole() sends (tag WS_CTUBE_TAG_FRAME) or the delta to
+ * it from the last frame sent (tag WS_CTUBE_TAG_DELTA). Keeps a
+ * reference to out_data as the base of the next delta if it can be one
+ */
+static int _ws_ctube_send_delta(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, unsigned long out_data_id, const struct ws_ctube_roi *roi)
+{
+	const struct ws_ctube_data *base = conn->delta_base;
+	const struct ws_ctube_delta *delta = NULL;
+	const int applies = _ws_ctube_sends_frame(out_data, roi);
+	const size_t frame_size = _ws_ctube_frame_size(out_data);
+	char tag = WS_CTUBE_TAG_FRAME;
+	int retval;
+
+	if (applies && base != NULL && frame_size > 0 && conn->delta_nframe < WS_CTUBE_DELTA_KEYFRAME
+	    && _ws_ctube_frame_size(base) == frame_size) {
+		delta = ws_ctube_data_get_delta(out_data, base, conn->delta_base_id, frame_size, &conn->ctube->encoder);
+	}
+	if (delta != NULL) {
+		tag = WS_CTUBE_TAG_DELTA;
+	}
+
+	retval = ws_ctube_ws_send_part(conn->fd, &tag, 1, 1, 0);
+	if (retval == 0) {
+		if (delta != NULL) {
+			/* an empty delta (nothing changed) ends with an empty frame */
+			retval = ws_ctube_ws_send_part(conn->fd, delta->buf, delta->size, 0, 1);
+		} else {
+			retval = _ws_ctube_send_whole(conn->fd, out_data, roi, 0);
+		}
+	}
+
+	_ws_ctube_drop_delta_base(conn);
+	if (applies) {
+		ws_ctube_data_acquire(out_data);
+		conn->delta_base = out_data;
+		conn->delta_base_id = out_data_id;
+		conn->delta_nframe = delta != NULL ? conn->delta_nframe + 1 : 0;
+	}
+	return retval;
+}
+
+/** send out_data (of id out_data_id) to a client in its encoding */
+static int _ws_ctube_send_encoded(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, unsigned long out_data_id, const struct ws_ctube_roi *roi)
+{
+	switch (conn->encoding) {
+	case WS_CTUBE_ENCODING_DELTA:
+		return _ws_ctube_send_delta(conn, out_data, out_data_id, roi);
+	case WS_CTUBE_ENCODING_DEFLATE:
+		return _ws_ctube_send_deflate_stream(conn, out_data, roi);
+	default:
+		return _ws_ctube_send_maybe_deflated(conn, out_data, roi);
+	}
 }
 
 /** sends broadcast data to client */
 static void *ws_ctube_writer_main(void *arg)
 {
 	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
-	struct ws_ctube *ctube = conn->ctube;
+	struct ws_ctube_channel *channel;
 	struct ws_ctube_data *out_data = NULL;
 	unsigned long out_data_id = 0;
+	unsigned long sub_gen = 0;
+	struct ws_ctube_roi roi;
 	int send_retval;
 
+	/* a snapshot is sent first, then what was published after it */
+	if (conn->snapshot != NULL) {
+		out_data = conn->snapshot;
+		conn->snapshot = NULL;
+		out_data_id = conn->snapshot_out_data_id;
+		/* a snapshot is not a grid: no roi applies */
+		roi.ndim = 0;
+		roi.level = 0;
+		roi.fit = 0;
+
+		__atomic_store_n(&conn->sending_bytes, ws_ctube_data_pooled_bytes(out_data), __ATOMIC_RELAXED);
+		__atomic_store_n(&conn->sending_id, conn->snapshot_id, __ATOMIC_RELEASE);
+
+		pthread_cleanup_push(_ws_ctube_cleanup_release_ws_ctube_data, out_data);
+		_ws_ctube_send_encoded(conn, out_data, conn->snapshot_id, &roi);
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_release_ws_ctube_data */
+		__atomic_store_n(&conn->sending_id, (unsigned long)0, __ATOMIC_RELEASE);
+		ws_ctube_data_release(out_data);
+	}
+
 	for (;;) {
-		/* wait until new data is needed to be broadcast by checking data id */
-		pthread_mutex_lock(&ctube->out_data_mutex);
-		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->out_data_mutex);
-		while (out_data_id == ctube->out_data_id) {
-			pthread_cond_wait(&ctube->out_data_cond, &ctube->out_data_mutex);
+		/* paused or unsubscribed clients are left out of the fan-out:
+		 * their writer waits here instead of on a channel */
+		pthread_mutex_lock(&conn->sub_mutex);
+		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &conn->sub_mutex);
+		while (conn->paused || conn->channel == NULL) {
+			pthread_cond_wait(&conn->sub_cond, &conn->sub_mutex);
+		}
+		channel = conn->channel;
+		roi = conn->roi;
+		/* send the latest data again after a change, e.g. of roi */
+		if (sub_gen != conn->sub_gen) {
+			sub_gen = conn->sub_gen;
+			out_data_id = 0;
+		}
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
+		pthread_mutex_unlock(&conn->sub_mutex);
+
+		/* wait until new data is needed to be broadcast by checking data
+		 * id (ids are unique across channels), or the subscription changes */
+		pthread_mutex_lock(&channel->out_data_mutex);
+		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
+		while ((channel->out_data == NULL || out_data_id == channel->out_data_id) && sub_gen == __atomic_load_n(&conn->sub_gen, __ATOMIC_ACQUIRE)) {
+			pthread_cond_wait(&channel->out_data_cond, &channel->out_data_mutex);
+		}
+
+		out_data = NULL;
+		if (sub_gen == __atomic_load_n(&conn->sub_gen, __ATOMIC_ACQUIRE)) {
+			ws_ctube_data_acquire(channel->out_data);
+			out_data = channel->out_data;
+			out_data_id = channel->out_data_id;
 		}
 
-		ws_ctube_ref_count_acquire(ctube->out_data, refc);
-		out_data = ctube->out_data;
-		out_data_id = ctube->out_data_id;
+		/* let the producer find laggards for the memory budget */
+		if (out_data != NULL) {
+			__atomic_store_n(&conn->sending_bytes, ws_ctube_data_pooled_bytes(out_data), __ATOMIC_RELAXED);
+			__atomic_store_n(&conn->sending_id, out_data_id, __ATOMIC_RELEASE);
+		}
 
 		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
-		pthread_mutex_unlock(&ctube->out_data_mutex);
+		pthread_mutex_unlock(&channel->out_data_mutex);
+
+		/* subscription changed: wait again */
+		if (out_data == NULL) {
+			continue;
+		}
 
 		/* broadcast data in a cancellable way */
 		pthread_cleanup_push(_ws_ctube_cleanup_release_ws_ctube_data, out_data);
-		send_retval = ws_ctube_ws_send(conn->fd, (char *)out_data->data, out_data->data_size);
+		send_retval = _ws_ctube_send_encoded(conn, out_data, out_data_id, &roi);
 		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_release_ws_ctube_data */
-		ws_ctube_ref_count_release(out_data, refc, ws_ctube_data_free);
+		__atomic_store_n(&conn->sending_id, (unsigned long)0, __ATOMIC_RELEASE);
+		ws_ctube_data_release(out_data);
 
 		/* TODO: error handling of failed broadcast */
 		if (send_retval != 0) {
@@ -198,66 +887,175 @@ static void ws_ctube_conn_struct_stop(struct ws_ctube_conn_struct *conn)
 	pthread_join(conn->reader_tid, NULL);
 	pthread_join(conn->writer_tid, NULL);
 
+	/* held by the writer between broadcasts */
+	_ws_ctube_drop_delta_base(conn);
+	/* not sent yet if the writer did not get to it */
+	if (conn->snapshot != NULL) {
+		ws_ctube_data_release(conn->snapshot);
+		conn->snapshot = NULL;
+	}
+
 	pthread_setcancelstate(oldstate, &statevar);
 }
 
-static void _ws_ctube_conn_list_add(struct ws_ctube_list *conn_list, struct ws_ctube_conn_struct *conn)
+/** runs on the reclaimer thread: stop a disconnected client's threads */
+static void _ws_ctube_conn_struct_reclaim(struct ws_ctube_reclaim_node *node)
 {
-	ws_ctube_ref_count_acquire(conn, refc);
-	ws_ctube_list_push_back(conn_list, &conn->lnode);
+	struct ws_ctube_conn_struct *conn = ws_ctube_container_of(node, typeof(*conn), rnode);
+
+	ws_ctube_conn_struct_stop(conn);
+	ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
 }
 
-static void _ws_ctube_conn_list_remove(struct ws_ctube_list *conn_list, struct ws_ctube_conn_struct *conn)
+/**
+ * get a snapshot made by snapshot_fn into a pooled ws_ctube_data (referenced)
+ *
+ * @param size bytes to try first or 0 to ask snapshot_fn; set to the bytes of
+ * the snapshot
+ *
+ * @return the snapshot, or NULL if there is none (or it does not fit within
+ * the memory budget)
+ */
+static struct ws_ctube_data *_ws_ctube_snapshot_take(struct ws_ctube *ctube, ws_ctube_snapshot_fn snapshot_fn, void *user, size_t *size)
 {
-	ws_ctube_list_unlink(conn_list, &conn->lnode);
-	ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+	struct ws_ctube_data_pool *pool = &ctube->data_pool;
+	struct ws_ctube_data *snapshot;
+	size_t n;
+
+	/* the state may grow between asking for the size and writing it */
+	for (int attempt = 0; attempt < 3; attempt++) {
+		if (*size == 0) {
+			*size = snapshot_fn(NULL, 0, user);
+			if (*size == 0) {
+				return NULL;
+			}
+		}
+
+		/* for one client only: never worth blocking or dropping others */
+		if (pool->budget == 0) {
+			_ws_ctube_data_pool_take(pool, ws_ctube_data_pool_capacity(*size));
+		} else if (ws_ctube_data_pool_reserve(pool, ws_ctube_data_pool_capacity(*size), pool->budget) != 0) {
+			__atomic_add_fetch(&ctube->nbudget_rejected, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		snapshot = ws_ctube_data_pool_get(pool, *size, 1);
+		if (ws_ctube_unlikely(snapshot == NULL)) {
+			return NULL;
+		}
+
+		n = snapshot_fn(snapshot->data, snapshot->data_capacity, user);
+		if (n > 0 && n <= snapshot->data_capacity) {
+			snapshot->data_size = n;
+			*size = n;
+			ws_ctube_data_acquire(snapshot);
+			return snapshot;
+		}
+		ws_ctube_data_recycle(snapshot);
+		*size = n;
+		if (n == 0) {
+			return NULL;
+		}
+	}
+
+	fprintf(stderr, "_ws_ctube_snapshot_take(): error: snapshot keeps growing\n");
+	fflush(stderr);
+	return NULL;
+}
+
+/**
+ * take the snapshot of conn->channel, if it has a snapshot_fn, for the writer
+ * of a client that just connected to send first. The writer must not be
+ * running yet
+ */
+static void _ws_ctube_conn_snapshot(struct ws_ctube_conn_struct *conn)
+{
+	struct ws_ctube_channel *channel = conn->channel;
+	ws_ctube_snapshot_fn snapshot_fn;
+	void *user;
+	size_t size;
+	unsigned long out_data_id;
+
+	/* the id is read first: whatever was published up to it was applied
+	 * to the state before the snapshot is written (and later publishes
+	 * are sent after it), so that no update is missed */
+	pthread_mutex_lock(&channel->out_data_mutex);
+	snapshot_fn = channel->snapshot_fn;
+	user = channel->snapshot_user;
+	size = channel->snapshot_size;
+	out_data_id = channel->out_data_id;
+	pthread_mutex_unlock(&channel->out_data_mutex);
+
+	if (snapshot_fn == NULL) {
+		return;
+	}
+
+	/* not under out_data_mutex: snapshot_fn may wait on a lock held by a
+	 * thread that publishes to channel */
+	conn->snapshot = _ws_ctube_snapshot_take(conn->ctube, snapshot_fn, user, &size);
+	if (conn->snapshot == NULL) {
+		return;
+	}
+	/* ids are unique across snapshots too, for deltas from it */
+	conn->snapshot_id = __atomic_add_fetch(&conn->ctube->out_data_seq, 1, __ATOMIC_RELAXED);
+	conn->snapshot_out_data_id = out_data_id;
+
+	/* a hint for the next client */
+	pthread_mutex_lock(&channel->out_data_mutex);
+	if (channel->snapshot_fn == snapshot_fn) {
+		channel->snapshot_size = size;
+	}
+	pthread_mutex_unlock(&channel->out_data_mutex);
 }
 
 /** process work item from FIFO connq (start/stop connection) */
-static void ws_ctube_handler_process_queue(struct ws_ctube_list *connq, struct ws_ctube_list *conn_list, int max_nclient)
+static void ws_ctube_handler_process_queue(struct ws_ctube *ctube)
 {
+	struct ws_ctube_conn_table *conn_table = &ctube->conn_table;
 	struct ws_ctube_conn_qentry *qentry;
-	struct ws_ctube_list_node *node;
+	struct ws_ctube_mpsc_node *node;
 	struct ws_ctube_conn_struct *conn;
+	char path[WS_CTUBE_PATH_LEN];
+	int protocol;
 
-	while ((node = ws_ctube_list_pop_front(connq)) != NULL) {
-		qentry = ws_ctube_container_of(node, typeof(*qentry), lnode);
+	while ((node = ws_ctube_mpsc_queue_pop(&ctube->connq)) != NULL) {
+		qentry = ws_ctube_container_of(node, typeof(*qentry), qnode);
 		conn = qentry->conn;
 
 		pthread_cleanup_push((cleanup_func)ws_ctube_conn_qentry_free, qentry);
 
 		switch (qentry->act) {
 		case WS_CTUBE_CONN_START:
-			pthread_mutex_lock(&conn_list->mutex);
-
 			/* refuse new connections if limit exceeded*/
-			if (conn_list->len >= max_nclient) {
-				pthread_mutex_unlock(&conn_list->mutex);
+			if (conn_table->len >= ctube->max_nclient) {
 				fprintf(stderr, "ws_ctube_handler_process_queue(): max_nclient reached\n");
 				fflush(stderr);
 				break;
-			} else {
-				pthread_mutex_unlock(&conn_list->mutex);
 			}
 
 			/* do websocket handshake */
-			if (ws_ctube_ws_handshake(conn->fd, &conn->ctube->timeout_val) == 0) {
+			conn->deflate = WS_CTUBE_DEFLATE;
+			if (ws_ctube_ws_handshake(conn->fd, &ctube->timeout_val, path, sizeof(path), &conn->deflate,
+						  ws_ctube_encoding_names, WS_CTUBE_NENCODING, &protocol) == 0) {
+				/* the writer is not running yet */
+				conn->channel = _ws_ctube_channel_find(ctube, path);
+				conn->encoding = _ws_ctube_conn_encoding(path, protocol);
+				_ws_ctube_conn_snapshot(conn);
 				ws_ctube_conn_struct_start(conn);
-				_ws_ctube_conn_list_add(conn_list, conn);
+				ws_ctube_conn_table_add(conn_table, conn);
 			}
 			break;
 
 		case WS_CTUBE_CONN_STOP:
-			pthread_mutex_lock(&conn->stopping_mutex);
 			/* prevent double stop */
-			if (!conn->stopping) {
-				conn->stopping = 1;
-				pthread_mutex_unlock(&conn->stopping_mutex);
-
-				_ws_ctube_conn_list_remove(conn_list, conn);
-				ws_ctube_conn_struct_stop(conn);
-			} else {
-				pthread_mutex_unlock(&conn->stopping_mutex);
+			if (!ws_ctube_conn_struct_set_stopping(conn)) {
+				if (ws_ctube_conn_table_remove(conn_table, ws_ctube_slab_slot(conn)) != NULL) {
+					ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+				}
+
+				/* joining its threads can take a while: let the
+				 * reclaimer do it so other clients are not held up */
+				ws_ctube_ref_count_acquire(conn, refc);
+				ws_ctube_reclaimer_push(&ctube->reclaimer, &conn->rnode, _ws_ctube_conn_struct_reclaim);
 			}
 			break;
 		}
@@ -267,26 +1065,23 @@ static void ws_ctube_handler_process_queue(struct ws_ctube_list *connq, struct w
 }
 
 /** stop all client connections and cleanup */
-static void _ws_ctube_cleanup_conn_list(void *arg)
+static void _ws_ctube_cleanup_conn_table(void *arg)
 {
 	int oldstate, statevar;
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-	struct ws_ctube_list *conn_list = (struct ws_ctube_list *)arg;
-	struct ws_ctube_list_node *node;
+	struct ws_ctube_conn_table *conn_table = (struct ws_ctube_conn_table *)arg;
 	struct ws_ctube_conn_struct *conn;
 
-	while ((node = ws_ctube_list_pop_front(conn_list)) != NULL) {
-		conn = ws_ctube_container_of(node, typeof(*conn), lnode);
+	for (int slot = 0; slot < conn_table->capacity; slot++) {
+		conn = ws_ctube_conn_table_remove(conn_table, slot);
+		if (conn == NULL) {
+			continue;
+		}
 
-		pthread_mutex_lock(&conn->stopping_mutex);
 		/* prevent double stop */
-		if (!conn->stopping) {
-			conn->stopping = 1;
-			pthread_mutex_unlock(&conn->stopping_mutex);
+		if (!ws_ctube_conn_struct_set_stopping(conn)) {
 			ws_ctube_conn_struct_stop(conn);
-		} else {
-			pthread_mutex_unlock(&conn->stopping_mutex);
 		}
 
 		ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
@@ -300,22 +1095,22 @@ static void *ws_ctube_handler_main(void *arg)
 {
 	struct ws_ctube *ctube = (struct ws_ctube *)arg;
 
-	struct ws_ctube_list conn_list;
-	ws_ctube_list_init(&conn_list);
-	pthread_cleanup_push(_ws_ctube_cleanup_conn_list, &conn_list);
+	pthread_cleanup_push(_ws_ctube_cleanup_conn_table, &ctube->conn_table);
 
 	for (;;) {
 		/* wait for work items in FIFO connq */
 		pthread_mutex_lock(&ctube->connq_mutex);
 		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->connq_mutex);
-		while (!ctube->connq_pred) {
+		while (!__atomic_load_n(&ctube->connq_pred, __ATOMIC_SEQ_CST)) {
 			pthread_cond_wait(&ctube->connq_cond, &ctube->connq_mutex);
 		}
-		ctube->connq_pred = 0;
 		pthread_mutex_unlock(&ctube->connq_mutex);
 		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
 
-		ws_ctube_handler_process_queue(&ctube->connq, &conn_list, ctube->max_nclient);
+		/* cleared before draining: pushes from now on wake us again */
+		__atomic_store_n(&ctube->connq_pred, (int)0, __ATOMIC_SEQ_CST);
+
+		ws_ctube_handler_process_queue(ctube);
 	}
 
 	pthread_cleanup_pop(1);
@@ -343,13 +1138,13 @@ static int ws_ctube_server_accept_new_conn(struct ws_ctube *ctube, const int ser
 	int conn_fd = accept(server_sock, NULL, NULL);
 	pthread_cleanup_push(_ws_ctube_cleanup_close_client_conn, &conn_fd);
 
-	/* create new conn_struct for client */
-	struct ws_ctube_conn_struct *conn = (typeof(conn))malloc(sizeof(*conn));
+	/* create new conn_struct for client (refused if all slots are in use) */
+	struct ws_ctube_conn_struct *conn = (typeof(conn))ws_ctube_slab_alloc(&ctube->conn_slab);
 	if (conn == NULL) {
 		retval = -1;
 		goto out_noalloc;
 	}
-	pthread_cleanup_push(free, conn);
+	pthread_cleanup_push(ws_ctube_slab_free, conn);
 
 	if (ws_ctube_conn_struct_init(conn, conn_fd, ctube) != 0) {
 		retval = -1;
@@ -368,7 +1163,7 @@ static int ws_ctube_server_accept_new_conn(struct ws_ctube *ctube, const int ser
 out_nopush:
 	pthread_cleanup_pop(retval); /* ws_ctube_conn_struct_destroy */
 out_noinit:
-	pthread_cleanup_pop(retval); /* free */
+	pthread_cleanup_pop(retval); /* ws_ctube_slab_free */
 out_noalloc:
 	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_close_client_conn */
 	return retval;
@@ -494,6 +1289,34 @@ static int ws_ctube_start(struct ws_ctube *ctube)
 {
 	int retval = 0;
 
+	if (ws_ctube_encoder_start(&ctube->encoder, ctube->encode_threads) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create encoder failed\n");
+		retval = -1;
+		goto out_noencoder;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_encoder_stop, &ctube->encoder);
+
+	if (ws_ctube_reclaimer_start(&ctube->reclaimer) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create reclaimer failed\n");
+		retval = -1;
+		goto out_noreclaimer;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_reclaimer_stop, &ctube->reclaimer);
+
+	if (ctube->record_path != NULL && ws_ctube_recorder_start(&ctube->recorder, ctube->record_path, ctube->record_segment_size, ctube->record_backlog) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create recorder failed\n");
+		retval = -1;
+		goto out_norecorder;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_recorder_stop, &ctube->recorder);
+
+	if (ctube->shm_path != NULL && ws_ctube_shm_start(&ctube->shm, ctube->shm_path, ctube->shm_size) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create shm ring failed\n");
+		retval = -1;
+		goto out_noshm;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_shm_stop, &ctube->shm);
+
 	if (pthread_create(&ctube->handler_tid, NULL, ws_ctube_handler_main, (void *)ctube) != 0) {
 		fprintf(stderr, "ws_ctube_start(): create handler failed\n");
 		retval = -1;
@@ -533,6 +1356,14 @@ out_noinit:
 out_noserver:
 	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_handler */
 out_nohandler:
+	pthread_cleanup_pop(retval); /* ws_ctube_shm_stop */
+out_noshm:
+	pthread_cleanup_pop(retval); /* ws_ctube_recorder_stop */
+out_norecorder:
+	pthread_cleanup_pop(retval); /* ws_ctube_reclaimer_stop */
+out_noreclaimer:
+	pthread_cleanup_pop(retval); /* ws_ctube_encoder_stop */
+out_noencoder:
 	return retval;
 }
 
@@ -548,52 +1379,147 @@ static void ws_ctube_stop(struct ws_ctube *ctube)
 	pthread_join(ctube->handler_tid, NULL);
 	pthread_join(ctube->server_tid, NULL);
 
+	/* readers get what was written before */
+	ws_ctube_shm_stop(&ctube->shm);
+	/* writes what is still queued, then lets go of it */
+	ws_ctube_recorder_stop(&ctube->recorder);
+	/* stops clients and frees data queued by the other threads */
+	ws_ctube_reclaimer_stop(&ctube->reclaimer);
+	/* last: no writer is left to run an encode job */
+	ws_ctube_encoder_stop(&ctube->encoder);
+
 	pthread_setcancelstate(oldstate, &statevar);
 }
 
-struct ws_ctube* ws_ctube_open(
-	int port,
-	int max_nclient,
-	int timeout_ms,
-	double max_broadcast_fps)
+void ws_ctube_opts_init(struct ws_ctube_opts *opts)
+{
+	opts->port = 0;
+	opts->max_nclient = 1;
+	opts->timeout_ms = 0;
+	opts->max_broadcast_fps = 0;
+
+	opts->prealloc_size = 0;
+	opts->prealloc_count = 2;
+	opts->hugepage_threshold = 0;
+
+	opts->ctrl_alloc.alloc = NULL;
+	opts->ctrl_alloc.free = NULL;
+	opts->ctrl_alloc.user = NULL;
+	opts->payload_alloc = opts->ctrl_alloc;
+
+	opts->mem_budget = 0;
+	opts->budget_policy = WS_CTUBE_BUDGET_REJECT;
+
+	opts->encode_threads = 0;
+
+	opts->record_path = NULL;
+	opts->record_segment_size = (size_t)64 << 20;
+	opts->record_backlog = (size_t)256 << 20;
+	opts->shm_path = NULL;
+	opts->shm_size = (size_t)64 << 20;
+}
+
+/** free ctube memory with the allocator it came from */
+static void _ws_ctube_free(struct ws_ctube *ctube)
+{
+	const struct ws_ctube_allocator ctrl = ctube->mem.ctrl;
+	ws_ctube_mem_free(&ctrl, ctube, sizeof(*ctube), __alignof__(*ctube));
+}
+
+/** @return 0 if both or neither hooks of allocator are set, -1 otherwise */
+static int _ws_ctube_check_allocator(const struct ws_ctube_allocator *allocator)
+{
+	return (allocator->alloc == NULL) == (allocator->free == NULL) ? 0 : -1;
+}
+
+struct ws_ctube *ws_ctube_open_opts(const struct ws_ctube_opts *opts)
 {
 	int err = 0;
 	struct ws_ctube *ctube;
 
 	/* input sanity checks */
-	if (port < 1) {
-		fprintf(stderr, "ws_ctube_open(): invalid port\n");
+	if (opts == NULL) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid opts\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->port < 1) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid port\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->max_nclient < 1) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid max_nclient\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->timeout_ms < 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid timeout_ms\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->max_broadcast_fps < 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid max_broadcast_fps\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->prealloc_count < 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid prealloc_count\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (_ws_ctube_check_allocator(&opts->ctrl_alloc) != 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid ctrl_alloc\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (_ws_ctube_check_allocator(&opts->payload_alloc) != 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid payload_alloc\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->budget_policy != WS_CTUBE_BUDGET_REJECT && opts->budget_policy != WS_CTUBE_BUDGET_DROP && opts->budget_policy != WS_CTUBE_BUDGET_BLOCK) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid budget_policy\n");
 		fflush(stderr);
 		err = -1;
 		goto out_noalloc;
 	}
-	if (max_nclient < 1) {
-		fprintf(stderr, "ws_ctube_open(): invalid max_nclient\n");
+	if (opts->encode_threads < 0 || opts->encode_threads > WS_CTUBE_ENCODE_MAXTHREAD) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid encode_threads\n");
 		fflush(stderr);
 		err = -1;
 		goto out_noalloc;
 	}
-	if (timeout_ms < 0) {
-		fprintf(stderr, "ws_ctube_open(): invalid timeout_ms\n");
+	if (opts->record_path != NULL && (opts->record_path[0] == '\0' || opts->record_segment_size == 0)) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid record_path or record_segment_size\n");
 		fflush(stderr);
 		err = -1;
 		goto out_noalloc;
 	}
-	if (max_broadcast_fps < 0) {
-		fprintf(stderr, "ws_ctube_open(): invalid max_broadcast_fps\n");
+	if (opts->shm_path != NULL && (opts->shm_path[0] == '\0' || opts->shm_size == 0)) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid shm_path or shm_size\n");
 		fflush(stderr);
 		err = -1;
 		goto out_noalloc;
 	}
 
-	ctube = (typeof(ctube))malloc(sizeof(*ctube));
+	ctube = (typeof(ctube))ws_ctube_mem_alloc(&opts->ctrl_alloc, sizeof(*ctube), __alignof__(*ctube));
 	if (ctube == NULL) {
 		err = -1;
 		goto out_noalloc;
 	}
-	pthread_cleanup_push((cleanup_func)free, ctube);
+	ctube->mem.ctrl = opts->ctrl_alloc;
+	pthread_cleanup_push((cleanup_func)_ws_ctube_free, ctube);
 
-	if (ws_ctube_init(ctube, port, max_nclient, timeout_ms, max_broadcast_fps) != 0) {
+	if (ws_ctube_init(ctube, opts) != 0) {
 		err = -1;
 		goto out_noinit;
 	}
@@ -616,6 +1542,23 @@ out_noalloc:
 	}
 }
 
+struct ws_ctube *ws_ctube_open(
+	int port,
+	int max_nclient,
+	int timeout_ms,
+	double max_broadcast_fps)
+{
+	struct ws_ctube_opts opts;
+
+	ws_ctube_opts_init(&opts);
+	opts.port = port;
+	opts.max_nclient = max_nclient;
+	opts.timeout_ms = timeout_ms;
+	opts.max_broadcast_fps = max_broadcast_fps;
+
+	return ws_ctube_open_opts(&opts);
+}
+
 void ws_ctube_close(struct ws_ctube *ctube)
 {
 	if (ws_ctube_unlikely(ctube == NULL)) {
@@ -626,90 +1569,1334 @@ void ws_ctube_close(struct ws_ctube *ctube)
 
 	ws_ctube_stop(ctube);
 	ws_ctube_destroy(ctube);
-	free(ctube);
+	_ws_ctube_free(ctube);
 }
 
-int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_size)
+/**
+ * check whether publishing to channel now would exceed max_bcast_fps;
+ * channel->out_data_mutex must be held
+ *
+ * @param cur_time set to the current time if rate limiting is enabled
+ *
+ * @return 0 if broadcasting is allowed, -1 otherwise
+ */
+static int _ws_ctube_bcast_ratelim(struct ws_ctube_channel *channel, struct timespec *cur_time)
 {
-	if (ws_ctube_unlikely(ctube == NULL)) {
-		fprintf(stderr, "ws_ctube_broadcast(): error: ctube is NULL\n");
-		fflush(stderr);
-		return -1;
+	const double max_bcast_fps = channel->ctube->max_bcast_fps;
+	if (max_bcast_fps <= 0) {
+		return 0;
 	}
-	if (ws_ctube_unlikely(data == NULL)) {
-		fprintf(stderr, "ws_ctube_broadcast(): error: data is NULL\n");
-		fflush(stderr);
-		return -1;
+
+#ifdef CLOCK_MONOTONIC
+	if (ws_ctube_unlikely(clock_gettime(CLOCK_MONOTONIC, cur_time) != 0)) {
+		clock_gettime(CLOCK_REALTIME, cur_time);
 	}
-	if (ws_ctube_unlikely(data_size == 0)) {
-		fprintf(stderr, "ws_ctube_broadcast(): error: data_size is 0\n");
-		fflush(stderr);
+#else
+	clock_gettime(CLOCK_REALTIME, cur_time);
+#endif /* CLOCK_MONOTONIC */
+
+	double dt = (cur_time->tv_sec - channel->prev_bcast_time.tv_sec) +
+		1e-9 * (cur_time->tv_nsec - channel->prev_bcast_time.tv_nsec);
+
+	if (dt < 1.0 / max_bcast_fps) {
 		return -1;
 	}
+	return 0;
+}
 
-	int retval = 0;
-	if (pthread_mutex_trylock(&ctube->out_data_mutex) != 0) {
-		retval = -1;
-		goto out_nolock;
+/** runs on the recorder thread: copy a broadcast into the log, then release it */
+static void _ws_ctube_record_data(struct ws_ctube_record_node *node, char *payload)
+{
+	struct ws_ctube_data *out_data = ws_ctube_container_of(node, typeof(*out_data), record);
+	struct ws_ctube_live *live = out_data->live;
+	const char *base = (const char *)out_data->data;
+	char buf[WS_CTUBE_LIVE_CHUNK_SIZE];
+
+	if (payload != NULL && live != NULL) {
+		/* as of the broadcast, like the writers send it */
+		for (size_t i = 0; i < live->nchunk; i++) {
+			const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+			size_t len = node->size - off;
+			if (len > WS_CTUBE_LIVE_CHUNK_SIZE) {
+				len = WS_CTUBE_LIVE_CHUNK_SIZE;
+			}
+			memcpy(payload + off, ws_ctube_live_read_chunk(live, base, i, buf, len), len);
+		}
+	} else if (payload != NULL) {
+		memcpy(payload, base, node->size);
 	}
-	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->out_data_mutex);
 
-	/* rate limit broadcasting if set */
-	struct timespec cur_time;
-	const double max_bcast_fps = ctube->max_bcast_fps;
-	if (max_bcast_fps > 0) {
+	ws_ctube_data_release(out_data);
+}
 
-#ifdef CLOCK_MONOTONIC
-		if (ws_ctube_unlikely(clock_gettime(CLOCK_MONOTONIC, &cur_time) != 0)) {
-			clock_gettime(CLOCK_REALTIME, &cur_time);
+/**
+ * have out_data (of id out_data_id, just published to channel) recorded:
+ * the recorder shares the producer's buffer, nothing is copied here
+ */
+static void _ws_ctube_record(struct ws_ctube_channel *channel, struct ws_ctube_data *out_data, unsigned long out_data_id)
+{
+	struct ws_ctube_record_node *node = &out_data->record;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	node->id = out_data_id;
+	node->time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	node->channel = channel->name;
+	/* what a raw client is sent (of a grid, without its levels, which
+	 * replaying builds again from its layout) */
+	node->size = _ws_ctube_frame_size(out_data);
+	node->grid = out_data->grid.ndim > 0 ? &out_data->grid : NULL;
+
+	ws_ctube_data_acquire(out_data);
+	if (ws_ctube_recorder_push(&channel->ctube->recorder, node, _ws_ctube_record_data) != 0) {
+		ws_ctube_data_release(out_data);
+	}
+}
+
+/**
+ * copy out_data (of id out_data_id, just published to channel) into the
+ * shared memory ring: the one copy other processes on the host read from.
+ * Called once out_data_mutex is unlocked, so that writers and the next
+ * publish are not held up by the copy; releases the reference
+ * _ws_ctube_set_out_data() took for it
+ */
+static void _ws_ctube_shm_write(struct ws_ctube_channel *channel, struct ws_ctube_data *out_data, unsigned long out_data_id)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	/* live data is as of the broadcast until ws_ctube_live_touch(), which
+	 * is not called before the publish returns; of a grid, without its
+	 * levels */
+	ws_ctube_shm_write(&channel->ctube->shm, channel->name, out_data->data, _ws_ctube_frame_size(out_data),
+			   out_data_id, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+	ws_ctube_data_release(out_data);
+}
+
+/**
+ * make out_data the current channel->out_data, releasing the old one;
+ * channel->out_data_mutex must be held and writers should be woken afterwards
+ *
+ * @param record whether to have out_data recorded if the recorder is running
+ * (not when it is being replayed from the log)
+ *
+ * @return the id of out_data if it is to be passed to _ws_ctube_shm_write()
+ * after unlocking out_data_mutex (holding a reference for that), else 0
+ */
+static unsigned long _ws_ctube_set_out_data(struct ws_ctube_channel *channel, struct ws_ctube_data *out_data, const struct timespec *cur_time, int record)
+{
+	struct ws_ctube *ctube = channel->ctube;
+	unsigned long shm_id = 0;
+
+	/* release old out_data if held */
+	if (channel->out_data != NULL) {
+		__atomic_sub_fetch(&ctube->pinned_bytes, ws_ctube_data_pooled_bytes(channel->out_data), __ATOMIC_RELAXED);
+		ws_ctube_data_unshare(channel->out_data);
+		ws_ctube_data_release(channel->out_data);
+	}
+
+	ws_ctube_data_acquire(out_data);
+	ws_ctube_data_share(out_data);
+	__atomic_add_fetch(&ctube->pinned_bytes, ws_ctube_data_pooled_bytes(out_data), __ATOMIC_RELAXED);
+	channel->out_data = out_data;
+	/* unique id for out_data, increasing across channels */
+	__atomic_store_n(&channel->out_data_id, __atomic_add_fetch(&ctube->out_data_seq, 1, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+
+	if (record && __atomic_load_n(&ctube->recorder.running, __ATOMIC_RELAXED)) {
+		_ws_ctube_record(channel, out_data, channel->out_data_id);
+	}
+	if (__atomic_load_n(&ctube->shm.running, __ATOMIC_RELAXED)) {
+		ws_ctube_data_acquire(out_data);
+		shm_id = channel->out_data_id;
+	}
+
+	/* record broadcast time for rate-limiting next time */
+	if (ctube->max_bcast_fps > 0) {
+		channel->prev_bcast_time = *cur_time;
+	}
+	return shm_id;
+}
+
+/**
+ * disconnect the clients being sent the oldest broadcasts (other than the
+ * current one) until giving back at least need bytes is under way
+ *
+ * @return bytes the dropped clients were being sent: at most what is given
+ * back once their writers stop, as others may hold the same buffers
+ */
+static size_t _ws_ctube_budget_drop_laggiest(struct ws_ctube *ctube, size_t need)
+{
+	struct ws_ctube_conn_table *conn_table = &ctube->conn_table;
+	struct ws_ctube_conn_struct *conn;
+	struct ws_ctube_channel *channel;
+	unsigned long oldest_id;
+	unsigned long id;
+	size_t oldest_bytes;
+	size_t freed = 0;
+
+	pthread_mutex_lock(&conn_table->mutex);
+	while (freed < need) {
+		/* find the oldest broadcast still being sent */
+		oldest_id = 0;
+		oldest_bytes = 0;
+		for (int slot = 0; slot < conn_table->capacity; slot++) {
+			conn = conn_table->conns[slot];
+			if (conn == NULL || conn->dropped) {
+				continue;
+			}
+			id = __atomic_load_n(&conn->sending_id, __ATOMIC_ACQUIRE);
+			channel = __atomic_load_n(&conn->channel, __ATOMIC_ACQUIRE);
+			if (id != 0 && (channel == NULL || id != __atomic_load_n(&channel->out_data_id, __ATOMIC_ACQUIRE)) && (oldest_id == 0 || id < oldest_id)) {
+				oldest_id = id;
+				oldest_bytes = __atomic_load_n(&conn->sending_bytes, __ATOMIC_RELAXED);
+			}
 		}
-#else
-		clock_gettime(CLOCK_REALTIME, &cur_time);
-#endif /* CLOCK_MONOTONIC */
+		if (oldest_id == 0) {
+			break;
+		}
+
+		/* its memory is given back once all its writers stop: shutting
+		 * down the socket fails their send and makes the reader queue
+		 * the disconnect */
+		for (int slot = 0; slot < conn_table->capacity; slot++) {
+			conn = conn_table->conns[slot];
+			if (conn == NULL || conn->dropped || __atomic_load_n(&conn->sending_id, __ATOMIC_ACQUIRE) != oldest_id) {
+				continue;
+			}
+			conn->dropped = 1;
+			shutdown(conn->fd, SHUT_RDWR);
+			__atomic_add_fetch(&ctube->nbudget_dropped, 1, __ATOMIC_RELAXED);
+		}
+		freed += oldest_bytes;
+	}
+	pthread_mutex_unlock(&conn_table->mutex);
+
+	return freed;
+}
+
+/** ensures nwaiting is restored even if producer is cancelled */
+static void _ws_ctube_cleanup_budget_wait(void *arg)
+{
+	struct ws_ctube_data_pool *pool = (struct ws_ctube_data_pool *)arg;
+	__atomic_sub_fetch(&pool->nwaiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->budget_mutex);
+}
 
-		double dt = (cur_time.tv_sec - ctube->prev_bcast_time.tv_sec) +
-			1e-9 * (cur_time.tv_nsec - ctube->prev_bcast_time.tv_nsec);
+/**
+ * block until at most limit bytes of buffers of pool are in use, or until
+ * deadline (CLOCK_REALTIME) if it is not NULL
+ *
+ * @return 0 once at most limit bytes are in use, -1 if deadline passed first
+ */
+static int _ws_ctube_budget_wait(struct ws_ctube_data_pool *pool, size_t limit, const struct timespec *deadline)
+{
+	int retval = 0;
+
+	pthread_mutex_lock(&pool->budget_mutex);
+	__atomic_add_fetch(&pool->nwaiting, 1, __ATOMIC_SEQ_CST);
+	pthread_cleanup_push(_ws_ctube_cleanup_budget_wait, pool);
 
-		if (dt < 1.0 / ctube->max_bcast_fps) {
+	while (__atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST) > limit) {
+		if (deadline == NULL) {
+			pthread_cond_wait(&pool->budget_cond, &pool->budget_mutex);
+		} else if (pthread_cond_timedwait(&pool->budget_cond, &pool->budget_mutex, deadline) == ETIMEDOUT) {
 			retval = -1;
-			goto out_ratelim;
+			break;
 		}
 	}
 
-	/* release old out_data if held */
-	if (ctube->out_data != NULL) {
-		ws_ctube_ref_count_release(ctube->out_data, refc, ws_ctube_data_free);
+	pthread_cleanup_pop(1); /* _ws_ctube_cleanup_budget_wait */
+	return retval;
+}
+
+/**
+ * reserve a buffer of capacity bytes within the memory budget, applying the
+ * budget policy if it does not fit. The reservation is handed to
+ * ws_ctube_data_pool_get() (reserved set) or given back with
+ * ws_ctube_data_pool_unreserve(). Producer only, and never under a channel's
+ * out_data_mutex: BLOCK waits for writers that take it.
+ *
+ * @return 0 if reserved, -1 otherwise
+ */
+static int _ws_ctube_budget_admit(struct ws_ctube *ctube, size_t capacity)
+{
+	struct ws_ctube_data_pool *pool = &ctube->data_pool;
+	const size_t budget = pool->budget;
+	const size_t pinned = __atomic_load_n(&ctube->pinned_bytes, __ATOMIC_RELAXED);
+	struct timespec deadline;
+	size_t limit;
+	int retval = 0;
+
+	if (budget == 0) {
+		_ws_ctube_data_pool_take(pool, capacity);
+		return 0;
+	}
+
+	if (ws_ctube_data_pool_reserve(pool, capacity, budget) == 0) {
+		return 0;
 	}
 
-	/* alloc new out_data */
-	ctube->out_data = (typeof(ctube->out_data))malloc(sizeof(*ctube->out_data));
-	if (ws_ctube_unlikely(ctube->out_data == NULL)) {
+	switch (ctube->budget_policy) {
+	case WS_CTUBE_BUDGET_REJECT:
 		retval = -1;
-		goto out_nodata;
+		break;
+
+	case WS_CTUBE_BUDGET_DROP:
+		if (capacity > budget || _ws_ctube_budget_drop_laggiest(ctube, __atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST) + capacity - budget) == 0) {
+			retval = -1;
+			break;
+		}
+		/* what the dropped clients were sent only counts once it is
+		 * given back: another client's delta base, the recorder or
+		 * the current out_data may still hold it */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)WS_CTUBE_BUDGET_DROP_WAIT_MS * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		do {
+			retval = _ws_ctube_budget_wait(pool, budget - capacity, &deadline);
+		} while (retval == 0 && ws_ctube_data_pool_reserve(pool, capacity, budget) != 0);
+		break;
+
+	case WS_CTUBE_BUDGET_BLOCK:
+		/* the current out_data of each channel and any reservation
+		 * are not given back while waiting: do not wait for them */
+		limit = budget >= capacity + pinned ? budget : pinned + capacity;
+		/* producers woken together race for the memory given back */
+		do {
+			_ws_ctube_budget_wait(pool, limit - capacity, NULL);
+		} while (ws_ctube_data_pool_reserve(pool, capacity, limit) != 0);
+		break;
+	}
+
+	if (retval != 0) {
+		__atomic_add_fetch(&ctube->nbudget_rejected, 1, __ATOMIC_RELAXED);
+	}
+	return retval;
+}
+
+/**
+ * copy data into a pooled ws_ctube_data and make it the current out_data of
+ * channel. If grid is not NULL, data is a grid with that layout and data_size
+ * is the bytes of it packed along with its grid->nlevel levels. If quant is
+ * not NULL, data are values converted by quant into data_size bytes. record
+ * is passed on to _ws_ctube_set_out_data()
+ */
+static int _ws_ctube_publish(struct ws_ctube_channel *channel, const void *data, size_t data_size, const struct ws_ctube_grid *grid, const struct ws_ctube_quant *quant, int record)
+{
+	struct ws_ctube *ctube = channel->ctube;
+	const size_t capacity = ws_ctube_data_pool_capacity(data_size);
+	int retval = 0;
+	struct timespec cur_time;
+	struct ws_ctube_data *out_data;
+	unsigned long shm_id;
+
+	/* not under out_data_mutex: the writers that give back what the
+	 * budget waits for need it to move on */
+	if (_ws_ctube_budget_admit(ctube, capacity) != 0) {
+		retval = -1;
+		goto out_nolock;
 	}
-	pthread_cleanup_push(free, ctube->out_data);
 
-	/* init and memcpy into out_data */
-	if (ws_ctube_unlikely(ws_ctube_data_init(ctube->out_data, data, data_size) != 0)) {
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		ws_ctube_data_pool_unreserve(&ctube->data_pool, capacity);
 		retval = -1;
-		goto out_noinit;
+		goto out_nolock;
 	}
-	ws_ctube_ref_count_acquire(ctube->out_data, refc);
-	ctube->out_data_id++; /* unique id for out_data */
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
 
-	/* record broadcast time for rate-limiting next time */
-	if (max_bcast_fps > 0) {
-		ctube->prev_bcast_time = cur_time;
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		ws_ctube_data_pool_unreserve(&ctube->data_pool, capacity);
+		retval = -1;
+		goto out_ratelim;
 	}
 
-	pthread_mutex_unlock(&ctube->out_data_mutex);
-	pthread_cond_broadcast(&ctube->out_data_cond);
+	/* get recycled out_data (no allocation in steady state) */
+	out_data = ws_ctube_data_pool_get(&ctube->data_pool, data_size, 1);
+	if (ws_ctube_unlikely(out_data == NULL)) {
+		retval = -1;
+		goto out_nodata;
+	}
+
+	if (grid != NULL) {
+		out_data->grid = *grid;
+		ws_ctube_grid_pack_strides(&out_data->grid);
+		ws_ctube_grid_pack((char *)out_data->data, (const char *)data, grid);
+
+		/* build the pyramid once for all clients */
+		for (int level = 0; level < grid->nlevel; level++) {
+			struct ws_ctube_grid view;
+			const size_t offset = ws_ctube_grid_level(&out_data->grid, level, &view);
+			char *src = (char *)out_data->data + offset;
+			ws_ctube_grid_downsample(src + ws_ctube_grid_size(&view), src, &view);
+		}
+	} else if (quant != NULL) {
+		const size_t count = (data_size - sizeof(struct ws_ctube_quant_header)) / ws_ctube_quant_elem_size(quant->format);
+		ws_ctube_quantize((char *)out_data->data, data, count, quant);
+	} else {
+		memcpy(out_data->data, data, data_size);
+	}
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, record);
+
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
+	}
 
-out_noinit:
-	pthread_cleanup_pop(retval); /* free */
 out_nodata:
 out_ratelim:
 	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
 out_nolock:
 	return retval;
 }
+
+int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_size)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_broadcast(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	return _ws_ctube_publish(&ctube->channel, data, data_size, NULL, NULL, 1);
+}
+
+int ws_ctube_broadcast_owned(struct ws_ctube *ctube, void *data, size_t data_size, ws_ctube_release_fn release_fn, void *user)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(release_fn == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: release_fn is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_channel *channel = &ctube->channel;
+	int retval = 0;
+	struct timespec cur_time;
+	struct ws_ctube_data *out_data;
+	unsigned long shm_id;
+
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		retval = -1;
+		goto out_nolock;
+	}
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
+
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		retval = -1;
+		goto out_ratelim;
+	}
+
+	/* get bufferless out_data */
+	out_data = ws_ctube_data_pool_get(&ctube->data_pool, 0, 0);
+	if (ws_ctube_unlikely(out_data == NULL)) {
+		retval = -1;
+		goto out_nodata;
+	}
+
+	/* reference caller's data: no copy */
+	ws_ctube_data_set_owned(out_data, data, data_size, release_fn, user);
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, 1);
+
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
+	}
+
+out_nodata:
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
+	return retval;
+}
+
+/**
+ * stop tracking live data that no writer holds or can acquire anymore (i.e.
+ * only the live_list reference remains and it is not the current out_data)
+ */
+static void _ws_ctube_live_retire(struct ws_ctube *ctube)
+{
+	struct ws_ctube_list_node *node, *next;
+	struct ws_ctube_data *data;
+
+	for (node = ctube->live_list.head.next; node != &ctube->live_list.head; node = next) {
+		next = node->next;
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+
+		if (data != ctube->channel.out_data && ws_ctube_data_refs(data) == 1) {
+			ws_ctube_list_unlink(&ctube->live_list, node);
+			ws_ctube_data_release(data);
+		}
+	}
+}
+
+int ws_ctube_broadcast_live(struct ws_ctube *ctube, void *data, size_t data_size)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_live(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_live(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_broadcast_live(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_channel *channel = &ctube->channel;
+	int retval = 0;
+	struct timespec cur_time;
+	struct ws_ctube_data *out_data;
+	unsigned long shm_id;
+
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		retval = -1;
+		goto out_nolock;
+	}
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
+
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		retval = -1;
+		goto out_ratelim;
+	}
+
+	/* get bufferless out_data */
+	out_data = ws_ctube_data_pool_get(&ctube->data_pool, 0, 0);
+	if (ws_ctube_unlikely(out_data == NULL)) {
+		retval = -1;
+		goto out_nodata;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_data_recycle, out_data);
+
+	/* reference live data: chunks are only copied once touched */
+	if (ws_ctube_unlikely(ws_ctube_data_set_live(out_data, data, data_size) != 0)) {
+		retval = -1;
+		goto out_noinit;
+	}
+
+	/* live_list reference: kept until no writer can be sending it */
+	ws_ctube_data_acquire(out_data);
+	ws_ctube_list_push_back(&ctube->live_list, &out_data->lnode);
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, 1);
+
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
+	}
+
+	_ws_ctube_live_retire(ctube);
+
+out_noinit:
+	pthread_cleanup_pop(retval); /* ws_ctube_data_recycle */
+out_nodata:
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
+	return retval;
+}
+
+void ws_ctube_live_touch(struct ws_ctube *ctube, const void *addr, size_t len)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+	int ncopied = 0;
+
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_live_touch(): error: ctube is NULL\n");
+		fflush(stderr);
+		return;
+	}
+	if (ws_ctube_likely(ctube->live_list.len == 0) || len == 0) {
+		return;
+	}
+
+	_ws_ctube_live_retire(ctube);
+
+	ws_ctube_list_for_each(&ctube->live_list, node) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		const char *base = (const char *)data->data;
+		const char *begin = (const char *)addr;
+		const char *end = begin + len;
+
+		/* clip to overlap with live data */
+		if (end <= base || begin >= base + data->data_size) {
+			continue;
+		}
+		if (begin < base) {
+			begin = base;
+		}
+		if (end > base + data->data_size) {
+			end = base + data->data_size;
+		}
+
+		const size_t first = (begin - base) / WS_CTUBE_LIVE_CHUNK_SIZE;
+		const size_t last = (end - 1 - base) / WS_CTUBE_LIVE_CHUNK_SIZE;
+		for (size_t i = first; i <= last; i++) {
+			ncopied += ws_ctube_live_copy_chunk(data->live, base, i);
+		}
+	}
+
+	/* copied flags must be visible before the caller modifies the memory */
+	if (ncopied > 0) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void *ws_ctube_reserve(struct ws_ctube *ctube, size_t data_size)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_reserve(): error: ctube is NULL\n");
+		fflush(stderr);
+		return NULL;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_reserve(): error: data_size is 0\n");
+		fflush(stderr);
+		return NULL;
+	}
+
+	/* reuse previous uncommitted reservation if possible */
+	struct ws_ctube_data *reserved_data = ctube->reserved_data;
+	if (reserved_data != NULL) {
+		if (reserved_data->data_capacity >= data_size) {
+			reserved_data->data_size = data_size;
+			return reserved_data->data;
+		}
+		__atomic_sub_fetch(&ctube->pinned_bytes, reserved_data->data_capacity, __ATOMIC_RELAXED);
+		ws_ctube_data_recycle(reserved_data);
+		ctube->reserved_data = NULL;
+	}
+
+	if (_ws_ctube_budget_admit(ctube, ws_ctube_data_pool_capacity(data_size)) != 0) {
+		return NULL;
+	}
+
+	reserved_data = ws_ctube_data_pool_get(&ctube->data_pool, data_size, 1);
+	if (ws_ctube_unlikely(reserved_data == NULL)) {
+		return NULL;
+	}
+
+	__atomic_add_fetch(&ctube->pinned_bytes, reserved_data->data_capacity, __ATOMIC_RELAXED);
+	ctube->reserved_data = reserved_data;
+	return reserved_data->data;
+}
+
+int ws_ctube_commit(struct ws_ctube *ctube, void *data)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_commit(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(ctube->reserved_data == NULL || data != ctube->reserved_data->data)) {
+		fprintf(stderr, "ws_ctube_commit(): error: data was not reserved\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_channel *channel = &ctube->channel;
+	struct ws_ctube_data *out_data = ctube->reserved_data;
+	int retval = 0;
+	struct timespec cur_time;
+	unsigned long shm_id;
+
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		retval = -1;
+		goto out_nolock;
+	}
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
+
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		retval = -1;
+		goto out_ratelim;
+	}
+
+	/* pinned as out_data from now on */
+	__atomic_sub_fetch(&ctube->pinned_bytes, out_data->data_capacity, __ATOMIC_RELAXED);
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, 1);
+	ctube->reserved_data = NULL;
+
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
+	}
+
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
+	return retval;
+}
+
+struct ws_ctube_channel *ws_ctube_channel_open(struct ws_ctube *ctube, const char *name)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_channel_open(): error: ctube is NULL\n");
+		fflush(stderr);
+		return NULL;
+	}
+	if (name == NULL) {
+		return &ctube->channel;
+	}
+	if (ws_ctube_unlikely(name[0] == '\0' || strlen(name) >= WS_CTUBE_CHANNEL_NAME_LEN || strpbrk(name, "/?#") != NULL)) {
+		fprintf(stderr, "ws_ctube_channel_open(): error: invalid name\n");
+		fflush(stderr);
+		return NULL;
+	}
+
+	struct ws_ctube_channel *channel;
+
+	/* the handler looks channels up concurrently under the list mutex */
+	pthread_mutex_lock(&ctube->channel_list.mutex);
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->channel_list.mutex);
+
+	channel = _ws_ctube_channel_find_locked(ctube, name, strlen(name));
+	if (channel != NULL) {
+		goto out_found;
+	}
+
+	channel = (typeof(channel))ws_ctube_mem_alloc(&ctube->mem.ctrl, sizeof(*channel), __alignof__(*channel));
+	if (channel == NULL) {
+		goto out_noalloc;
+	}
+	ws_ctube_channel_init(channel, ctube, name);
+	_ws_ctube_list_add_after(ctube->channel_list.head.prev, &channel->lnode);
+	ctube->channel_list.len++;
+
+out_noalloc:
+out_found:
+	pthread_cleanup_pop(1); /* _ws_ctube_cleanup_unlock_mutex */
+	return channel;
+}
+
+int ws_ctube_channel_set_snapshot(struct ws_ctube_channel *channel, ws_ctube_snapshot_fn snapshot_fn, void *user)
+{
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_channel_set_snapshot(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	pthread_mutex_lock(&channel->out_data_mutex);
+	channel->snapshot_fn = snapshot_fn;
+	channel->snapshot_user = user;
+	channel->snapshot_size = 0;
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	return 0;
+}
+
+int ws_ctube_publish(struct ws_ctube_channel *channel, const void *data, size_t data_size)
+{
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_publish(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_publish(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_publish(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	return _ws_ctube_publish(channel, data, data_size, NULL, NULL, 1);
+}
+
+/** bytes per element of type, or 0 for WS_CTUBE_ELEM_RAW */
+static size_t _ws_ctube_elem_size(enum ws_ctube_elem_type type)
+{
+	switch (type) {
+	case WS_CTUBE_ELEM_U8:
+	case WS_CTUBE_ELEM_I8:
+		return 1;
+	case WS_CTUBE_ELEM_U16:
+	case WS_CTUBE_ELEM_I16:
+		return 2;
+	case WS_CTUBE_ELEM_U32:
+	case WS_CTUBE_ELEM_I32:
+	case WS_CTUBE_ELEM_F32:
+		return 4;
+	case WS_CTUBE_ELEM_F64:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+/** @return NULL if grid is a layout ws_ctube_publish_grid() takes, else what is wrong with it */
+static const char *_ws_ctube_grid_invalid(const struct ws_ctube_grid *grid)
+{
+	size_t size = grid->elem_size;
+
+	if (grid->ndim < 1 || grid->ndim > WS_CTUBE_GRID_MAXDIM || grid->elem_size == 0) {
+		return "invalid grid";
+	}
+	if (grid->nlevel < 0 || grid->nlevel > WS_CTUBE_GRID_MAXLEVEL || (unsigned)grid->filter > WS_CTUBE_LOD_MAX) {
+		return "invalid grid levels";
+	}
+	if (grid->type != WS_CTUBE_ELEM_RAW && grid->elem_size != _ws_ctube_elem_size(grid->type)) {
+		return "elem_size does not match type";
+	}
+	for (int i = 0; i < grid->ndim; i++) {
+		if (grid->dims[i] == 0 || size > (size_t)-1 / grid->dims[i]) {
+			return "invalid grid dims";
+		}
+		size *= grid->dims[i];
+	}
+	return NULL;
+}
+
+/**
+ * publish the grid at data with the valid layout grid, building its levels.
+ * record is passed on to _ws_ctube_set_out_data()
+ */
+static int _ws_ctube_publish_grid(struct ws_ctube_channel *channel, const void *data, const struct ws_ctube_grid *grid, int record)
+{
+	struct ws_ctube_grid layout = *grid;
+	struct ws_ctube_grid view;
+	size_t data_size;
+	int packed = 1;
+
+	for (int i = 0; i < layout.ndim; i++) {
+		packed = packed && layout.strides[i] == 0;
+	}
+	if (packed) {
+		ws_ctube_grid_pack_strides(&layout);
+	}
+
+	/* levels are smaller than the grid, so this cannot overflow */
+	layout.nlevel = ws_ctube_grid_nlevel(&layout);
+	data_size = ws_ctube_grid_level(&layout, layout.nlevel, &view) + ws_ctube_grid_size(&view);
+
+	return _ws_ctube_publish(channel, data, data_size, &layout, NULL, record);
+}
+
+int ws_ctube_publish_grid(struct ws_ctube_channel *channel, const void *data, const struct ws_ctube_grid *grid)
+{
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(grid == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: invalid grid\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	const char *invalid = _ws_ctube_grid_invalid(grid);
+	if (ws_ctube_unlikely(invalid != NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: %s\n", invalid);
+		fflush(stderr);
+		return -1;
+	}
+
+	return _ws_ctube_publish_grid(channel, data, grid, 1);
+}
+
+int ws_ctube_publish_quantized(struct ws_ctube_channel *channel, const void *data, size_t count, const struct ws_ctube_quant *quant)
+{
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(count == 0 || count > ((size_t)-1 - sizeof(struct ws_ctube_quant_header)) / 2)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: invalid count\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(quant == NULL || (quant->type != WS_CTUBE_ELEM_F32 && quant->type != WS_CTUBE_ELEM_F64)
+			      || (unsigned)quant->format > WS_CTUBE_QUANT_U16)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: invalid quant\n");
+		fflush(stderr);
+		return -1;
+	}
+	/* a fixed range must be finite and not empty, unless left to each publish */
+	if (ws_ctube_unlikely(!(quant->min == 0 && quant->max == 0) && !(quant->min < quant->max && quant->max - quant->min < INFINITY))) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: invalid quant range\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	return _ws_ctube_publish(channel, data, ws_ctube_quant_size(quant->format, count), NULL, quant, 1);
+}
+
+void ws_ctube_get_stats(struct ws_ctube *ctube, struct ws_ctube_stats *stats)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_get_stats(): error: ctube is NULL\n");
+		fflush(stderr);
+		return;
+	}
+	if (ws_ctube_unlikely(stats == NULL)) {
+		fprintf(stderr, "ws_ctube_get_stats(): error: stats is NULL\n");
+		fflush(stderr);
+		return;
+	}
+
+	stats->bytes_in_flight = __atomic_load_n(&ctube->data_pool.in_use, __ATOMIC_SEQ_CST);
+	stats->bytes_in_flight_peak = __atomic_load_n(&ctube->data_pool.in_use_peak, __ATOMIC_SEQ_CST);
+	stats->bytes_cached = __atomic_load_n(&ctube->data_pool.cached, __ATOMIC_SEQ_CST);
+	stats->nbudget_rejected = __atomic_load_n(&ctube->nbudget_rejected, __ATOMIC_SEQ_CST);
+	stats->nbudget_dropped = __atomic_load_n(&ctube->nbudget_dropped, __ATOMIC_SEQ_CST);
+	stats->nrecorded = __atomic_load_n(&ctube->recorder.nrecorded, __ATOMIC_SEQ_CST);
+	stats->nrecord_dropped = __atomic_load_n(&ctube->recorder.ndropped, __ATOMIC_SEQ_CST);
+	stats->nshm_written = __atomic_load_n(&ctube->shm.nwritten, __ATOMIC_SEQ_CST);
+	stats->nshm_dropped = __atomic_load_n(&ctube->shm.ndropped, __ATOMIC_SEQ_CST);
+	stats->nreplay_skipped = __atomic_load_n(&ctube->nreplay_skipped, __ATOMIC_SEQ_CST);
+}
+
+void ws_ctube_replay_opts_init(struct ws_ctube_replay_opts *opts)
+{
+	opts->speed = 1;
+	opts->start_ns = 0;
+	opts->end_ns = 0;
+}
+
+/** read-only mapping of a file of a log */
+struct _ws_ctube_replay_file {
+	const char *map;
+	size_t size;
+};
+
+/**
+ * map the file called name
+ *
+ * @return 0 on success, -1 otherwise (errno is ENOENT if there is no such file)
+ */
+static int _ws_ctube_replay_open(struct _ws_ctube_replay_file *file, const char *name)
+{
+	struct stat st;
+	void *map;
+	int fd;
+	int retval = -1;
+
+	file->map = NULL;
+	file->size = 0;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		goto out_noopen;
+	}
+	if (fstat(fd, &st) != 0) {
+		goto out_nomap;
+	}
+	if (st.st_size == 0) {
+		retval = 0;
+		goto out_nomap;
+	}
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		goto out_nomap;
+	}
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	file->map = (const char *)map;
+	file->size = (size_t)st.st_size;
+	retval = 0;
+
+out_nomap:
+	close(fd);
+out_noopen:
+	return retval;
+}
+
+static void _ws_ctube_replay_close(void *arg)
+{
+	struct _ws_ctube_replay_file *file = (struct _ws_ctube_replay_file *)arg;
+
+	if (file->map != NULL) {
+		munmap((void *)file->map, file->size);
+	}
+	file->map = NULL;
+	file->size = 0;
+}
+
+/**
+ * find where to replay from for start_ns: the record of the last index entry
+ * at or before it (entries are in time order), else the start of the log
+ */
+static void _ws_ctube_replay_seek(const char *path, long long start_ns, uint32_t *segment, size_t *offset)
+{
+	char name[PATH_MAX];
+	struct _ws_ctube_replay_file index;
+	struct ws_ctube_record_index entry;
+	size_t lo = 0;
+	size_t hi;
+
+	*segment = 0;
+	*offset = sizeof(struct ws_ctube_record_segment);
+
+	if (snprintf(name, sizeof(name), "%s.index", path) >= (int)sizeof(name) || _ws_ctube_replay_open(&index, name) != 0) {
+		return;
+	}
+
+	hi = index.size / sizeof(entry);
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		memcpy(&entry, index.map + mid * sizeof(entry), sizeof(entry));
+		if (entry.time_ns <= start_ns) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo > 0) {
+		memcpy(&entry, index.map + (lo - 1) * sizeof(entry), sizeof(entry));
+		*segment = entry.segment;
+		*offset = (size_t)entry.offset;
+	}
+
+	_ws_ctube_replay_close(&index);
+}
+
+/** wait until a record recorded elapsed_ns after the first replayed one is due */
+static void _ws_ctube_replay_wait(const struct timespec *start_time, long long elapsed_ns, double speed)
+{
+	const long long ns = (long long)((double)elapsed_ns / speed);
+	struct timespec due;
+
+	if (ns <= 0) {
+		return;
+	}
+
+	due.tv_sec = start_time->tv_sec + (time_t)(ns / 1000000000);
+	due.tv_nsec = start_time->tv_nsec + (long)(ns % 1000000000);
+	if (due.tv_nsec >= 1000000000) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+/**
+ * layout of a grid record of size bytes
+ *
+ * @return 0 if it is one ws_ctube_publish_grid() takes, packed in size bytes
+ */
+static int _ws_ctube_replay_grid(struct ws_ctube_grid *grid, const struct ws_ctube_record_grid *rec, uint64_t size)
+{
+	memset(grid, 0, sizeof(*grid));
+	if (rec->ndim < 1 || rec->ndim > WS_CTUBE_GRID_MAXDIM || rec->nlevel > WS_CTUBE_GRID_MAXLEVEL
+	    || rec->type > (uint32_t)WS_CTUBE_ELEM_F64 || rec->filter > (uint32_t)WS_CTUBE_LOD_MAX || rec->elem_size > size) {
+		return -1;
+	}
+	grid->ndim = (int)rec->ndim;
+	grid->type = (enum ws_ctube_elem_type)rec->type;
+	grid->nlevel = (int)rec->nlevel;
+	grid->filter = (enum ws_ctube_lod_filter)rec->filter;
+	grid->elem_size = (size_t)rec->elem_size;
+	for (int i = 0; i < grid->ndim; i++) {
+		if (rec->dims[i] > size) {
+			return -1;
+		}
+		grid->dims[i] = (size_t)rec->dims[i];
+	}
+	if (_ws_ctube_grid_invalid(grid) != NULL || ws_ctube_grid_size(grid) != size) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * publish a replayed record, not to be recorded again: of a grid (with its
+ * levels built again) if grid is not NULL. Retried for up to
+ * WS_CTUBE_REPLAY_RETRY ms if that fails (long enough to wait out the rate
+ * limit of max_broadcast_fps >= 10), then counted as skipped
+ */
+static int _ws_ctube_replay_publish(struct ws_ctube_channel *channel, const void *data, size_t size, const struct ws_ctube_grid *grid)
+{
+	static const struct timespec retry_wait = {0, 1000000};
+	int retval;
+
+	for (int i = 0; size > 0 && i < WS_CTUBE_REPLAY_RETRY; i++) {
+		if (grid != NULL) {
+			retval = _ws_ctube_publish_grid(channel, data, grid, 0);
+		} else {
+			retval = _ws_ctube_publish(channel, data, size, NULL, NULL, 0);
+		}
+		if (retval == 0) {
+			return 0;
+		}
+		nanosleep(&retry_wait, NULL);
+	}
+	__atomic_add_fetch(&channel->ctube->nreplay_skipped, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+long ws_ctube_replay(struct ws_ctube *ctube, const char *path, const struct ws_ctube_replay_opts *opts)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_replay(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(path == NULL)) {
+		fprintf(stderr, "ws_ctube_replay(): error: path is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(opts != NULL && !(opts->speed >= 0))) {
+		fprintf(stderr, "ws_ctube_replay(): error: invalid speed\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_replay_opts defaults;
+	struct _ws_ctube_replay_file file;
+	struct ws_ctube_record_segment seg;
+	struct ws_ctube_record_header hdr;
+	struct ws_ctube_record_grid rec_grid;
+	struct ws_ctube_grid grid;
+	size_t grid_len, left;
+	struct ws_ctube_channel *channel = NULL;
+	char name[PATH_MAX];
+	char channel_name[WS_CTUBE_CHANNEL_NAME_LEN];
+	uint32_t segment;
+	size_t offset;
+	struct timespec start_time;
+	long long first_ns = 0;
+	int started = 0;
+	int done = 0;
+	long nreplayed = 0;
+
+	if (opts == NULL) {
+		ws_ctube_replay_opts_init(&defaults);
+		opts = &defaults;
+	}
+
+	if (opts->start_ns > 0) {
+		_ws_ctube_replay_seek(path, opts->start_ns, &segment, &offset);
+	} else {
+		segment = 0;
+		offset = sizeof(seg);
+	}
+
+	while (!done) {
+		if (snprintf(name, sizeof(name), "%s.%06lu", path, (unsigned long)segment) >= (int)sizeof(name)) {
+			fprintf(stderr, "ws_ctube_replay(): error: path too long\n");
+			fflush(stderr);
+			return -1;
+		}
+		if (_ws_ctube_replay_open(&file, name) != 0) {
+			/* past the last file */
+			if (errno == ENOENT && (started || segment > 0)) {
+				break;
+			}
+			fprintf(stderr, "ws_ctube_replay(): error: cannot read %s: %s\n", name, strerror(errno));
+			fflush(stderr);
+			return -1;
+		}
+		pthread_cleanup_push(_ws_ctube_replay_close, &file);
+
+		if (file.size >= sizeof(seg)) {
+			memcpy(&seg, file.map, sizeof(seg));
+		}
+		if (file.size < sizeof(seg) || memcmp(seg.magic, WS_CTUBE_RECORD_SEGMENT_MAGIC, sizeof(seg.magic)) != 0 || seg.version != WS_CTUBE_RECORD_VERSION) {
+			fprintf(stderr, "ws_ctube_replay(): error: %s is not a log file\n", name);
+			fflush(stderr);
+			nreplayed = -1;
+			done = 1;
+		}
+
+		/* up to a record that is not complete (the end of the file); each
+		 * part is checked against what is left before the next is, so
+		 * that the remainder cannot wrap around */
+		while (!done && offset <= file.size && file.size - offset >= sizeof(hdr)) {
+			memcpy(&hdr, file.map + offset, sizeof(hdr));
+			left = file.size - offset - sizeof(hdr);
+			grid_len = (hdr.flags & WS_CTUBE_RECORD_GRID) ? sizeof(rec_grid) : 0;
+			if (hdr.magic != WS_CTUBE_RECORD_MAGIC || hdr.channel_len >= sizeof(channel_name)
+			    || grid_len > left || hdr.channel_len > left - grid_len
+			    || hdr.size > left - grid_len - hdr.channel_len) {
+				break;
+			}
+			const char *rec = file.map + offset + sizeof(hdr);
+			offset += (sizeof(hdr) + grid_len + hdr.channel_len + hdr.size + 7) & ~(size_t)7;
+			if (grid_len > 0) {
+				memcpy(&rec_grid, rec, sizeof(rec_grid));
+				rec += sizeof(rec_grid);
+			}
+
+			if (hdr.time_ns < opts->start_ns) {
+				continue;
+			}
+			if (opts->end_ns > 0 && hdr.time_ns >= opts->end_ns) {
+				done = 1;
+				break;
+			}
+
+			if (opts->speed > 0 && started) {
+				_ws_ctube_replay_wait(&start_time, hdr.time_ns - first_ns, opts->speed);
+			} else if (!started) {
+				clock_gettime(CLOCK_MONOTONIC, &start_time);
+				first_ns = hdr.time_ns;
+			}
+			started = 1;
+
+			memcpy(channel_name, rec, hdr.channel_len);
+			channel_name[hdr.channel_len] = '\0';
+			if (channel == NULL || strcmp(channel->name, channel_name) != 0) {
+				channel = ws_ctube_channel_open(ctube, channel_name[0] != '\0' ? channel_name : NULL);
+			}
+			if (channel == NULL || (grid_len > 0 && _ws_ctube_replay_grid(&grid, &rec_grid, hdr.size) != 0)) {
+				__atomic_add_fetch(&ctube->nreplay_skipped, 1, __ATOMIC_RELAXED);
+			} else if (_ws_ctube_replay_publish(channel, rec + hdr.channel_len, hdr.size, grid_len > 0 ? &grid : NULL) == 0) {
+				nreplayed++;
+			}
+		}
+
+		pthread_cleanup_pop(1); /* _ws_ctube_replay_close */
+		segment++;
+		offset = sizeof(seg);
+	}
+
+	return nreplayed;
+}
+
+struct ws_ctube_shm_reader *ws_ctube_shm_reader_open(const char *path)
+{
+	struct ws_ctube_shm_reader *reader;
+
+	if (ws_ctube_unlikely(path == NULL)) {
+		fprintf(stderr, "ws_ctube_shm_reader_open(): error: path is NULL\n");
+		fflush(stderr);
+		return NULL;
+	}
+
+	reader = (struct ws_ctube_shm_reader *)malloc(sizeof(*reader));
+	if (reader == NULL) {
+		goto out_noreader;
+	}
+	if (ws_ctube_shm_reader_init(reader, path) != 0) {
+		goto out_noinit;
+	}
+	return reader;
+
+out_noinit:
+	free(reader);
+out_noreader:
+	return NULL;
+}
+
+void ws_ctube_shm_reader_close(struct ws_ctube_shm_reader *reader)
+{
+	if (ws_ctube_unlikely(reader == NULL)) {
+		fprintf(stderr, "ws_ctube_shm_reader_close(): error: reader is NULL\n");
+		fflush(stderr);
+		return;
+	}
+
+	ws_ctube_shm_reader_destroy(reader);
+	free(reader);
+}
+
+long ws_ctube_shm_read(struct ws_ctube_shm_reader *reader, void *buf, size_t max, struct ws_ctube_shm_msg *msg, int timeout_ms)
+{
+	if (ws_ctube_unlikely(reader == NULL)) {
+		fprintf(stderr, "ws_ctube_shm_read(): error: reader is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(buf == NULL && max > 0)) {
+		fprintf(stderr, "ws_ctube_shm_read(): error: buf is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_shm_msg unused;
+	struct timespec deadline, now, left;
+	uint32_t futex;
+	long size;
+
+	if (msg == NULL) {
+		msg = &unused;
+	}
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	for (;;) {
+		/* read before looking: a broadcast after it changes it */
+		futex = __atomic_load_n(&reader->hdr->futex, __ATOMIC_ACQUIRE);
+		size = ws_ctube_shm_reader_next(reader, buf, max, msg);
+		if (size != 0 || timeout_ms == 0) {
+			return size;
+		}
+
+		if (timeout_ms < 0) {
+			ws_ctube_shm_reader_wait(reader, futex, NULL);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = deadline.tv_sec - now.tv_sec;
+		left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000;
+		}
+		if (left.tv_sec < 0) {
+			return 0;
+		}
+		ws_ctube_shm_reader_wait(reader, futex, &left);
+	}
+}
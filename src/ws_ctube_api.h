@@ -16,6 +16,288 @@
 #endif
 
 struct ws_ctube;
+struct ws_ctube_channel;
+
+/**
+ * called by ws_ctube to give back caller-owned memory passed to
+ * ws_ctube_broadcast_owned()
+ *
+ * @param data the pointer that was broadcast
+ * @param user the user pointer that was passed along with data
+ */
+typedef void (*ws_ctube_release_fn)(void *data, void *user);
+
+/**
+ * called by ws_ctube to write a snapshot of the state that a channel's
+ * broadcasts update, for a client that just connected to it (see
+ * ws_ctube_channel_set_snapshot()). Like snprintf(), it returns the size of
+ * the whole snapshot even if that does not fit in max bytes; it is then
+ * called again with a larger buf
+ *
+ * @param buf where to write the snapshot (NULL if max is 0)
+ * @param max bytes available at buf
+ * @param user the user pointer that was passed along with this function
+ *
+ * @return bytes of the snapshot, or 0 to send none
+ */
+typedef size_t (*ws_ctube_snapshot_fn)(void *buf, size_t max, void *user);
+
+/**
+ * memory allocation hooks: ws_ctube memory comes from alloc and is given back
+ * with free instead of malloc()/free(). Both hooks are called from any
+ * ws_ctube thread, so they must be thread-safe. Leave both NULL for the
+ * default allocator.
+ */
+struct ws_ctube_allocator {
+	/**
+	 * @param size bytes to allocate
+	 * @param align required alignment (a power of 2)
+	 * @param user the user pointer of this allocator
+	 * @return pointer to the memory or NULL on failure
+	 */
+	void *(*alloc)(size_t size, size_t align, void *user);
+	/** give back ptr that was allocated with the same size and align */
+	void (*free)(void *ptr, size_t size, size_t align, void *user);
+	/** passed to alloc and free */
+	void *user;
+};
+
+/** what ws_ctube does when a broadcast buffer would exceed opts.mem_budget */
+enum ws_ctube_budget_policy {
+	/** fail the broadcast (or reservation) */
+	WS_CTUBE_BUDGET_REJECT,
+	/**
+	 * disconnect the clients still being sent the oldest broadcasts until
+	 * enough memory will be given back; fail if that is not enough
+	 */
+	WS_CTUBE_BUDGET_DROP,
+	/** block the producer until slow clients give back enough memory */
+	WS_CTUBE_BUDGET_BLOCK
+};
+
+/** maximum number of axes of a ws_ctube_grid */
+#define WS_CTUBE_GRID_MAXDIM 3
+/** maximum number of downsampled levels of a ws_ctube_grid */
+#define WS_CTUBE_GRID_MAXLEVEL 16
+
+/** element types of a ws_ctube_grid */
+enum ws_ctube_elem_type {
+	/** any elem_size: downsampled levels pick one element of each block */
+	WS_CTUBE_ELEM_RAW,
+	WS_CTUBE_ELEM_U8,
+	WS_CTUBE_ELEM_I8,
+	WS_CTUBE_ELEM_U16,
+	WS_CTUBE_ELEM_I16,
+	WS_CTUBE_ELEM_U32,
+	WS_CTUBE_ELEM_I32,
+	WS_CTUBE_ELEM_F32,
+	WS_CTUBE_ELEM_F64
+};
+
+/** how a downsampled level of a ws_ctube_grid combines each 2x2(x2) block */
+enum ws_ctube_lod_filter {
+	/** mean (box filter) */
+	WS_CTUBE_LOD_MEAN,
+	/** minimum, e.g. to keep narrow troughs visible */
+	WS_CTUBE_LOD_MIN,
+	/** maximum, e.g. to keep narrow peaks visible */
+	WS_CTUBE_LOD_MAX
+};
+
+/**
+ * layout of a 1D, 2D or 3D array for ws_ctube_publish_grid(). Axis 0 varies
+ * slowest, e.g. dims = {ny, nx} for a C array float field[ny][nx]
+ */
+struct ws_ctube_grid {
+	/** number of axes (1 to WS_CTUBE_GRID_MAXDIM) */
+	int ndim;
+	/** number of elements along each axis */
+	size_t dims[WS_CTUBE_GRID_MAXDIM];
+	/** bytes per element */
+	size_t elem_size;
+	/**
+	 * bytes between consecutive elements along each axis, or all 0 if the
+	 * array is packed. Lets e.g. the interior of a field with ghost cells
+	 * be published without copying it out first
+	 */
+	size_t strides[WS_CTUBE_GRID_MAXDIM];
+
+	/** element type (elem_size must match unless WS_CTUBE_ELEM_RAW) */
+	enum ws_ctube_elem_type type;
+	/**
+	 * number of downsampled levels to build once per publish (0 for none,
+	 * at most WS_CTUBE_GRID_MAXLEVEL): level l + 1 has (n + 1) / 2
+	 * elements along each axis where level l has n, so that clients can be
+	 * sent a coarser level (see README.md). Levels stop at 1 element
+	 */
+	int nlevel;
+	/** how levels are downsampled */
+	enum ws_ctube_lod_filter filter;
+};
+
+/** what ws_ctube_publish_quantized() converts values to */
+enum ws_ctube_quant_format {
+	/** IEEE half precision */
+	WS_CTUBE_QUANT_F16,
+	/** bfloat16: the upper 16 bits of a float, rounded */
+	WS_CTUBE_QUANT_BF16,
+	/** uint8_t q standing for min + q * (max - min) / 255 */
+	WS_CTUBE_QUANT_U8,
+	/** uint16_t q standing for min + q * (max - min) / 65535 */
+	WS_CTUBE_QUANT_U16
+};
+
+/** how ws_ctube_publish_quantized() converts an array */
+struct ws_ctube_quant {
+	/** type of the values given: WS_CTUBE_ELEM_F32 or WS_CTUBE_ELEM_F64 */
+	enum ws_ctube_elem_type type;
+	/** what they are sent as */
+	enum ws_ctube_quant_format format;
+	/**
+	 * range of the U8 and U16 formats (values outside are clamped), or
+	 * both 0 to use the minimum and maximum finite value of each publish
+	 */
+	double min;
+	double max;
+};
+
+/** memory usage of a ws_ctube, see ws_ctube_get_stats() */
+struct ws_ctube_stats {
+	/** bytes of broadcast buffers (and their deltas and compressed copies) currently referenced */
+	size_t bytes_in_flight;
+	/** maximum of bytes_in_flight so far */
+	size_t bytes_in_flight_peak;
+	/** bytes of unreferenced buffers kept for reuse */
+	size_t bytes_cached;
+	/** broadcasts/reservations refused because of mem_budget */
+	unsigned long nbudget_rejected;
+	/** clients disconnected because of mem_budget */
+	unsigned long nbudget_dropped;
+	/** broadcasts written to the log at opts.record_path */
+	unsigned long nrecorded;
+	/** broadcasts not written to it (recorder too far behind, or disk errors) */
+	unsigned long nrecord_dropped;
+	/** broadcasts written to the shared memory ring at opts.shm_path */
+	unsigned long nshm_written;
+	/** broadcasts not written to it (larger than the ring) */
+	unsigned long nshm_dropped;
+	/**
+	 * records ws_ctube_replay() skipped because they could not be
+	 * broadcast (e.g. rate-limited or refused by the budget for too long)
+	 */
+	unsigned long nreplay_skipped;
+};
+
+/** options for ws_ctube_open_opts(); set defaults with ws_ctube_opts_init() */
+struct ws_ctube_opts {
+	/** port for websocket server */
+	int port;
+	/** maximum number of websocket client connections allowed */
+	int max_nclient;
+	/** timeout (ms) for server starting and websocket handshake or 0 for no timeout */
+	int timeout_ms;
+	/** maximum number of broadcasts per second or 0 for no limit */
+	double max_broadcast_fps;
+
+	/**
+	 * expected bytes per broadcast or 0 (default): if nonzero,
+	 * prealloc_count buffers of this size are allocated and prefaulted
+	 * when opening so that broadcasting never calls the allocator in
+	 * steady state
+	 */
+	size_t prealloc_size;
+	/** number of buffers to preallocate (default 2) */
+	int prealloc_count;
+
+	/**
+	 * broadcast buffers of at least this many bytes are backed by 2 MB
+	 * huge pages (explicit if reserved, else transparent), falling back to
+	 * ordinary pages if unavailable; 0 (default) to never use huge pages
+	 */
+	size_t hugepage_threshold;
+
+	/**
+	 * allocator for small control objects: the ctube itself, data
+	 * descriptors, connection slabs and tables (default: malloc)
+	 */
+	struct ws_ctube_allocator ctrl_alloc;
+	/**
+	 * allocator for broadcast data buffers (default: malloc). If set,
+	 * hugepage_threshold is ignored: every buffer comes from this allocator
+	 */
+	struct ws_ctube_allocator payload_alloc;
+
+	/**
+	 * maximum bytes of broadcast buffers referenced by ctube and its
+	 * writers at once or 0 (default) for no limit. Each size class is
+	 * rounded up to a power of 2; allow at least two buffers (the current
+	 * broadcast and the next). Buffers kept for reuse are given up to stay
+	 * within the budget. Buffers for the deltas and compressed copies of a
+	 * broadcast count too: they only get what leaves room for the next
+	 * broadcast, and keyframes or uncompressed data are sent instead of
+	 * those that do not fit. Caller memory of
+	 * ws_ctube_broadcast_owned() and ws_ctube_broadcast_live() is not
+	 * counted.
+	 */
+	size_t mem_budget;
+	/** what to do when mem_budget would be exceeded (default WS_CTUBE_BUDGET_REJECT) */
+	enum ws_ctube_budget_policy budget_policy;
+
+	/**
+	 * number of threads (at most 64) that help encode large broadcasts in
+	 * chunks, e.g. deltas and permessage-deflate, or 0 (default) for the
+	 * writer that first needs an encoding to make it alone
+	 */
+	int encode_threads;
+
+	/**
+	 * if not NULL (default NULL), every broadcast is appended, with its
+	 * sequence number, time and channel, to a log of files
+	 * <record_path>.000000, <record_path>.000001, ... with a time index in
+	 * <record_path>.index (see README.md). Earlier files are kept: new
+	 * ones are numbered after them. Not referenced after opening
+	 */
+	const char *record_path;
+	/** bytes of each log file (default 64 MB), more for larger broadcasts */
+	size_t record_segment_size;
+	/**
+	 * bytes of broadcasts waiting to be recorded past which further ones
+	 * are dropped instead of held in memory (default 256 MB), or 0 for no
+	 * limit. These count towards mem_budget
+	 */
+	size_t record_backlog;
+
+	/**
+	 * if not NULL (default NULL), every broadcast is also written to a
+	 * ring in a file created at shm_path (e.g. "/dev/shm/ws_ctube"), for
+	 * processes on the same host to read with ws_ctube_shm_reader_open()
+	 * instead of a websocket. The file is removed when closing. Not
+	 * referenced after opening
+	 */
+	const char *shm_path;
+	/**
+	 * bytes of the ring (default 64 MB): the largest broadcast that fits
+	 * and how far behind a reader may fall before it skips ahead
+	 */
+	size_t shm_size;
+};
+
+/**
+ * ws_ctube_opts_init - set opts to defaults. port must still be set before
+ * calling ws_ctube_open_opts()
+ */
+void ws_ctube_opts_init(struct ws_ctube_opts *opts);
+
+/**
+ * ws_ctube_open_opts - like ws_ctube_open() but with more options
+ *
+ * @param opts options initialized with ws_ctube_opts_init(); not referenced
+ * after this returns
+ *
+ * @return on success, a struct ws_ctube* is returned; on failure,
+ * NULL is returned
+ */
+struct ws_ctube *ws_ctube_open_opts(const struct ws_ctube_opts *opts);
 
 /**
  * ws_ctube_open - create a ws_ctube websocket server. When finished, close with
@@ -46,7 +328,8 @@ void ws_ctube_close(struct ws_ctube *ctube);
  * If max_broadcast_fps was nonzero when ws_ctube_open was called, this function
  * is rate-limited accordingly and returns failure if called too soon.
  *
- * Data is copied to an internal out-buffer, then this function returns. Actual
+ * Data is copied to an internal out-buffer (recycled from earlier broadcasts
+ * of similar size), then this function returns. Actual
  * network operations will be handled internally and opaquely by separate
  * threads.
  *
@@ -65,4 +348,323 @@ void ws_ctube_close(struct ws_ctube *ctube);
  */
 int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_size);
 
+/**
+ * ws_ctube_broadcast_owned - tries to broadcast caller-owned memory to all
+ * connected websocket clients without copying it.
+ *
+ * Like ws_ctube_broadcast(), but on success ctube references data directly.
+ * The caller must not modify or free data until release_fn is called, which
+ * happens exactly once after the last writer is done sending it. release_fn
+ * may be called from any ws_ctube thread (or from within a later
+ * ws_ctube_broadcast*() or ws_ctube_close()), so it should be quick and
+ * thread-safe.
+ *
+ * On failure (e.g. rate-limited), release_fn is not called and the caller
+ * keeps ownership of data.
+ *
+ * @param ctube the websocket ctube
+ * @param data pointer to read-only data to broadcast
+ * @param data_size bytes of data
+ * @param release_fn called with (data, user) to give back data
+ * @param user passed to release_fn
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_broadcast_owned(struct ws_ctube *ctube, void *data, size_t data_size, ws_ctube_release_fn release_fn, void *user);
+
+/**
+ * ws_ctube_broadcast_live - tries to broadcast memory that the caller keeps
+ * modifying, without copying it up front.
+ *
+ * Writers send data directly from the caller's memory. Before modifying any
+ * part of data after this call, the caller must call ws_ctube_live_touch() on
+ * that part: chunks (of WS_CTUBE_LIVE_CHUNK_SIZE bytes) that writers may
+ * still be sending are then copied once, so every client receives data as it
+ * was at the time of broadcast. Cost is proportional to the modified chunks
+ * rather than to data_size.
+ *
+ * data must stay allocated until ws_ctube_close(). Call this and
+ * ws_ctube_live_touch() from one thread only or serialize externally.
+ *
+ * @param ctube the websocket ctube
+ * @param data pointer to live data to broadcast
+ * @param data_size bytes of data
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_broadcast_live(struct ws_ctube *ctube, void *data, size_t data_size);
+
+/**
+ * ws_ctube_live_touch - announce that [addr, addr + len) is about to be
+ * modified. Must be called before modifying memory previously passed to
+ * ws_ctube_broadcast_live(). Cheap when no broadcast of that memory can still
+ * be in flight.
+ *
+ * @param ctube the websocket ctube
+ * @param addr start of memory about to be modified
+ * @param len bytes about to be modified
+ */
+void ws_ctube_live_touch(struct ws_ctube *ctube, const void *addr, size_t len);
+
+/**
+ * ws_ctube_reserve - get a writable buffer owned by ctube that can be
+ * broadcast with ws_ctube_commit() without copying.
+ *
+ * The buffer is recycled from an internal pool once all writers are done
+ * with it, so that the producer can render directly into outgoing memory.
+ * Contents of the returned buffer are unspecified.
+ *
+ * Only one reservation may be outstanding: reserving again before committing
+ * reuses (and may move) the previous reservation. Call from one thread only or
+ * serialize externally.
+ *
+ * @param ctube the websocket ctube
+ * @param data_size bytes of data to reserve
+ *
+ * @return pointer to data_size writable bytes on success, NULL otherwise
+ */
+void *ws_ctube_reserve(struct ws_ctube *ctube, size_t data_size);
+
+/**
+ * ws_ctube_commit - tries to broadcast a buffer obtained from
+ * ws_ctube_reserve() to all connected websocket clients.
+ *
+ * Like ws_ctube_broadcast() but no copy is made. On success, ctube takes back
+ * ownership of data and it must not be written to anymore. On failure (e.g.
+ * rate-limited), the reservation stays valid and can be committed later or
+ * reused by ws_ctube_reserve().
+ *
+ * @param ctube the websocket ctube
+ * @param data pointer returned by the latest ws_ctube_reserve()
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_commit(struct ws_ctube *ctube, void *data);
+
+/**
+ * ws_ctube_channel_open - get the channel of ctube with the given name,
+ * creating it if needed.
+ *
+ * A channel is a separate stream on the same port and threads as ctube: a
+ * client connecting to ws://host:port/<name> is sent only what is published
+ * to that channel, and its writer only wakes for it. Clients whose request
+ * path names no open channel (e.g. "/") get the default channel, which is
+ * what ws_ctube_broadcast() and friends publish to. A client keeps the channel
+ * it connected to unless it sends "subscribe <name>" (see README.md), so open
+ * channels before clients connect or subscribe.
+ *
+ * @param ctube the websocket ctube
+ * @param name nonempty channel name of fewer than 64 bytes, without '/', '?'
+ * or '#', or NULL for the default channel
+ *
+ * @return the channel, valid until ws_ctube_close(), or NULL on failure
+ */
+struct ws_ctube_channel *ws_ctube_channel_open(struct ws_ctube *ctube, const char *name);
+
+/**
+ * ws_ctube_channel_set_snapshot - have each client that connects to channel
+ * sent a snapshot of the current state first, e.g. when the channel's
+ * broadcasts are updates that only make sense on top of it.
+ *
+ * snapshot_fn is called from the connection handler thread right after the
+ * handshake, so it should be quick. The client is sent the snapshot, in its
+ * encoding, then what is published to channel from when snapshot_fn was
+ * called; no other client is sent anything. Updates published while
+ * snapshot_fn runs may also be in the snapshot: number them if clients must
+ * skip those. Clients that switch to channel with "subscribe" are sent its
+ * latest broadcast as usual.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param snapshot_fn writes the snapshot, or NULL (default) for none: a new
+ * client is first sent the latest broadcast
+ * @param user passed to snapshot_fn
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_channel_set_snapshot(struct ws_ctube_channel *channel, ws_ctube_snapshot_fn snapshot_fn, void *user);
+
+/**
+ * ws_ctube_publish - tries to queue data for sending to the clients of
+ * channel.
+ *
+ * Like ws_ctube_broadcast(), with the rate limit applying to each channel
+ * separately. Different channels may be published to from different threads.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param data pointer to data to publish
+ * @param data_size bytes of data
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_publish(struct ws_ctube_channel *channel, const void *data, size_t data_size);
+
+/**
+ * ws_ctube_publish_grid - tries to queue a grid for sending to the clients of
+ * channel.
+ *
+ * Like ws_ctube_publish(), with the grid copied packed (row-major). Clients
+ * that declared a region of interest by sending "roi <lo> <hi> ..." (see
+ * README.md) are sent only that box of the grid, the others the whole grid.
+ * If grid->nlevel > 0, a pyramid of downsampled levels is built (here, once)
+ * and clients that asked for a level are sent that level instead.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param data pointer to the first element of the grid
+ * @param grid layout of data
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_publish_grid(struct ws_ctube_channel *channel, const void *data, const struct ws_ctube_grid *grid);
+
+/**
+ * ws_ctube_publish_quantized - tries to queue an array of floating-point
+ * values for sending to the clients of channel at lower precision.
+ *
+ * Like ws_ctube_publish(), with the values converted (here, once) to 16 or 8
+ * bits each. Clients are sent a 24 byte header (the format as 1 byte, 7 zero
+ * bytes, then min and max as doubles) followed by the converted values; see
+ * README.md.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param data pointer to the values
+ * @param count number of values
+ * @param quant their type and how to convert them
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_publish_quantized(struct ws_ctube_channel *channel, const void *data, size_t count, const struct ws_ctube_quant *quant);
+
+/** options for ws_ctube_replay(); set defaults with ws_ctube_replay_opts_init() */
+struct ws_ctube_replay_opts {
+	/**
+	 * 1 (default) to broadcast records with the timing they were recorded
+	 * with, N to go N times faster, or 0 to go as fast as possible
+	 */
+	double speed;
+	/**
+	 * skip records broadcast before this time (ns since 1970), found with
+	 * the time index, or 0 (default) to start at the beginning
+	 */
+	long long start_ns;
+	/** stop at the first record broadcast at or after this time, or 0 (default) at the end */
+	long long end_ns;
+};
+
+/** ws_ctube_replay_opts_init - set opts to defaults */
+void ws_ctube_replay_opts_init(struct ws_ctube_replay_opts *opts);
+
+/**
+ * ws_ctube_replay - broadcast the records of a log written with
+ * opts.record_path (see ws_ctube_open_opts()) to the clients of ctube, each
+ * to the channel it was recorded from (opened if needed).
+ *
+ * Blocks until the end of the log (or opts->end_ns) is reached. The files are
+ * mapped and read in place; each record is published like ws_ctube_publish()
+ * would (or ws_ctube_publish_grid(), for a grid), but not recorded again if the recorder is running. A record that
+ * cannot be published (e.g. rate-limited) is retried for up to 100 ms, then
+ * skipped and counted in nreplay_skipped of ws_ctube_get_stats(). Gaps
+ * between recording runs are waited out too at the recorded timing.
+ *
+ * @param ctube the websocket ctube
+ * @param path the record_path of the log
+ * @param opts options initialized with ws_ctube_replay_opts_init(), or NULL
+ * for defaults
+ *
+ * @return number of records broadcast (not counting skipped ones), or -1 if
+ * the log cannot be read
+ */
+long ws_ctube_replay(struct ws_ctube *ctube, const char *path, const struct ws_ctube_replay_opts *opts);
+
+struct ws_ctube_shm_reader;
+
+/** a broadcast read with ws_ctube_shm_read() */
+struct ws_ctube_shm_msg {
+	/** channel it was published to ("" for the default channel), valid until the next read */
+	const char *channel;
+	/** bytes of data */
+	size_t size;
+	/** sequence number, increasing across channels (as recorded with opts.record_path) */
+	unsigned long id;
+	/** CLOCK_REALTIME when it was broadcast, in ns since 1970 */
+	long long time_ns;
+	/** broadcasts overwritten before they could be read, since the last one read */
+	unsigned long nmissed;
+};
+
+/**
+ * ws_ctube_shm_reader_open - map the ring that a ctube opened with
+ * opts.shm_path writes to, from any process on the same host. Reading
+ * starts at its latest broadcast
+ *
+ * @param path the shm_path of the ctube
+ *
+ * @return reader to close with ws_ctube_shm_reader_close(), or NULL if there
+ * is no such ring
+ */
+struct ws_ctube_shm_reader *ws_ctube_shm_reader_open(const char *path);
+
+/** ws_ctube_shm_reader_close - unmap the ring and free reader */
+void ws_ctube_shm_reader_close(struct ws_ctube_shm_reader *reader);
+
+/**
+ * ws_ctube_shm_read - copy the next broadcast from the ring.
+ *
+ * Readers do not slow the producer down: a reader that falls a whole ring
+ * behind skips to the latest broadcast (counted in msg->nmissed). Waiting
+ * sleeps on a futex, which the producer only wakes if a reader is asleep.
+ *
+ * @param reader from ws_ctube_shm_reader_open()
+ * @param buf receives the data
+ * @param max bytes of buf
+ * @param msg set to the channel, size, id and time of the broadcast (may be NULL)
+ * @param timeout_ms -1 to wait for a broadcast, 0 to return at once, or ms to wait at most
+ *
+ * @return size of the broadcast (if more than max, nothing was read: call
+ * again with a larger buf), 0 if none came in time, or -1 if the producer has
+ * closed its ctube (reopen the path once it is back)
+ */
+long ws_ctube_shm_read(struct ws_ctube_shm_reader *reader, void *buf, size_t max, struct ws_ctube_shm_msg *msg, int timeout_ms);
+
+/**
+ * ws_ctube_get_stats - get memory usage of ctube. May be called from any
+ * thread; the values are a snapshot
+ *
+ * @param ctube the websocket ctube
+ * @param stats set to the current stats
+ */
+void ws_ctube_get_stats(struct ws_ctube *ctube, struct ws_ctube_stats *stats);
+
+#if defined(__cplusplus) && __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+extern "C++" {
+#include <memory_resource>
+
+/**
+ * ws_ctube_pmr_allocator - make a ws_ctube_allocator that allocates from a
+ * std::pmr::memory_resource, e.g. for opts.payload_alloc
+ *
+ * @param resource must outlive the ctube and be thread-safe (e.g. a
+ * std::pmr::synchronized_pool_resource)
+ */
+inline struct ws_ctube_allocator ws_ctube_pmr_allocator(std::pmr::memory_resource *resource)
+{
+	struct ws_ctube_allocator allocator;
+
+	allocator.alloc = [](size_t size, size_t align, void *user) -> void * {
+		try {
+			return static_cast<std::pmr::memory_resource *>(user)->allocate(size, align);
+		} catch (...) {
+			return nullptr;
+		}
+	};
+	allocator.free = [](void *ptr, size_t size, size_t align, void *user) {
+		static_cast<std::pmr::memory_resource *>(user)->deallocate(ptr, size, align);
+	};
+	allocator.user = resource;
+	return allocator;
+}
+} /* extern "C++" */
+#endif /* __has_include(<memory_resource>) */
+#endif /* __cplusplus >= 201703L */
+
 #endif /* WS_CTUBE_API_H */
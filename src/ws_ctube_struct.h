@@ -10,26 +10,272 @@
 #define WS_CTUBE_STRUCT_H
 
 #include <pthread.h>
+#include <string.h>
 #include <time.h>
+#include <sys/mman.h>
 #include "container_of.h"
+#include "cache_line.h"
 #include "ref_count.h"
 #include "list.h"
+#include "mpsc_queue.h"
+#include "reclaim.h"
+#include "record.h"
+#include "shm.h"
+#include "alloc.h"
+#include "slab.h"
+#include "huge_page.h"
+#include "quant.h"
+#include "encoding.h"
+#include "delta.h"
+#include "deflate.h"
+#include "encoder.h"
+#include "ws_ctube_api.h"
+
+/**
+ * max number of unreferenced ws_ctube_data kept around for reuse per size
+ * class (in addition to one per client)
+ */
+#define WS_CTUBE_DATA_POOL_LEN 4
+/** number of buffer size classes in ws_ctube_data_pool */
+#define WS_CTUBE_DATA_POOL_NCLASS 48
+/** smallest buffer size class (2^6 bytes) */
+#define WS_CTUBE_DATA_POOL_MIN_CLASS 6
+
+/** deltas from different earlier broadcasts kept per ws_ctube_data */
+#define WS_CTUBE_DELTA_NCACHE 4
+/** a client in delta mode is sent a keyframe at least every this many frames */
+#define WS_CTUBE_DELTA_KEYFRAME 64
+
+/** conn_slab holds this many conn_structs per allowed client */
+#define WS_CTUBE_CONN_SLAB_FACTOR 2
+
+/** bytes per copy-on-write chunk of live data */
+#define WS_CTUBE_LIVE_CHUNK_SIZE 65536
+
+/**
+ * define as 1 before including ws_ctube.h to count references to the current
+ * broadcast in per-thread shards (see ws_ctube_sharded_ref_count): worth it
+ * with hundreds of clients, at the cost of ~1 KB per pooled ws_ctube_data
+ */
+#ifndef WS_CTUBE_SHARDED_REFC
+#define WS_CTUBE_SHARDED_REFC 0
+#endif /* WS_CTUBE_SHARDED_REFC */
+
+/**
+ * copy-on-write state of data broadcast from live memory: before the producer
+ * modifies a chunk that writers may still be sending, the chunk is copied to
+ * snapshot and writers send the copy instead
+ */
+struct ws_ctube_live {
+	/* only chunks that get copied are backed by physical memory */
+	char *snapshot;
+	size_t snapshot_size;
+
+	size_t nchunk;
+	/* whether each chunk has been copied to snapshot */
+	unsigned char *copied;
+
+	/* copied is allocated from this */
+	const struct ws_ctube_allocator *allocator;
+};
+
+static int ws_ctube_live_init(struct ws_ctube_live *live, size_t data_size, const struct ws_ctube_allocator *allocator)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+
+	live->nchunk = (data_size + WS_CTUBE_LIVE_CHUNK_SIZE - 1) / WS_CTUBE_LIVE_CHUNK_SIZE;
+	live->allocator = allocator;
+	live->copied = (typeof(live->copied))ws_ctube_mem_alloc(allocator, live->nchunk, 1);
+	if (live->copied == NULL) {
+		goto out_nocopied;
+	}
+	memset(live->copied, 0, live->nchunk);
+
+	live->snapshot_size = data_size;
+	live->snapshot = (typeof(live->snapshot))mmap(NULL, data_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (live->snapshot == MAP_FAILED) {
+		goto out_nosnapshot;
+	}
+
+	return 0;
+
+out_nosnapshot:
+	ws_ctube_mem_free(allocator, live->copied, live->nchunk, 1);
+out_nocopied:
+	return -1;
+}
+
+static void ws_ctube_live_destroy(struct ws_ctube_live *live)
+{
+	munmap(live->snapshot, live->snapshot_size);
+	live->snapshot = NULL;
+	live->snapshot_size = 0;
+
+	ws_ctube_mem_free(live->allocator, live->copied, live->nchunk, 1);
+	live->copied = NULL;
+	live->nchunk = 0;
+	live->allocator = NULL;
+}
+
+/**
+ * producer side: copy chunk i of base to snapshot unless already copied
+ *
+ * @return 1 if copied now, 0 otherwise
+ */
+static inline int ws_ctube_live_copy_chunk(struct ws_ctube_live *live, const char *base, size_t i)
+{
+	if (live->copied[i]) {
+		return 0;
+	}
+
+	const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+	size_t len = live->snapshot_size - off;
+	if (len > WS_CTUBE_LIVE_CHUNK_SIZE) {
+		len = WS_CTUBE_LIVE_CHUNK_SIZE;
+	}
+
+	memcpy(live->snapshot + off, base + off, len);
+	__atomic_store_n(&live->copied[i], (unsigned char)1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * writer side: get a consistent copy of chunk i as it was when broadcast
+ *
+ * @param buf scratch space of WS_CTUBE_LIVE_CHUNK_SIZE bytes
+ *
+ * @return pointer to the chunk (either in snapshot or buf)
+ */
+static inline const char *ws_ctube_live_read_chunk(struct ws_ctube_live *live, const char *base, size_t i, char *buf, size_t len)
+{
+	const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+
+	if (__atomic_load_n(&live->copied[i], __ATOMIC_ACQUIRE)) {
+		return live->snapshot + off;
+	}
+
+	/* seqlock-style: if the chunk still isn't copied after reading it, the
+	 * producer cannot have started modifying it */
+	memcpy(buf, base + off, len);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&live->copied[i], __ATOMIC_RELAXED)) {
+		return live->snapshot + off;
+	}
+	return buf;
+}
+
+struct ws_ctube_data_pool;
+
+/** delta to a ws_ctube_data from an earlier broadcast, see delta.h */
+struct ws_ctube_delta {
+	/* id of the earlier broadcast, 0 if the slot is unused */
+	unsigned long base_id;
+	/* (size_t)-1 if the delta would be no smaller than a keyframe */
+	size_t size;
+	/* buffer of capacity bytes (kept when recycled) from mem->payload */
+	char *buf;
+	size_t capacity;
+};
+
+/** a ws_ctube_data in an encoding that is the same for every client */
+struct ws_ctube_encoded {
+	/* 0 if not encoded yet, 1 if buf holds it, -1 if not worth it */
+	int state;
+	size_t size;
+	/* buffer of capacity bytes (kept when recycled) from mem->payload */
+	char *buf;
+	size_t capacity;
+};
 
 /** holds data to be sent/received over the network */
 struct ws_ctube_data {
+	/* read-only while published: read by every writer */
 	void *data;
 	size_t data_size;
+	/** bytes allocated for data (may exceed data_size when recycled) */
+	size_t data_capacity;
+	/* whether data was allocated by ws_ctube_huge_alloc() instead of mem */
+	int huge;
+
+	/* the descriptor and data buffer are allocated from this */
+	const struct ws_ctube_mem *mem;
+
+	/* if not NULL, data is recycled into pool instead of freed */
+	struct ws_ctube_data_pool *pool;
+
+	/* if not NULL, data is owned by the caller and released with
+	 * release_fn(data, release_user) instead of freed */
+	void (*release_fn)(void *data, void *user);
+	void *release_user;
+
+	/* if not NULL, data is live caller memory protected by copy-on-write */
+	struct ws_ctube_live *live;
+
+	/* layout of data if published as a packed grid, else ndim is 0 */
+	struct ws_ctube_grid grid;
+
+	/* deltas to this broadcast, each computed once by the first writer
+	 * that needs it and shared by all writers at the same base_id; under
+	 * mutex */
+	struct ws_ctube_delta delta[WS_CTUBE_DELTA_NCACHE];
+	/* this broadcast in each encoding that does not depend on the client
+	 * (raw and delta slots are unused), each made once by the first
+	 * writer that needs it and shared by all writers; under mutex */
+	struct ws_ctube_encoded encoded[WS_CTUBE_NENCODING];
 
 	pthread_mutex_t mutex;
 	struct ws_ctube_list_node lnode;
-	struct ws_ctube_ref_count refc;
+	struct ws_ctube_reclaim_node rnode;
+	/* queued to the recorder (holding a reference) when published */
+	struct ws_ctube_record_node record;
+
+	/* changed by every writer: kept off the line of the fields above */
+#if WS_CTUBE_SHARDED_REFC
+	struct ws_ctube_sharded_ref_count refc;
+#else /* WS_CTUBE_SHARDED_REFC */
+	struct ws_ctube_ref_count refc ws_ctube_cache_aligned;
+#endif /* WS_CTUBE_SHARDED_REFC */
 };
 
-static int ws_ctube_data_init(struct ws_ctube_data *ws_ctube_data, const void *data, size_t data_size)
+/**
+ * allocate a data buffer of data_size bytes for ws_ctube_data, with huge pages
+ * if try_huge and possible
+ */
+static int _ws_ctube_data_alloc_buf(struct ws_ctube_data *ws_ctube_data, size_t data_size, int try_huge)
+{
+	void *buf = NULL;
+
+	ws_ctube_data->huge = 0;
+	if (try_huge) {
+		buf = ws_ctube_huge_alloc(data_size);
+		ws_ctube_data->huge = buf != NULL;
+	}
+	if (buf == NULL) {
+		buf = ws_ctube_mem_alloc(&ws_ctube_data->mem->payload, data_size, WS_CTUBE_PAYLOAD_ALIGN);
+	}
+
+	ws_ctube_data->data = buf;
+	if (buf == NULL) {
+		ws_ctube_data->data_size = 0;
+		ws_ctube_data->data_capacity = 0;
+		return -1;
+	}
+
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	return 0;
+}
+
+static int ws_ctube_data_init(struct ws_ctube_data *ws_ctube_data, const struct ws_ctube_mem *mem, const void *data, size_t data_size)
 {
+	ws_ctube_data->mem = mem;
+	ws_ctube_data->data = NULL;
+	ws_ctube_data->huge = 0;
 	if (data_size > 0) {
-		ws_ctube_data->data = (typeof(ws_ctube_data->data))malloc(data_size);
-		if (ws_ctube_data->data == NULL) {
+		if (_ws_ctube_data_alloc_buf(ws_ctube_data, data_size, 0) != 0) {
 			goto out_nodata;
 		}
 
@@ -39,28 +285,189 @@ static int ws_ctube_data_init(struct ws_ctube_data *ws_ctube_data, const void *d
 	}
 
 	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	ws_ctube_data->pool = NULL;
+	ws_ctube_data->release_fn = NULL;
+	ws_ctube_data->release_user = NULL;
+	ws_ctube_data->live = NULL;
+	ws_ctube_data->grid.ndim = 0;
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		ws_ctube_data->delta[i].base_id = 0;
+		ws_ctube_data->delta[i].size = 0;
+		ws_ctube_data->delta[i].buf = NULL;
+		ws_ctube_data->delta[i].capacity = 0;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		ws_ctube_data->encoded[i].state = 0;
+		ws_ctube_data->encoded[i].size = 0;
+		ws_ctube_data->encoded[i].buf = NULL;
+		ws_ctube_data->encoded[i].capacity = 0;
+	}
 
 	pthread_mutex_init(&ws_ctube_data->mutex, NULL);
 	ws_ctube_list_node_init(&ws_ctube_data->lnode);
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_init(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
 	ws_ctube_ref_count_init(&ws_ctube_data->refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
 	return 0;
 
 out_nodata:
 	return -1;
 }
 
+/**
+ * make a bufferless ws_ctube_data reference caller-owned data without copying;
+ * release_fn(data, release_user) is called when it is destroyed or recycled
+ */
+static void ws_ctube_data_set_owned(
+	struct ws_ctube_data *ws_ctube_data,
+	void *data,
+	size_t data_size,
+	void (*release_fn)(void *data, void *user),
+	void *release_user)
+{
+	ws_ctube_data->data = data;
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	ws_ctube_data->release_fn = release_fn;
+	ws_ctube_data->release_user = release_user;
+}
+
+/** make a bufferless ws_ctube_data reference live caller memory with copy-on-write */
+static int ws_ctube_data_set_live(struct ws_ctube_data *ws_ctube_data, void *data, size_t data_size)
+{
+	const struct ws_ctube_allocator *ctrl = &ws_ctube_data->mem->ctrl;
+	struct ws_ctube_live *live = (typeof(live))ws_ctube_mem_alloc(ctrl, sizeof(*live), __alignof__(*live));
+	if (live == NULL) {
+		goto out_noalloc;
+	}
+	if (ws_ctube_live_init(live, data_size, ctrl) != 0) {
+		goto out_nolive;
+	}
+
+	ws_ctube_data->data = data;
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	ws_ctube_data->live = live;
+	return 0;
+
+out_nolive:
+	ws_ctube_mem_free(ctrl, live, sizeof(*live), __alignof__(*live));
+out_noalloc:
+	return -1;
+}
+
+/**
+ * give back caller memory referenced by ws_ctube_data, leaving it bufferless
+ *
+ * @return 1 if ws_ctube_data referenced caller memory, 0 otherwise
+ */
+static int _ws_ctube_data_unborrow(struct ws_ctube_data *ws_ctube_data)
+{
+	if (ws_ctube_data->live != NULL) {
+		/* live memory belongs to the caller */
+		ws_ctube_live_destroy(ws_ctube_data->live);
+		ws_ctube_mem_free(&ws_ctube_data->mem->ctrl, ws_ctube_data->live, sizeof(*ws_ctube_data->live), __alignof__(*ws_ctube_data->live));
+		ws_ctube_data->live = NULL;
+	} else if (ws_ctube_data->release_fn != NULL) {
+		ws_ctube_data->release_fn(ws_ctube_data->data, ws_ctube_data->release_user);
+		ws_ctube_data->release_fn = NULL;
+		ws_ctube_data->release_user = NULL;
+	} else {
+		return 0;
+	}
+
+	ws_ctube_data->data = NULL;
+	ws_ctube_data->data_size = 0;
+	ws_ctube_data->data_capacity = 0;
+	return 1;
+}
+
+/** free the buffer owned by ws_ctube_data */
+static void _ws_ctube_data_free_buf(struct ws_ctube_data *ws_ctube_data)
+{
+	if (ws_ctube_data->huge) {
+		ws_ctube_huge_free(ws_ctube_data->data, ws_ctube_data->data_capacity);
+	} else {
+		ws_ctube_mem_free(&ws_ctube_data->mem->payload, ws_ctube_data->data, ws_ctube_data->data_capacity, WS_CTUBE_PAYLOAD_ALIGN);
+	}
+	ws_ctube_data->data = NULL;
+	ws_ctube_data->huge = 0;
+}
+
+/** bytes of the buffers ws_ctube_data keeps for deltas and encodings */
+static inline size_t ws_ctube_data_encoding_bytes(const struct ws_ctube_data *ws_ctube_data)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		n += ws_ctube_data->delta[i].capacity;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		n += ws_ctube_data->encoded[i].capacity;
+	}
+	return n;
+}
+
+/**
+ * free the buffers ws_ctube_data keeps for deltas and encodings (the caller
+ * accounts for them)
+ */
+static void _ws_ctube_data_free_encodings(struct ws_ctube_data *ws_ctube_data)
+{
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		struct ws_ctube_delta *delta = &ws_ctube_data->delta[i];
+		if (delta->buf != NULL) {
+			ws_ctube_mem_free(&ws_ctube_data->mem->payload, delta->buf, delta->capacity, WS_CTUBE_PAYLOAD_ALIGN);
+		}
+		delta->base_id = 0;
+		delta->buf = NULL;
+		delta->capacity = 0;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		struct ws_ctube_encoded *encoded = &ws_ctube_data->encoded[i];
+		if (encoded->buf != NULL) {
+			ws_ctube_mem_free(&ws_ctube_data->mem->payload, encoded->buf, encoded->capacity, WS_CTUBE_PAYLOAD_ALIGN);
+		}
+		encoded->state = 0;
+		encoded->buf = NULL;
+		encoded->capacity = 0;
+	}
+}
+
 static void ws_ctube_data_destroy(struct ws_ctube_data *ws_ctube_data)
 {
-	if (ws_ctube_data->data != NULL) {
-		free(ws_ctube_data->data);
-		ws_ctube_data->data = NULL;
+	if (!_ws_ctube_data_unborrow(ws_ctube_data)) {
+		_ws_ctube_data_free_buf(ws_ctube_data);
 	}
 
 	ws_ctube_data->data_size = 0;
+	ws_ctube_data->data_capacity = 0;
+	ws_ctube_data->pool = NULL;
+
+	_ws_ctube_data_free_encodings(ws_ctube_data);
 
 	pthread_mutex_destroy(&ws_ctube_data->mutex);
 	ws_ctube_list_node_destroy(&ws_ctube_data->lnode);
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_destroy(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
 	ws_ctube_ref_count_destroy(&ws_ctube_data->refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** ensure ws_ctube_data can hold data_size bytes (contents are not preserved) */
+static int ws_ctube_data_reserve(struct ws_ctube_data *ws_ctube_data, size_t data_size)
+{
+	if (ws_ctube_data->data_capacity < data_size) {
+		_ws_ctube_data_free_buf(ws_ctube_data);
+		return _ws_ctube_data_alloc_buf(ws_ctube_data, data_size, 0);
+	}
+
+	ws_ctube_data->data_size = data_size;
+	return 0;
 }
 
 /** copy data into ws_ctube_data */
@@ -69,41 +476,850 @@ static inline int ws_ctube_data_cp(struct ws_ctube_data *ws_ctube_data, const vo
 	int retval = 0;
 
 	pthread_mutex_lock(&ws_ctube_data->mutex);
-	if (ws_ctube_data->data_size < data_size) {
-		if (ws_ctube_data->data != NULL) {
-			free(ws_ctube_data->data);
+	if (ws_ctube_data_reserve(ws_ctube_data, data_size) != 0) {
+		retval = -1;
+		goto out;
+	}
+
+	memcpy(ws_ctube_data->data, data, data_size);
+
+out:
+	pthread_mutex_unlock(&ws_ctube_data->mutex);
+	return retval;
+}
+
+/**
+ * an encoding of the first size bytes of cur (and prev, for deltas) split into
+ * chunks for a ws_ctube_encoder: each chunk is encoded into its own region of
+ * out, then the outputs are packed together
+ */
+struct _ws_ctube_chunked_job {
+	struct ws_ctube_encode_job job;
+	const char *prev;
+	const char *cur;
+	size_t size;
+	size_t chunk_size;
+	char *out;
+	size_t region_size;
+	/* bytes each chunk wrote to its region, or (size_t)-1 if too many */
+	size_t out_size[WS_CTUBE_ENCODE_MAXCHUNK];
+};
+
+/**
+ * set up cj to encode size bytes, with a region of chunk_size bytes per chunk
+ * (the caller may enlarge region_size before allocating out)
+ */
+static void _ws_ctube_chunked_job_init(struct _ws_ctube_chunked_job *cj, const char *prev, const char *cur, size_t size)
+{
+	cj->prev = prev;
+	cj->cur = cur;
+	cj->size = size;
+	cj->job.nchunk = ws_ctube_encode_nchunk(size, &cj->chunk_size);
+	cj->region_size = cj->chunk_size;
+	cj->out = NULL;
+}
+
+/** first and one past the last byte of chunk of cj */
+static inline void _ws_ctube_chunked_range(const struct _ws_ctube_chunked_job *cj, int chunk, size_t *begin, size_t *end)
+{
+	*begin = (size_t)chunk * cj->chunk_size;
+	*end = chunk == cj->job.nchunk - 1 ? cj->size : *begin + cj->chunk_size;
+}
+
+static void _ws_ctube_delta_chunk(struct ws_ctube_encode_job *job, int chunk)
+{
+	struct _ws_ctube_chunked_job *cj = ws_ctube_container_of(job, typeof(*cj), job);
+	size_t begin, end;
+
+	_ws_ctube_chunked_range(cj, chunk, &begin, &end);
+	cj->out_size[chunk] = ws_ctube_delta_encode_part(cj->out + chunk * cj->region_size, end - begin, cj->prev, cj->cur, begin, end, end == cj->size);
+}
+
+static void _ws_ctube_deflate_chunk(struct ws_ctube_encode_job *job, int chunk)
+{
+	struct _ws_ctube_chunked_job *cj = ws_ctube_container_of(job, typeof(*cj), job);
+	size_t begin, end;
+
+	_ws_ctube_chunked_range(cj, chunk, &begin, &end);
+	cj->out_size[chunk] = ws_ctube_deflate_part(cj->out + chunk * cj->region_size, cj->region_size, cj->cur + begin, end - begin);
+}
+
+/**
+ * pack the outputs of the chunks of cj together at cj->out
+ *
+ * @return their total bytes, or (size_t)-1 if a chunk failed
+ */
+static size_t _ws_ctube_chunked_pack(struct _ws_ctube_chunked_job *cj)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < cj->job.nchunk; i++) {
+		if (cj->out_size[i] == (size_t)-1) {
+			return (size_t)-1;
+		}
+		memmove(cj->out + n, cj->out + i * cj->region_size, cj->out_size[i]);
+		n += cj->out_size[i];
+	}
+	return n;
+}
+
+/** bytes a buffer for chunked output needs */
+static inline size_t _ws_ctube_chunked_capacity(const struct _ws_ctube_chunked_job *cj)
+{
+	return cj->job.nchunk * cj->region_size;
+}
+
+/** bytes of ws_ctube_data buffer owned by ctube (caller memory is not counted) */
+static inline size_t ws_ctube_data_pooled_bytes(const struct ws_ctube_data *ws_ctube_data)
+{
+	if (ws_ctube_data->live != NULL || ws_ctube_data->release_fn != NULL) {
+		return 0;
+	}
+	return ws_ctube_data->data_capacity;
+}
+
+/** allocate an uninitialized ws_ctube_data descriptor from mem */
+static struct ws_ctube_data *ws_ctube_data_alloc(const struct ws_ctube_mem *mem)
+{
+	return (struct ws_ctube_data *)ws_ctube_mem_alloc(&mem->ctrl, sizeof(struct ws_ctube_data), __alignof__(struct ws_ctube_data));
+}
+
+static void ws_ctube_data_free(struct ws_ctube_data *ws_ctube_data)
+{
+	const struct ws_ctube_mem *mem = ws_ctube_data->mem;
+
+	ws_ctube_data_destroy(ws_ctube_data);
+	ws_ctube_mem_free(&mem->ctrl, ws_ctube_data, sizeof(*ws_ctube_data), __alignof__(*ws_ctube_data));
+}
+
+/**
+ * recycles unreferenced ws_ctube_data so that their descriptors and buffers
+ * can be reused without calling the allocator.
+ *
+ * Buffers are kept in power-of-2 size classes: class k holds buffers of
+ * 2^k bytes (class 0 holds bufferless descriptors, e.g. for caller-owned
+ * data). Rounding up mostly costs address space since pages of a buffer that
+ * are never written to are never faulted in.
+ */
+struct ws_ctube_data_pool {
+	/** maximum number of ws_ctube_data kept for reuse per size class */
+	int max_len;
+	/** buffers of at least this many bytes are allocated with huge pages (0: never) */
+	size_t huge_threshold;
+	/** descriptors and buffers are allocated from this */
+	const struct ws_ctube_mem *mem;
+	/** ws_ctube_data that cannot be kept are freed by this */
+	struct ws_ctube_reclaimer *reclaimer;
+
+	/** if nonzero, buffers are only kept for reuse while in_use + cached fit */
+	size_t budget;
+
+	/* buffer accounting (updated atomically by the producer and writers) */
+	/** bytes of buffers taken from the pool and not yet recycled */
+	size_t in_use ws_ctube_cache_aligned;
+	size_t in_use_peak;
+	/** bytes of buffers kept in free_list for reuse */
+	size_t cached;
+
+	/* producers blocked on the budget wait for in_use to drop */
+	int nwaiting;
+	pthread_mutex_t budget_mutex;
+	pthread_cond_t budget_cond;
+
+	struct ws_ctube_list free_list[WS_CTUBE_DATA_POOL_NCLASS] ws_ctube_cache_aligned;
+};
+
+/** size class of buffers able to hold data_size bytes */
+static inline int ws_ctube_data_pool_class(size_t data_size)
+{
+	if (data_size == 0) {
+		return 0;
+	}
+	if (data_size <= ((size_t)1 << WS_CTUBE_DATA_POOL_MIN_CLASS)) {
+		return WS_CTUBE_DATA_POOL_MIN_CLASS;
+	}
+	return 8 * sizeof(unsigned long long) - __builtin_clzll((unsigned long long)data_size - 1);
+}
+
+static inline size_t ws_ctube_data_pool_class_size(int k)
+{
+	return k == 0 ? 0 : (size_t)1 << k;
+}
+
+/** bytes of the buffer that ws_ctube_data_pool_get() uses for data_size bytes */
+static inline size_t ws_ctube_data_pool_capacity(size_t data_size)
+{
+	const int k = ws_ctube_data_pool_class(data_size);
+	return k >= WS_CTUBE_DATA_POOL_NCLASS ? data_size : ws_ctube_data_pool_class_size(k);
+}
+
+static int ws_ctube_data_pool_init(struct ws_ctube_data_pool *pool, const struct ws_ctube_mem *mem, struct ws_ctube_reclaimer *reclaimer, int max_len, size_t huge_threshold, size_t budget)
+{
+	for (int k = 0; k < WS_CTUBE_DATA_POOL_NCLASS; k++) {
+		ws_ctube_list_init(&pool->free_list[k]);
+	}
+	pool->max_len = max_len;
+	/* a custom payload allocator takes precedence over huge pages */
+	pool->huge_threshold = ws_ctube_allocator_is_custom(&mem->payload) ? 0 : huge_threshold;
+	pool->mem = mem;
+	pool->reclaimer = reclaimer;
+
+	pool->in_use = 0;
+	pool->in_use_peak = 0;
+	pool->cached = 0;
+	pool->budget = budget;
+
+	pool->nwaiting = 0;
+	pthread_mutex_init(&pool->budget_mutex, NULL);
+	pthread_cond_init(&pool->budget_cond, NULL);
+	return 0;
+}
+
+static void ws_ctube_data_pool_destroy(struct ws_ctube_data_pool *pool)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+
+	for (int k = 0; k < WS_CTUBE_DATA_POOL_NCLASS; k++) {
+		while ((node = ws_ctube_list_pop_front(&pool->free_list[k])) != NULL) {
+			data = ws_ctube_container_of(node, typeof(*data), lnode);
+			ws_ctube_data_free(data);
+		}
+		ws_ctube_list_destroy(&pool->free_list[k]);
+	}
+	pool->max_len = 0;
+	pool->huge_threshold = 0;
+	pool->mem = NULL;
+	pool->reclaimer = NULL;
+
+	pool->in_use = 0;
+	pool->in_use_peak = 0;
+	pool->cached = 0;
+	pool->budget = 0;
+
+	pool->nwaiting = 0;
+	pthread_mutex_destroy(&pool->budget_mutex);
+	pthread_cond_destroy(&pool->budget_cond);
+}
+
+/** account for capacity bytes of buffer taken from pool */
+static void _ws_ctube_data_pool_take(struct ws_ctube_data_pool *pool, size_t capacity)
+{
+	const size_t in_use = __atomic_add_fetch(&pool->in_use, capacity, __ATOMIC_SEQ_CST);
+	size_t peak = __atomic_load_n(&pool->in_use_peak, __ATOMIC_RELAXED);
+
+	while (in_use > peak && !__atomic_compare_exchange_n(&pool->in_use_peak, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** wake producers waiting for buffers to be given back to pool */
+static void _ws_ctube_data_pool_notify(struct ws_ctube_data_pool *pool)
+{
+	if (__atomic_load_n(&pool->nwaiting, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->budget_mutex);
+		pthread_mutex_unlock(&pool->budget_mutex);
+		pthread_cond_broadcast(&pool->budget_cond);
+	}
+}
+
+/**
+ * account for capacity bytes of buffer about to be taken from pool, but only
+ * if in_use stays within limit. Atomic, so producers racing for the same
+ * headroom cannot all fit in it
+ *
+ * @return 0 if reserved, -1 otherwise
+ */
+static int ws_ctube_data_pool_reserve(struct ws_ctube_data_pool *pool, size_t capacity, size_t limit)
+{
+	size_t in_use = __atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST);
+	size_t peak;
+
+	do {
+		if (capacity > limit || in_use > limit - capacity) {
+			return -1;
 		}
+	} while (!__atomic_compare_exchange_n(&pool->in_use, &in_use, in_use + capacity, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	in_use += capacity;
+	peak = __atomic_load_n(&pool->in_use_peak, __ATOMIC_RELAXED);
+	while (in_use > peak && !__atomic_compare_exchange_n(&pool->in_use_peak, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+/** give back capacity bytes reserved or taken from pool */
+static void ws_ctube_data_pool_unreserve(struct ws_ctube_data_pool *pool, size_t capacity)
+{
+	__atomic_sub_fetch(&pool->in_use, capacity, __ATOMIC_SEQ_CST);
+	if (capacity > 0) {
+		_ws_ctube_data_pool_notify(pool);
+	}
+}
 
-		ws_ctube_data->data = (typeof(ws_ctube_data->data))malloc(data_size);
-		if (ws_ctube_data->data == NULL) {
-			retval = -1;
+/**
+ * account in the pool of ws_ctube_data for capacity bytes of buffer for its
+ * deltas or encodings. With a budget, they are only given what leaves room for a next
+ * broadcast of the same size: producers waiting on the budget must not be
+ * stuck behind the encodings of the current one, which are given back with it
+ *
+ * @return 0 if accounted for, -1 if they do not fit
+ */
+static int _ws_ctube_data_reserve_encoding(struct ws_ctube_data *ws_ctube_data, size_t capacity)
+{
+	struct ws_ctube_data_pool *pool = ws_ctube_data->pool;
+	const size_t pooled = ws_ctube_data_pooled_bytes(ws_ctube_data);
+
+	if (pool->budget == 0) {
+		_ws_ctube_data_pool_take(pool, capacity);
+		return 0;
+	}
+	if (pooled >= pool->budget) {
+		return -1;
+	}
+	return ws_ctube_data_pool_reserve(pool, capacity, pool->budget - pooled);
+}
+
+/**
+ * make *buf, a buffer of *buf_capacity bytes for an encoding of ws_ctube_data,
+ * hold at least capacity bytes (contents are not preserved), accounted for in
+ * its pool like its data buffer. Under ws_ctube_data->mutex, while holding a
+ * reference
+ *
+ * @return 0 on success, -1 if no memory (within the budget)
+ */
+static int _ws_ctube_data_grow_encoding(struct ws_ctube_data *ws_ctube_data, char **buf, size_t *buf_capacity, size_t capacity)
+{
+	const struct ws_ctube_allocator *payload = &ws_ctube_data->mem->payload;
+
+	if (*buf_capacity >= capacity) {
+		return 0;
+	}
+
+	if (*buf != NULL) {
+		ws_ctube_mem_free(payload, *buf, *buf_capacity, WS_CTUBE_PAYLOAD_ALIGN);
+		ws_ctube_data_pool_unreserve(ws_ctube_data->pool, *buf_capacity);
+		*buf = NULL;
+		*buf_capacity = 0;
+	}
+
+	if (_ws_ctube_data_reserve_encoding(ws_ctube_data, capacity) != 0) {
+		return -1;
+	}
+	*buf = (char *)ws_ctube_mem_alloc(payload, capacity, WS_CTUBE_PAYLOAD_ALIGN);
+	if (*buf == NULL) {
+		ws_ctube_data_pool_unreserve(ws_ctube_data->pool, capacity);
+		return -1;
+	}
+	*buf_capacity = capacity;
+	return 0;
+}
+
+/**
+ * the delta to the first size bytes of ws_ctube_data from base (broadcast
+ * base_id, of at least size bytes), computed by the first caller (in chunks
+ * shared with encoder's workers, if encoder is not NULL) and shared with
+ * later ones. Stays valid while the caller holds its reference.
+ *
+ * @return the delta, or NULL if a keyframe should be sent instead (the delta
+ * would be no smaller, all slots hold deltas from other broadcasts, or no
+ * memory within the budget)
+ */
+static const struct ws_ctube_delta *ws_ctube_data_get_delta(struct ws_ctube_data *ws_ctube_data, const struct ws_ctube_data *base, unsigned long base_id, size_t size, struct ws_ctube_encoder *encoder)
+{
+	struct ws_ctube_delta *delta = NULL;
+	struct ws_ctube_delta *slot;
+	struct _ws_ctube_chunked_job cj;
+
+	pthread_mutex_lock(&ws_ctube_data->mutex);
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		slot = &ws_ctube_data->delta[i];
+		if (slot->base_id == base_id) {
+			delta = slot;
 			goto out;
 		}
+		if (slot->base_id == 0 && delta == NULL) {
+			delta = slot;
+		}
+	}
+	if (delta == NULL) {
+		goto out;
+	}
 
-		ws_ctube_data->data_size = data_size;
+	_ws_ctube_chunked_job_init(&cj, (const char *)base->data, (const char *)ws_ctube_data->data, size);
+	if (_ws_ctube_data_grow_encoding(ws_ctube_data, &delta->buf, &delta->capacity, _ws_ctube_chunked_capacity(&cj)) != 0) {
+		delta = NULL;
+		goto out;
 	}
 
-	memcpy(ws_ctube_data->data, data, data_size);
+	cj.out = delta->buf;
+	ws_ctube_encoder_run(encoder, &cj.job, _ws_ctube_delta_chunk, cj.job.nchunk);
+	delta->base_id = base_id;
+	delta->size = _ws_ctube_chunked_pack(&cj);
+	if (delta->size != (size_t)-1 && delta->size >= size) {
+		/* no smaller than a keyframe */
+		delta->size = (size_t)-1;
+	}
 
 out:
 	pthread_mutex_unlock(&ws_ctube_data->mutex);
-	return retval;
+	return delta != NULL && delta->size != (size_t)-1 ? delta : NULL;
 }
 
-static void ws_ctube_data_free(struct ws_ctube_data *ws_ctube_data)
+/**
+ * the first size bytes of ws_ctube_data in encoding, made by the first caller
+ * (in chunks shared with encoder's workers, if encoder is not NULL) and shared
+ * with later ones. Stays valid while the caller holds its reference.
+ *
+ * For WS_CTUBE_ENCODING_DEFLATE, this is the message to send with
+ * permessage-deflate: the WS_CTUBE_DEFLATE_TAIL bytes it leaves out still
+ * follow it in buf.
+ *
+ * @return the encoded data, or NULL if the data should be sent as is
+ * (encoding does not make it smaller, encoding is made per client, or no
+ * memory within the budget)
+ */
+static const struct ws_ctube_encoded *ws_ctube_data_get_encoded(struct ws_ctube_data *ws_ctube_data, enum ws_ctube_encoding encoding, size_t size, struct ws_ctube_encoder *encoder)
 {
-	ws_ctube_data_destroy(ws_ctube_data);
-	free(ws_ctube_data);
+	struct ws_ctube_encoded *encoded = &ws_ctube_data->encoded[encoding];
+	struct _ws_ctube_chunked_job cj;
+	ws_ctube_encode_fn encode;
+
+	pthread_mutex_lock(&ws_ctube_data->mutex);
+	if (encoded->state != 0) {
+		goto out;
+	}
+
+	encoded->state = -1;
+	if (size == 0) {
+		goto out;
+	}
+
+	_ws_ctube_chunked_job_init(&cj, NULL, (const char *)ws_ctube_data->data, size);
+	switch (encoding) {
+	case WS_CTUBE_ENCODING_DEFLATE:
+		cj.region_size = WS_CTUBE_DEFLATE_BOUND(cj.chunk_size);
+		encode = _ws_ctube_deflate_chunk;
+		break;
+	default:
+		goto out;
+	}
+
+	if (_ws_ctube_data_grow_encoding(ws_ctube_data, &encoded->buf, &encoded->capacity, _ws_ctube_chunked_capacity(&cj)) != 0) {
+		goto out;
+	}
+
+	cj.out = encoded->buf;
+	ws_ctube_encoder_run(encoder, &cj.job, encode, cj.job.nchunk);
+	encoded->size = _ws_ctube_chunked_pack(&cj);
+	if (encoded->size == (size_t)-1) {
+		goto out;
+	}
+
+	if (encoding == WS_CTUBE_ENCODING_DEFLATE) {
+		/* the tail of the last chunk is not sent */
+		encoded->size -= WS_CTUBE_DEFLATE_TAIL;
+	}
+	if (encoded->size < size) {
+		encoded->state = 1;
+	}
+
+out:
+	pthread_mutex_unlock(&ws_ctube_data->mutex);
+	return encoded->state == 1 ? encoded : NULL;
+}
+
+/** allocate a new ws_ctube_data with a buffer of size class k for pool */
+static struct ws_ctube_data *_ws_ctube_data_pool_alloc(struct ws_ctube_data_pool *pool, int k)
+{
+	const size_t size = ws_ctube_data_pool_class_size(k);
+	const int huge = pool->huge_threshold > 0 && size >= pool->huge_threshold;
+
+	struct ws_ctube_data *data = ws_ctube_data_alloc(pool->mem);
+	if (data == NULL) {
+		goto out_noalloc;
+	}
+	if (ws_ctube_data_init(data, pool->mem, NULL, 0) != 0) {
+		goto out_noinit;
+	}
+	if (size > 0 && _ws_ctube_data_alloc_buf(data, size, huge) != 0) {
+		goto out_nobuf;
+	}
+
+	data->pool = pool;
+	return data;
+
+out_nobuf:
+	ws_ctube_data_destroy(data);
+out_noinit:
+	ws_ctube_mem_free(&pool->mem->ctrl, data, sizeof(*data), __alignof__(*data));
+out_noalloc:
+	return NULL;
+}
+
+/**
+ * get an unreferenced ws_ctube_data able to hold data_size bytes from pool,
+ * allocating a new one if none are available. With data_size 0, a bufferless
+ * descriptor is returned.
+ *
+ * @param reserved whether ws_ctube_data_pool_reserve() already accounted for
+ * the ws_ctube_data_pool_capacity(data_size) bytes of buffer (given back if
+ * this fails)
+ *
+ * @return ws_ctube_data with ref count 0 and data_size set or NULL on failure
+ */
+static struct ws_ctube_data *ws_ctube_data_pool_get(struct ws_ctube_data_pool *pool, size_t data_size, int reserved)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+	const int k = ws_ctube_data_pool_class(data_size);
+	size_t encoding_bytes = 0;
+
+	if (ws_ctube_unlikely(k >= WS_CTUBE_DATA_POOL_NCLASS)) {
+		/* too big to pool */
+		data = ws_ctube_data_alloc(pool->mem);
+		if (data == NULL) {
+			goto out_noalloc;
+		}
+		if (ws_ctube_data_init(data, pool->mem, NULL, data_size) != 0) {
+			ws_ctube_mem_free(&pool->mem->ctrl, data, sizeof(*data), __alignof__(*data));
+			goto out_noalloc;
+		}
+		/* accounted for, but freed instead of kept when recycled */
+		data->pool = pool;
+		if (!reserved) {
+			_ws_ctube_data_pool_take(pool, data->data_capacity);
+		}
+		return data;
+	}
+
+	node = ws_ctube_list_pop_front(&pool->free_list[k]);
+	if (node != NULL) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		encoding_bytes = ws_ctube_data_encoding_bytes(data);
+		__atomic_sub_fetch(&pool->cached, data->data_capacity + encoding_bytes, __ATOMIC_SEQ_CST);
+	} else {
+		data = _ws_ctube_data_pool_alloc(pool, k);
+		if (data == NULL) {
+			goto out_noalloc;
+		}
+	}
+
+	if (!reserved) {
+		_ws_ctube_data_pool_take(pool, data->data_capacity);
+	}
+	/* its encoding buffers are in use again if the budget has room */
+	if (encoding_bytes > 0 && _ws_ctube_data_reserve_encoding(data, encoding_bytes) != 0) {
+		_ws_ctube_data_free_encodings(data);
+	}
+	data->data_size = data_size;
+	data->grid.ndim = 0;
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		data->delta[i].base_id = 0;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		data->encoded[i].state = 0;
+	}
+	return data;
+
+out_noalloc:
+	if (reserved) {
+		ws_ctube_data_pool_unreserve(pool, ws_ctube_data_pool_capacity(data_size));
+	}
+	return NULL;
+}
+
+/**
+ * allocate and prefault count buffers able to hold data_size bytes so that
+ * the first broadcasts do not pay for allocation and page faults
+ */
+static int ws_ctube_data_pool_prealloc(struct ws_ctube_data_pool *pool, size_t data_size, int count)
+{
+	struct ws_ctube_data *data;
+	const int k = ws_ctube_data_pool_class(data_size);
+
+	if (k >= WS_CTUBE_DATA_POOL_NCLASS) {
+		return -1;
+	}
+
+	for (int i = 0; i < count && pool->free_list[k].len < pool->max_len; i++) {
+		data = _ws_ctube_data_pool_alloc(pool, k);
+		if (data == NULL) {
+			return -1;
+		}
+		memset(data->data, 0, data->data_capacity);
+		__atomic_add_fetch(&pool->cached, data->data_capacity, __ATOMIC_SEQ_CST);
+		ws_ctube_list_push_back(&pool->free_list[k], &data->lnode);
+	}
+	return 0;
+}
+
+/**
+ * keep unborrowed ws_ctube_data in pool for reuse if there is room (within
+ * max_len and the budget)
+ *
+ * @return 1 if kept, 0 otherwise
+ */
+static int _ws_ctube_data_pool_keep(struct ws_ctube_data_pool *pool, struct ws_ctube_data *ws_ctube_data)
+{
+	const int k = ws_ctube_data_pool_class(ws_ctube_data->data_capacity);
+	const size_t capacity = ws_ctube_data->data_capacity + ws_ctube_data_encoding_bytes(ws_ctube_data);
+	struct ws_ctube_list *free_list;
+	int keep;
+
+	if (k >= WS_CTUBE_DATA_POOL_NCLASS) {
+		return 0;
+	}
+
+	free_list = &pool->free_list[k];
+	pthread_mutex_lock(&free_list->mutex);
+	keep = free_list->len < pool->max_len;
+	pthread_mutex_unlock(&free_list->mutex);
+
+	/* do not keep memory that the budget needs for in-flight data */
+	if (keep && pool->budget > 0 && __atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST) + __atomic_load_n(&pool->cached, __ATOMIC_SEQ_CST) > pool->budget) {
+		keep = 0;
+	}
+	if (!keep) {
+		return 0;
+	}
+
+	__atomic_add_fetch(&pool->cached, capacity, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&pool->in_use, capacity, __ATOMIC_SEQ_CST);
+	ws_ctube_list_push_back(free_list, &ws_ctube_data->lnode);
+
+	if (capacity > 0) {
+		_ws_ctube_data_pool_notify(pool);
+	}
+	return 1;
+}
+
+/** runs on the reclaimer thread: give back caller memory, then keep or free */
+static void _ws_ctube_data_reclaim(struct ws_ctube_reclaim_node *node)
+{
+	struct ws_ctube_data *ws_ctube_data = ws_ctube_container_of(node, typeof(*ws_ctube_data), rnode);
+	struct ws_ctube_data_pool *pool = ws_ctube_data->pool;
+
+	if (_ws_ctube_data_unborrow(ws_ctube_data) && _ws_ctube_data_pool_keep(pool, ws_ctube_data)) {
+		return;
+	}
+
+	const size_t capacity = ws_ctube_data->data_capacity + ws_ctube_data_encoding_bytes(ws_ctube_data);
+	ws_ctube_data_free(ws_ctube_data);
+	ws_ctube_data_pool_unreserve(pool, capacity);
+}
+
+/**
+ * release routine for ws_ctube_data: return to its pool if there is room.
+ * Anything expensive (freeing buffers, giving back caller memory) is deferred
+ * to the pool's reclaimer thread, so this is cheap for the releasing thread.
+ */
+static void ws_ctube_data_recycle(struct ws_ctube_data *ws_ctube_data)
+{
+	struct ws_ctube_data_pool *pool = ws_ctube_data->pool;
+
+	if (pool == NULL) {
+		ws_ctube_data_free(ws_ctube_data);
+		return;
+	}
+
+	if (ws_ctube_data->live == NULL && ws_ctube_data->release_fn == NULL && _ws_ctube_data_pool_keep(pool, ws_ctube_data)) {
+		return;
+	}
+
+	ws_ctube_reclaimer_push(pool->reclaimer, &ws_ctube_data->rnode, _ws_ctube_data_reclaim);
+}
+
+/** the caller must already hold a reference (or the lock it is published under) */
+static inline void ws_ctube_data_acquire(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_acquire(ws_ctube_data, refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	ws_ctube_ref_count_acquire(ws_ctube_data, refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** recycles ws_ctube_data when the last reference is released */
+static inline void ws_ctube_data_release(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_release(ws_ctube_data, refc, ws_ctube_data_recycle);
+#else /* WS_CTUBE_SHARDED_REFC */
+	ws_ctube_ref_count_release(ws_ctube_data, refc, ws_ctube_data_recycle);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** number of references: only exact while it is not the current out_data */
+static inline long ws_ctube_data_refs(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	return ws_ctube_sharded_ref_count_load(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	return ws_ctube_ref_count_load(&ws_ctube_data->refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/**
+ * called under out_data_mutex when ws_ctube_data becomes (share) or stops
+ * being (unshare) the current out_data that every writer acquires
+ */
+static inline void ws_ctube_data_share(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_share(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	(void)ws_ctube_data;
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+static inline void ws_ctube_data_unshare(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_unshare(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	(void)ws_ctube_data;
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** max bytes of a channel name, including the terminating null */
+#define WS_CTUBE_CHANNEL_NAME_LEN 64
+
+/**
+ * a named stream with its own latest-data slot: clients whose request path
+ * is /<name> are sent what is published to it and only wake for it
+ */
+struct ws_ctube_channel {
+	struct ws_ctube *ctube;
+	char name[WS_CTUBE_CHANNEL_NAME_LEN];
+	/* in ctube->channel_list (unused for the default channel) */
+	struct ws_ctube_list_node lnode;
+
+	/* written by the producer on each publish, read by the writers of the
+	 * channel's clients */
+
+	/* current ws_ctube_data representing data to be sent */
+	struct ws_ctube_data *out_data ws_ctube_cache_aligned;
+	/* unique among all channels of the ctube, 0 before the first publish */
+	unsigned long out_data_id;
+	pthread_mutex_t out_data_mutex;
+	pthread_cond_t out_data_cond;
+
+	/* called for each client that connects, see
+	 * ws_ctube_channel_set_snapshot(); snapshot_size is the size of the
+	 * last snapshot, to try first. All three under out_data_mutex */
+	ws_ctube_snapshot_fn snapshot_fn;
+	void *snapshot_user;
+	size_t snapshot_size;
+
+	/* producer only: time of previous broadcast for rate-limiting */
+	struct timespec prev_bcast_time ws_ctube_cache_aligned;
+};
+
+static int ws_ctube_channel_init(struct ws_ctube_channel *channel, struct ws_ctube *ctube, const char *name)
+{
+	if (strlen(name) >= sizeof(channel->name)) {
+		return -1;
+	}
+
+	channel->ctube = ctube;
+	strcpy(channel->name, name);
+	ws_ctube_list_node_init(&channel->lnode);
+
+	channel->out_data = NULL;
+	channel->out_data_id = 0;
+	pthread_mutex_init(&channel->out_data_mutex, NULL);
+	pthread_cond_init(&channel->out_data_cond, NULL);
+
+	channel->snapshot_fn = NULL;
+	channel->snapshot_user = NULL;
+	channel->snapshot_size = 0;
+
+	channel->prev_bcast_time.tv_sec = 0;
+	channel->prev_bcast_time.tv_nsec = 0;
+	return 0;
 }
 
-/** represents a client connection and owns their associated reader/writer threads */
+static void ws_ctube_channel_destroy(struct ws_ctube_channel *channel)
+{
+	if (channel->out_data != NULL) {
+		ws_ctube_data_unshare(channel->out_data);
+		ws_ctube_data_release(channel->out_data);
+		channel->out_data = NULL;
+	}
+	channel->out_data_id = 0;
+	pthread_mutex_destroy(&channel->out_data_mutex);
+	pthread_cond_destroy(&channel->out_data_cond);
+
+	channel->snapshot_fn = NULL;
+	channel->snapshot_user = NULL;
+	channel->snapshot_size = 0;
+
+	channel->ctube = NULL;
+	channel->name[0] = '\0';
+	ws_ctube_list_node_destroy(&channel->lnode);
+}
+
+/**
+ * part of grids that a client wants instead of the whole grid: elements with
+ * lo[i] <= index < hi[i] along each of the first ndim axes (later axes whole),
+ * or no box if ndim is 0, from a downsampled level (level, or the finest
+ * level at which the box has at most fit elements along every axis if fit is
+ * not 0). Box indices are of the full grid
+ */
+struct ws_ctube_roi {
+	int ndim;
+	size_t lo[WS_CTUBE_GRID_MAXDIM];
+	size_t hi[WS_CTUBE_GRID_MAXDIM];
+	int level;
+	size_t fit;
+};
+
+/**
+ * represents a client connection and owns their associated reader/writer
+ * threads; allocated from ctube->conn_slab
+ */
 struct ws_ctube_conn_struct {
 	int fd;
 	struct ws_ctube *ctube;
 
+	/* subscription, chosen from the request path and changed by control
+	 * messages from the client: the writer only waits on channel while
+	 * subscribed (not NULL) and not paused. Changed under sub_mutex,
+	 * bumping sub_gen so that a waiting writer notices */
+	struct ws_ctube_channel *channel;
+	int paused;
+	/* box of grids to send, also under sub_mutex */
+	struct ws_ctube_roi roi;
+	/* what the client is sent, chosen in the handshake */
+	enum ws_ctube_encoding encoding;
+	/* whether permessage-deflate was negotiated in the handshake */
+	int deflate;
+	unsigned long sub_gen;
+	pthread_mutex_t sub_mutex;
+	pthread_cond_t sub_cond;
+
 	/* to prevent double shutdown */
 	int stopping;
-	pthread_mutex_t stopping_mutex;
+	/* threads are stopped by the reclaimer after the client disconnects */
+	struct ws_ctube_reclaim_node rnode;
+
+	/* writer only: the last frame the client was sent in delta mode (a
+	 * reference, or NULL), its id and frames sent since a keyframe */
+	struct ws_ctube_data *delta_base;
+	unsigned long delta_base_id;
+	int delta_nframe;
+
+	/* snapshot of the channel taken for the client when it connected
+	 * (a reference, or NULL), until the writer sends it first; its own
+	 * id and the out_data_id of the last publish it includes */
+	struct ws_ctube_data *snapshot;
+	unsigned long snapshot_id;
+	unsigned long snapshot_out_data_id;
+
+	/* out_data_id and pooled buffer bytes of the broadcast being sent by
+	 * the writer (0 if idle); read by the producer to find laggards */
+	unsigned long sending_id;
+	size_t sending_bytes;
+	/* set once the connection is dropped to meet the memory budget */
+	int dropped;
 
 	/** reader thread */
 	pthread_t reader_tid;
@@ -111,7 +1327,6 @@ struct ws_ctube_conn_struct {
 	pthread_t writer_tid;
 
 	struct ws_ctube_ref_count refc;
-	struct ws_ctube_list_node lnode;
 };
 
 static int ws_ctube_conn_struct_init(struct ws_ctube_conn_struct *conn, int fd, struct ws_ctube *ctube)
@@ -119,11 +1334,30 @@ static int ws_ctube_conn_struct_init(struct ws_ctube_conn_struct *conn, int fd,
 	conn->fd = fd;
 	conn->ctube = ctube;
 
+	conn->channel = NULL;
+	conn->paused = 0;
+	conn->roi.ndim = 0;
+	conn->roi.level = 0;
+	conn->roi.fit = 0;
+	conn->encoding = WS_CTUBE_ENCODING_RAW;
+	conn->deflate = 0;
+	conn->sub_gen = 0;
+
 	conn->stopping = 0;
-	pthread_mutex_init(&conn->stopping_mutex, NULL);
+
+	conn->delta_base = NULL;
+	conn->delta_base_id = 0;
+	conn->delta_nframe = 0;
+
+	conn->snapshot = NULL;
+	conn->snapshot_id = 0;
+	conn->snapshot_out_data_id = 0;
+
+	conn->sending_id = 0;
+	conn->sending_bytes = 0;
+	conn->dropped = 0;
 
 	ws_ctube_ref_count_init(&conn->refc);
-	ws_ctube_list_node_init(&conn->lnode);
 	return 0;
 }
 
@@ -137,17 +1371,43 @@ static void ws_ctube_conn_struct_destroy(struct ws_ctube_conn_struct *conn)
 	conn->fd = -1;
 	conn->ctube = NULL;
 
+	conn->channel = NULL;
+	conn->paused = 0;
+	conn->roi.ndim = 0;
+	conn->encoding = WS_CTUBE_ENCODING_RAW;
+	conn->deflate = 0;
+	conn->sub_gen = 0;
+
 	conn->stopping = 0;
-	pthread_mutex_destroy(&conn->stopping_mutex);
 
 	ws_ctube_ref_count_destroy(&conn->refc);
-	ws_ctube_list_node_destroy(&conn->lnode);
+}
+
+/** set up once per conn_slab slot: kept while the slot is reused */
+static void ws_ctube_conn_struct_slot_init(void *obj)
+{
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)obj;
+	pthread_mutex_init(&conn->sub_mutex, NULL);
+	pthread_cond_init(&conn->sub_cond, NULL);
+}
+
+static void ws_ctube_conn_struct_slot_destroy(void *obj)
+{
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)obj;
+	pthread_mutex_destroy(&conn->sub_mutex);
+	pthread_cond_destroy(&conn->sub_cond);
 }
 
 static void ws_ctube_conn_struct_free(struct ws_ctube_conn_struct *conn)
 {
 	ws_ctube_conn_struct_destroy(conn);
-	free(conn);
+	ws_ctube_slab_free(conn);
+}
+
+/** @return nonzero if conn was already stopping (prevents double stop) */
+static inline int ws_ctube_conn_struct_set_stopping(struct ws_ctube_conn_struct *conn)
+{
+	return __atomic_exchange_n(&conn->stopping, (int)1, __ATOMIC_SEQ_CST);
 }
 
 enum ws_ctube_qaction {
@@ -155,11 +1415,14 @@ enum ws_ctube_qaction {
 	WS_CTUBE_CONN_STOP
 };
 
-/** a work item in FIFO queue: start or stop a connection to client */
+/**
+ * a work item in FIFO queue: start or stop a connection to client; allocated
+ * from ctube->qentry_slab
+ */
 struct ws_ctube_conn_qentry {
 	struct ws_ctube_conn_struct *conn;
 	enum ws_ctube_qaction act;
-	struct ws_ctube_list_node lnode;
+	struct ws_ctube_mpsc_node qnode;
 };
 
 static int ws_ctube_conn_qentry_init(struct ws_ctube_conn_qentry *qentry, struct ws_ctube_conn_struct *conn, enum ws_ctube_qaction act)
@@ -167,7 +1430,7 @@ static int ws_ctube_conn_qentry_init(struct ws_ctube_conn_qentry *qentry, struct
 	ws_ctube_ref_count_acquire(conn, refc);
 	qentry->conn = conn;
 	qentry->act = act;
-	ws_ctube_list_node_init(&qentry->lnode);
+	qentry->qnode.next = NULL;
 	return 0;
 }
 
@@ -175,17 +1438,86 @@ static void ws_ctube_conn_qentry_destroy(struct ws_ctube_conn_qentry *qentry)
 {
 	ws_ctube_ref_count_release(qentry->conn, refc, ws_ctube_conn_struct_free);
 	qentry->conn = NULL;
-	ws_ctube_list_node_destroy(&qentry->lnode);
+	qentry->qnode.next = NULL;
 }
 
 static void ws_ctube_conn_qentry_free(struct ws_ctube_conn_qentry *qentry)
 {
 	ws_ctube_conn_qentry_destroy(qentry);
-	free(qentry);
+	ws_ctube_slab_free(qentry);
+}
+
+/**
+ * connected clients indexed by the slab slot of their conn_struct; only
+ * modified by the connection handler thread, which holds mutex while doing so.
+ * Other threads must hold mutex to read conns.
+ */
+struct ws_ctube_conn_table {
+	struct ws_ctube_conn_struct **conns;
+	int capacity;
+	/** number of connected clients */
+	int len;
+	pthread_mutex_t mutex;
+
+	/* conns is allocated from this */
+	const struct ws_ctube_allocator *allocator;
+};
+
+static int ws_ctube_conn_table_init(struct ws_ctube_conn_table *table, int capacity, const struct ws_ctube_allocator *allocator)
+{
+	table->conns = (typeof(table->conns))ws_ctube_mem_alloc(allocator, capacity * sizeof(*table->conns), __alignof__(*table->conns));
+	if (table->conns == NULL) {
+		return -1;
+	}
+	memset(table->conns, 0, capacity * sizeof(*table->conns));
+	table->capacity = capacity;
+	table->allocator = allocator;
+	table->len = 0;
+	pthread_mutex_init(&table->mutex, NULL);
+	return 0;
+}
+
+static void ws_ctube_conn_table_destroy(struct ws_ctube_conn_table *table)
+{
+	ws_ctube_mem_free(table->allocator, table->conns, table->capacity * sizeof(*table->conns), __alignof__(*table->conns));
+	table->conns = NULL;
+	table->capacity = 0;
+	table->len = 0;
+	table->allocator = NULL;
+	pthread_mutex_destroy(&table->mutex);
+}
+
+static void ws_ctube_conn_table_add(struct ws_ctube_conn_table *table, struct ws_ctube_conn_struct *conn)
+{
+	ws_ctube_ref_count_acquire(conn, refc);
+	pthread_mutex_lock(&table->mutex);
+	table->conns[ws_ctube_slab_slot(conn)] = conn;
+	table->len++;
+	pthread_mutex_unlock(&table->mutex);
+}
+
+/** @return conn if it was in table (its reference must then be released) */
+static struct ws_ctube_conn_struct *ws_ctube_conn_table_remove(struct ws_ctube_conn_table *table, int slot)
+{
+	struct ws_ctube_conn_struct *conn;
+
+	pthread_mutex_lock(&table->mutex);
+	conn = table->conns[slot];
+	if (conn != NULL) {
+		table->conns[slot] = NULL;
+		table->len--;
+	}
+	pthread_mutex_unlock(&table->mutex);
+	return conn;
 }
 
 /** main struct for ws_ctube */
 struct ws_ctube {
+	/* read-mostly: set up by ws_ctube_init() */
+
+	/* allocators from opts: the ctube itself is allocated from mem.ctrl */
+	struct ws_ctube_mem mem;
+
 	int server_sock;
 	int port;
 	int max_nclient;
@@ -194,29 +1526,86 @@ struct ws_ctube {
 	struct timespec timeout_spec;
 	struct timeval timeout_val;
 
-	/* currently unused (for incoming data) */
-	struct ws_ctube_list in_data_list;
-	int in_data_pred;
-	pthread_mutex_t in_data_mutex;
-	pthread_cond_t in_data_cond;
-
-	/* current ws_ctube_data representing data to be sent */
-	struct ws_ctube_data *out_data;
-	unsigned long out_data_id;
-	pthread_mutex_t out_data_mutex;
-	pthread_cond_t out_data_cond;
+	/* what to do when a buffer would exceed data_pool.budget */
+	enum ws_ctube_budget_policy budget_policy;
 
-	/* rate-limit broadcasting */
+	/* rate-limit broadcasting (per channel) */
 	double max_bcast_fps;
-	struct timespec prev_bcast_time;
+
+	/* number of encoder workers to start */
+	int encode_threads;
+
+	/* default channel: ws_ctube_broadcast() etc. publish to it and it is
+	 * sent to clients whose request path names no open channel */
+	struct ws_ctube_channel channel;
+	/* channels from ws_ctube_channel_open(), protected by the list mutex */
+	struct ws_ctube_list channel_list;
+	/* source of channel out_data_id */
+	unsigned long out_data_seq;
+
+	/* producer only */
+
+	/* reserved but not yet committed ws_ctube_data */
+	struct ws_ctube_data *reserved_data ws_ctube_cache_aligned;
+	/* ws_ctube_data broadcast from live memory that writers may still be
+	 * sending */
+	struct ws_ctube_list live_list;
+
+	/* recycled ws_ctube_data for ws_ctube_reserve()/ws_ctube_commit():
+	 * taken by the producer and given back by writers (its hot members
+	 * are in their own cache lines) */
+	struct ws_ctube_data_pool data_pool;
+
+	/* broadcasts refused and connections dropped because of the budget */
+	unsigned long nbudget_rejected ws_ctube_cache_aligned;
+	unsigned long nbudget_dropped;
+	/* pooled bytes of every channel's out_data and of reserved_data:
+	 * memory the producers hold on to while waiting for the budget */
+	size_t pinned_bytes;
+	/* records ws_ctube_replay() could not broadcast */
+	unsigned long nreplay_skipped;
 
 	/* the FIFO work queue: connection handler starts/stops client
-	 * connections based on queued actions */
-	struct ws_ctube_list connq;
-	int connq_pred;
+	 * connections based on queued actions; pushed to lock-free by the
+	 * server and reader threads, connq_pred is set to wake the handler */
+	struct ws_ctube_mpsc_queue connq;
+	int connq_pred ws_ctube_cache_aligned;
 	pthread_mutex_t connq_mutex;
 	pthread_cond_t connq_cond;
 
+	/* conn_structs and qentries come from fixed-capacity slabs so that
+	 * connection churn does not touch the allocator; allocated by the
+	 * server and reader threads, freed by the handler and reclaimer */
+	struct ws_ctube_slab conn_slab ws_ctube_cache_aligned;
+	struct ws_ctube_slab qentry_slab ws_ctube_cache_aligned;
+	/* connection handler only (and budget drops) */
+	struct ws_ctube_conn_table conn_table ws_ctube_cache_aligned;
+
+	/* frees data and stops disconnected clients off the hot paths */
+	struct ws_ctube_reclaimer reclaimer;
+
+	/* appends every broadcast to the log at record_path, if not NULL */
+	struct ws_ctube_recorder recorder;
+	const char *record_path;
+	size_t record_segment_size;
+	size_t record_backlog;
+
+	/* writes every broadcast to the ring at shm_path, if not NULL */
+	struct ws_ctube_shm shm;
+	const char *shm_path;
+	size_t shm_size;
+
+	/* helps writers encode large broadcasts (deltas, compression) */
+	struct ws_ctube_encoder encoder;
+
+	/* cold */
+
+	/* currently unused (for incoming data) */
+	struct ws_ctube_list in_data_list ws_ctube_cache_aligned;
+	int in_data_pred;
+	pthread_mutex_t in_data_mutex;
+	pthread_cond_t in_data_cond;
+
 	/* allows ws_ctube_open() to know if server successfully started or not */
 	int server_inited;
 	pthread_mutex_t server_init_mutex;
@@ -228,15 +1617,16 @@ struct ws_ctube {
 	pthread_t server_tid;
 };
 
-static int ws_ctube_init(
-	struct ws_ctube *ctube,
-	int port,
-	int max_nclient,
-	unsigned int timeout_ms,
-	double max_broadcast_fps)
+static int ws_ctube_init(struct ws_ctube *ctube, const struct ws_ctube_opts *opts)
 {
+	const int max_nclient = opts->max_nclient;
+	const unsigned int timeout_ms = opts->timeout_ms;
+
+	ctube->mem.ctrl = opts->ctrl_alloc;
+	ctube->mem.payload = opts->payload_alloc;
+
 	ctube->server_sock = -1;
-	ctube->port = port;
+	ctube->port = opts->port;
 	ctube->max_nclient = max_nclient;
 
 	ctube->timeout_spec.tv_sec = timeout_ms / 1000;
@@ -249,16 +1639,47 @@ static int ws_ctube_init(
 	pthread_mutex_init(&ctube->in_data_mutex, NULL);
 	pthread_cond_init(&ctube->in_data_cond, NULL);
 
-	ctube->out_data = NULL;
-	ctube->out_data_id = 0;
-	pthread_mutex_init(&ctube->out_data_mutex, NULL);
-	pthread_cond_init(&ctube->out_data_cond, NULL);
-
-	ctube->max_bcast_fps = max_broadcast_fps;
-	ctube->prev_bcast_time.tv_sec = 0;
-	ctube->prev_bcast_time.tv_nsec = 0;
+	ws_ctube_channel_init(&ctube->channel, ctube, "");
+	ws_ctube_list_init(&ctube->channel_list);
+	ctube->out_data_seq = 0;
+
+	ws_ctube_reclaimer_init(&ctube->reclaimer);
+	ws_ctube_recorder_init(&ctube->recorder);
+	ctube->record_path = opts->record_path;
+	ctube->record_segment_size = opts->record_segment_size;
+	ctube->record_backlog = opts->record_backlog;
+	ws_ctube_shm_init(&ctube->shm);
+	ctube->shm_path = opts->shm_path;
+	ctube->shm_size = opts->shm_size;
+	ws_ctube_data_pool_init(&ctube->data_pool, &ctube->mem, &ctube->reclaimer, max_nclient + WS_CTUBE_DATA_POOL_LEN, opts->hugepage_threshold, opts->mem_budget);
+	ctube->reserved_data = NULL;
+	ws_ctube_list_init(&ctube->live_list);
+
+	ctube->budget_policy = opts->budget_policy;
+	ctube->nbudget_rejected = 0;
+	ctube->nbudget_dropped = 0;
+	ctube->pinned_bytes = 0;
+	ctube->nreplay_skipped = 0;
+
+	ctube->max_bcast_fps = opts->max_broadcast_fps;
+
+	ctube->encode_threads = opts->encode_threads;
+	ws_ctube_encoder_init(&ctube->encoder);
+
+	/* room for connected clients plus as many connecting/disconnecting
+	 * ones; at most one start and one stop qentry per conn_struct */
+	if (ws_ctube_slab_init(&ctube->conn_slab, sizeof(struct ws_ctube_conn_struct), WS_CTUBE_CONN_SLAB_FACTOR * max_nclient, &ctube->mem.ctrl,
+				ws_ctube_conn_struct_slot_init, ws_ctube_conn_struct_slot_destroy) != 0) {
+		goto out_noconnslab;
+	}
+	if (ws_ctube_slab_init(&ctube->qentry_slab, sizeof(struct ws_ctube_conn_qentry), 2 * WS_CTUBE_CONN_SLAB_FACTOR * max_nclient, &ctube->mem.ctrl, NULL, NULL) != 0) {
+		goto out_noqentryslab;
+	}
+	if (ws_ctube_conn_table_init(&ctube->conn_table, WS_CTUBE_CONN_SLAB_FACTOR * max_nclient, &ctube->mem.ctrl) != 0) {
+		goto out_noconntable;
+	}
 
-	ws_ctube_list_init(&ctube->connq);
+	ws_ctube_mpsc_queue_init(&ctube->connq);
 	ctube->connq_pred = 0;
 	pthread_mutex_init(&ctube->connq_mutex, NULL);
 	pthread_cond_init(&ctube->connq_cond, NULL);
@@ -267,7 +1688,31 @@ static int ws_ctube_init(
 	pthread_mutex_init(&ctube->server_init_mutex, NULL);
 	pthread_cond_init(&ctube->server_init_cond, NULL);
 
+	/* prefault buffers for the expected broadcast size */
+	if (opts->prealloc_size > 0 && ws_ctube_data_pool_prealloc(&ctube->data_pool, opts->prealloc_size, opts->prealloc_count) != 0) {
+		fprintf(stderr, "ws_ctube_init(): warning: prealloc failed\n");
+		fflush(stderr);
+	}
+
 	return 0;
+
+out_noconntable:
+	ws_ctube_slab_destroy(&ctube->qentry_slab);
+out_noqentryslab:
+	ws_ctube_slab_destroy(&ctube->conn_slab);
+out_noconnslab:
+	ws_ctube_encoder_destroy(&ctube->encoder);
+	ws_ctube_list_destroy(&ctube->live_list);
+	ws_ctube_data_pool_destroy(&ctube->data_pool);
+	ws_ctube_shm_destroy(&ctube->shm);
+	ws_ctube_recorder_destroy(&ctube->recorder);
+	ws_ctube_reclaimer_destroy(&ctube->reclaimer);
+	ws_ctube_list_destroy(&ctube->channel_list);
+	ws_ctube_channel_destroy(&ctube->channel);
+	ws_ctube_list_destroy(&ctube->in_data_list);
+	pthread_mutex_destroy(&ctube->in_data_mutex);
+	pthread_cond_destroy(&ctube->in_data_cond);
+	return -1;
 }
 
 static void _ws_ctube_data_list_clear(struct ws_ctube_list *dlist)
@@ -281,13 +1726,36 @@ static void _ws_ctube_data_list_clear(struct ws_ctube_list *dlist)
 	}
 }
 
-static void _ws_ctube_connq_clear(struct ws_ctube_list *connq)
+static void _ws_ctube_live_list_clear(struct ws_ctube_list *live_list)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+
+	while ((node = ws_ctube_list_pop_front(live_list)) != NULL) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		ws_ctube_data_release(data);
+	}
+}
+
+static void _ws_ctube_channel_list_clear(struct ws_ctube *ctube)
 {
 	struct ws_ctube_list_node *node;
+	struct ws_ctube_channel *channel;
+
+	while ((node = ws_ctube_list_pop_front(&ctube->channel_list)) != NULL) {
+		channel = ws_ctube_container_of(node, typeof(*channel), lnode);
+		ws_ctube_channel_destroy(channel);
+		ws_ctube_mem_free(&ctube->mem.ctrl, channel, sizeof(*channel), __alignof__(*channel));
+	}
+}
+
+static void _ws_ctube_connq_clear(struct ws_ctube_mpsc_queue *connq)
+{
+	struct ws_ctube_mpsc_node *node;
 	struct ws_ctube_conn_qentry *qentry;
 
-	while ((node = ws_ctube_list_pop_front(connq)) != NULL) {
-		qentry = ws_ctube_container_of(node, typeof(*qentry), lnode);
+	while ((node = ws_ctube_mpsc_queue_pop(connq)) != NULL) {
+		qentry = ws_ctube_container_of(node, typeof(*qentry), qnode);
 		ws_ctube_conn_qentry_free(qentry);
 	}
 }
@@ -309,24 +1777,46 @@ static void ws_ctube_destroy(struct ws_ctube *ctube)
 	pthread_mutex_destroy(&ctube->in_data_mutex);
 	pthread_cond_destroy(&ctube->in_data_cond);
 
-	if (ctube->out_data != NULL) {
-		ws_ctube_ref_count_release(ctube->out_data, refc, ws_ctube_data_free);
-		ctube->out_data = NULL;
+	/* their out_data go back to the pool */
+	_ws_ctube_channel_list_clear(ctube);
+	ws_ctube_list_destroy(&ctube->channel_list);
+	ws_ctube_channel_destroy(&ctube->channel);
+	ctube->out_data_seq = 0;
+
+	if (ctube->reserved_data != NULL) {
+		ws_ctube_data_recycle(ctube->reserved_data);
+		ctube->reserved_data = NULL;
 	}
-	ctube->out_data_id = 0;
-	pthread_mutex_destroy(&ctube->out_data_mutex);
-	pthread_cond_destroy(&ctube->out_data_cond);
+
+	/* live data go back to the pool too, so clear before destroying it */
+	_ws_ctube_live_list_clear(&ctube->live_list);
+	ws_ctube_list_destroy(&ctube->live_list);
+
+	ws_ctube_data_pool_destroy(&ctube->data_pool);
+	/* stopped by now: nothing is queued */
+	ws_ctube_recorder_destroy(&ctube->recorder);
+	ctube->record_path = NULL;
+	ws_ctube_shm_destroy(&ctube->shm);
+	ctube->shm_path = NULL;
+	ws_ctube_reclaimer_destroy(&ctube->reclaimer);
 
 	ctube->max_bcast_fps = 0;
-	ctube->prev_bcast_time.tv_sec = 0;
-	ctube->prev_bcast_time.tv_nsec = 0;
+	ctube->pinned_bytes = 0;
+
+	ctube->encode_threads = 0;
+	ws_ctube_encoder_destroy(&ctube->encoder);
 
 	_ws_ctube_connq_clear(&ctube->connq);
-	ws_ctube_list_destroy(&ctube->connq);
+	ws_ctube_mpsc_queue_destroy(&ctube->connq);
 	ctube->connq_pred = 0;
 	pthread_mutex_destroy(&ctube->connq_mutex);
 	pthread_cond_destroy(&ctube->connq_cond);
 
+	/* all conn_structs and qentries are back in their slabs by now */
+	ws_ctube_conn_table_destroy(&ctube->conn_table);
+	ws_ctube_slab_destroy(&ctube->qentry_slab);
+	ws_ctube_slab_destroy(&ctube->conn_slab);
+
 	ctube->server_inited = 0;
 	pthread_mutex_destroy(&ctube->server_init_mutex);
 	pthread_cond_destroy(&ctube->server_init_cond);
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief contention on one channel: a producer broadcasting small messages
+ * as fast as it can to nclient local clients
+ *
+ * every broadcast makes each writer take out_data_mutex and acquire and
+ * release the ws_ctube_data, while the producer writes out_data and its id,
+ * so the rates measure how much the threads get in each other's way. Uses
+ * only ws_ctube_open() and ws_ctube_broadcast(), to compare layouts across
+ * versions of ws_ctube.h.
+ *
+ * usage: bench_contention [nclient [seconds [size]]]
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "ws_ctube.h"
+
+#define BENCH_PORT 9790
+
+static volatile int stop;
+
+struct client {
+	pthread_t tid;
+	int fd;
+	unsigned long long nbyte;
+};
+
+static int client_connect(struct client *client)
+{
+	static const char request[] =
+		"GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+		"Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n";
+	struct sockaddr_in addr;
+	char buf[1024];
+	size_t len = 0;
+	ssize_t n;
+
+	client->fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (client->fd < 0 || connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		return -1;
+	}
+	if (write(client->fd, request, sizeof(request) - 1) != (ssize_t)sizeof(request) - 1) {
+		return -1;
+	}
+
+	/* the response ends the handshake */
+	while (len < sizeof(buf) - 1) {
+		n = read(client->fd, buf + len, 1);
+		if (n <= 0) {
+			return -1;
+		}
+		len++;
+		buf[len] = '\0';
+		if (len >= 4 && strcmp(buf + len - 4, "\r\n\r\n") == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void *client_main(void *arg)
+{
+	struct client *client = (struct client *)arg;
+	char buf[1 << 16];
+	ssize_t n;
+
+	while (!stop && (n = read(client->fd, buf, sizeof(buf))) > 0) {
+		client->nbyte += (unsigned long long)n;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	const int nclient = argc > 1 ? atoi(argv[1]) : 4;
+	const double seconds = argc > 2 ? atof(argv[2]) : 3;
+	const size_t size = argc > 3 ? (size_t)atol(argv[3]) : 64;
+	const size_t frame = size + (size < 126 ? 2 : size < 65536 ? 4 : 10);
+	struct ws_ctube *ctube;
+	struct client *clients;
+	unsigned long long nbyte = 0;
+	unsigned long nsent = 0, ntry = 0;
+	char *data;
+	double start, elapsed;
+
+	ctube = ws_ctube_open(BENCH_PORT, nclient, 0, 0);
+	clients = (struct client *)calloc(nclient, sizeof(*clients));
+	data = (char *)calloc(size, 1);
+	if (ctube == NULL || clients == NULL || data == NULL) {
+		fprintf(stderr, "bench_contention: error: cannot start\n");
+		return 1;
+	}
+	for (int i = 0; i < nclient; i++) {
+		if (client_connect(&clients[i]) != 0) {
+			fprintf(stderr, "bench_contention: error: cannot connect\n");
+			return 1;
+		}
+		pthread_create(&clients[i].tid, NULL, client_main, &clients[i]);
+	}
+	/* let every writer start waiting for data */
+	usleep(200000);
+
+	start = now();
+	do {
+		for (int i = 0; i < 256; i++) {
+			memcpy(data, &ntry, size < sizeof(ntry) ? size : sizeof(ntry));
+			ntry++;
+			nsent += ws_ctube_broadcast(ctube, data, size) == 0;
+		}
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+
+	stop = 1;
+	ws_ctube_close(ctube);
+	for (int i = 0; i < nclient; i++) {
+		pthread_join(clients[i].tid, NULL);
+		close(clients[i].fd);
+		nbyte += clients[i].nbyte;
+	}
+
+	printf("clients %d size %zu: broadcasts %.0f/s (%.1f%% of tries), frames received %.0f/s\n",
+	       nclient, size, nsent / elapsed, 100.0 * nsent / ntry, nbyte / frame / elapsed);
+
+	free(data);
+	free(clients);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ws_ctube_inflate() of messages compressed as clients send them
+ *
+ * messages are compressed with ws_ctube_deflate_part() in one or more parts,
+ * and with plain zlib as a browser would, then stripped of the tail and
+ * inflated. Corrupt messages and too little room must give (size_t)-1
+ */
+
+#define WS_CTUBE_DEFLATE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "ws_ctube.h"
+
+#define MAX_SIZE 100000
+
+static int nfail;
+static char msg[MAX_SIZE];
+static char comp[WS_CTUBE_DEFLATE_BOUND(MAX_SIZE) + 64];
+static char out[MAX_SIZE + 1];
+
+/** compress msg in nparts parts like a broadcast, which strips only the last tail: @return bytes to send */
+static size_t compress_parts(size_t size, int nparts)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < nparts; i++) {
+		const size_t begin = size * i / nparts;
+		const size_t end = size * (i + 1) / nparts;
+		const size_t part = ws_ctube_deflate_part(comp + n, sizeof(comp) - n, msg + begin, end - begin);
+		if (part == (size_t)-1) {
+			return (size_t)-1;
+		}
+		n += part;
+	}
+	return n - WS_CTUBE_DEFLATE_TAIL;
+}
+
+/** compress msg with zlib in one go, as a browser would: @return bytes to send */
+static size_t compress_zlib(size_t size)
+{
+	z_stream zs;
+	size_t n;
+
+	memset(&zs, 0, sizeof(zs));
+	deflateInit2(&zs, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	zs.next_in = (Bytef *)msg;
+	zs.avail_in = (uInt)size;
+	zs.next_out = (Bytef *)comp;
+	zs.avail_out = sizeof(comp);
+	deflate(&zs, Z_SYNC_FLUSH);
+	n = sizeof(comp) - zs.avail_out;
+	deflateEnd(&zs);
+	return n - WS_CTUBE_DEFLATE_TAIL;
+}
+
+static void expect(size_t n, size_t size, const char *what)
+{
+	if (n == (size_t)-1 || n != size || memcmp(out, msg, size) != 0) {
+		printf("check_deflate: %s size %zu: does not inflate to the message\n", what, size);
+		nfail++;
+	}
+}
+
+int main(void)
+{
+	static const size_t sizes[] = {0, 1, 100, 4096, MAX_SIZE};
+	size_t n;
+
+	srand(1);
+	/* compressible: runs of a few symbols */
+	for (size_t i = 0; i < MAX_SIZE; i++) {
+		msg[i] = (char)('a' + rand() % 4);
+	}
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		const size_t size = sizes[s];
+		for (int nparts = 1; nparts <= 3; nparts++) {
+			n = compress_parts(size, nparts);
+			expect(ws_ctube_inflate(out, size + 1, comp, n), size, "parts");
+		}
+		n = compress_zlib(size);
+		expect(ws_ctube_inflate(out, size + 1, comp, n), size, "zlib");
+	}
+
+	/* longer than max */
+	n = compress_parts(MAX_SIZE, 1);
+	if (ws_ctube_inflate(out, MAX_SIZE / 2, comp, n) != (size_t)-1) {
+		printf("check_deflate: too little room: not reported\n");
+		nfail++;
+	}
+
+	/* corrupt: a reserved block type */
+	comp[0] = (char)0xff;
+	if (ws_ctube_inflate(out, sizeof(out), comp, n) != (size_t)-1) {
+		printf("check_deflate: corrupt message: not reported\n");
+		nfail++;
+	}
+
+	if (nfail != 0) {
+		printf("check_deflate: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_deflate: ok\n");
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ws_ctube_delta_encode_part() round trips
+ *
+ * frames with changes of various densities are encoded whole and in parts,
+ * the parts concatenated, and the delta applied to the earlier frame with a
+ * decoder written from the format description in delta.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws_ctube.h"
+
+#define MAX_SIZE 5000
+
+static int nfail;
+
+/** read a LEB128 number at delta[*pos]: @return 0 on success */
+static int get_len(const char *delta, size_t n, size_t *pos, size_t *len)
+{
+	*len = 0;
+	for (int shift = 0; *pos < n && shift < 64; shift += 7) {
+		const unsigned char c = (unsigned char)delta[(*pos)++];
+		*len |= (size_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/** apply delta of n bytes to frame: @return 0 on success */
+static int apply(char *frame, size_t size, const char *delta, size_t n)
+{
+	size_t pos = 0, off = 0, skip, len;
+
+	while (pos < n) {
+		if (get_len(delta, n, &pos, &skip) != 0 || get_len(delta, n, &pos, &len) != 0) {
+			return -1;
+		}
+		if (skip > size - off || len > size - off - skip || len > n - pos) {
+			return -1;
+		}
+		off += skip;
+		for (size_t i = 0; i < len; i++) {
+			frame[off + i] ^= delta[pos + i];
+		}
+		off += len;
+		pos += len;
+	}
+	return 0;
+}
+
+/** encode prev to cur in nparts parts and check the decoded result */
+static void check(const char *prev, const char *cur, size_t size, int nparts, const char *what)
+{
+	static char delta[4 * MAX_SIZE];
+	static char frame[MAX_SIZE];
+	size_t n = 0;
+
+	for (int i = 0; i < nparts; i++) {
+		const size_t begin = size * i / nparts;
+		const size_t end = size * (i + 1) / nparts;
+		const size_t part = ws_ctube_delta_encode_part(delta + n, sizeof(delta) - n, prev, cur, begin, end, i == nparts - 1);
+		if (part == (size_t)-1) {
+			printf("check_delta: %s size %zu parts %d: out of room\n", what, size, nparts);
+			nfail++;
+			return;
+		}
+		n += part;
+	}
+
+	memcpy(frame, prev, size);
+	if (apply(frame, size, delta, n) != 0 || memcmp(frame, cur, size) != 0) {
+		printf("check_delta: %s size %zu parts %d: does not decode to cur\n", what, size, nparts);
+		nfail++;
+	}
+}
+
+int main(void)
+{
+	static const size_t sizes[] = {0, 1, 7, 31, 32, 33, 100, 1000, MAX_SIZE};
+	static const int densities[] = {0, 1, 10, 50, 100};
+	static char prev[MAX_SIZE], cur[MAX_SIZE];
+	char what[64];
+	char out[64];
+
+	srand(1);
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		const size_t size = sizes[s];
+		for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+			/* each byte changes with probability densities[d] % */
+			for (size_t i = 0; i < size; i++) {
+				prev[i] = (char)rand();
+				cur[i] = rand() % 100 < densities[d] ? (char)(prev[i] ^ (1 + rand() % 255)) : prev[i];
+			}
+			snprintf(what, sizeof(what), "density %d%%", densities[d]);
+			for (int nparts = 1; nparts <= 4; nparts++) {
+				check(prev, cur, size, nparts, what);
+			}
+		}
+	}
+
+	/* identical frames give an empty delta */
+	if (ws_ctube_delta_encode(out, sizeof(out), prev, prev, MAX_SIZE) != 0) {
+		printf("check_delta: identical frames: delta not empty\n");
+		nfail++;
+	}
+	/* too little room is reported, not overrun */
+	memcpy(cur, prev, MAX_SIZE);
+	memset(cur + 1000, 0, 100);
+	cur[1000] = (char)~prev[1000];
+	if (ws_ctube_delta_encode(out, sizeof(out), prev, cur, MAX_SIZE) != (size_t)-1) {
+		printf("check_delta: out of room: not reported\n");
+		nfail++;
+	}
+
+	if (nfail != 0) {
+		printf("check_delta: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_delta: ok\n");
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ws_ctube_grid_downsample() against a plain reference
+ *
+ * the reference combines the 2, 2x2 or 2x2x2 block of each output element
+ * directly, repeating the last element along an odd axis, for each filter,
+ * for 1D, 2D and 3D grids of odd and even sizes and a few element types
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws_ctube.h"
+
+static int nfail;
+
+/** index of element (z, y, x) of a packed grid of dims, as 3D */
+static size_t at(const size_t *dims, size_t z, size_t y, size_t x)
+{
+	return (z * dims[1] + y) * dims[2] + x;
+}
+
+/** clamp 2 * i + d to an axis of n elements */
+static size_t clamp(size_t i, int d, size_t n)
+{
+	return 2 * i + d < n ? 2 * i + d : 2 * i;
+}
+
+/*
+ * reference downsample of a grid of T with dims (as 3D) into want. The mean
+ * sums 4 (1D, 2D) or 8 (3D) elements like the kernels do, rounding unsigned
+ * integers to nearest and signed ones toward zero
+ */
+#define CHECK_TYPE(name, T, ACC, ROUND, ELEM) \
+static void check_##name(int ndim, const size_t *dims, enum ws_ctube_lod_filter filter) \
+{ \
+	const int nz = ndim == 3 ? 2 : 1; \
+	const int nsum = 4 * nz; \
+	const size_t out_dims[3] = {(dims[0] + 1) / 2, (dims[1] + 1) / 2, (dims[2] + 1) / 2}; \
+	const size_t n = dims[0] * dims[1] * dims[2]; \
+	const size_t n_out = out_dims[0] * out_dims[1] * out_dims[2]; \
+	T *src = (T *)malloc(n * sizeof(T)); \
+	T *got = (T *)malloc(n_out * sizeof(T)); \
+	T *want = (T *)malloc(n_out * sizeof(T)); \
+	struct ws_ctube_grid view; \
+\
+	/* negative values for signed types, fractions for floating point */ \
+	for (size_t i = 0; i < n; i++) { \
+		src[i] = (T)(rand() % 251 - ((T)-1 < 0 ? 125 : 0)) / ((T)0.5 == 0 ? 1 : 7); \
+	} \
+\
+	for (size_t z = 0; z < out_dims[0]; z++) { \
+		for (size_t y = 0; y < out_dims[1]; y++) { \
+			for (size_t x = 0; x < out_dims[2]; x++) { \
+				ACC sum = 0; \
+				T lo = 0, hi = 0; \
+				for (int k = 0; k < nsum; k++) { \
+					const size_t zz = nz == 2 ? clamp(z, k / 4, dims[0]) : 0; \
+					const T v = src[at(dims, zz, clamp(y, k / 2 % 2, dims[1]), clamp(x, k % 2, dims[2]))]; \
+					sum += (ACC)v; \
+					lo = k == 0 || v < lo ? v : lo; \
+					hi = k == 0 || v > hi ? v : hi; \
+				} \
+				want[at(out_dims, z, y, x)] = filter == WS_CTUBE_LOD_MIN ? lo \
+					: filter == WS_CTUBE_LOD_MAX ? hi \
+					: (T)((sum + nsum / 2 * (ROUND)) / nsum); \
+			} \
+		} \
+	} \
+\
+	memset(&view, 0, sizeof(view)); \
+	view.ndim = ndim; \
+	for (int i = 0; i < ndim; i++) { \
+		view.dims[i] = dims[3 - ndim + i]; \
+	} \
+	view.elem_size = sizeof(T); \
+	view.type = ELEM; \
+	view.filter = filter; \
+	ws_ctube_grid_pack_strides(&view); \
+	ws_ctube_grid_downsample((char *)got, (const char *)src, &view); \
+\
+	for (size_t i = 0; i < n_out; i++) { \
+		if (fabs((double)got[i] - (double)want[i]) > 1e-5 * fabs((double)want[i])) { \
+			printf("check_grid: " #name " ndim %d dims %zu %zu %zu filter %d: element %zu is %g, want %g\n", \
+			       ndim, dims[0], dims[1], dims[2], (int)filter, i, (double)got[i], (double)want[i]); \
+			nfail++; \
+			break; \
+		} \
+	} \
+\
+	free(want); \
+	free(got); \
+	free(src); \
+}
+
+CHECK_TYPE(u8, uint8_t, unsigned, 1, WS_CTUBE_ELEM_U8)
+CHECK_TYPE(i16, int16_t, int, 0, WS_CTUBE_ELEM_I16)
+CHECK_TYPE(u32, uint32_t, uint64_t, 1, WS_CTUBE_ELEM_U32)
+CHECK_TYPE(f32, float, float, 0, WS_CTUBE_ELEM_F32)
+CHECK_TYPE(f64, double, double, 0, WS_CTUBE_ELEM_F64)
+
+int main(void)
+{
+	static const size_t sizes[] = {1, 2, 5, 8, 37};
+	const int nsize = sizeof(sizes) / sizeof(sizes[0]);
+
+	srand(1);
+	for (int ndim = 1; ndim <= 3; ndim++) {
+		for (int i = 0; i < nsize; i++) {
+			for (int j = 0; j < nsize; j++) {
+				/* axes before the last ndim have length 1 */
+				const size_t dims[3] = {ndim == 3 ? sizes[j] : 1, ndim >= 2 ? sizes[i] : 1, sizes[(i + j) % nsize]};
+				for (int f = WS_CTUBE_LOD_MEAN; f <= WS_CTUBE_LOD_MAX; f++) {
+					check_u8(ndim, dims, (enum ws_ctube_lod_filter)f);
+					check_i16(ndim, dims, (enum ws_ctube_lod_filter)f);
+					check_u32(ndim, dims, (enum ws_ctube_lod_filter)f);
+					check_f32(ndim, dims, (enum ws_ctube_lod_filter)f);
+					check_f64(ndim, dims, (enum ws_ctube_lod_filter)f);
+				}
+			}
+		}
+	}
+
+	if (nfail != 0) {
+		printf("check_grid: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_grid: ok\n");
+	return 0;
+}
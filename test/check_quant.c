@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ws_ctube_quantize() against the formats it sends
+ *
+ * F16 and BF16: every finite value of the format, the midpoints between
+ * neighbours (ties to even) and the floats just either side of them must
+ * convert to the right value, and infinities and NaN must stay so.
+ * U8 and U16: the range found must be that of the finite values, and each
+ * value must decode to within half a step of its input, NaN to 0 and values
+ * outside a given range to its ends
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws_ctube.h"
+
+static int nfail;
+
+/** IEEE half precision bits to float (exact) */
+static float from_f16(uint16_t h)
+{
+	const int exp = (h >> 10) & 0x1f;
+	const int mant = h & 0x3ff;
+	float x;
+
+	if (exp == 0x1f) {
+		x = mant != 0 ? NAN : INFINITY;
+	} else if (exp == 0) {
+		x = ldexpf((float)mant, -24);
+	} else {
+		x = ldexpf((float)(0x400 | mant), exp - 25);
+	}
+	return (h & 0x8000) != 0 ? -x : x;
+}
+
+/** bfloat16 bits to float (exact) */
+static float from_bf16(uint16_t h)
+{
+	const uint32_t f = (uint32_t)h << 16;
+	float x;
+
+	memcpy(&x, &f, sizeof(x));
+	return x;
+}
+
+/** ws_ctube_quantize() count floats to values (F16 or BF16) */
+static void quantize16(uint16_t *values, const float *in, size_t count, enum ws_ctube_quant_format format)
+{
+	struct ws_ctube_quant quant = {WS_CTUBE_ELEM_F32, format, 0, 0};
+	char *out = (char *)malloc(ws_ctube_quant_size(format, count));
+
+	ws_ctube_quantize(out, in, count, &quant);
+	memcpy(values, out + sizeof(struct ws_ctube_quant_header), count * sizeof(*values));
+	free(out);
+}
+
+/**
+ * check a 16-bit float format with largest finite magnitude max_bits
+ * (positive), infinity inf_bits, decoded by decode
+ */
+static void check_float16(enum ws_ctube_quant_format format, const char *name, uint16_t max_bits, uint16_t inf_bits, float (*decode)(uint16_t))
+{
+	/* per positive h: h, midpoint to h + 1, just below it, just above it */
+	const size_t n = 4 * ((size_t)max_bits + 1);
+	float *in = (float *)malloc(2 * n * sizeof(*in) + 4 * sizeof(*in));
+	uint16_t *want = (uint16_t *)malloc((2 * n + 4) * sizeof(*want));
+	uint16_t *got = (uint16_t *)malloc((2 * n + 4) * sizeof(*got));
+	size_t count = 0;
+
+	for (int sign = 0; sign < 2; sign++) {
+		const uint16_t s = (uint16_t)(sign << 15);
+		for (uint32_t h = 0; h <= max_bits; h++) {
+			const float x = decode((uint16_t)(s | h));
+			const float x1 = decode((uint16_t)(s | (h + 1)));
+			/* not (x + x1) / 2, which overflows near FLT_MAX; next after the
+			 * largest finite value is where it would be */
+			const float mid = h < max_bits ? x + (x1 - x) / 2 : x + (x - decode((uint16_t)(s | (h - 1)))) / 2;
+			const uint16_t even = (uint16_t)(s | (h % 2 == 0 ? h : h + 1));
+
+			in[count] = x;
+			want[count++] = (uint16_t)(s | h);
+			in[count] = mid;
+			want[count++] = even;
+			in[count] = nextafterf(mid, 0);
+			want[count++] = (uint16_t)(s | h);
+			in[count] = nextafterf(mid, sign ? -INFINITY : INFINITY);
+			want[count++] = (uint16_t)(s | (h + 1));
+		}
+	}
+	in[count] = INFINITY;
+	want[count++] = inf_bits;
+	in[count] = -INFINITY;
+	want[count++] = (uint16_t)(inf_bits | 0x8000);
+
+	quantize16(got, in, count, format);
+	for (size_t i = 0; i < count; i++) {
+		if (got[i] != want[i]) {
+			printf("check_quant: %s of %a is 0x%04x, want 0x%04x\n", name, in[i], got[i], want[i]);
+			nfail++;
+			break;
+		}
+	}
+
+	/* NaN stays NaN */
+	in[0] = NAN;
+	in[1] = -NAN;
+	quantize16(got, in, 2, format);
+	if (!isnan(decode(got[0])) || !isnan(decode(got[1]))) {
+		printf("check_quant: %s of NaN is 0x%04x 0x%04x, not NaN\n", name, got[0], got[1]);
+		nfail++;
+	}
+
+	free(got);
+	free(want);
+	free(in);
+}
+
+/**
+ * quantize in (of type) to U8 or U16 with range min to max (both 0 for the
+ * range of the finite values) and check each value against its input
+ */
+static void check_int(enum ws_ctube_elem_type type, enum ws_ctube_quant_format format, const double *in, size_t count, double min, double max)
+{
+	struct ws_ctube_quant quant = {type, format, min, max};
+	struct ws_ctube_quant_header hdr;
+	const char *name = format == WS_CTUBE_QUANT_U8 ? "U8" : "U16";
+	const double qmax = format == WS_CTUBE_QUANT_U8 ? UINT8_MAX : UINT16_MAX;
+	char *out = (char *)malloc(ws_ctube_quant_size(format, count));
+	float *in_f = (float *)malloc(count * sizeof(*in_f));
+	double want_min = INFINITY, want_max = -INFINITY;
+
+	for (size_t i = 0; i < count; i++) {
+		in_f[i] = (float)in[i];
+		if (isfinite(in[i])) {
+			want_min = in[i] < want_min ? in[i] : want_min;
+			want_max = in[i] > want_max ? in[i] : want_max;
+		}
+	}
+	if (min != 0 || max != 0) {
+		want_min = min;
+		want_max = max;
+	}
+
+	ws_ctube_quantize(out, type == WS_CTUBE_ELEM_F64 ? (const void *)in : (const void *)in_f, count, &quant);
+	memcpy(&hdr, out, sizeof(hdr));
+	if (hdr.format != format || hdr.min != want_min || hdr.max != want_max) {
+		printf("check_quant: %s range %g to %g, want %g to %g\n", name, hdr.min, hdr.max, want_min, want_max);
+		nfail++;
+	}
+
+	/* half a step, and float rounding of the scaled values */
+	const double step = (want_max - want_min) / qmax;
+	const double tol = 0.5 * step * 1.001 + 1e-6 * (fabs(want_min) + fabs(want_max));
+	for (size_t i = 0; i < count; i++) {
+		uint16_t q16;
+		const double q = format == WS_CTUBE_QUANT_U8 ? (double)(uint8_t)out[sizeof(hdr) + i]
+			: (memcpy(&q16, out + sizeof(hdr) + 2 * i, sizeof(q16)), (double)q16);
+		const double x = isnan(in[i]) ? want_min : fmin(fmax(in[i], want_min), want_max);
+		if (fabs(want_min + q * step - x) > tol) {
+			printf("check_quant: %s of %g is %g (decodes to %g)\n", name, in[i], q, want_min + q * step);
+			nfail++;
+			break;
+		}
+	}
+
+	free(in_f);
+	free(out);
+}
+
+int main(void)
+{
+	const size_t count = 10000;
+	double *in = (double *)malloc(count * sizeof(*in));
+
+	check_float16(WS_CTUBE_QUANT_F16, "F16", 0x7bff, 0x7c00, from_f16);
+	check_float16(WS_CTUBE_QUANT_BF16, "BF16", 0x7f7f, 0x7f80, from_bf16);
+
+	/* values in -3 to 5, with a NaN and infinities */
+	srand(1);
+	for (size_t i = 0; i < count; i++) {
+		in[i] = -3 + 8 * (double)rand() / RAND_MAX;
+	}
+	in[0] = -3;
+	in[1] = 5;
+	in[10] = NAN;
+	in[20] = INFINITY;
+	in[30] = -INFINITY;
+	for (int f = WS_CTUBE_QUANT_U8; f <= WS_CTUBE_QUANT_U16; f++) {
+		check_int(WS_CTUBE_ELEM_F32, (enum ws_ctube_quant_format)f, in, count, 0, 0);
+		check_int(WS_CTUBE_ELEM_F64, (enum ws_ctube_quant_format)f, in, count, 0, 0);
+		/* values outside a given range */
+		check_int(WS_CTUBE_ELEM_F32, (enum ws_ctube_quant_format)f, in, count, -1, 1);
+		check_int(WS_CTUBE_ELEM_F64, (enum ws_ctube_quant_format)f, in, count, -1, 1);
+	}
+	free(in);
+
+	if (nfail != 0) {
+		printf("check_quant: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_quant: ok\n");
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ws_ctube_ref_count and ws_ctube_sharded_ref_count under contention
+ *
+ * threads acquire and release references to one object, each keeping a few,
+ * while the main thread shares and unshares the sharded count. Once the main
+ * thread has unshared, the count must be exact. Then every thread gives its
+ * references back, shared or not: the release routine must run exactly once,
+ * after the last one, and see what each thread wrote before releasing
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws_ctube.h"
+
+#define NTHREAD 4
+#define NROUND 50
+#define NITER 20000
+
+static int nfail;
+
+struct obj {
+	struct ws_ctube_ref_count refc;
+	struct ws_ctube_sharded_ref_count sharded_refc;
+	/* written by each thread before its last release */
+	int done[NTHREAD];
+	int nreleased;
+	int released_early;
+};
+
+static struct obj obj;
+static int sharded;
+/* set once the threads hold what they keep */
+static volatile int nheld;
+/* set by the main thread to make the threads give their references back */
+static volatile int go_release;
+
+static void obj_release(struct obj *o)
+{
+	for (int t = 0; t < NTHREAD; t++) {
+		if (!o->done[t]) {
+			o->released_early = 1;
+		}
+	}
+	__atomic_add_fetch(&o->nreleased, 1, __ATOMIC_RELAXED);
+}
+
+static void acquire(void)
+{
+	if (sharded) {
+		ws_ctube_sharded_ref_count_acquire(&obj, sharded_refc);
+	} else {
+		ws_ctube_ref_count_acquire(&obj, refc);
+	}
+}
+
+static void release(void)
+{
+	if (sharded) {
+		ws_ctube_sharded_ref_count_release(&obj, sharded_refc, obj_release);
+	} else {
+		ws_ctube_ref_count_release(&obj, refc, obj_release);
+	}
+}
+
+static long load(void)
+{
+	return sharded ? ws_ctube_sharded_ref_count_load(&obj.sharded_refc) : ws_ctube_ref_count_load(&obj.refc);
+}
+
+/** thread t keeps t + 1 references once done churning */
+static void *worker(void *arg)
+{
+	const int t = (int)(long)arg;
+	unsigned seed = (unsigned)t + 1;
+
+	for (int i = 0; i < NITER; i++) {
+		const int k = 1 + rand_r(&seed) % 3;
+		for (int j = 0; j < k; j++) {
+			acquire();
+		}
+		for (int j = 0; j < k; j++) {
+			release();
+		}
+	}
+	for (int j = 0; j <= t; j++) {
+		acquire();
+	}
+	__atomic_add_fetch(&nheld, 1, __ATOMIC_RELEASE);
+
+	while (!__atomic_load_n(&go_release, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+	obj.done[t] = 1;
+	for (int j = 0; j <= t; j++) {
+		release();
+	}
+	return NULL;
+}
+
+/** share and unshare until the threads are done with phase, ending unshared */
+static void toggle_until(volatile int *phase, int want)
+{
+	while (__atomic_load_n(phase, __ATOMIC_ACQUIRE) < want) {
+		if (sharded) {
+			ws_ctube_sharded_ref_count_share(&obj.sharded_refc);
+			sched_yield();
+			ws_ctube_sharded_ref_count_unshare(&obj.sharded_refc);
+		}
+		sched_yield();
+	}
+}
+
+static void check_round(int round)
+{
+	pthread_t tid[NTHREAD];
+	const char *name = sharded ? "sharded" : "atomic";
+	const long want = 1 + NTHREAD * (NTHREAD + 1) / 2;
+
+	memset(&obj, 0, sizeof(obj));
+	ws_ctube_ref_count_init(&obj.refc);
+	ws_ctube_sharded_ref_count_init(&obj.sharded_refc);
+	nheld = 0;
+	go_release = 0;
+
+	/* the main thread's reference, given back last */
+	acquire();
+	for (long t = 0; t < NTHREAD; t++) {
+		pthread_create(&tid[t], NULL, worker, (void *)t);
+	}
+
+	toggle_until(&nheld, NTHREAD);
+	if (load() != want) {
+		printf("check_refcount: %s round %d: count is %ld, want %ld\n", name, round, load(), want);
+		nfail++;
+	}
+
+	/* the threads give back while shared, then while not: the main
+	 * thread holds its reference while sharing and unsharing, then gives
+	 * it back while they may still be releasing */
+	if (sharded) {
+		ws_ctube_sharded_ref_count_share(&obj.sharded_refc);
+	}
+	__atomic_store_n(&go_release, 1, __ATOMIC_RELEASE);
+	if (sharded) {
+		sched_yield();
+		ws_ctube_sharded_ref_count_unshare(&obj.sharded_refc);
+	}
+	release();
+	for (int t = 0; t < NTHREAD; t++) {
+		pthread_join(tid[t], NULL);
+	}
+
+	if (obj.nreleased != 1 || obj.released_early || load() != 0) {
+		printf("check_refcount: %s round %d: released %d times%s, count %ld\n", name, round, obj.nreleased, obj.released_early ? " (before a thread was done)" : "", load());
+		nfail++;
+	}
+
+	ws_ctube_sharded_ref_count_destroy(&obj.sharded_refc);
+	ws_ctube_ref_count_destroy(&obj.refc);
+}
+
+int main(void)
+{
+	for (sharded = 0; sharded < 2; sharded++) {
+		for (int round = 0; round < NROUND && nfail == 0; round++) {
+			check_round(round);
+		}
+	}
+
+	if (nfail != 0) {
+		printf("check_refcount: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_refcount: ok\n");
+	return 0;
+}
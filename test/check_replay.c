@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief ws_ctube_replay() of a log cut short
+ *
+ * the recorder writes small logs of a few segments into a temporary
+ * directory, one whose last record follows others in its segment and one
+ * whose last record is too large to (so it is alone in the last segment).
+ * The last segment is then cut inside the payload, the channel name and the
+ * header of that record, like a crash would leave it: each time,
+ * ws_ctube_replay() must publish every record before it, skip none and leave
+ * each channel with the last complete record it was sent
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ws_ctube.h"
+
+#define PORT 9797
+#define NREC 40
+#define SEGMENT_SIZE 4096
+/* of the last record when it is to be alone in its segment */
+#define LAST_SIZE 6000
+
+static int nfail;
+
+static const char *const channels[] = {"alpha", "beta"};
+
+struct rec {
+	struct ws_ctube_record_node node;
+	char payload[LAST_SIZE];
+};
+
+static struct ws_ctube_recorder recorder;
+static struct rec recs[NREC];
+
+static void record(struct ws_ctube_record_node *node, char *payload)
+{
+	struct rec *r = ws_ctube_container_of(node, struct rec, node);
+
+	if (payload != NULL) {
+		memcpy(payload, r->payload, node->size);
+	}
+}
+
+/**
+ * record i has 100 + 37 * i bytes of i (last_size for the last one), on
+ * channels[i % 2]
+ */
+static int write_log(const char *path, size_t last_size)
+{
+	if (ws_ctube_recorder_init(&recorder) != 0 || ws_ctube_recorder_start(&recorder, path, SEGMENT_SIZE, 0) != 0) {
+		return -1;
+	}
+	for (int i = 0; i < NREC; i++) {
+		struct rec *r = &recs[i];
+		r->node.id = (uint64_t)i + 1;
+		r->node.time_ns = (int64_t)i * 1000;
+		r->node.channel = channels[i % 2];
+		r->node.size = i < NREC - 1 ? 100 + 37 * (size_t)i : last_size;
+		r->node.grid = NULL;
+		memset(r->payload, i, r->node.size);
+		if (ws_ctube_recorder_push(&recorder, &r->node, record) != 0) {
+			return -1;
+		}
+	}
+	ws_ctube_recorder_stop(&recorder);
+	ws_ctube_recorder_destroy(&recorder);
+	return recorder.nrecorded == NREC ? 0 : -1;
+}
+
+/** @return offset of the last record in the segment file name, or 0 */
+static size_t last_record(const char *name)
+{
+	struct ws_ctube_record_header hdr;
+	size_t offset = sizeof(struct ws_ctube_record_segment);
+	size_t last = 0;
+	FILE *f = fopen(name, "rb");
+
+	if (f == NULL) {
+		return 0;
+	}
+	while (fseek(f, (long)offset, SEEK_SET) == 0 && fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == WS_CTUBE_RECORD_MAGIC) {
+		last = offset;
+		offset += (sizeof(hdr) + hdr.channel_len + hdr.size + 7) & ~(size_t)7;
+	}
+	fclose(f);
+	return last;
+}
+
+/**
+ * cut the segment file name to size bytes, inside the last record, and
+ * replay path into ctube, expecting all but that record
+ */
+static void check_replay(struct ws_ctube *ctube, const char *path, const char *name, size_t size, const char *cut)
+{
+	struct ws_ctube_stats stats;
+	long nreplayed;
+
+	if (truncate(name, (off_t)size) != 0) {
+		printf("check_replay: cannot cut %s\n", name);
+		nfail++;
+		return;
+	}
+	nreplayed = ws_ctube_replay(ctube, path, NULL);
+
+	ws_ctube_get_stats(ctube, &stats);
+	if (nreplayed != NREC - 1 || stats.nreplay_skipped != 0) {
+		printf("check_replay: cut inside the %s: replayed %ld, skipped %lu, want %d, 0\n", cut, nreplayed, stats.nreplay_skipped, NREC - 1);
+		nfail++;
+	}
+
+	/* the last complete record of each channel */
+	for (int i = NREC - 3; i < NREC - 1; i++) {
+		struct ws_ctube_channel *channel = ws_ctube_channel_open(ctube, channels[i % 2]);
+		const struct rec *r = &recs[i];
+		const struct ws_ctube_data *out_data = channel != NULL ? channel->out_data : NULL;
+		if (out_data == NULL || out_data->data_size != r->node.size || memcmp(out_data->data, r->payload, r->node.size) != 0) {
+			printf("check_replay: cut inside the %s: %s does not have record %d\n", cut, channels[i % 2], i);
+			nfail++;
+		}
+	}
+}
+
+/** remove the files of the log at path */
+static void remove_log(const char *path)
+{
+	char name[PATH_MAX];
+
+	for (uint32_t segment = 0; snprintf(name, sizeof(name), "%s.%06lu", path, (unsigned long)segment) > 0 && unlink(name) == 0; segment++);
+	snprintf(name, sizeof(name), "%s.index", path);
+	unlink(name);
+}
+
+/** record a log at path, then cut and replay its last segment */
+static void check_log(struct ws_ctube *ctube, const char *path, size_t last_size)
+{
+	const size_t hdr_len = sizeof(struct ws_ctube_record_header);
+	const size_t name_len = strlen(channels[(NREC - 1) % 2]);
+	char name[PATH_MAX];
+	size_t last;
+
+	if (write_log(path, last_size) != 0) {
+		printf("check_replay: cannot record the log\n");
+		nfail++;
+		goto out;
+	}
+	snprintf(name, sizeof(name), "%s.%06lu", path, (unsigned long)recorder.segment - 1);
+	last = last_record(name);
+	if (recorder.segment < 2 || last == 0) {
+		printf("check_replay: want a log of several segments\n");
+		nfail++;
+		goto out;
+	}
+	if ((last == sizeof(struct ws_ctube_record_segment)) != (last_size == LAST_SIZE)) {
+		printf("check_replay: the last record of size %zu is not where it should be\n", last_size);
+		nfail++;
+	}
+
+	/* each shorter than the last */
+	check_replay(ctube, path, name, last + hdr_len + name_len + 10, "payload");
+	check_replay(ctube, path, name, last + hdr_len + 2, "name");
+	check_replay(ctube, path, name, last + 4, "header");
+
+out:
+	remove_log(path);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/check_replay.XXXXXX";
+	char path[PATH_MAX];
+	struct ws_ctube *ctube;
+
+	if (mkdtemp(dir) == NULL) {
+		printf("check_replay: cannot create a temporary directory\n");
+		return 1;
+	}
+
+	/* no rate limit, or records are skipped */
+	ctube = ws_ctube_open(PORT, 1, 0, 0);
+	if (ctube == NULL) {
+		printf("check_replay: cannot open a ctube on port %d\n", PORT);
+		nfail++;
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/shared", dir);
+	check_log(ctube, path, 100 + 37 * (NREC - 1));
+	snprintf(path, sizeof(path), "%s/alone", dir);
+	check_log(ctube, path, LAST_SIZE);
+	ws_ctube_close(ctube);
+
+out:
+	rmdir(dir);
+
+	if (nfail != 0) {
+		printf("check_replay: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_replay: ok\n");
+	return 0;
+}
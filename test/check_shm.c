@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2023 Bryance Oyang
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * @file
+ * @brief the shared memory ring, written and read back through a temp file
+ *
+ * ws_ctube_shm_write() fills a ring of one page many times over while a
+ * reader keeps up, record by record and a few at a time: every record must
+ * come back as written, across the wraparound, past pad records and the
+ * short gaps too small for one. A reader a whole ring behind, or overtaken
+ * while reading a record, must skip to the latest one and count what it
+ * missed. Hand-made records whose channel name or payload runs past the end
+ * of the ring (which ends the mapping) must be rejected as bad, not read
+ * (the reader prints an error for each)
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ws_ctube.h"
+
+/* of a broadcast, enough for a ring of a page of 64 kB */
+#define MAX_SIZE 65536
+
+static int nfail;
+
+static char path[64];
+static struct ws_ctube_shm shm;
+static struct ws_ctube_shm_reader reader;
+static uint64_t last_id;
+
+/** what the payload of broadcast id has at k */
+static char fill(uint64_t id, size_t k)
+{
+	return (char)(id * 31 + k * 7);
+}
+
+/** a ring of one page (4 kB or more), and a reader of it */
+static int open_ring(void)
+{
+	ws_ctube_shm_init(&shm);
+	if (ws_ctube_shm_start(&shm, path, 4096 - sizeof(struct ws_ctube_shm_header)) != 0) {
+		return -1;
+	}
+	if (ws_ctube_shm_reader_init(&reader, path) != 0) {
+		ws_ctube_shm_stop(&shm);
+		return -1;
+	}
+	return 0;
+}
+
+static void close_ring(void)
+{
+	ws_ctube_shm_stop(&shm);
+	ws_ctube_shm_destroy(&shm);
+	ws_ctube_shm_reader_destroy(&reader);
+}
+
+/** @return the id of the broadcast of size bytes written to channel */
+static uint64_t write_msg(const char *channel, size_t size)
+{
+	static char buf[MAX_SIZE];
+	const uint64_t id = ++last_id;
+
+	for (size_t k = 0; k < size; k++) {
+		buf[k] = fill(id, k);
+	}
+	if (ws_ctube_shm_write(&shm, channel, buf, size, id, (int64_t)id * 1000) != 0) {
+		printf("check_shm: write of %zu bytes failed\n", size);
+		nfail++;
+	}
+	return id;
+}
+
+/** read the next broadcast, expecting id of size bytes on channel */
+static void expect(const char *what, const char *channel, size_t size, uint64_t id, unsigned long nmissed)
+{
+	static char buf[MAX_SIZE];
+	struct ws_ctube_shm_msg msg = {""};
+	const long n = ws_ctube_shm_reader_next(&reader, buf, sizeof(buf), &msg);
+	int same = n == (long)size;
+
+	for (size_t k = 0; same && k < size; k++) {
+		same = buf[k] == fill(id, k);
+	}
+	if (!same || strcmp(msg.channel, channel) != 0 || msg.id != id || msg.time_ns != (long long)id * 1000 || msg.nmissed != nmissed) {
+		printf("check_shm: %s: read %ld bytes of %lu on \"%s\" missing %lu, want %zu bytes of %lu on \"%s\" missing %lu\n",
+		       what, n, msg.id, msg.channel, msg.nmissed,
+		       size, (unsigned long)id, channel, nmissed);
+		nfail++;
+	}
+}
+
+/** read the next broadcast, expecting n */
+static void expect_none(const char *what, long want)
+{
+	static char buf[MAX_SIZE];
+	struct ws_ctube_shm_msg msg;
+	const long n = ws_ctube_shm_reader_next(&reader, buf, sizeof(buf), &msg);
+
+	if (n != want) {
+		printf("check_shm: %s: read returned %ld, want %ld\n", what, n, want);
+		nfail++;
+	}
+}
+
+/** copy a record of type (channel_len bytes of name, then size) into slot and commit it */
+static void put(const struct ws_ctube_shm_slot *slot, uint32_t type, uint32_t channel_len, uint64_t size)
+{
+	struct ws_ctube_shm_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.seq = slot->seq;
+	rec.type = type;
+	rec.channel_len = channel_len;
+	rec.size = size;
+	rec.id = ++last_id;
+	rec.time_ns = (int64_t)last_id * 1000;
+	memcpy(slot->rec, &rec, sizeof(rec));
+	ws_ctube_shm_commit(&shm, slot);
+}
+
+/**
+ * write broadcasts of many sizes, reading them back one at a time or every
+ * few, until they have gone around the ring often enough to have left both
+ * pad records and gaps too small for one
+ */
+static void check_wraparound(void)
+{
+	static const char *const channels[] = {"", "a", "channel"};
+	uint64_t ids[3];
+	size_t sizes[3];
+	int npad = 0, ngap = 0;
+
+	for (int i = 0; i < 2000 && nfail == 0; i++) {
+		const int batch = 1 + i % 3;
+		for (int j = 0; j < batch; j++) {
+			const char *channel = channels[(i + j) % 3];
+			const size_t off = (size_t)(shm.head % shm.size);
+			sizes[j] = (size_t)(i * 97 + j * 13) % 600;
+			const size_t len = _ws_ctube_shm_record_size(strlen(channel), sizes[j]);
+			if (shm.size - off < len && shm.size - off >= sizeof(struct ws_ctube_shm_record)) {
+				npad++;
+			} else if (shm.size - off < len) {
+				ngap++;
+			}
+			ids[j] = write_msg(channel, sizes[j]);
+		}
+		for (int j = 0; j < batch; j++) {
+			expect("wraparound", channels[(i + j) % 3], sizes[j], ids[j], 0);
+		}
+		expect_none("wraparound, caught up", 0);
+	}
+	if (npad == 0 || ngap == 0) {
+		printf("check_shm: wraparound left %d pads and %d short gaps, want some of each\n", npad, ngap);
+		nfail++;
+	}
+
+	/* too large for buf: stays next */
+	const uint64_t id = write_msg("a", 100);
+	char small[50];
+	struct ws_ctube_shm_msg msg;
+	if (ws_ctube_shm_reader_next(&reader, small, sizeof(small), &msg) != 100) {
+		printf("check_shm: a broadcast larger than buf is not reported\n");
+		nfail++;
+	}
+	expect("after one too large", "a", 100, id, 0);
+}
+
+/** fall a whole ring behind: skip to the latest, counting the others */
+static void check_behind(void)
+{
+	const int n = (int)(2 * shm.size / 300) + 1;
+	uint64_t id = 0;
+
+	for (int i = 0; i < n; i++) {
+		id = write_msg("behind", 256);
+	}
+	expect("a ring behind", "behind", 256, id, (unsigned long)n - 1);
+	expect_none("a ring behind, caught up", 0);
+}
+
+/**
+ * be overtaken while reading: a record reserved (but not yet written) over
+ * the one being read makes the reader skip to the latest
+ */
+static void check_overtaken(void)
+{
+	struct ws_ctube_shm_slot slot;
+	const size_t hdr_len = sizeof(struct ws_ctube_shm_record);
+	/* so that a third does not fit after two */
+	const size_t size = shm.size / 3;
+	const size_t len = _ws_ctube_shm_record_size(1, size);
+	size_t off;
+	uint64_t id_b;
+
+	/* to the start of the ring (a gap too small for a record is skipped) */
+	off = (size_t)(shm.head % shm.size);
+	if (off != 0 && shm.size - off >= hdr_len) {
+		ws_ctube_shm_reserve(&shm, shm.size - off, &slot);
+		put(&slot, WS_CTUBE_SHM_DATA, 0, shm.size - off - hdr_len);
+		expect_none("to the start", (long)(shm.size - off - hdr_len));
+	}
+
+	/* a at the start, then b; the reader is at a. Another record as
+	 * large wraps around over a, not b */
+	write_msg("a", size);
+	id_b = write_msg("b", size);
+	ws_ctube_shm_reserve(&shm, len, &slot);
+	if (slot.rec != shm.ring) {
+		printf("check_shm: overtaken: the record does not wrap around\n");
+		nfail++;
+	}
+	expect("overtaken while reading", "b", size, id_b, 1);
+	put(&slot, WS_CTUBE_SHM_DATA, 0, len - hdr_len);
+	expect_none("overtaken, then written", (long)(len - hdr_len));
+	expect_none("overtaken, caught up", 0);
+}
+
+/** what was written before closing is still read, then no more */
+static void check_closed(void)
+{
+	const uint64_t id = write_msg("last", 10);
+
+	ws_ctube_shm_stop(&shm);
+	expect("closed", "last", 10, id, 0);
+	expect_none("closed, caught up", -1);
+}
+
+/**
+ * a record of channel_len and size at the last 64 bytes of a fresh ring
+ * must be rejected without reading past its end
+ */
+static void check_bad(const char *what, uint32_t channel_len, uint64_t size)
+{
+	struct ws_ctube_shm_slot slot;
+	const size_t hdr_len = sizeof(struct ws_ctube_shm_record);
+
+	if (open_ring() != 0) {
+		printf("check_shm: cannot open %s\n", path);
+		nfail++;
+		return;
+	}
+	const uint64_t id = write_msg("", shm.size - 64 - hdr_len);
+	expect(what, "", shm.size - 64 - hdr_len, id, 0);
+
+	ws_ctube_shm_reserve(&shm, 64, &slot);
+	if (slot.rec != shm.ring + shm.size - 64) {
+		printf("check_shm: %s: the record is not at the end of the ring\n", what);
+		nfail++;
+	}
+	put(&slot, WS_CTUBE_SHM_DATA, channel_len, size);
+	expect_none(what, -1);
+	close_ring();
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/check_shm.XXXXXX";
+
+	if (mkdtemp(dir) == NULL) {
+		printf("check_shm: cannot create a temporary directory\n");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/ring", dir);
+
+	if (open_ring() != 0) {
+		printf("check_shm: cannot open %s\n", path);
+		nfail++;
+		goto out;
+	}
+	expect_none("empty", 0);
+	check_wraparound();
+	check_behind();
+	check_overtaken();
+	check_closed();
+	close_ring();
+
+	/* 64 - 40 bytes are left for the name and payload */
+	check_bad("name past the end", 32, 0);
+	check_bad("payload past the end", 8, 24);
+	check_bad("name too long", 0xffffffffu, 0);
+	check_bad("payload too large", 8, UINT64_MAX);
+
+out:
+	rmdir(dir);
+
+	if (nfail != 0) {
+		printf("check_shm: %d failed\n", nfail);
+		return 1;
+	}
+	printf("check_shm: ok\n");
+	return 0;
+}
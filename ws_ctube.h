@@ -31,6 +31,288 @@ extern "C" {
 #endif
 
 struct ws_ctube;
+struct ws_ctube_channel;
+
+/**
+ * called by ws_ctube to give back caller-owned memory passed to
+ * ws_ctube_broadcast_owned()
+ *
+ * @param data the pointer that was broadcast
+ * @param user the user pointer that was passed along with data
+ */
+typedef void (*ws_ctube_release_fn)(void *data, void *user);
+
+/**
+ * called by ws_ctube to write a snapshot of the state that a channel's
+ * broadcasts update, for a client that just connected to it (see
+ * ws_ctube_channel_set_snapshot()). Like snprintf(), it returns the size of
+ * the whole snapshot even if that does not fit in max bytes; it is then
+ * called again with a larger buf
+ *
+ * @param buf where to write the snapshot (NULL if max is 0)
+ * @param max bytes available at buf
+ * @param user the user pointer that was passed along with this function
+ *
+ * @return bytes of the snapshot, or 0 to send none
+ */
+typedef size_t (*ws_ctube_snapshot_fn)(void *buf, size_t max, void *user);
+
+/**
+ * memory allocation hooks: ws_ctube memory comes from alloc and is given back
+ * with free instead of malloc()/free(). Both hooks are called from any
+ * ws_ctube thread, so they must be thread-safe. Leave both NULL for the
+ * default allocator.
+ */
+struct ws_ctube_allocator {
+	/**
+	 * @param size bytes to allocate
+	 * @param align required alignment (a power of 2)
+	 * @param user the user pointer of this allocator
+	 * @return pointer to the memory or NULL on failure
+	 */
+	void *(*alloc)(size_t size, size_t align, void *user);
+	/** give back ptr that was allocated with the same size and align */
+	void (*free)(void *ptr, size_t size, size_t align, void *user);
+	/** passed to alloc and free */
+	void *user;
+};
+
+/** what ws_ctube does when a broadcast buffer would exceed opts.mem_budget */
+enum ws_ctube_budget_policy {
+	/** fail the broadcast (or reservation) */
+	WS_CTUBE_BUDGET_REJECT,
+	/**
+	 * disconnect the clients still being sent the oldest broadcasts until
+	 * enough memory will be given back; fail if that is not enough
+	 */
+	WS_CTUBE_BUDGET_DROP,
+	/** block the producer until slow clients give back enough memory */
+	WS_CTUBE_BUDGET_BLOCK
+};
+
+/** maximum number of axes of a ws_ctube_grid */
+#define WS_CTUBE_GRID_MAXDIM 3
+/** maximum number of downsampled levels of a ws_ctube_grid */
+#define WS_CTUBE_GRID_MAXLEVEL 16
+
+/** element types of a ws_ctube_grid */
+enum ws_ctube_elem_type {
+	/** any elem_size: downsampled levels pick one element of each block */
+	WS_CTUBE_ELEM_RAW,
+	WS_CTUBE_ELEM_U8,
+	WS_CTUBE_ELEM_I8,
+	WS_CTUBE_ELEM_U16,
+	WS_CTUBE_ELEM_I16,
+	WS_CTUBE_ELEM_U32,
+	WS_CTUBE_ELEM_I32,
+	WS_CTUBE_ELEM_F32,
+	WS_CTUBE_ELEM_F64
+};
+
+/** how a downsampled level of a ws_ctube_grid combines each 2x2(x2) block */
+enum ws_ctube_lod_filter {
+	/** mean (box filter) */
+	WS_CTUBE_LOD_MEAN,
+	/** minimum, e.g. to keep narrow troughs visible */
+	WS_CTUBE_LOD_MIN,
+	/** maximum, e.g. to keep narrow peaks visible */
+	WS_CTUBE_LOD_MAX
+};
+
+/**
+ * layout of a 1D, 2D or 3D array for ws_ctube_publish_grid(). Axis 0 varies
+ * slowest, e.g. dims = {ny, nx} for a C array float field[ny][nx]
+ */
+struct ws_ctube_grid {
+	/** number of axes (1 to WS_CTUBE_GRID_MAXDIM) */
+	int ndim;
+	/** number of elements along each axis */
+	size_t dims[WS_CTUBE_GRID_MAXDIM];
+	/** bytes per element */
+	size_t elem_size;
+	/**
+	 * bytes between consecutive elements along each axis, or all 0 if the
+	 * array is packed. Lets e.g. the interior of a field with ghost cells
+	 * be published without copying it out first
+	 */
+	size_t strides[WS_CTUBE_GRID_MAXDIM];
+
+	/** element type (elem_size must match unless WS_CTUBE_ELEM_RAW) */
+	enum ws_ctube_elem_type type;
+	/**
+	 * number of downsampled levels to build once per publish (0 for none,
+	 * at most WS_CTUBE_GRID_MAXLEVEL): level l + 1 has (n + 1) / 2
+	 * elements along each axis where level l has n, so that clients can be
+	 * sent a coarser level (see README.md). Levels stop at 1 element
+	 */
+	int nlevel;
+	/** how levels are downsampled */
+	enum ws_ctube_lod_filter filter;
+};
+
+/** what ws_ctube_publish_quantized() converts values to */
+enum ws_ctube_quant_format {
+	/** IEEE half precision */
+	WS_CTUBE_QUANT_F16,
+	/** bfloat16: the upper 16 bits of a float, rounded */
+	WS_CTUBE_QUANT_BF16,
+	/** uint8_t q standing for min + q * (max - min) / 255 */
+	WS_CTUBE_QUANT_U8,
+	/** uint16_t q standing for min + q * (max - min) / 65535 */
+	WS_CTUBE_QUANT_U16
+};
+
+/** how ws_ctube_publish_quantized() converts an array */
+struct ws_ctube_quant {
+	/** type of the values given: WS_CTUBE_ELEM_F32 or WS_CTUBE_ELEM_F64 */
+	enum ws_ctube_elem_type type;
+	/** what they are sent as */
+	enum ws_ctube_quant_format format;
+	/**
+	 * range of the U8 and U16 formats (values outside are clamped), or
+	 * both 0 to use the minimum and maximum finite value of each publish
+	 */
+	double min;
+	double max;
+};
+
+/** memory usage of a ws_ctube, see ws_ctube_get_stats() */
+struct ws_ctube_stats {
+	/** bytes of broadcast buffers (and their deltas and compressed copies) currently referenced */
+	size_t bytes_in_flight;
+	/** maximum of bytes_in_flight so far */
+	size_t bytes_in_flight_peak;
+	/** bytes of unreferenced buffers kept for reuse */
+	size_t bytes_cached;
+	/** broadcasts/reservations refused because of mem_budget */
+	unsigned long nbudget_rejected;
+	/** clients disconnected because of mem_budget */
+	unsigned long nbudget_dropped;
+	/** broadcasts written to the log at opts.record_path */
+	unsigned long nrecorded;
+	/** broadcasts not written to it (recorder too far behind, or disk errors) */
+	unsigned long nrecord_dropped;
+	/** broadcasts written to the shared memory ring at opts.shm_path */
+	unsigned long nshm_written;
+	/** broadcasts not written to it (larger than the ring) */
+	unsigned long nshm_dropped;
+	/**
+	 * records ws_ctube_replay() skipped because they could not be
+	 * broadcast (e.g. rate-limited or refused by the budget for too long)
+	 */
+	unsigned long nreplay_skipped;
+};
+
+/** options for ws_ctube_open_opts(); set defaults with ws_ctube_opts_init() */
+struct ws_ctube_opts {
+	/** port for websocket server */
+	int port;
+	/** maximum number of websocket client connections allowed */
+	int max_nclient;
+	/** timeout (ms) for server starting and websocket handshake or 0 for no timeout */
+	int timeout_ms;
+	/** maximum number of broadcasts per second or 0 for no limit */
+	double max_broadcast_fps;
+
+	/**
+	 * expected bytes per broadcast or 0 (default): if nonzero,
+	 * prealloc_count buffers of this size are allocated and prefaulted
+	 * when opening so that broadcasting never calls the allocator in
+	 * steady state
+	 */
+	size_t prealloc_size;
+	/** number of buffers to preallocate (default 2) */
+	int prealloc_count;
+
+	/**
+	 * broadcast buffers of at least this many bytes are backed by 2 MB
+	 * huge pages (explicit if reserved, else transparent), falling back to
+	 * ordinary pages if unavailable; 0 (default) to never use huge pages
+	 */
+	size_t hugepage_threshold;
+
+	/**
+	 * allocator for small control objects: the ctube itself, data
+	 * descriptors, connection slabs and tables (default: malloc)
+	 */
+	struct ws_ctube_allocator ctrl_alloc;
+	/**
+	 * allocator for broadcast data buffers (default: malloc). If set,
+	 * hugepage_threshold is ignored: every buffer comes from this allocator
+	 */
+	struct ws_ctube_allocator payload_alloc;
+
+	/**
+	 * maximum bytes of broadcast buffers referenced by ctube and its
+	 * writers at once or 0 (default) for no limit. Each size class is
+	 * rounded up to a power of 2; allow at least two buffers (the current
+	 * broadcast and the next). Buffers kept for reuse are given up to stay
+	 * within the budget. Buffers for the deltas and compressed copies of a
+	 * broadcast count too: they only get what leaves room for the next
+	 * broadcast, and keyframes or uncompressed data are sent instead of
+	 * those that do not fit. Caller memory of
+	 * ws_ctube_broadcast_owned() and ws_ctube_broadcast_live() is not
+	 * counted.
+	 */
+	size_t mem_budget;
+	/** what to do when mem_budget would be exceeded (default WS_CTUBE_BUDGET_REJECT) */
+	enum ws_ctube_budget_policy budget_policy;
+
+	/**
+	 * number of threads (at most 64) that help encode large broadcasts in
+	 * chunks, e.g. deltas and permessage-deflate, or 0 (default) for the
+	 * writer that first needs an encoding to make it alone
+	 */
+	int encode_threads;
+
+	/**
+	 * if not NULL (default NULL), every broadcast is appended, with its
+	 * sequence number, time and channel, to a log of files
+	 * <record_path>.000000, <record_path>.000001, ... with a time index in
+	 * <record_path>.index (see README.md). Earlier files are kept: new
+	 * ones are numbered after them. Not referenced after opening
+	 */
+	const char *record_path;
+	/** bytes of each log file (default 64 MB), more for larger broadcasts */
+	size_t record_segment_size;
+	/**
+	 * bytes of broadcasts waiting to be recorded past which further ones
+	 * are dropped instead of held in memory (default 256 MB), or 0 for no
+	 * limit. These count towards mem_budget
+	 */
+	size_t record_backlog;
+
+	/**
+	 * if not NULL (default NULL), every broadcast is also written to a
+	 * ring in a file created at shm_path (e.g. "/dev/shm/ws_ctube"), for
+	 * processes on the same host to read with ws_ctube_shm_reader_open()
+	 * instead of a websocket. The file is removed when closing. Not
+	 * referenced after opening
+	 */
+	const char *shm_path;
+	/**
+	 * bytes of the ring (default 64 MB): the largest broadcast that fits
+	 * and how far behind a reader may fall before it skips ahead
+	 */
+	size_t shm_size;
+};
+
+/**
+ * ws_ctube_opts_init - set opts to defaults. port must still be set before
+ * calling ws_ctube_open_opts()
+ */
+void ws_ctube_opts_init(struct ws_ctube_opts *opts);
+
+/**
+ * ws_ctube_open_opts - like ws_ctube_open() but with more options
+ *
+ * @param opts options initialized with ws_ctube_opts_init(); not referenced
+ * after this returns
+ *
+ * @return on success, a struct ws_ctube* is returned; on failure,
+ * NULL is returned
+ */
+struct ws_ctube *ws_ctube_open_opts(const struct ws_ctube_opts *opts);
 
 /**
  * ws_ctube_open - create a ws_ctube websocket server. When finished, close with
@@ -61,7 +343,8 @@ void ws_ctube_close(struct ws_ctube *ctube);
  * If max_broadcast_fps was nonzero when ws_ctube_open was called, this function
  * is rate-limited accordingly and returns failure if called too soon.
  *
- * Data is copied to an internal out-buffer, then this function returns. Actual
+ * Data is copied to an internal out-buffer (recycled from earlier broadcasts
+ * of similar size), then this function returns. Actual
  * network operations will be handled internally and opaquely by separate
  * threads.
  *
@@ -80,18 +363,344 @@ void ws_ctube_close(struct ws_ctube *ctube);
  */
 int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_size);
 
+/**
+ * ws_ctube_broadcast_owned - tries to broadcast caller-owned memory to all
+ * connected websocket clients without copying it.
+ *
+ * Like ws_ctube_broadcast(), but on success ctube references data directly.
+ * The caller must not modify or free data until release_fn is called, which
+ * happens exactly once after the last writer is done sending it. release_fn
+ * may be called from any ws_ctube thread (or from within a later
+ * ws_ctube_broadcast*() or ws_ctube_close()), so it should be quick and
+ * thread-safe.
+ *
+ * On failure (e.g. rate-limited), release_fn is not called and the caller
+ * keeps ownership of data.
+ *
+ * @param ctube the websocket ctube
+ * @param data pointer to read-only data to broadcast
+ * @param data_size bytes of data
+ * @param release_fn called with (data, user) to give back data
+ * @param user passed to release_fn
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_broadcast_owned(struct ws_ctube *ctube, void *data, size_t data_size, ws_ctube_release_fn release_fn, void *user);
+
+/**
+ * ws_ctube_broadcast_live - tries to broadcast memory that the caller keeps
+ * modifying, without copying it up front.
+ *
+ * Writers send data directly from the caller's memory. Before modifying any
+ * part of data after this call, the caller must call ws_ctube_live_touch() on
+ * that part: chunks (of WS_CTUBE_LIVE_CHUNK_SIZE bytes) that writers may
+ * still be sending are then copied once, so every client receives data as it
+ * was at the time of broadcast. Cost is proportional to the modified chunks
+ * rather than to data_size.
+ *
+ * data must stay allocated until ws_ctube_close(). Call this and
+ * ws_ctube_live_touch() from one thread only or serialize externally.
+ *
+ * @param ctube the websocket ctube
+ * @param data pointer to live data to broadcast
+ * @param data_size bytes of data
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_broadcast_live(struct ws_ctube *ctube, void *data, size_t data_size);
+
+/**
+ * ws_ctube_live_touch - announce that [addr, addr + len) is about to be
+ * modified. Must be called before modifying memory previously passed to
+ * ws_ctube_broadcast_live(). Cheap when no broadcast of that memory can still
+ * be in flight.
+ *
+ * @param ctube the websocket ctube
+ * @param addr start of memory about to be modified
+ * @param len bytes about to be modified
+ */
+void ws_ctube_live_touch(struct ws_ctube *ctube, const void *addr, size_t len);
+
+/**
+ * ws_ctube_reserve - get a writable buffer owned by ctube that can be
+ * broadcast with ws_ctube_commit() without copying.
+ *
+ * The buffer is recycled from an internal pool once all writers are done
+ * with it, so that the producer can render directly into outgoing memory.
+ * Contents of the returned buffer are unspecified.
+ *
+ * Only one reservation may be outstanding: reserving again before committing
+ * reuses (and may move) the previous reservation. Call from one thread only or
+ * serialize externally.
+ *
+ * @param ctube the websocket ctube
+ * @param data_size bytes of data to reserve
+ *
+ * @return pointer to data_size writable bytes on success, NULL otherwise
+ */
+void *ws_ctube_reserve(struct ws_ctube *ctube, size_t data_size);
+
+/**
+ * ws_ctube_commit - tries to broadcast a buffer obtained from
+ * ws_ctube_reserve() to all connected websocket clients.
+ *
+ * Like ws_ctube_broadcast() but no copy is made. On success, ctube takes back
+ * ownership of data and it must not be written to anymore. On failure (e.g.
+ * rate-limited), the reservation stays valid and can be committed later or
+ * reused by ws_ctube_reserve().
+ *
+ * @param ctube the websocket ctube
+ * @param data pointer returned by the latest ws_ctube_reserve()
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_commit(struct ws_ctube *ctube, void *data);
+
+/**
+ * ws_ctube_channel_open - get the channel of ctube with the given name,
+ * creating it if needed.
+ *
+ * A channel is a separate stream on the same port and threads as ctube: a
+ * client connecting to ws://host:port/<name> is sent only what is published
+ * to that channel, and its writer only wakes for it. Clients whose request
+ * path names no open channel (e.g. "/") get the default channel, which is
+ * what ws_ctube_broadcast() and friends publish to. A client keeps the channel
+ * it connected to unless it sends "subscribe <name>" (see README.md), so open
+ * channels before clients connect or subscribe.
+ *
+ * @param ctube the websocket ctube
+ * @param name nonempty channel name of fewer than 64 bytes, without '/', '?'
+ * or '#', or NULL for the default channel
+ *
+ * @return the channel, valid until ws_ctube_close(), or NULL on failure
+ */
+struct ws_ctube_channel *ws_ctube_channel_open(struct ws_ctube *ctube, const char *name);
+
+/**
+ * ws_ctube_channel_set_snapshot - have each client that connects to channel
+ * sent a snapshot of the current state first, e.g. when the channel's
+ * broadcasts are updates that only make sense on top of it.
+ *
+ * snapshot_fn is called from the connection handler thread right after the
+ * handshake, so it should be quick. The client is sent the snapshot, in its
+ * encoding, then what is published to channel from when snapshot_fn was
+ * called; no other client is sent anything. Updates published while
+ * snapshot_fn runs may also be in the snapshot: number them if clients must
+ * skip those. Clients that switch to channel with "subscribe" are sent its
+ * latest broadcast as usual.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param snapshot_fn writes the snapshot, or NULL (default) for none: a new
+ * client is first sent the latest broadcast
+ * @param user passed to snapshot_fn
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_channel_set_snapshot(struct ws_ctube_channel *channel, ws_ctube_snapshot_fn snapshot_fn, void *user);
+
+/**
+ * ws_ctube_publish - tries to queue data for sending to the clients of
+ * channel.
+ *
+ * Like ws_ctube_broadcast(), with the rate limit applying to each channel
+ * separately. Different channels may be published to from different threads.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param data pointer to data to publish
+ * @param data_size bytes of data
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_publish(struct ws_ctube_channel *channel, const void *data, size_t data_size);
+
+/**
+ * ws_ctube_publish_grid - tries to queue a grid for sending to the clients of
+ * channel.
+ *
+ * Like ws_ctube_publish(), with the grid copied packed (row-major). Clients
+ * that declared a region of interest by sending "roi <lo> <hi> ..." (see
+ * README.md) are sent only that box of the grid, the others the whole grid.
+ * If grid->nlevel > 0, a pyramid of downsampled levels is built (here, once)
+ * and clients that asked for a level are sent that level instead.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param data pointer to the first element of the grid
+ * @param grid layout of data
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_publish_grid(struct ws_ctube_channel *channel, const void *data, const struct ws_ctube_grid *grid);
+
+/**
+ * ws_ctube_publish_quantized - tries to queue an array of floating-point
+ * values for sending to the clients of channel at lower precision.
+ *
+ * Like ws_ctube_publish(), with the values converted (here, once) to 16 or 8
+ * bits each. Clients are sent a 24 byte header (the format as 1 byte, 7 zero
+ * bytes, then min and max as doubles) followed by the converted values; see
+ * README.md.
+ *
+ * @param channel from ws_ctube_channel_open()
+ * @param data pointer to the values
+ * @param count number of values
+ * @param quant their type and how to convert them
+ *
+ * @return 0 on success, nonzero otherwise
+ */
+int ws_ctube_publish_quantized(struct ws_ctube_channel *channel, const void *data, size_t count, const struct ws_ctube_quant *quant);
+
+/** options for ws_ctube_replay(); set defaults with ws_ctube_replay_opts_init() */
+struct ws_ctube_replay_opts {
+	/**
+	 * 1 (default) to broadcast records with the timing they were recorded
+	 * with, N to go N times faster, or 0 to go as fast as possible
+	 */
+	double speed;
+	/**
+	 * skip records broadcast before this time (ns since 1970), found with
+	 * the time index, or 0 (default) to start at the beginning
+	 */
+	long long start_ns;
+	/** stop at the first record broadcast at or after this time, or 0 (default) at the end */
+	long long end_ns;
+};
+
+/** ws_ctube_replay_opts_init - set opts to defaults */
+void ws_ctube_replay_opts_init(struct ws_ctube_replay_opts *opts);
+
+/**
+ * ws_ctube_replay - broadcast the records of a log written with
+ * opts.record_path (see ws_ctube_open_opts()) to the clients of ctube, each
+ * to the channel it was recorded from (opened if needed).
+ *
+ * Blocks until the end of the log (or opts->end_ns) is reached. The files are
+ * mapped and read in place; each record is published like ws_ctube_publish()
+ * would (or ws_ctube_publish_grid(), for a grid), but not recorded again if the recorder is running. A record that
+ * cannot be published (e.g. rate-limited) is retried for up to 100 ms, then
+ * skipped and counted in nreplay_skipped of ws_ctube_get_stats(). Gaps
+ * between recording runs are waited out too at the recorded timing.
+ *
+ * @param ctube the websocket ctube
+ * @param path the record_path of the log
+ * @param opts options initialized with ws_ctube_replay_opts_init(), or NULL
+ * for defaults
+ *
+ * @return number of records broadcast (not counting skipped ones), or -1 if
+ * the log cannot be read
+ */
+long ws_ctube_replay(struct ws_ctube *ctube, const char *path, const struct ws_ctube_replay_opts *opts);
+
+struct ws_ctube_shm_reader;
+
+/** a broadcast read with ws_ctube_shm_read() */
+struct ws_ctube_shm_msg {
+	/** channel it was published to ("" for the default channel), valid until the next read */
+	const char *channel;
+	/** bytes of data */
+	size_t size;
+	/** sequence number, increasing across channels (as recorded with opts.record_path) */
+	unsigned long id;
+	/** CLOCK_REALTIME when it was broadcast, in ns since 1970 */
+	long long time_ns;
+	/** broadcasts overwritten before they could be read, since the last one read */
+	unsigned long nmissed;
+};
+
+/**
+ * ws_ctube_shm_reader_open - map the ring that a ctube opened with
+ * opts.shm_path writes to, from any process on the same host. Reading
+ * starts at its latest broadcast
+ *
+ * @param path the shm_path of the ctube
+ *
+ * @return reader to close with ws_ctube_shm_reader_close(), or NULL if there
+ * is no such ring
+ */
+struct ws_ctube_shm_reader *ws_ctube_shm_reader_open(const char *path);
+
+/** ws_ctube_shm_reader_close - unmap the ring and free reader */
+void ws_ctube_shm_reader_close(struct ws_ctube_shm_reader *reader);
+
+/**
+ * ws_ctube_shm_read - copy the next broadcast from the ring.
+ *
+ * Readers do not slow the producer down: a reader that falls a whole ring
+ * behind skips to the latest broadcast (counted in msg->nmissed). Waiting
+ * sleeps on a futex, which the producer only wakes if a reader is asleep.
+ *
+ * @param reader from ws_ctube_shm_reader_open()
+ * @param buf receives the data
+ * @param max bytes of buf
+ * @param msg set to the channel, size, id and time of the broadcast (may be NULL)
+ * @param timeout_ms -1 to wait for a broadcast, 0 to return at once, or ms to wait at most
+ *
+ * @return size of the broadcast (if more than max, nothing was read: call
+ * again with a larger buf), 0 if none came in time, or -1 if the producer has
+ * closed its ctube (reopen the path once it is back)
+ */
+long ws_ctube_shm_read(struct ws_ctube_shm_reader *reader, void *buf, size_t max, struct ws_ctube_shm_msg *msg, int timeout_ms);
+
+/**
+ * ws_ctube_get_stats - get memory usage of ctube. May be called from any
+ * thread; the values are a snapshot
+ *
+ * @param ctube the websocket ctube
+ * @param stats set to the current stats
+ */
+void ws_ctube_get_stats(struct ws_ctube *ctube, struct ws_ctube_stats *stats);
+
+#if defined(__cplusplus) && __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+extern "C++" {
+#include <memory_resource>
+
+/**
+ * ws_ctube_pmr_allocator - make a ws_ctube_allocator that allocates from a
+ * std::pmr::memory_resource, e.g. for opts.payload_alloc
+ *
+ * @param resource must outlive the ctube and be thread-safe (e.g. a
+ * std::pmr::synchronized_pool_resource)
+ */
+inline struct ws_ctube_allocator ws_ctube_pmr_allocator(std::pmr::memory_resource *resource)
+{
+	struct ws_ctube_allocator allocator;
+
+	allocator.alloc = [](size_t size, size_t align, void *user) -> void * {
+		try {
+			return static_cast<std::pmr::memory_resource *>(user)->allocate(size, align);
+		} catch (...) {
+			return nullptr;
+		}
+	};
+	allocator.free = [](void *ptr, size_t size, size_t align, void *user) {
+		static_cast<std::pmr::memory_resource *>(user)->deallocate(ptr, size, align);
+	};
+	allocator.user = resource;
+	return allocator;
+}
+} /* extern "C++" */
+#endif /* __has_include(<memory_resource>) */
+#endif /* __cplusplus >= 201703L */
+
 #endif /* WS_CTUBE_API_H */
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
-#include <unistd.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <float.h>
 
 
@@ -129,6 +738,23 @@ int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_siz
 
 
 
+#ifndef WS_CTUBE_CACHE_LINE_H
+#define WS_CTUBE_CACHE_LINE_H
+
+/** bytes per cache line (x86-64 and most arm64) */
+#define WS_CTUBE_CACHE_LINE 64
+
+/**
+ * start a struct member (and the members following it) on a new cache line,
+ * so that it does not share a line with members written by other threads
+ */
+#define ws_ctube_cache_aligned __attribute__((aligned(WS_CTUBE_CACHE_LINE)))
+
+#endif /* WS_CTUBE_CACHE_LINE_H */
+
+
+
+
 #ifndef WS_CTUBE_REF_COUNT_H
 #define WS_CTUBE_REF_COUNT_H
 
@@ -140,24 +766,45 @@ struct ws_ctube_ref_count {
 
 static int ws_ctube_ref_count_init(struct ws_ctube_ref_count *ref_count)
 {
-	__atomic_store_n(&ref_count->refc, (int)0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ref_count->refc, (int)0, __ATOMIC_RELAXED);
 	return 0;
 }
 
 static void ws_ctube_ref_count_destroy(struct ws_ctube_ref_count *ref_count)
 {
-	__atomic_store_n(&ref_count->refc, (int)(-1), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ref_count->refc, (int)(-1), __ATOMIC_RELAXED);
+}
+
+/** current count: only exact if no other thread can acquire concurrently */
+static inline int ws_ctube_ref_count_load(struct ws_ctube_ref_count *ref_count)
+{
+	return __atomic_load_n(&ref_count->refc, __ATOMIC_ACQUIRE);
+}
+
+static inline void _ws_ctube_ref_count_inc(struct ws_ctube_ref_count *ref_count)
+{
+	__atomic_add_fetch(&ref_count->refc, (int)1, __ATOMIC_RELAXED);
+}
+
+/** @return the remaining count: if 0, the caller may free the object */
+static inline int _ws_ctube_ref_count_dec(struct ws_ctube_ref_count *ref_count)
+{
+	const int refc = __atomic_sub_fetch(&ref_count->refc, (int)1, __ATOMIC_RELEASE);
+	if (refc == 0) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	return refc;
 }
 
 #ifndef __cplusplus
 #define ws_ctube_ref_count_acquire(ptr, ref_count_member) do { \
 		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_ref_count), "type mismatch in ws_ctube_ref_count_acquire()"); \
-		__atomic_add_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		_ws_ctube_ref_count_inc(&(ptr)->ref_count_member); \
 	} while (0);
 
 #define ws_ctube_ref_count_release(ptr, ref_count_member, release_routine) do { \
 		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_ref_count), "type mismatch in ws_ctube_ref_count_release()"); \
-		const int _ws_ctube_ref_count_refc = __atomic_sub_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		const int _ws_ctube_ref_count_refc = _ws_ctube_ref_count_dec(&(ptr)->ref_count_member); \
 		if (_ws_ctube_ref_count_refc <= 0) { \
 			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
 				release_routine(ptr); \
@@ -168,11 +815,11 @@ static void ws_ctube_ref_count_destroy(struct ws_ctube_ref_count *ref_count)
 	} while (0);
 #else /* __cplusplus */
 #define ws_ctube_ref_count_acquire(ptr, ref_count_member) do { \
-		__atomic_add_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		_ws_ctube_ref_count_inc(&(ptr)->ref_count_member); \
 	} while (0);
 
 #define ws_ctube_ref_count_release(ptr, ref_count_member, release_routine) do { \
-		const int _ws_ctube_ref_count_refc = __atomic_sub_fetch(&(ptr)->ref_count_member.refc, (int)1, __ATOMIC_SEQ_CST); \
+		const int _ws_ctube_ref_count_refc = _ws_ctube_ref_count_dec(&(ptr)->ref_count_member); \
 		if (_ws_ctube_ref_count_refc <= 0) { \
 			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
 				release_routine(ptr); \
@@ -183,101 +830,332 @@ static void ws_ctube_ref_count_destroy(struct ws_ctube_ref_count *ref_count)
 	} while (0);
 #endif /* __cplusplus */
 
-#endif /* WS_CTUBE_REF_COUNT_H */
-
+#ifndef WS_CTUBE_REF_COUNT_NSHARD
+#define WS_CTUBE_REF_COUNT_NSHARD 16
+#endif /* WS_CTUBE_REF_COUNT_NSHARD */
 
+/* a drained shard holds about this value: its threads count in central */
+#define WS_CTUBE_REF_COUNT_DRAINED (LONG_MIN / 2)
+/* added to central while shared so that it cannot reach 0 */
+#define WS_CTUBE_REF_COUNT_BIAS (LONG_MAX / 2)
 
+/**
+ * reference count split into per-thread shards on their own cache lines
+ *
+ * it starts (and ends) in atomic mode where every thread counts in central,
+ * exactly like ws_ctube_ref_count. While shared, threads count in their own
+ * shard without contending and central is biased so that no release can see
+ * 0. Unsharing drains every shard back into central and removes the bias,
+ * after which the last release frees the object as usual.
+ */
+struct ws_ctube_sharded_ref_count {
+	long central ws_ctube_cache_aligned;
+	struct {
+		long count ws_ctube_cache_aligned;
+	} shard[WS_CTUBE_REF_COUNT_NSHARD];
+};
 
-#ifndef WS_CTUBE_LIST_H
-#define WS_CTUBE_LIST_H
+/* threads are given shards round-robin the first time they count */
+static unsigned _ws_ctube_ref_count_nthread;
+static __thread unsigned _ws_ctube_ref_count_shard_idx;
 
+static inline unsigned _ws_ctube_ref_count_shard(void)
+{
+	unsigned idx = _ws_ctube_ref_count_shard_idx;
 
-/** including this in a larger struct allows it to be a part of a list */
-struct ws_ctube_list_node {
-	struct ws_ctube_list_node *prev;
-	struct ws_ctube_list_node *next;
-	pthread_mutex_t mutex;
-};
+	if (ws_ctube_unlikely(idx == 0)) {
+		idx = 1 + __atomic_fetch_add(&_ws_ctube_ref_count_nthread, 1u, __ATOMIC_RELAXED) % WS_CTUBE_REF_COUNT_NSHARD;
+		_ws_ctube_ref_count_shard_idx = idx;
+	}
+	return idx - 1;
+}
 
-static int ws_ctube_list_node_init(struct ws_ctube_list_node *node)
+static inline int ws_ctube_sharded_ref_count_init(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	node->prev = NULL;
-	node->next = NULL;
-	pthread_mutex_init(&node->mutex, NULL);
+	__atomic_store_n(&ref_count->central, (long)0, __ATOMIC_RELAXED);
+	for (int i = 0; i < WS_CTUBE_REF_COUNT_NSHARD; i++) {
+		__atomic_store_n(&ref_count->shard[i].count, (long)WS_CTUBE_REF_COUNT_DRAINED, __ATOMIC_RELAXED);
+	}
 	return 0;
 }
 
-static void ws_ctube_list_node_destroy(struct ws_ctube_list_node *node)
+static inline void ws_ctube_sharded_ref_count_destroy(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	node->prev = NULL;
-	node->next = NULL;
-	pthread_mutex_destroy(&node->mutex);
+	__atomic_store_n(&ref_count->central, (long)(-1), __ATOMIC_RELAXED);
 }
 
-/** thread-safe circular doubly-linked list */
-struct ws_ctube_list {
-	struct ws_ctube_list_node head;
-	int len;
-	pthread_mutex_t mutex;
-};
-
-static int ws_ctube_list_init(struct ws_ctube_list *l)
+/**
+ * switch to sharded counting: the caller must hold a reference and
+ * share/unshare calls on the same count must not run concurrently
+ */
+static inline void ws_ctube_sharded_ref_count_share(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	ws_ctube_list_node_init(&l->head);
-	l->head.next = &l->head;
-	l->head.prev = &l->head;
-	l->len = 0;
-	pthread_mutex_init(&l->mutex, NULL);
-	return 0;
+	__atomic_add_fetch(&ref_count->central, (long)WS_CTUBE_REF_COUNT_BIAS, __ATOMIC_RELAXED);
+	for (int i = 0; i < WS_CTUBE_REF_COUNT_NSHARD; i++) {
+		__atomic_exchange_n(&ref_count->shard[i].count, (long)0, __ATOMIC_ACQ_REL);
+	}
 }
 
-static void ws_ctube_list_destroy(struct ws_ctube_list *l)
+/** switch back to atomic counting: same requirements as sharing */
+static inline void ws_ctube_sharded_ref_count_unshare(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	ws_ctube_list_node_destroy(&l->head);
-	pthread_mutex_destroy(&l->mutex);
-}
+	long sum = 0;
 
-static void _ws_ctube_list_add_after(struct ws_ctube_list_node *prior, struct ws_ctube_list_node *new_node)
-{
-	new_node->prev = prior;
-	new_node->next = prior->next;
-	prior->next->prev = new_node;
-	prior->next = new_node;
+	for (int i = 0; i < WS_CTUBE_REF_COUNT_NSHARD; i++) {
+		sum += __atomic_exchange_n(&ref_count->shard[i].count, (long)WS_CTUBE_REF_COUNT_DRAINED, __ATOMIC_ACQ_REL);
+	}
+	__atomic_add_fetch(&ref_count->central, sum - (long)WS_CTUBE_REF_COUNT_BIAS, __ATOMIC_RELEASE);
 }
 
-static void _ws_ctube_list_node_unlink(struct ws_ctube_list_node *node)
+/** current count: only exact while not shared and nobody acquires concurrently */
+static inline long ws_ctube_sharded_ref_count_load(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	node->next->prev = node->prev;
-	node->prev->next = node->next;
-	node->next = NULL;
-	node->prev = NULL;
+	return __atomic_load_n(&ref_count->central, __ATOMIC_ACQUIRE);
 }
 
-static inline void ws_ctube_list_unlink(struct ws_ctube_list *l, struct ws_ctube_list_node *node)
+static inline void _ws_ctube_sharded_ref_count_inc(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	pthread_mutex_lock(&l->mutex);
-	pthread_mutex_lock(&node->mutex);
-	_ws_ctube_list_node_unlink(node);
-	l->len--;
-	pthread_mutex_unlock(&node->mutex);
-	pthread_mutex_unlock(&l->mutex);
+	const long old = __atomic_fetch_add(&ref_count->shard[_ws_ctube_ref_count_shard()].count, (long)1, __ATOMIC_RELAXED);
+	if (ws_ctube_unlikely(old <= WS_CTUBE_REF_COUNT_DRAINED / 2)) {
+		__atomic_add_fetch(&ref_count->central, (long)1, __ATOMIC_RELAXED);
+	}
 }
 
-static inline int ws_ctube_list_push_front(struct ws_ctube_list *l, struct ws_ctube_list_node *node)
+/** @return the remaining count (positive while shared): if 0, the caller may free */
+static inline long _ws_ctube_sharded_ref_count_dec(struct ws_ctube_sharded_ref_count *ref_count)
 {
-	int retval = 0;
-	pthread_mutex_lock(&l->mutex);
-	pthread_mutex_lock(&node->mutex);
+	long refc;
+	const long old = __atomic_fetch_sub(&ref_count->shard[_ws_ctube_ref_count_shard()].count, (long)1, __ATOMIC_RELEASE);
+	if (ws_ctube_likely(old > WS_CTUBE_REF_COUNT_DRAINED / 2)) {
+		return 1;
+	}
 
-	if (node->next != NULL || node->prev != NULL) {
-		retval = -1;
-		goto out;
+	refc = __atomic_sub_fetch(&ref_count->central, (long)1, __ATOMIC_RELEASE);
+	if (refc == 0) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	return refc;
+}
+
+#ifndef __cplusplus
+#define ws_ctube_sharded_ref_count_acquire(ptr, ref_count_member) do { \
+		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_sharded_ref_count), "type mismatch in ws_ctube_sharded_ref_count_acquire()"); \
+		_ws_ctube_sharded_ref_count_inc(&(ptr)->ref_count_member); \
+	} while (0);
+
+#define ws_ctube_sharded_ref_count_release(ptr, ref_count_member, release_routine) do { \
+		_Static_assert(__builtin_types_compatible_p(typeof((ptr)->ref_count_member), struct ws_ctube_sharded_ref_count), "type mismatch in ws_ctube_sharded_ref_count_release()"); \
+		const long _ws_ctube_ref_count_refc = _ws_ctube_sharded_ref_count_dec(&(ptr)->ref_count_member); \
+		if (_ws_ctube_ref_count_refc <= 0) { \
+			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
+				release_routine(ptr); \
+			} else { \
+				raise(SIGSEGV); \
+			} \
+		} \
+	} while (0);
+#else /* __cplusplus */
+#define ws_ctube_sharded_ref_count_acquire(ptr, ref_count_member) do { \
+		_ws_ctube_sharded_ref_count_inc(&(ptr)->ref_count_member); \
+	} while (0);
+
+#define ws_ctube_sharded_ref_count_release(ptr, ref_count_member, release_routine) do { \
+		const long _ws_ctube_ref_count_refc = _ws_ctube_sharded_ref_count_dec(&(ptr)->ref_count_member); \
+		if (_ws_ctube_ref_count_refc <= 0) { \
+			if (ws_ctube_likely(_ws_ctube_ref_count_refc == 0)) { \
+				release_routine(ptr); \
+			} else { \
+				raise(SIGSEGV); \
+			} \
+		} \
+	} while (0);
+
+extern "C++" {
+/**
+ * ws_ctube_ref - owning handle to one reference of a T counted by its
+ * ws_ctube_ref_count member, like boost::intrusive_ptr
+ *
+ * copying acquires another reference; moving hands the reference over
+ * without touching the count; the destructor releases with release_routine
+ */
+template <typename T, struct ws_ctube_ref_count T::*ref_count_member, void (*release_routine)(T *)>
+class ws_ctube_ref {
+public:
+	ws_ctube_ref() noexcept : ptr(nullptr) {}
+
+	/** acquire a new reference to p (may be NULL) */
+	explicit ws_ctube_ref(T *p) noexcept : ptr(p)
+	{
+		if (ptr != nullptr) {
+			_ws_ctube_ref_count_inc(&(ptr->*ref_count_member));
+		}
+	}
+
+	/** take over a reference to p already held by the caller */
+	static ws_ctube_ref adopt(T *p) noexcept
+	{
+		ws_ctube_ref ref;
+		ref.ptr = p;
+		return ref;
+	}
+
+	ws_ctube_ref(const ws_ctube_ref &other) noexcept : ws_ctube_ref(other.ptr) {}
+
+	ws_ctube_ref(ws_ctube_ref &&other) noexcept : ptr(other.ptr)
+	{
+		other.ptr = nullptr;
+	}
+
+	ws_ctube_ref &operator=(const ws_ctube_ref &other) noexcept
+	{
+		ws_ctube_ref(other).swap(*this);
+		return *this;
+	}
+
+	ws_ctube_ref &operator=(ws_ctube_ref &&other) noexcept
+	{
+		ws_ctube_ref(static_cast<ws_ctube_ref &&>(other)).swap(*this);
+		return *this;
+	}
+
+	~ws_ctube_ref()
+	{
+		reset();
+	}
+
+	/** release the held reference, if any */
+	void reset() noexcept
+	{
+		T *p = ptr;
+		ptr = nullptr;
+		if (p == nullptr) {
+			return;
+		}
+
+		const int refc = _ws_ctube_ref_count_dec(&(p->*ref_count_member));
+		if (refc <= 0) {
+			if (ws_ctube_likely(refc == 0)) {
+				release_routine(p);
+			} else {
+				raise(SIGSEGV);
+			}
+		}
+	}
+
+	/** give the held reference back to the caller */
+	T *detach() noexcept
+	{
+		T *p = ptr;
+		ptr = nullptr;
+		return p;
+	}
+
+	void swap(ws_ctube_ref &other) noexcept
+	{
+		T *p = ptr;
+		ptr = other.ptr;
+		other.ptr = p;
+	}
+
+	T *get() const noexcept { return ptr; }
+	T &operator*() const noexcept { return *ptr; }
+	T *operator->() const noexcept { return ptr; }
+	explicit operator bool() const noexcept { return ptr != nullptr; }
+
+private:
+	T *ptr;
+};
+} /* extern "C++" */
+#endif /* __cplusplus */
+
+#endif /* WS_CTUBE_REF_COUNT_H */
+
+
+
+
+#ifndef WS_CTUBE_LIST_H
+#define WS_CTUBE_LIST_H
+
+
+/** including this in a larger struct allows it to be a part of a list */
+struct ws_ctube_list_node {
+	struct ws_ctube_list_node *prev;
+	struct ws_ctube_list_node *next;
+};
+
+static int ws_ctube_list_node_init(struct ws_ctube_list_node *node)
+{
+	node->prev = NULL;
+	node->next = NULL;
+	return 0;
+}
+
+static void ws_ctube_list_node_destroy(struct ws_ctube_list_node *node)
+{
+	node->prev = NULL;
+	node->next = NULL;
+}
+
+/** thread-safe circular doubly-linked list: nodes are protected by the list mutex */
+struct ws_ctube_list {
+	struct ws_ctube_list_node head;
+	int len;
+	pthread_mutex_t mutex;
+};
+
+static int ws_ctube_list_init(struct ws_ctube_list *l)
+{
+	ws_ctube_list_node_init(&l->head);
+	l->head.next = &l->head;
+	l->head.prev = &l->head;
+	l->len = 0;
+	pthread_mutex_init(&l->mutex, NULL);
+	return 0;
+}
+
+static void ws_ctube_list_destroy(struct ws_ctube_list *l)
+{
+	ws_ctube_list_node_destroy(&l->head);
+	pthread_mutex_destroy(&l->mutex);
+}
+
+static void _ws_ctube_list_add_after(struct ws_ctube_list_node *prior, struct ws_ctube_list_node *new_node)
+{
+	new_node->prev = prior;
+	new_node->next = prior->next;
+	prior->next->prev = new_node;
+	prior->next = new_node;
+}
+
+static void _ws_ctube_list_node_unlink(struct ws_ctube_list_node *node)
+{
+	node->next->prev = node->prev;
+	node->prev->next = node->next;
+	node->next = NULL;
+	node->prev = NULL;
+}
+
+static inline void ws_ctube_list_unlink(struct ws_ctube_list *l, struct ws_ctube_list_node *node)
+{
+	pthread_mutex_lock(&l->mutex);
+	_ws_ctube_list_node_unlink(node);
+	l->len--;
+	pthread_mutex_unlock(&l->mutex);
+}
+
+static inline int ws_ctube_list_push_front(struct ws_ctube_list *l, struct ws_ctube_list_node *node)
+{
+	int retval = 0;
+	pthread_mutex_lock(&l->mutex);
+
+	if (node->next != NULL || node->prev != NULL) {
+		retval = -1;
+		goto out;
 	}
 	_ws_ctube_list_add_after(&l->head, node);
 	l->len++;
 
 out:
-	pthread_mutex_unlock(&node->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return retval;
 }
@@ -286,7 +1164,6 @@ static inline int ws_ctube_list_push_back(struct ws_ctube_list *l, struct ws_ctu
 {
 	int retval = 0;
 	pthread_mutex_lock(&l->mutex);
-	pthread_mutex_lock(&node->mutex);
 
 	if (node->next != NULL || node->prev != NULL) {
 		retval = -1;
@@ -296,7 +1173,6 @@ static inline int ws_ctube_list_push_back(struct ws_ctube_list *l, struct ws_ctu
 	l->len++;
 
 out:
-	pthread_mutex_unlock(&node->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return retval;
 }
@@ -311,12 +1187,10 @@ static inline struct ws_ctube_list_node *ws_ctube_list_pop_front(struct ws_ctube
 		return NULL;
 	}
 	front = l->head.next;
-	pthread_mutex_lock(&front->mutex);
 
 	_ws_ctube_list_node_unlink(front);
 	l->len--;
 
-	pthread_mutex_unlock(&front->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return front;
 }
@@ -331,12 +1205,10 @@ static inline struct ws_ctube_list_node *ws_ctube_list_pop_back(struct ws_ctube_
 		return NULL;
 	}
 	back = l->head.prev;
-	pthread_mutex_lock(&back->mutex);
 
 	_ws_ctube_list_node_unlink(back);
 	l->len--;
 
-	pthread_mutex_unlock(&back->mutex);
 	pthread_mutex_unlock(&l->mutex);
 	return back;
 }
@@ -362,1611 +1234,8084 @@ static inline struct ws_ctube_list_node *ws_ctube_list_pop_back(struct ws_ctube_
 #endif /* WS_CTUBE_LIST_H */
 
 
-#ifndef WS_CTUBE_CRYPT_H
-#define WS_CTUBE_CRYPT_H
 
 
-void ws_ctube_b64_encode(unsigned char *out, const unsigned char *in, size_t in_bytes);
-void ws_ctube_sha1sum(unsigned char *out, const unsigned char *in, size_t len);
+#ifndef WS_CTUBE_MPSC_QUEUE_H
+#define WS_CTUBE_MPSC_QUEUE_H
 
-#endif /* WS_CTUBE_CRYPT_H */
 
+/** including this in a larger struct allows it to be in a mpsc_queue */
+struct ws_ctube_mpsc_node {
+	struct ws_ctube_mpsc_node *next;
+};
 
+struct ws_ctube_mpsc_queue {
+	/* producers: most recently pushed node */
+	struct ws_ctube_mpsc_node *head ws_ctube_cache_aligned;
+	/* consumer: next node to pop */
+	struct ws_ctube_mpsc_node *tail ws_ctube_cache_aligned;
+	struct ws_ctube_mpsc_node stub;
+};
 
+static int ws_ctube_mpsc_queue_init(struct ws_ctube_mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	__atomic_store_n(&q->head, &q->stub, __ATOMIC_RELAXED);
+	q->tail = &q->stub;
+	return 0;
+}
 
-#ifndef WS_CTUBE_SOCKET_H
-#define WS_CTUBE_SOCKET_H
+static void ws_ctube_mpsc_queue_destroy(struct ws_ctube_mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = NULL;
+	q->tail = NULL;
+}
 
+/** thread-safe, lock-free */
+static inline void ws_ctube_mpsc_queue_push(struct ws_ctube_mpsc_queue *q, struct ws_ctube_mpsc_node *node)
+{
+	struct ws_ctube_mpsc_node *prev;
 
-#ifndef MSG_NOSIGNAL
-#define MSG_NOSIGNAL 0
-#endif
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
 
-/**
- * send all characters in buf through a socket
- *
- * @param fd file descriptor
- * @param buf buffer
- * @param buf_size size of buffer in bytes
- *
- * @return 0 on success, -1 otherwise
- */
-static inline int ws_ctube_socket_send_all(const int fd, const char *buf, ssize_t buf_size)
+/** single consumer only: @return oldest node or NULL if (momentarily) empty */
+static inline struct ws_ctube_mpsc_node *ws_ctube_mpsc_queue_pop(struct ws_ctube_mpsc_queue *q)
 {
-	while (buf_size > 0) {
-		ssize_t nsent = send(fd, buf, buf_size, MSG_NOSIGNAL);
-		if (nsent < 1) {
-			return -1;
+	struct ws_ctube_mpsc_node *tail = q->tail;
+	struct ws_ctube_mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	/* skip over stub */
+	if (tail == &q->stub) {
+		if (next == NULL) {
+			return NULL;
 		}
-		buf += nsent;
-		buf_size -= nsent;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
 	}
 
-	return 0;
-}
-
-/**
- * receive all characters up to buf_size or when delim is encountered
- *
- * @param fd file descriptor
- * @param buf buffer to read into
- * @param buf_size size of buffer (including '\0' if delim is not NULL)
- * @param delim should be a null-terminated string or NULL
- * if delim is NULL, receive up to buf_size bytes
- * if delim is not NULL, receive up to buf_size - 1 bytes or until delim is found
- *
- * @return 0 on success, -1 otherwise
- */
-static inline int ws_ctube_socket_recv_all(const int fd, char *const buf, const ssize_t buf_size, const char *delim)
-{
-	char *remain_buf = buf;
-	ssize_t remain_size;
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
 
-	if (buf_size <= 0) {
-		return 0;
+	/* tail is the last node unless a producer is mid-push */
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
 	}
 
-	if (delim != NULL) {
-		remain_size = buf_size - 1;
-		buf[buf_size - 1] = '\0';
-	} else {
-		remain_size = buf_size;
+	/* re-insert stub so that tail can be popped */
+	ws_ctube_mpsc_queue_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
 	}
+	return NULL;
+}
 
-	while (remain_size > 0) {
-		ssize_t nrecv = recv(fd, remain_buf, remain_size, MSG_NOSIGNAL);
-		if (nrecv < 1) {
-			return -1;
-		}
-		remain_buf += nrecv;
-		remain_size -= nrecv;
+#endif /* WS_CTUBE_MPSC_QUEUE_H */
 
-		/* look for delim */
-		if (delim != NULL && remain_size > 0) {
-			*remain_buf = '\0';
-			char *dpos = strstr(buf, delim);
-			if (dpos == NULL) {
-				continue;
-			}
 
-			dpos += strlen(delim);
-			*dpos = '\0';
-			return 0;
-		}
-	}
 
+
+#ifndef WS_CTUBE_RECLAIM_H
+#define WS_CTUBE_RECLAIM_H
+
+
+struct ws_ctube_reclaim_node;
+
+typedef void (*ws_ctube_reclaim_fn)(struct ws_ctube_reclaim_node *node);
+
+/** including this in a larger struct allows it to be reclaimed in the background */
+struct ws_ctube_reclaim_node {
+	struct ws_ctube_mpsc_node qnode;
+	/* called on the reclaimer thread with this node */
+	ws_ctube_reclaim_fn reclaim;
+};
+
+struct ws_ctube_reclaimer {
+	struct ws_ctube_mpsc_queue queue;
+	/* set to wake the reclaimer thread */
+	int pred ws_ctube_cache_aligned;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* nodes are reclaimed by the caller of push if the thread is not running */
+	int running;
+	pthread_t tid;
+};
+
+static int ws_ctube_reclaimer_init(struct ws_ctube_reclaimer *reclaimer)
+{
+	ws_ctube_mpsc_queue_init(&reclaimer->queue);
+	reclaimer->pred = 0;
+	pthread_mutex_init(&reclaimer->mutex, NULL);
+	pthread_cond_init(&reclaimer->cond, NULL);
+	reclaimer->running = 0;
 	return 0;
 }
 
-static inline int ws_ctube_bind_server(int server_sock, int port)
+static void ws_ctube_reclaimer_destroy(struct ws_ctube_reclaimer *reclaimer)
 {
-	struct sockaddr_in sa;
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = htonl(INADDR_ANY);
-	sa.sin_port = htons(port);
-	return bind(server_sock, (struct sockaddr *)&sa, sizeof(sa));
+	ws_ctube_mpsc_queue_destroy(&reclaimer->queue);
+	reclaimer->pred = 0;
+	pthread_mutex_destroy(&reclaimer->mutex);
+	pthread_cond_destroy(&reclaimer->cond);
+	reclaimer->running = 0;
 }
 
-#endif /* WS_CTUBE_SOCKET_H */
+/** reclaim all queued nodes: only one thread at a time may drain */
+static void _ws_ctube_reclaimer_drain(struct ws_ctube_reclaimer *reclaimer)
+{
+	struct ws_ctube_mpsc_node *qnode;
+	struct ws_ctube_reclaim_node *node;
 
+	while ((qnode = ws_ctube_mpsc_queue_pop(&reclaimer->queue)) != NULL) {
+		node = ws_ctube_container_of(qnode, typeof(*node), qnode);
+		node->reclaim(node);
+	}
+}
 
-#ifndef WS_CTUBE_WS_BASE_H
-#define WS_CTUBE_WS_BASE_H
+/** thread-safe, lock-free: have reclaim(node) called on the reclaimer thread */
+static void ws_ctube_reclaimer_push(struct ws_ctube_reclaimer *reclaimer, struct ws_ctube_reclaim_node *node, ws_ctube_reclaim_fn reclaim)
+{
+	node->reclaim = reclaim;
 
+	if (!__atomic_load_n(&reclaimer->running, __ATOMIC_SEQ_CST)) {
+		reclaim(node);
+		return;
+	}
 
-#define WS_CTUBE_FRAME_HDR_SIZE 2
-#define WS_CTUBE_MAX_PAYLD_SIZE 125
+	ws_ctube_mpsc_queue_push(&reclaimer->queue, &node->qnode);
 
-/**
- * make a websocket frame
- *
- * @param frame pointer to buffer where frame shall be written; needs to have
- * size of at least WS_CTUBE_FRAME_HDR_SIZE + WS_CTUBE_MAX_PAYLD_SIZE bytes
- * @param msg pointer to data
- * @param msg_size bytes of message
- * @param first whether this is the first frame in a sequence
- *
- * @return number of bytes of msg contained in frame
- */
-int ws_ctube_ws_mkframe(char *frame, const char *msg, size_t msg_size, int first);
-
-int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size);
-int ws_ctube_ws_recv(int conn, char *msg, int *msg_size, size_t max_msg_size);
-int ws_ctube_ws_is_ping(const char *msg, int msg_size);
-int ws_ctube_ws_pong(int conn, const char *msg, int msg_size);
-int ws_ctube_ws_handshake(int conn, const struct timeval *timeout);
-
-#endif /* WS_CTUBE_WS_BASE_H */
-
-
-#ifndef WS_CTUBE_STRUCT_H
-#define WS_CTUBE_STRUCT_H
-
-
-/** holds data to be sent/received over the network */
-struct ws_ctube_data {
-	void *data;
-	size_t data_size;
+	/* wake reclaimer unless a wakeup is already pending */
+	if (!__atomic_exchange_n(&reclaimer->pred, (int)1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&reclaimer->mutex);
+		pthread_mutex_unlock(&reclaimer->mutex);
+		pthread_cond_signal(&reclaimer->cond);
+	}
+}
 
-	pthread_mutex_t mutex;
-	struct ws_ctube_list_node lnode;
-	struct ws_ctube_ref_count refc;
-};
+static void _ws_ctube_reclaimer_cleanup_unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
 
-static int ws_ctube_data_init(struct ws_ctube_data *ws_ctube_data, const void *data, size_t data_size)
+static void *ws_ctube_reclaimer_main(void *arg)
 {
-	if (data_size > 0) {
-		ws_ctube_data->data = (typeof(ws_ctube_data->data))malloc(data_size);
-		if (ws_ctube_data->data == NULL) {
-			goto out_nodata;
-		}
+	struct ws_ctube_reclaimer *reclaimer = (struct ws_ctube_reclaimer *)arg;
+	int oldstate, statevar;
 
-		if (data != NULL) {
-			memcpy(ws_ctube_data->data, data, data_size);
+	for (;;) {
+		pthread_mutex_lock(&reclaimer->mutex);
+		pthread_cleanup_push(_ws_ctube_reclaimer_cleanup_unlock, &reclaimer->mutex);
+		while (!__atomic_load_n(&reclaimer->pred, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&reclaimer->cond, &reclaimer->mutex);
 		}
-	}
+		pthread_mutex_unlock(&reclaimer->mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_reclaimer_cleanup_unlock */
 
-	ws_ctube_data->data_size = data_size;
+		/* cleared before draining: pushes from now on wake us again */
+		__atomic_store_n(&reclaimer->pred, (int)0, __ATOMIC_SEQ_CST);
 
-	pthread_mutex_init(&ws_ctube_data->mutex, NULL);
-	ws_ctube_list_node_init(&ws_ctube_data->lnode);
-	ws_ctube_ref_count_init(&ws_ctube_data->refc);
-	return 0;
+		/* reclaim callbacks are not cancellation safe */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		_ws_ctube_reclaimer_drain(reclaimer);
+		pthread_setcancelstate(oldstate, &statevar);
+	}
 
-out_nodata:
-	return -1;
+	return NULL;
 }
 
-static void ws_ctube_data_destroy(struct ws_ctube_data *ws_ctube_data)
+static int ws_ctube_reclaimer_start(struct ws_ctube_reclaimer *reclaimer)
 {
-	if (ws_ctube_data->data != NULL) {
-		free(ws_ctube_data->data);
-		ws_ctube_data->data = NULL;
+	__atomic_store_n(&reclaimer->running, (int)1, __ATOMIC_SEQ_CST);
+	if (pthread_create(&reclaimer->tid, NULL, ws_ctube_reclaimer_main, (void *)reclaimer) != 0) {
+		__atomic_store_n(&reclaimer->running, (int)0, __ATOMIC_SEQ_CST);
+		return -1;
 	}
-
-	ws_ctube_data->data_size = 0;
-
-	pthread_mutex_destroy(&ws_ctube_data->mutex);
-	ws_ctube_list_node_destroy(&ws_ctube_data->lnode);
-	ws_ctube_ref_count_destroy(&ws_ctube_data->refc);
+	return 0;
 }
 
-/** copy data into ws_ctube_data */
-static inline int ws_ctube_data_cp(struct ws_ctube_data *ws_ctube_data, const void *data, size_t data_size)
+/** stop the reclaimer thread and reclaim everything still queued */
+static void ws_ctube_reclaimer_stop(struct ws_ctube_reclaimer *reclaimer)
 {
-	int retval = 0;
-
-	pthread_mutex_lock(&ws_ctube_data->mutex);
-	if (ws_ctube_data->data_size < data_size) {
-		if (ws_ctube_data->data != NULL) {
-			free(ws_ctube_data->data);
-		}
-
-		ws_ctube_data->data = (typeof(ws_ctube_data->data))malloc(data_size);
-		if (ws_ctube_data->data == NULL) {
-			retval = -1;
-			goto out;
-		}
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-		ws_ctube_data->data_size = data_size;
-	}
+	pthread_cancel(reclaimer->tid);
+	pthread_join(reclaimer->tid, NULL);
 
-	memcpy(ws_ctube_data->data, data, data_size);
+	__atomic_store_n(&reclaimer->running, (int)0, __ATOMIC_SEQ_CST);
+	_ws_ctube_reclaimer_drain(reclaimer);
 
-out:
-	pthread_mutex_unlock(&ws_ctube_data->mutex);
-	return retval;
+	pthread_setcancelstate(oldstate, &statevar);
 }
 
-static void ws_ctube_data_free(struct ws_ctube_data *ws_ctube_data)
-{
-	ws_ctube_data_destroy(ws_ctube_data);
-	free(ws_ctube_data);
-}
+#endif /* WS_CTUBE_RECLAIM_H */
 
-/** represents a client connection and owns their associated reader/writer threads */
-struct ws_ctube_conn_struct {
-	int fd;
-	struct ws_ctube *ctube;
 
-	/* to prevent double shutdown */
-	int stopping;
-	pthread_mutex_t stopping_mutex;
 
-	/** reader thread */
-	pthread_t reader_tid;
-	/** writer thread */
-	pthread_t writer_tid;
 
-	struct ws_ctube_ref_count refc;
-	struct ws_ctube_list_node lnode;
-};
+#ifndef WS_CTUBE_RECORD_H
+#define WS_CTUBE_RECORD_H
 
-static int ws_ctube_conn_struct_init(struct ws_ctube_conn_struct *conn, int fd, struct ws_ctube *ctube)
-{
-	conn->fd = fd;
-	conn->ctube = ctube;
 
-	conn->stopping = 0;
-	pthread_mutex_init(&conn->stopping_mutex, NULL);
+/** nanoseconds between entries of the time index (at most) */
+#ifndef WS_CTUBE_RECORD_INDEX_INTERVAL_NS
+#define WS_CTUBE_RECORD_INDEX_INTERVAL_NS ((int64_t)1000000000)
+#endif /* WS_CTUBE_RECORD_INDEX_INTERVAL_NS */
 
-	ws_ctube_ref_count_init(&conn->refc);
-	ws_ctube_list_node_init(&conn->lnode);
-	return 0;
-}
+/** magic of a segment file, including the terminating null */
+#define WS_CTUBE_RECORD_SEGMENT_MAGIC "WSCTUBE"
+/** magic of a complete record ("WSCR" in little-endian byte order) */
+#define WS_CTUBE_RECORD_MAGIC 0x52435357u
+#define WS_CTUBE_RECORD_VERSION 2
+/** flag of a record whose payload is a grid */
+#define WS_CTUBE_RECORD_GRID 0x1u
 
-static void ws_ctube_conn_struct_destroy(struct ws_ctube_conn_struct *conn)
-{
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-	close(conn->fd);
-	pthread_setcancelstate(oldstate, &statevar);
+/** starts every segment file */
+struct ws_ctube_record_segment {
+	char magic[8];
+	uint32_t version;
+	/* n of the file name */
+	uint32_t segment;
+	/* CLOCK_REALTIME when the segment was started */
+	int64_t time_ns;
+	uint64_t reserved;
+};
 
-	conn->fd = -1;
-	conn->ctube = NULL;
+/** starts every record */
+struct ws_ctube_record_header {
+	/* WS_CTUBE_RECORD_MAGIC, written last */
+	uint32_t magic;
+	/* bytes of the channel name that follows (0 for the default channel) */
+	uint32_t channel_len;
+	/* bytes of the payload that follows the name */
+	uint64_t size;
+	/* sequence number of the broadcast, increasing across channels */
+	uint64_t id;
+	/* CLOCK_REALTIME when it was broadcast */
+	int64_t time_ns;
+	/* WS_CTUBE_RECORD_GRID or 0 */
+	uint32_t flags;
+	uint32_t reserved;
+};
 
-	conn->stopping = 0;
-	pthread_mutex_destroy(&conn->stopping_mutex);
+/**
+ * layout of a grid record: its payload is the grid packed, without levels,
+ * like ws_ctube_publish_grid() makes it
+ */
+struct ws_ctube_record_grid {
+	uint32_t ndim;
+	/* enum ws_ctube_elem_type */
+	uint32_t type;
+	/* asked for, as in struct ws_ctube_grid */
+	uint32_t nlevel;
+	/* enum ws_ctube_lod_filter */
+	uint32_t filter;
+	uint64_t elem_size;
+	uint64_t dims[WS_CTUBE_GRID_MAXDIM];
+};
 
-	ws_ctube_ref_count_destroy(&conn->refc);
-	ws_ctube_list_node_destroy(&conn->lnode);
-}
+/** entry of the time index */
+struct ws_ctube_record_index {
+	int64_t time_ns;
+	uint64_t id;
+	uint32_t segment;
+	uint32_t reserved;
+	/* of the record's header in the segment file */
+	uint64_t offset;
+};
 
-static void ws_ctube_conn_struct_free(struct ws_ctube_conn_struct *conn)
-{
-	ws_ctube_conn_struct_destroy(conn);
-	free(conn);
-}
+struct ws_ctube_record_node;
 
-enum ws_ctube_qaction {
-	WS_CTUBE_CONN_START,
-	WS_CTUBE_CONN_STOP
+/**
+ * copy the payload of node to payload (node->size bytes), or only let go of it
+ * if payload is NULL (it could not be recorded)
+ */
+typedef void (*ws_ctube_record_fn)(struct ws_ctube_record_node *node, char *payload);
+
+/** including this in a larger struct allows it to be recorded */
+struct ws_ctube_record_node {
+	struct ws_ctube_mpsc_node qnode;
+	/* called on the recorder thread with this node */
+	ws_ctube_record_fn record;
+
+	/* the record, set by the producer */
+	uint64_t id;
+	int64_t time_ns;
+	/* must stay valid until the recorder is stopped */
+	const char *channel;
+	size_t size;
+	/* layout of the payload if it is a grid, else NULL; must stay valid
+	 * until record() is called */
+	const struct ws_ctube_grid *grid;
 };
 
-/** a work item in FIFO queue: start or stop a connection to client */
-struct ws_ctube_conn_qentry {
-	struct ws_ctube_conn_struct *conn;
-	enum ws_ctube_qaction act;
-	struct ws_ctube_list_node lnode;
+struct ws_ctube_recorder {
+	struct ws_ctube_mpsc_queue queue;
+	/* set to wake the recorder thread */
+	int pred ws_ctube_cache_aligned;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* payload bytes queued: records are dropped rather than queued past
+	 * max_backlog (unless nothing is queued) */
+	size_t backlog ws_ctube_cache_aligned;
+	size_t max_backlog;
+	unsigned long nrecorded;
+	unsigned long ndropped;
+
+	/* records are only pushed while the thread is running */
+	int running;
+	pthread_t tid;
+
+	/* recorder thread only: the open segment (fd -1 if none) and index */
+	char path[PATH_MAX];
+	size_t segment_size;
+	uint32_t segment;
+	int fd;
+	char *map;
+	size_t map_size;
+	size_t used;
+	int index_fd;
+	int64_t index_time_ns;
 };
 
-static int ws_ctube_conn_qentry_init(struct ws_ctube_conn_qentry *qentry, struct ws_ctube_conn_struct *conn, enum ws_ctube_qaction act)
+static int ws_ctube_recorder_init(struct ws_ctube_recorder *recorder)
 {
-	ws_ctube_ref_count_acquire(conn, refc);
-	qentry->conn = conn;
-	qentry->act = act;
-	ws_ctube_list_node_init(&qentry->lnode);
+	ws_ctube_mpsc_queue_init(&recorder->queue);
+	recorder->pred = 0;
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+
+	recorder->backlog = 0;
+	recorder->max_backlog = 0;
+	recorder->nrecorded = 0;
+	recorder->ndropped = 0;
+	recorder->running = 0;
+
+	recorder->path[0] = '\0';
+	recorder->segment_size = 0;
+	recorder->segment = 0;
+	recorder->fd = -1;
+	recorder->map = NULL;
+	recorder->map_size = 0;
+	recorder->used = 0;
+	recorder->index_fd = -1;
+	recorder->index_time_ns = 0;
 	return 0;
 }
 
-static void ws_ctube_conn_qentry_destroy(struct ws_ctube_conn_qentry *qentry)
+static void ws_ctube_recorder_destroy(struct ws_ctube_recorder *recorder)
 {
-	ws_ctube_ref_count_release(qentry->conn, refc, ws_ctube_conn_struct_free);
-	qentry->conn = NULL;
-	ws_ctube_list_node_destroy(&qentry->lnode);
+	ws_ctube_mpsc_queue_destroy(&recorder->queue);
+	recorder->pred = 0;
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->cond);
+	recorder->running = 0;
 }
 
-static void ws_ctube_conn_qentry_free(struct ws_ctube_conn_qentry *qentry)
+/** @return 0 if name fits in PATH_MAX bytes, -1 otherwise */
+static int _ws_ctube_recorder_name(const struct ws_ctube_recorder *recorder, char *name, const char *suffix, uint32_t segment)
 {
-	ws_ctube_conn_qentry_destroy(qentry);
-	free(qentry);
-}
-
-/** main struct for ws_ctube */
-struct ws_ctube {
-	int server_sock;
-	int port;
-	int max_nclient;
+	int len;
 
-	/* to have timeout on operations */
-	struct timespec timeout_spec;
-	struct timeval timeout_val;
+	if (suffix != NULL) {
+		len = snprintf(name, PATH_MAX, "%s.%s", recorder->path, suffix);
+	} else {
+		len = snprintf(name, PATH_MAX, "%s.%06lu", recorder->path, (unsigned long)segment);
+	}
+	return len > 0 && len < PATH_MAX ? 0 : -1;
+}
 
-	/* currently unused (for incoming data) */
-	struct ws_ctube_list in_data_list;
-	int in_data_pred;
-	pthread_mutex_t in_data_mutex;
-	pthread_cond_t in_data_cond;
+/** write the time index entry of the record at offset of the open segment */
+static void _ws_ctube_recorder_index(struct ws_ctube_recorder *recorder, const struct ws_ctube_record_header *hdr, size_t offset)
+{
+	struct ws_ctube_record_index entry;
 
-	/* current ws_ctube_data representing data to be sent */
-	struct ws_ctube_data *out_data;
-	unsigned long out_data_id;
-	pthread_mutex_t out_data_mutex;
-	pthread_cond_t out_data_cond;
+	memset(&entry, 0, sizeof(entry));
+	entry.time_ns = hdr->time_ns;
+	entry.id = hdr->id;
+	entry.segment = recorder->segment;
+	entry.offset = offset;
 
-	/* rate-limit broadcasting */
-	double max_bcast_fps;
-	struct timespec prev_bcast_time;
+	/* a short write leaves the index sparser, not the log broken */
+	if (write(recorder->index_fd, &entry, sizeof(entry)) != (ssize_t)sizeof(entry)) {
+		fprintf(stderr, "ws_ctube_recorder: error: index write failed\n");
+		fflush(stderr);
+	}
+	recorder->index_time_ns = hdr->time_ns;
+}
 
-	/* the FIFO work queue: connection handler starts/stops client
-	 * connections based on queued actions */
-	struct ws_ctube_list connq;
-	int connq_pred;
-	pthread_mutex_t connq_mutex;
-	pthread_cond_t connq_cond;
+/** trim the open segment to what was written and close it */
+static void _ws_ctube_recorder_segment_close(struct ws_ctube_recorder *recorder)
+{
+	if (recorder->fd < 0) {
+		return;
+	}
 
-	/* allows ws_ctube_open() to know if server successfully started or not */
-	int server_inited;
-	pthread_mutex_t server_init_mutex;
-	pthread_cond_t server_init_cond;
+	munmap(recorder->map, recorder->map_size);
+	if (ftruncate(recorder->fd, (off_t)recorder->used) != 0) {
+		fprintf(stderr, "ws_ctube_recorder: error: segment truncate failed\n");
+		fflush(stderr);
+	}
+	close(recorder->fd);
 
-	/** connection handler thread */
-	pthread_t handler_tid;
-	/** server thread */
-	pthread_t server_tid;
-};
+	recorder->fd = -1;
+	recorder->map = NULL;
+	recorder->map_size = 0;
+	recorder->used = 0;
+	recorder->segment++;
+}
 
-static int ws_ctube_init(
-	struct ws_ctube *ctube,
-	int port,
-	int max_nclient,
-	unsigned int timeout_ms,
-	double max_broadcast_fps)
+/**
+ * start segment recorder->segment, with room for a record of at least need
+ * bytes. Its disk space is allocated up front so that writing to the mapping
+ * cannot fail (with SIGBUS) once the disk fills up
+ */
+static int _ws_ctube_recorder_segment_open(struct ws_ctube_recorder *recorder, size_t need, int64_t time_ns)
 {
-	ctube->server_sock = -1;
-	ctube->port = port;
-	ctube->max_nclient = max_nclient;
+	char name[PATH_MAX];
+	struct ws_ctube_record_segment seg;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = recorder->segment_size;
+	int err;
+
+	if (size < sizeof(seg) + need) {
+		size = sizeof(seg) + need;
+	}
+	size = (size + page - 1) & ~(page - 1);
 
-	ctube->timeout_spec.tv_sec = timeout_ms / 1000;
-	ctube->timeout_spec.tv_nsec = (timeout_ms % 1000) * 1000000;
-	ctube->timeout_val.tv_sec = timeout_ms / 1000;
-	ctube->timeout_val.tv_usec = (timeout_ms % 1000) * 1000;
+	if (_ws_ctube_recorder_name(recorder, name, NULL, recorder->segment) != 0) {
+		goto out_noname;
+	}
+	recorder->fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (recorder->fd < 0) {
+		goto out_noopen;
+	}
+	err = posix_fallocate(recorder->fd, 0, (off_t)size);
+	if (err != 0) {
+		errno = err;
+		goto out_noalloc;
+	}
+	recorder->map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0);
+	if (recorder->map == MAP_FAILED) {
+		goto out_nomap;
+	}
 
-	ws_ctube_list_init(&ctube->in_data_list);
-	ctube->in_data_pred = 0;
-	pthread_mutex_init(&ctube->in_data_mutex, NULL);
-	pthread_cond_init(&ctube->in_data_cond, NULL);
+	memset(&seg, 0, sizeof(seg));
+	memcpy(seg.magic, WS_CTUBE_RECORD_SEGMENT_MAGIC, sizeof(seg.magic));
+	seg.version = WS_CTUBE_RECORD_VERSION;
+	seg.segment = recorder->segment;
+	seg.time_ns = time_ns;
+	memcpy(recorder->map, &seg, sizeof(seg));
 
-	ctube->out_data = NULL;
-	ctube->out_data_id = 0;
-	pthread_mutex_init(&ctube->out_data_mutex, NULL);
-	pthread_cond_init(&ctube->out_data_cond, NULL);
+	recorder->map_size = size;
+	recorder->used = sizeof(seg);
+	return 0;
 
-	ctube->max_bcast_fps = max_broadcast_fps;
-	ctube->prev_bcast_time.tv_sec = 0;
-	ctube->prev_bcast_time.tv_nsec = 0;
+out_nomap:
+	recorder->map = NULL;
+out_noalloc:
+	err = errno;
+	close(recorder->fd);
+	unlink(name);
+	recorder->fd = -1;
+	errno = err;
+out_noopen:
+	fprintf(stderr, "ws_ctube_recorder: error: cannot create %s: %s\n", name, strerror(errno));
+	fflush(stderr);
+out_noname:
+	return -1;
+}
 
-	ws_ctube_list_init(&ctube->connq);
-	ctube->connq_pred = 0;
-	pthread_mutex_init(&ctube->connq_mutex, NULL);
-	pthread_cond_init(&ctube->connq_cond, NULL);
+static inline size_t _ws_ctube_record_size(const struct ws_ctube_record_node *node, size_t channel_len)
+{
+	const size_t grid_len = node->grid != NULL ? sizeof(struct ws_ctube_record_grid) : 0;
 
-	ctube->server_inited = 0;
-	pthread_mutex_init(&ctube->server_init_mutex, NULL);
-	pthread_cond_init(&ctube->server_init_cond, NULL);
+	return (sizeof(struct ws_ctube_record_header) + grid_len + channel_len + node->size + 7) & ~(size_t)7;
+}
 
-	return 0;
+/** the layout block of a grid record */
+static void _ws_ctube_record_grid(struct ws_ctube_record_grid *out, const struct ws_ctube_grid *grid)
+{
+	memset(out, 0, sizeof(*out));
+	out->ndim = (uint32_t)grid->ndim;
+	out->type = (uint32_t)grid->type;
+	out->nlevel = (uint32_t)grid->nlevel;
+	out->filter = (uint32_t)grid->filter;
+	out->elem_size = grid->elem_size;
+	for (int i = 0; i < grid->ndim; i++) {
+		out->dims[i] = grid->dims[i];
+	}
 }
 
-static void _ws_ctube_data_list_clear(struct ws_ctube_list *dlist)
+/**
+ * write node to the open segment (starting another if it does not fit)
+ *
+ * @return 0 on success, -1 if it could not be recorded
+ */
+static int _ws_ctube_recorder_write(struct ws_ctube_recorder *recorder, struct ws_ctube_record_node *node)
 {
-	struct ws_ctube_list_node *node;
-	struct ws_ctube_data *data;
+	struct ws_ctube_record_header hdr;
+	struct ws_ctube_record_grid grid;
+	const size_t channel_len = strlen(node->channel);
+	const size_t size = _ws_ctube_record_size(node, channel_len);
+	char *rec, *p;
+
+	if (recorder->fd >= 0 && recorder->used + size > recorder->map_size) {
+		_ws_ctube_recorder_segment_close(recorder);
+	}
+	if (recorder->fd < 0 && _ws_ctube_recorder_segment_open(recorder, size, node->time_ns) != 0) {
+		node->record(node, NULL);
+		return -1;
+	}
 
-	while ((node = ws_ctube_list_pop_front(dlist)) != NULL) {
-		data = ws_ctube_container_of(node, typeof(*data), lnode);
-		ws_ctube_data_free(data);
+	rec = recorder->map + recorder->used;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.channel_len = (uint32_t)channel_len;
+	hdr.size = node->size;
+	hdr.id = node->id;
+	hdr.time_ns = node->time_ns;
+	hdr.flags = node->grid != NULL ? WS_CTUBE_RECORD_GRID : 0;
+	memcpy(rec, &hdr, sizeof(hdr));
+	p = rec + sizeof(hdr);
+	if (node->grid != NULL) {
+		_ws_ctube_record_grid(&grid, node->grid);
+		memcpy(p, &grid, sizeof(grid));
+		p += sizeof(grid);
 	}
+	memcpy(p, node->channel, channel_len);
+	node->record(node, p + channel_len);
+
+	/* complete: readers of the mapping may follow it */
+	__atomic_store_n((uint32_t *)rec, (uint32_t)WS_CTUBE_RECORD_MAGIC, __ATOMIC_RELEASE);
+	if (recorder->used == sizeof(struct ws_ctube_record_segment)
+	    || hdr.time_ns - recorder->index_time_ns >= WS_CTUBE_RECORD_INDEX_INTERVAL_NS) {
+		_ws_ctube_recorder_index(recorder, &hdr, recorder->used);
+	}
+	recorder->used += size;
+	return 0;
 }
 
-static void _ws_ctube_connq_clear(struct ws_ctube_list *connq)
+/** record all queued nodes: only one thread at a time may drain */
+static void _ws_ctube_recorder_drain(struct ws_ctube_recorder *recorder)
 {
-	struct ws_ctube_list_node *node;
-	struct ws_ctube_conn_qentry *qentry;
-
-	while ((node = ws_ctube_list_pop_front(connq)) != NULL) {
-		qentry = ws_ctube_container_of(node, typeof(*qentry), lnode);
-		ws_ctube_conn_qentry_free(qentry);
+	struct ws_ctube_mpsc_node *qnode;
+	struct ws_ctube_record_node *node;
+	size_t size;
+
+	while ((qnode = ws_ctube_mpsc_queue_pop(&recorder->queue)) != NULL) {
+		node = ws_ctube_container_of(qnode, typeof(*node), qnode);
+		/* node is let go of while being written */
+		size = node->size;
+		if (_ws_ctube_recorder_write(recorder, node) == 0) {
+			__atomic_add_fetch(&recorder->nrecorded, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_add_fetch(&recorder->ndropped, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_sub_fetch(&recorder->backlog, size, __ATOMIC_RELAXED);
 	}
 }
 
-static void ws_ctube_destroy(struct ws_ctube *ctube)
+/**
+ * thread-safe, lock-free: have node recorded on the recorder thread
+ *
+ * @return 0 if queued (record(node, ...) will be called), -1 if it was
+ * dropped because the recorder is not running or too far behind
+ */
+static int ws_ctube_recorder_push(struct ws_ctube_recorder *recorder, struct ws_ctube_record_node *node, ws_ctube_record_fn record)
 {
-	ctube->server_sock = -1;
-	ctube->port = -1;
-	ctube->max_nclient = -1;
+	size_t backlog;
 
-	ctube->timeout_spec.tv_sec = 0;
-	ctube->timeout_spec.tv_nsec = 0;
-	ctube->timeout_val.tv_sec = 0;
-	ctube->timeout_val.tv_usec = 0;
-
-	_ws_ctube_data_list_clear(&ctube->in_data_list);
-	ws_ctube_list_destroy(&ctube->in_data_list);
-	ctube->in_data_pred = 0;
-	pthread_mutex_destroy(&ctube->in_data_mutex);
-	pthread_cond_destroy(&ctube->in_data_cond);
-
-	if (ctube->out_data != NULL) {
-		ws_ctube_ref_count_release(ctube->out_data, refc, ws_ctube_data_free);
-		ctube->out_data = NULL;
+	if (!__atomic_load_n(&recorder->running, __ATOMIC_SEQ_CST)) {
+		return -1;
 	}
-	ctube->out_data_id = 0;
-	pthread_mutex_destroy(&ctube->out_data_mutex);
-	pthread_cond_destroy(&ctube->out_data_cond);
 
-	ctube->max_bcast_fps = 0;
-	ctube->prev_bcast_time.tv_sec = 0;
-	ctube->prev_bcast_time.tv_nsec = 0;
+	/* never wait for the disk: drop instead */
+	backlog = __atomic_fetch_add(&recorder->backlog, node->size, __ATOMIC_RELAXED);
+	if (backlog > 0 && recorder->max_backlog > 0 && backlog + node->size > recorder->max_backlog) {
+		__atomic_sub_fetch(&recorder->backlog, node->size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&recorder->ndropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
 
-	_ws_ctube_connq_clear(&ctube->connq);
-	ws_ctube_list_destroy(&ctube->connq);
-	ctube->connq_pred = 0;
-	pthread_mutex_destroy(&ctube->connq_mutex);
-	pthread_cond_destroy(&ctube->connq_cond);
+	node->record = record;
+	ws_ctube_mpsc_queue_push(&recorder->queue, &node->qnode);
 
-	ctube->server_inited = 0;
-	pthread_mutex_destroy(&ctube->server_init_mutex);
-	pthread_cond_destroy(&ctube->server_init_cond);
+	/* wake recorder unless a wakeup is already pending */
+	if (!__atomic_exchange_n(&recorder->pred, (int)1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&recorder->mutex);
+		pthread_mutex_unlock(&recorder->mutex);
+		pthread_cond_signal(&recorder->cond);
+	}
+	return 0;
 }
 
-#endif /* WS_CTUBE_STRUCT_H */
-
+static void _ws_ctube_recorder_cleanup_unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
 
+static void *ws_ctube_recorder_main(void *arg)
+{
+	struct ws_ctube_recorder *recorder = (struct ws_ctube_recorder *)arg;
+	int oldstate, statevar;
 
+	for (;;) {
+		pthread_mutex_lock(&recorder->mutex);
+		pthread_cleanup_push(_ws_ctube_recorder_cleanup_unlock, &recorder->mutex);
+		while (!__atomic_load_n(&recorder->pred, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+		}
+		pthread_mutex_unlock(&recorder->mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_recorder_cleanup_unlock */
 
+		/* cleared before draining: pushes from now on wake us again */
+		__atomic_store_n(&recorder->pred, (int)0, __ATOMIC_SEQ_CST);
 
+		/* a record is not left half written */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		_ws_ctube_recorder_drain(recorder);
+		pthread_setcancelstate(oldstate, &statevar);
+	}
 
-static volatile int ws_ctube_b64_encode_inited = 0;
-static volatile unsigned char ws_ctube_b64_encode_table[64];
-static const uint32_t ws_ctube_b64_mask = 63;
+	return NULL;
+}
 
 /**
- * 0-25: A-Z
- * 26-51: a-z
- * 52-61: 0-9
- * 62: +
- * 63: /
+ * open the log at path (appending segments after those already there) and
+ * start the recorder thread
+ *
+ * @param segment_size bytes of each segment file (larger for a record that
+ * does not fit)
+ * @param max_backlog payload bytes that may be queued, or 0 for no limit
  */
-static void ws_ctube_init_b64_encode_table()
+static int ws_ctube_recorder_start(struct ws_ctube_recorder *recorder, const char *path, size_t segment_size, size_t max_backlog)
 {
-	/* prevent double init */
-	if (__atomic_exchange_n(&ws_ctube_b64_encode_inited, (int)1, __ATOMIC_SEQ_CST))
-		return;
+	char name[PATH_MAX];
 
-	for (int i = 0; i < 26; i++) {
-		ws_ctube_b64_encode_table[i] = 'A' + i;
-		ws_ctube_b64_encode_table[26 + i] = 'a' + i;
+	if (strlen(path) >= sizeof(recorder->path) - 16) {
+		fprintf(stderr, "ws_ctube_recorder: error: path too long\n");
+		fflush(stderr);
+		goto out_noindex;
 	}
-	for (int i = 0; i < 10; i++) {
-		ws_ctube_b64_encode_table[52 + i] = '0' + i;
+	strcpy(recorder->path, path);
+	recorder->segment_size = segment_size;
+	recorder->max_backlog = max_backlog;
+
+	/* keep what earlier runs recorded */
+	recorder->segment = 0;
+	while (_ws_ctube_recorder_name(recorder, name, NULL, recorder->segment) == 0 && access(name, F_OK) == 0) {
+		recorder->segment++;
 	}
-	ws_ctube_b64_encode_table[62] = '+';
-	ws_ctube_b64_encode_table[63] = '/';
+
+	if (_ws_ctube_recorder_name(recorder, name, "index", 0) != 0) {
+		goto out_noindex;
+	}
+	recorder->index_fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (recorder->index_fd < 0) {
+		fprintf(stderr, "ws_ctube_recorder: error: cannot open %s: %s\n", name, strerror(errno));
+		fflush(stderr);
+		goto out_noindex;
+	}
+
+	__atomic_store_n(&recorder->running, (int)1, __ATOMIC_SEQ_CST);
+	if (pthread_create(&recorder->tid, NULL, ws_ctube_recorder_main, (void *)recorder) != 0) {
+		__atomic_store_n(&recorder->running, (int)0, __ATOMIC_SEQ_CST);
+		goto out_nothread;
+	}
+	return 0;
+
+out_nothread:
+	close(recorder->index_fd);
+	recorder->index_fd = -1;
+out_noindex:
+	return -1;
 }
 
-/* 3*8 -> 4*6 base64 encoding */
-static void ws_ctube_b64_encode_triplet(unsigned char *out, unsigned char in0, unsigned char in1, unsigned char in2)
+/** stop the recorder thread, record everything still queued and close the log */
+static void ws_ctube_recorder_stop(struct ws_ctube_recorder *recorder)
 {
-	uint32_t triplet = ((uint32_t)in0 << 16) + ((uint32_t)in1 << 8) + (uint32_t)in2;
-	for (int i = 0; i < 4; i++) {
-		uint32_t b64_val = (triplet >> (6*(3 - i))) & ws_ctube_b64_mask;
-		out[i] = ws_ctube_b64_encode_table[b64_val];
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	if (!__atomic_load_n(&recorder->running, __ATOMIC_SEQ_CST)) {
+		goto out;
 	}
+
+	pthread_cancel(recorder->tid);
+	pthread_join(recorder->tid, NULL);
+
+	__atomic_store_n(&recorder->running, (int)0, __ATOMIC_SEQ_CST);
+	_ws_ctube_recorder_drain(recorder);
+
+	_ws_ctube_recorder_segment_close(recorder);
+	close(recorder->index_fd);
+	recorder->index_fd = -1;
+
+out:
+	pthread_setcancelstate(oldstate, &statevar);
 }
 
-/**
- * gives the base64 encoding of in. out must be large enough to hold output + 1
- * for null terminator
- */
-void ws_ctube_b64_encode(unsigned char *out, const unsigned char *in, size_t in_bytes)
-{
-#ifndef __cplusplus
-	_Static_assert(sizeof(uint8_t) == sizeof(unsigned char), "ws_ctube_b64_encode(): unsigned char not 8 bits");
-#endif /* __cplusplus */
+#endif /* WS_CTUBE_RECORD_H */
 
-	ws_ctube_init_b64_encode_table();
 
-	while (in_bytes >= 3) {
-		ws_ctube_b64_encode_triplet(out, in[0], in[1], in[2]);
-		in_bytes -= 3;
-		in += 3;
-		out += 4;
-	}
 
-	if (in_bytes == 0) {
-		out[0] = '\0';
-	} else if (in_bytes == 1) {
-		ws_ctube_b64_encode_triplet(out, in[0], 0, 0);
-		out[2] = '=';
-		out[3] = '=';
-		out[4] = '\0';
-	} else if (in_bytes == 2) {
-		ws_ctube_b64_encode_triplet(out, in[0], in[1], 0);
-		out[3] = '=';
-		out[4] = '\0';
-	}
+
+#ifndef WS_CTUBE_SHM_H
+#define WS_CTUBE_SHM_H
+
+
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif /* __linux__ */
+
+/** magic of the file, including the terminating null */
+#define WS_CTUBE_SHM_MAGIC "WSCSHM"
+#define WS_CTUBE_SHM_VERSION 1
+
+/** type of a record holding a broadcast */
+#define WS_CTUBE_SHM_DATA 1
+/** type of a record filling the end of the ring, to be skipped */
+#define WS_CTUBE_SHM_PAD 2
+
+/** starts the file (128 bytes: readers write only the second 64) */
+struct ws_ctube_shm_header {
+	char magic[8];
+	uint32_t version;
+	/* nonzero once the writer has stopped: nothing more will come */
+	uint32_t closed;
+	/* bytes of the ring that follows this header */
+	uint64_t size;
+	/* positions: up to which the ring may be being overwritten, the end
+	 * of the last complete record and its start */
+	uint64_t intent;
+	uint64_t head;
+	uint64_t last;
+	/* bumped after each record and when closing */
+	uint32_t futex;
+	uint32_t reserved;
+	uint64_t reserved2;
+
+	/* readers asleep on futex */
+	uint32_t nwaiter;
+	uint32_t reserved3[15];
+};
+
+/** starts every record */
+struct ws_ctube_shm_record {
+	/* number of the broadcast in the ring, from 0 */
+	uint64_t seq;
+	/* WS_CTUBE_SHM_DATA or WS_CTUBE_SHM_PAD */
+	uint32_t type;
+	/* bytes of the channel name that follows (0 for the default channel) */
+	uint32_t channel_len;
+	/* bytes of the payload that follows the name */
+	uint64_t size;
+	/* sequence number of the broadcast, increasing across channels */
+	uint64_t id;
+	/* CLOCK_REALTIME when it was broadcast */
+	int64_t time_ns;
+};
+
+static inline size_t _ws_ctube_shm_record_size(size_t channel_len, size_t size)
+{
+	return (sizeof(struct ws_ctube_shm_record) + channel_len + size + 7) & ~(size_t)7;
 }
 
-static inline uint32_t ws_ctube_left_rotate(uint32_t w, uint32_t amount)
+#ifdef __linux__
+static inline void _ws_ctube_shm_futex_wait(uint32_t *futex, uint32_t val, const struct timespec *timeout)
 {
-	return (w << amount) | (w >> (32 - amount));
+	syscall(SYS_futex, futex, FUTEX_WAIT, val, timeout, NULL, 0);
 }
 
-/** see sha1 standard */
-static inline void ws_ctube_sha1_wordgen(uint32_t *const word)
+static inline void _ws_ctube_shm_futex_wake(uint32_t *futex)
 {
-	for (int i = 16; i < 80; i++) {
-		word[i] = ws_ctube_left_rotate(word[i-3] ^ word[i-8] ^ word[i-14] ^ word[i-16], 1);
+	syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+/* no futex: readers poll every millisecond */
+static inline void _ws_ctube_shm_futex_wait(uint32_t *futex, uint32_t val, const struct timespec *timeout)
+{
+	struct timespec ms = {0, 1000000};
+
+	(void)futex;
+	(void)val;
+	if (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_nsec < ms.tv_nsec) {
+		ms.tv_nsec = timeout->tv_nsec;
 	}
+	nanosleep(&ms, NULL);
 }
 
-/** generate words 14,15 from input length (see sha1 standard) */
-static inline void ws_ctube_sha1_total_len_cpy(uint32_t *words, const uint64_t total_bits)
+static inline void _ws_ctube_shm_futex_wake(uint32_t *futex)
 {
-	const uint64_t mask = 0xFF;
+	(void)futex;
+}
+#endif /* __linux__ */
 
-	words[14] = 0;
-	words[15] = 0;
-	for (int i = 0; i < 2; i++) {
-		for (int j = 0; j < 4; j++) {
-			uint32_t byte = (total_bits >> 8*(8 - (4*i+j) - 1)) & mask;
-			words[14 + i] |= byte << 8*(4 - j - 1);
-		}
-	}
+/** the writer, in the producer */
+struct ws_ctube_shm {
+	/* serializes reserving room in the ring for the channels */
+	pthread_mutex_t mutex;
+	struct ws_ctube_shm_header *hdr;
+	char *ring;
+	size_t size;
+	size_t map_size;
+	/* position and number of the next record to reserve */
+	uint64_t head;
+	uint64_t seq;
+
+	unsigned long nwritten;
+	/* broadcasts larger than the ring */
+	unsigned long ndropped;
+	/* broadcasts are only written while running */
+	int running;
+	char path[PATH_MAX];
+};
+
+static int ws_ctube_shm_init(struct ws_ctube_shm *shm)
+{
+	pthread_mutex_init(&shm->mutex, NULL);
+	shm->hdr = NULL;
+	shm->ring = NULL;
+	shm->size = 0;
+	shm->map_size = 0;
+	shm->head = 0;
+	shm->seq = 0;
+	shm->nwritten = 0;
+	shm->ndropped = 0;
+	shm->running = 0;
+	shm->path[0] = '\0';
+	return 0;
 }
 
-/** copy byte stream into sha1 32-byte words */
-static inline void ws_ctube_sha1_cp_to_words(uint32_t *const words, const uint8_t *const in, const size_t len, int pad)
+static void ws_ctube_shm_destroy(struct ws_ctube_shm *shm)
 {
-	size_t i, w_ind, byte_ind;
+	pthread_mutex_destroy(&shm->mutex);
+	shm->running = 0;
+}
 
-	for (i = 0, w_ind = 0, byte_ind = 0; i < len; i++, w_ind = i / 4, byte_ind = i % 4) {
-		uint32_t tmp = in[i];
-		words[w_ind] |= tmp << 8*(4 - byte_ind - 1);
+/**
+ * create the file at path with a ring of at least size bytes. It is filled
+ * in under another name and renamed into place, so that readers of an
+ * earlier file keep their mapping of it and never see a partial header
+ */
+static int ws_ctube_shm_start(struct ws_ctube_shm *shm, const char *path, size_t size)
+{
+	char tmp[PATH_MAX];
+	struct ws_ctube_shm_header *hdr;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int fd, err;
+
+	if (strlen(path) >= sizeof(shm->path) - 32) {
+		fprintf(stderr, "ws_ctube_shm: error: path too long\n");
+		fflush(stderr);
+		return -1;
 	}
-	if (pad) {
-		uint32_t one = 0x80;
-		words[w_ind] |= one << 8*(4 - byte_ind - 1);
+	strcpy(shm->path, path);
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+	shm->map_size = (sizeof(*hdr) + size + page - 1) & ~(page - 1);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		goto out_noopen;
 	}
+	/* allocated up front: writing to the mapping of a full tmpfs would
+	 * raise SIGBUS instead of failing here */
+	err = posix_fallocate(fd, 0, (off_t)shm->map_size);
+	if (err != 0) {
+		errno = err;
+		goto out_nomap;
+	}
+	hdr = (struct ws_ctube_shm_header *)mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		goto out_nomap;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, WS_CTUBE_SHM_MAGIC, sizeof(WS_CTUBE_SHM_MAGIC));
+	hdr->version = WS_CTUBE_SHM_VERSION;
+	hdr->size = (shm->map_size - sizeof(*hdr)) & ~(uint64_t)7;
+	if (rename(tmp, path) != 0) {
+		goto out_norename;
+	}
+	close(fd);
+
+	shm->hdr = hdr;
+	shm->ring = (char *)hdr + sizeof(*hdr);
+	shm->size = (size_t)hdr->size;
+	shm->head = 0;
+	shm->seq = 0;
+	__atomic_store_n(&shm->running, (int)1, __ATOMIC_SEQ_CST);
+	return 0;
+
+out_norename:
+	err = errno;
+	munmap(hdr, shm->map_size);
+	errno = err;
+out_nomap:
+	err = errno;
+	close(fd);
+	unlink(tmp);
+	errno = err;
+out_noopen:
+	fprintf(stderr, "ws_ctube_shm: error: cannot create %s: %s\n", path, strerror(errno));
+	fflush(stderr);
+	return -1;
 }
 
-/** genearte all sha1 words (see sha1 standard) */
-static inline void ws_ctube_sha1_mkwords(uint32_t *const words, const uint8_t *const in, const size_t len, const int mode, const uint64_t total_bits)
+/** tell readers nothing more will come, then unmap and remove the file */
+static void ws_ctube_shm_stop(struct ws_ctube_shm *shm)
 {
-	for (int i = 0; i < 16; i++) {
-		words[i] = 0;
+	if (!__atomic_load_n(&shm->running, __ATOMIC_SEQ_CST)) {
+		return;
 	}
+	__atomic_store_n(&shm->running, (int)0, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&shm->mutex);
+	__atomic_store_n(&shm->hdr->closed, (uint32_t)1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&shm->hdr->futex, 1, __ATOMIC_SEQ_CST);
+	_ws_ctube_shm_futex_wake(&shm->hdr->futex);
+	pthread_mutex_unlock(&shm->mutex);
+
+	/* readers keep their mappings */
+	munmap(shm->hdr, shm->map_size);
+	unlink(shm->path);
+	shm->hdr = NULL;
+	shm->ring = NULL;
+}
 
-	switch (mode) {
-	case 0:
-		if (len < 56) {
-			ws_ctube_sha1_cp_to_words(words, in, len, 1);
-			ws_ctube_sha1_total_len_cpy(words, total_bits);
-		} else if (len < 64) {
-			ws_ctube_sha1_cp_to_words(words, in, len, 1);
-		} else {
-			ws_ctube_sha1_cp_to_words(words, in, 64, 0);
-		}
-		break;
+/** room for a record, from ws_ctube_shm_reserve() */
+struct ws_ctube_shm_slot {
+	/* where the record goes in the ring */
+	char *rec;
+	/* end of the record reserved before it: head once that is published */
+	uint64_t prev_end;
+	/* position of the record (after any pad) and of its end */
+	uint64_t start;
+	uint64_t end;
+	uint64_t seq;
+};
 
-	case 1:
-		/* needs total_len appended only */
-		ws_ctube_sha1_total_len_cpy(words, total_bits);
-		break;
+/**
+ * reserve room for a record of len bytes, overwriting the oldest ones. Only
+ * this is serialized between the channels: the record is copied in without
+ * holding the mutex
+ */
+static void ws_ctube_shm_reserve(struct ws_ctube_shm *shm, size_t len, struct ws_ctube_shm_slot *slot)
+{
+	struct ws_ctube_shm_header *hdr = shm->hdr;
+	struct ws_ctube_shm_record rec;
+	uint64_t head;
+	size_t off, pad;
+
+	pthread_mutex_lock(&shm->mutex);
+	head = shm->head;
+	off = (size_t)(head % shm->size);
+	pad = shm->size - off < len ? shm->size - off : 0;
+
+	/* readers learn the space is reused before it is */
+	__atomic_store_n(&hdr->intent, head + pad + len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (pad >= sizeof(rec)) {
+		memset(&rec, 0, sizeof(rec));
+		rec.seq = shm->seq;
+		rec.type = WS_CTUBE_SHM_PAD;
+		rec.size = pad - sizeof(rec);
+		memcpy(shm->ring + off, &rec, sizeof(rec));
 	}
 
-	ws_ctube_sha1_wordgen(words);
+	slot->prev_end = head;
+	slot->start = head + pad;
+	slot->end = head + pad + len;
+	slot->seq = shm->seq;
+	slot->rec = shm->ring + (size_t)(slot->start % shm->size);
+	shm->head = slot->end;
+	shm->seq++;
+	pthread_mutex_unlock(&shm->mutex);
+}
+
+/** make a reserved record, copied in, visible to readers and wake them */
+static void ws_ctube_shm_commit(struct ws_ctube_shm *shm, const struct ws_ctube_shm_slot *slot)
+{
+	struct ws_ctube_shm_header *hdr = shm->hdr;
+
+	/* in the order reserved: the records before it may still be being
+	 * copied in by other channels */
+	while (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != slot->prev_end) {
+		sched_yield();
+	}
+	__atomic_store_n(&hdr->last, slot->start, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->head, slot->end, __ATOMIC_RELEASE);
+
+	/* no system call unless a reader is asleep */
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->nwaiter, __ATOMIC_SEQ_CST) > 0) {
+		_ws_ctube_shm_futex_wake(&hdr->futex);
+	}
 }
 
 /**
- * computes the sha1 hash of in and stores the result in out. out must be able
- * to hold the 20 byte output of sha1
+ * thread-safe: append a broadcast to the ring, overwriting the oldest
+ *
+ * @return 0 on success, -1 if it is larger than the ring
  */
-void ws_ctube_sha1sum(unsigned char *out, const unsigned char *in, size_t len_bytes)
+static int ws_ctube_shm_write(struct ws_ctube_shm *shm, const char *channel, const void *data, size_t size, uint64_t id, int64_t time_ns)
 {
-#ifndef __cplusplus
-	_Static_assert(sizeof(uint8_t) == sizeof(unsigned char), "ws_ctube_sha1sum(): unsigned char not 8 bits");
-#endif /* __cplusplus */
+	struct ws_ctube_shm_record rec;
+	struct ws_ctube_shm_slot slot;
+	const size_t channel_len = strlen(channel);
+	const size_t len = _ws_ctube_shm_record_size(channel_len, size);
 
-	const uint8_t *in_byte = (uint8_t *)in;
-	uint8_t *const out_byte = (uint8_t *)out;
-	const uint64_t total_bits = ((uint64_t)8 * (uint64_t)len_bytes);
+	if (len > shm->size) {
+		__atomic_add_fetch(&shm->ndropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
 
-	const uint32_t K[4] = {
-		0x5A827999,
-		0x6ED9EBA1,
-		0x8F1BBCDC,
-		0xCA62C1D6
-	};
+	ws_ctube_shm_reserve(shm, len, &slot);
 
-	uint32_t h[5] = {
-		0x67452301,
-		0xEFCDAB89,
-		0x98BADCFE,
-		0x10325476,
-		0xC3D2E1F0
-	};
+	memset(&rec, 0, sizeof(rec));
+	rec.seq = slot.seq;
+	rec.type = WS_CTUBE_SHM_DATA;
+	rec.channel_len = (uint32_t)channel_len;
+	rec.size = size;
+	rec.id = id;
+	rec.time_ns = time_ns;
+	memcpy(slot.rec, &rec, sizeof(rec));
+	memcpy(slot.rec + sizeof(rec), channel, channel_len);
+	memcpy(slot.rec + sizeof(rec) + channel_len, data, size);
 
-	uint32_t words[80];
-	int mode = 0;
-	while(1) {
-		ws_ctube_sha1_mkwords(words, in_byte, len_bytes, mode, total_bits);
+	ws_ctube_shm_commit(shm, &slot);
 
-		uint32_t A = h[0];
-		uint32_t B = h[1];
-		uint32_t C = h[2];
-		uint32_t D = h[3];
-		uint32_t E = h[4];
+	__atomic_add_fetch(&shm->nwritten, 1, __ATOMIC_RELAXED);
+	return 0;
+}
 
-		for (int i = 0; i < 20; i++) {
-			uint32_t temp = ws_ctube_left_rotate(A, 5) + ((B & C) | ((~B) & D)) + E + words[i] + K[0];
-			E = D;
-			D = C;
-			C = ws_ctube_left_rotate(B, 30);
-			B = A;
-			A = temp;
-		}
-		for (int i = 20; i < 40; i++) {
-			uint32_t temp = ws_ctube_left_rotate(A, 5) + (B ^ C ^ D) + E + words[i] + K[1];
-			E = D;
-			D = C;
-			C = ws_ctube_left_rotate(B, 30);
-			B = A;
-			A = temp;
-		}
-		for (int i = 40; i < 60; i++) {
-			uint32_t temp = ws_ctube_left_rotate(A, 5) + ((B & C) | (B & D) | (C & D)) + E + words[i] + K[2];
-			E = D;
-			D = C;
-			C = ws_ctube_left_rotate(B, 30);
-			B = A;
-			A = temp;
-		}
-		for (int i = 60; i < 80; i++) {
-			uint32_t temp = ws_ctube_left_rotate(A, 5) + (B ^ C ^ D) + E + words[i] + K[3];
-			E = D;
-			D = C;
-			C = ws_ctube_left_rotate(B, 30);
-			B = A;
-			A = temp;
-		}
+/** a reader, in any process */
+struct ws_ctube_shm_reader {
+	struct ws_ctube_shm_header *hdr;
+	const char *ring;
+	size_t size;
+	size_t map_size;
+	/* position and number of the next record to read, once started */
+	uint64_t pos;
+	uint64_t seq;
+	int started;
+	int counting;
+	/* channel of the last record read (names are shorter than 64 bytes) */
+	char channel[64];
+};
 
-		h[0] += A;
-		h[1] += B;
-		h[2] += C;
-		h[3] += D;
-		h[4] += E;
+/** map the file at path, to start reading from its latest record */
+static int ws_ctube_shm_reader_init(struct ws_ctube_shm_reader *reader, const char *path)
+{
+	struct ws_ctube_shm_header *hdr;
+	struct stat st;
+	int fd;
 
-		if (mode != 0) {
-			break;
-		}
-		if (len_bytes < 56) {
-			break;
-		} else if (len_bytes < 64) {
-			mode = 1;
-		} else {
-			len_bytes -= 64;
-			in_byte += 64;
-		}
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		goto out_noopen;
 	}
-
-	uint32_t mask = 0xFF;
-	for (int i = 0; i < 5; i++) {
-		for (int j = 0; j < 4; j++) {
-			out_byte[4*i + j] = (h[i] >> 8*(4 - j - 1)) & mask;
-		}
+	if (fstat(fd, &st) != 0) {
+		goto out_nomap;
 	}
-}
-
-
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		errno = EINVAL;
+		goto out_nomap;
+	}
+	hdr = (struct ws_ctube_shm_header *)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		goto out_nomap;
+	}
+	if (memcmp(hdr->magic, WS_CTUBE_SHM_MAGIC, sizeof(WS_CTUBE_SHM_MAGIC)) != 0 || hdr->version != WS_CTUBE_SHM_VERSION
+	    || hdr->size == 0 || hdr->size > (uint64_t)st.st_size - sizeof(*hdr)) {
+		munmap(hdr, (size_t)st.st_size);
+		errno = EINVAL;
+		goto out_nomap;
+	}
+	close(fd);
+
+	reader->hdr = hdr;
+	reader->ring = (const char *)hdr + sizeof(*hdr);
+	reader->size = (size_t)hdr->size;
+	reader->map_size = (size_t)st.st_size;
+	reader->pos = 0;
+	reader->seq = 0;
+	reader->started = 0;
+	reader->counting = 0;
+	reader->channel[0] = '\0';
+	return 0;
 
+out_nomap:
+	close(fd);
+out_noopen:
+	fprintf(stderr, "ws_ctube_shm: error: cannot open %s: %s\n", path, strerror(errno));
+	fflush(stderr);
+	return -1;
+}
 
+static void ws_ctube_shm_reader_destroy(struct ws_ctube_shm_reader *reader)
+{
+	munmap(reader->hdr, reader->map_size);
+	reader->hdr = NULL;
+	reader->ring = NULL;
+}
 
+/**
+ * copy the next broadcast of the ring to buf
+ *
+ * @return its size (if more than max, nothing is copied and it stays next),
+ * 0 if there is none yet, -1 if there will be none (the writer stopped)
+ */
+static long ws_ctube_shm_reader_next(struct ws_ctube_shm_reader *reader, void *buf, size_t max, struct ws_ctube_shm_msg *msg)
+{
+	struct ws_ctube_shm_header *hdr = reader->hdr;
+	const size_t size = reader->size;
+	struct ws_ctube_shm_record rec;
+	uint32_t closed;
+	uint64_t head;
+	size_t off, avail;
+	int valid;
 
+	for (;;) {
+		closed = __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (reader->pos == head) {
+			return closed ? -1 : 0;
+		}
+		if (!reader->started || head - reader->pos > size) {
+			/* start at (or, overtaken, skip to) the latest */
+			reader->pos = __atomic_load_n(&hdr->last, __ATOMIC_RELAXED);
+			reader->started = 1;
+		}
 
-#define WS_DEBUG 0
-#define WS_BUFLEN 4096
+		off = (size_t)(reader->pos % size);
+		avail = size - off;
+		if (avail < sizeof(rec)) {
+			reader->pos += avail;
+			continue;
+		}
+		memcpy(&rec, reader->ring + off, sizeof(rec));
+		/* the name against what is left first, so that the remainder
+		 * the payload is checked against cannot wrap around */
+		valid = rec.type == WS_CTUBE_SHM_PAD
+			|| (rec.type == WS_CTUBE_SHM_DATA && rec.channel_len < sizeof(reader->channel)
+			    && rec.channel_len <= avail - sizeof(rec)
+			    && rec.size <= avail - sizeof(rec) - rec.channel_len);
+		if (valid && rec.type == WS_CTUBE_SHM_DATA && rec.size <= max) {
+			memcpy(reader->channel, reader->ring + off + sizeof(rec), rec.channel_len);
+			reader->channel[rec.channel_len] = '\0';
+			memcpy(buf, reader->ring + off + sizeof(rec) + rec.channel_len, rec.size);
+		}
 
-static void ws_print_frame(const char *prefix, char *frame, int len)
-{
-	if (!WS_DEBUG) {
-		return;
-	}
+		/* whether the writer got to any of it meanwhile */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->intent, __ATOMIC_RELAXED) - reader->pos > size) {
+			reader->started = 0;
+			continue;
+		}
 
-	printf("%s\n", prefix);
-	for (int i = 0; i < len; i++) {
-		for (int j = 7; j >= 0; j--) {
-			uint8_t mask = ((uint8_t)1 << j);
-			uint8_t val = ((frame[i] & mask) >> j);
-			printf("%u", val);
+		if (!valid) {
+			fprintf(stderr, "ws_ctube_shm: error: bad record\n");
+			fflush(stderr);
+			return -1;
 		}
-		printf("|");
-		if (i % 4 == 3) {
-			printf("\n");
+		if (rec.type == WS_CTUBE_SHM_PAD) {
+			reader->pos += avail;
+			continue;
+		}
+		if (rec.size > max) {
+			return (long)rec.size;
 		}
+
+		msg->channel = reader->channel;
+		msg->size = (size_t)rec.size;
+		msg->id = (unsigned long)rec.id;
+		msg->time_ns = (long long)rec.time_ns;
+		msg->nmissed = reader->counting ? (unsigned long)(rec.seq - reader->seq) : 0;
+		reader->seq = rec.seq + 1;
+		reader->counting = 1;
+		reader->pos += _ws_ctube_shm_record_size(rec.channel_len, (size_t)rec.size);
+		return (long)rec.size;
 	}
-	printf("\n\n");
-	fflush(stdout);
 }
 
-/** create data frame according to websocket standard */
-int ws_ctube_ws_mkframe(char *frame, const char *msg, size_t msg_size, int first)
+/** sleep until the futex word is no longer val, or for timeout (NULL for no limit) */
+static void ws_ctube_shm_reader_wait(struct ws_ctube_shm_reader *reader, uint32_t val, const struct timespec *timeout)
 {
-	int payld_size;
+	__atomic_add_fetch(&reader->hdr->nwaiter, 1, __ATOMIC_SEQ_CST);
+	_ws_ctube_shm_futex_wait(&reader->hdr->futex, val, timeout);
+	__atomic_sub_fetch(&reader->hdr->nwaiter, 1, __ATOMIC_SEQ_CST);
+}
 
-	first = !!first;
-	if (msg_size > WS_CTUBE_MAX_PAYLD_SIZE) {
-		frame[0] = 2*first;
-		payld_size = WS_CTUBE_MAX_PAYLD_SIZE;
-	} else {
-		frame[0] = 0b10000000 + 2*first;
-		payld_size = msg_size;
-	}
+#endif /* WS_CTUBE_SHM_H */
 
-	frame[1] = payld_size;
-	memcpy(&frame[WS_CTUBE_FRAME_HDR_SIZE], msg, payld_size);
 
-	return payld_size;
-}
 
-/** send data in data frames according to websocket standard */
-int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size)
-{
-	int payld_size;
-	char frame[WS_BUFLEN];
 
-	for (int first = 1; msg_size > 0; first = 0, msg += payld_size, msg_size -= payld_size) {
-		payld_size = ws_ctube_ws_mkframe(frame, msg, msg_size, first);
-		const int frame_len = payld_size + WS_CTUBE_FRAME_HDR_SIZE;
-		ws_print_frame("ws_ctube_ws_send()", frame, frame_len);
-		if (ws_ctube_socket_send_all(conn, frame, frame_len) != 0) {
-			return -1;
-		}
-	}
+#ifndef WS_CTUBE_ENCODER_H
+#define WS_CTUBE_ENCODER_H
 
-	return 0;
-}
 
-int ws_ctube_ws_recv(int conn, char *msg, int *msg_size, size_t max_msg_size)
-{
-	/* TODO */
-	(void)conn;
-	(void)msg;
-	(void)msg_size;
-	(void)max_msg_size;
-	return -1;
-}
+/** most encoder threads of a ws_ctube */
+#define WS_CTUBE_ENCODE_MAXTHREAD 64
+/** payloads are split into chunks of at least this many bytes */
+#define WS_CTUBE_ENCODE_CHUNK ((size_t)256 << 10)
+/** and into at most this many chunks */
+#define WS_CTUBE_ENCODE_MAXCHUNK 256
 
-int ws_ctube_ws_is_ping(const char *msg, int msg_size)
+struct ws_ctube_encode_job;
+
+typedef void (*ws_ctube_encode_fn)(struct ws_ctube_encode_job *job, int chunk);
+
+/** including this in a larger struct allows it to be encoded by a ws_ctube_encoder */
+struct ws_ctube_encode_job {
+	/* called once for each chunk, on any thread */
+	ws_ctube_encode_fn encode;
+	int nchunk;
+	/* next chunk to take */
+	int next;
+	/* workers taking chunks of the job, under the encoder mutex */
+	int nworker;
+	/* in the encoder's list while it may have chunks left */
+	struct ws_ctube_list_node lnode;
+};
+
+struct ws_ctube_encoder {
+	/* jobs for the workers; the list mutex also guards nworker */
+	struct ws_ctube_list jobs;
+	/* signalled when a job is queued */
+	pthread_cond_t work_cond;
+	/* broadcast when a worker leaves a job */
+	pthread_cond_t done_cond;
+
+	int nthread;
+	pthread_t tids[WS_CTUBE_ENCODE_MAXTHREAD];
+};
+
+static int ws_ctube_encoder_init(struct ws_ctube_encoder *encoder)
 {
-	/* TODO */
-	(void)msg;
-	(void)msg_size;
+	ws_ctube_list_init(&encoder->jobs);
+	pthread_cond_init(&encoder->work_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+	encoder->nthread = 0;
 	return 0;
 }
 
-int ws_ctube_ws_pong(int conn, const char *msg, int msg_size)
+static void ws_ctube_encoder_destroy(struct ws_ctube_encoder *encoder)
 {
-	/* TODO */
-	(void)conn;
-	(void)msg;
-	(void)msg_size;
-	return 0;
+	ws_ctube_list_destroy(&encoder->jobs);
+	pthread_cond_destroy(&encoder->work_cond);
+	pthread_cond_destroy(&encoder->done_cond);
+	encoder->nthread = 0;
 }
 
-/** extract the client key from handshake */
-static char *ws_client_key(char *rbuf)
+/**
+ * split size bytes into chunks
+ *
+ * @param chunk_size set to the bytes of each chunk (the last may be smaller)
+ *
+ * @return number of chunks, at least 1
+ */
+static inline int ws_ctube_encode_nchunk(size_t size, size_t *chunk_size)
 {
-	char *client_key, *client_key_end;
+	size_t chunk = WS_CTUBE_ENCODE_CHUNK;
 
-	client_key = strstr(rbuf, "Sec-WebSocket-Key: ");
-	if (client_key == NULL) {
-		return NULL;
+	if (size > chunk * WS_CTUBE_ENCODE_MAXCHUNK) {
+		chunk = (size + WS_CTUBE_ENCODE_MAXCHUNK - 1) / WS_CTUBE_ENCODE_MAXCHUNK;
 	}
+	*chunk_size = chunk;
+	return size > chunk ? (int)((size + chunk - 1) / chunk) : 1;
+}
 
-	client_key += strlen("Sec-WebSocket-Key: ");
-	client_key_end = strstr(client_key, "\r");
-	if (client_key_end == NULL) {
-		return NULL;
+/** encode chunks of job until none are left to take */
+static void _ws_ctube_encode_chunks(struct ws_ctube_encode_job *job)
+{
+	int chunk;
+
+	while ((chunk = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunk) {
+		job->encode(job, chunk);
 	}
+}
 
-	*client_key_end = '\0';
-	if (WS_DEBUG) {
-		printf("wskey\n%s\n", client_key);
+/** take job out of the workers' reach; jobs.mutex must be held */
+static inline void _ws_ctube_encoder_unlink(struct ws_ctube_encoder *encoder, struct ws_ctube_encode_job *job)
+{
+	if (job->lnode.next != NULL) {
+		_ws_ctube_list_node_unlink(&job->lnode);
+		encoder->jobs.len--;
 	}
-	return client_key;
 }
 
-/** compute server response key per websocket standard */
-static int ws_server_response_key(char *server_key, const char *client_key)
+/**
+ * call encode(job, chunk) for every chunk from 0 to nchunk - 1, on this
+ * thread and on the encoder's workers (if encoder is not NULL), and return
+ * once all are done. Not a cancellation point
+ */
+static void ws_ctube_encoder_run(struct ws_ctube_encoder *encoder, struct ws_ctube_encode_job *job, ws_ctube_encode_fn encode, int nchunk)
 {
-	size_t sha1_hash_len = 20;
-	char magic_client_key[WS_BUFLEN];
-	char client_sha1[WS_BUFLEN];
+	const int shared = encoder != NULL && encoder->nthread > 0 && nchunk > 1;
+	int oldstate, statevar;
 
-	if (snprintf(magic_client_key, WS_BUFLEN, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", client_key) >= WS_BUFLEN) {
-		return -1;
+	job->encode = encode;
+	job->nchunk = nchunk;
+	job->next = 0;
+	job->nworker = 0;
+	ws_ctube_list_node_init(&job->lnode);
+
+	if (shared) {
+		pthread_mutex_lock(&encoder->jobs.mutex);
+		_ws_ctube_list_add_after(encoder->jobs.head.prev, &job->lnode);
+		encoder->jobs.len++;
+		pthread_mutex_unlock(&encoder->jobs.mutex);
+		pthread_cond_broadcast(&encoder->work_cond);
 	}
 
-	ws_ctube_sha1sum((unsigned char *)client_sha1, (unsigned char *)magic_client_key, strlen(magic_client_key));
-	ws_ctube_b64_encode((unsigned char *)server_key, (unsigned char *)client_sha1, sha1_hash_len);
+	_ws_ctube_encode_chunks(job);
+	if (!shared) {
+		return;
+	}
 
-	return 0;
+	/* job is on this stack: wait for every worker to be done with it */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	pthread_mutex_lock(&encoder->jobs.mutex);
+	_ws_ctube_encoder_unlink(encoder, job);
+	while (job->nworker > 0) {
+		pthread_cond_wait(&encoder->done_cond, &encoder->jobs.mutex);
+	}
+	pthread_mutex_unlock(&encoder->jobs.mutex);
+	pthread_setcancelstate(oldstate, &statevar);
 }
 
-int ws_ctube_ws_handshake(int conn, const struct timeval *timeout)
+static void _ws_ctube_encoder_cleanup_unlock(void *arg)
 {
-	char rbuf[WS_BUFLEN];
-	char *client_key;
-	char server_key[WS_BUFLEN];
-	char response[2*WS_BUFLEN];
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
 
-	const char *const response_fmt = "HTTP/1.1 101 Switching Protocols\r\n"
-				"Upgrade: websocket\r\n"
-				"Connection: Upgrade\r\n"
-				"Sec-WebSocket-Accept: %s\r\n\r\n";
+static void *ws_ctube_encoder_main(void *arg)
+{
+	struct ws_ctube_encoder *encoder = (struct ws_ctube_encoder *)arg;
+	struct ws_ctube_encode_job *job;
+	int oldstate, statevar;
 
-	/* receive with timeout, but reset to old timeout afterwards */
-	struct timeval old_timeout;
-	socklen_t timeval_size = sizeof(old_timeout);
-	if (getsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &old_timeout, &timeval_size) < 0) {
-		goto err;
-	}
-	if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, timeout, sizeof(*timeout)) < 0) {
-		goto err;
-	}
-	if (ws_ctube_socket_recv_all(conn, rbuf, WS_BUFLEN, "\r\n\r\n") != 0) {
-		goto err;
-	}
-	if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &old_timeout, sizeof(old_timeout)) < 0) {
-		goto err;
+	for (;;) {
+		pthread_mutex_lock(&encoder->jobs.mutex);
+		pthread_cleanup_push(_ws_ctube_encoder_cleanup_unlock, &encoder->jobs.mutex);
+		while (encoder->jobs.len == 0) {
+			pthread_cond_wait(&encoder->work_cond, &encoder->jobs.mutex);
+		}
+		job = ws_ctube_container_of(encoder->jobs.head.next, typeof(*job), lnode);
+		job->nworker++;
+		pthread_mutex_unlock(&encoder->jobs.mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_encoder_cleanup_unlock */
+
+		/* the job's thread is waiting for us: finish before cancelling */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		_ws_ctube_encode_chunks(job);
+
+		pthread_mutex_lock(&encoder->jobs.mutex);
+		_ws_ctube_encoder_unlink(encoder, job);
+		job->nworker--;
+		pthread_mutex_unlock(&encoder->jobs.mutex);
+		pthread_cond_broadcast(&encoder->done_cond);
+		pthread_setcancelstate(oldstate, &statevar);
 	}
 
-	/* ensure null termination of received data */
-	rbuf[WS_BUFLEN - 1] = '\0';
-
-	if (WS_DEBUG) {
-		printf("get\n%s\n", rbuf);
-	}
+	return NULL;
+}
 
-	client_key = ws_client_key(rbuf);
-	if (client_key == NULL) {
-		goto err;
+/** stop the first nthread workers of encoder */
+static void _ws_ctube_encoder_cancel(struct ws_ctube_encoder *encoder, int nthread)
+{
+	for (int i = 0; i < nthread; i++) {
+		pthread_cancel(encoder->tids[i]);
 	}
-	if (ws_server_response_key(server_key, client_key) != 0) {
-		goto err;
+	for (int i = 0; i < nthread; i++) {
+		pthread_join(encoder->tids[i], NULL);
 	}
+}
 
-	snprintf(response, sizeof(response)/sizeof(response[0]), response_fmt, server_key);
-	if (WS_DEBUG) {
-		printf("server response\n%s\n", response);
+/** start nthread workers (at most WS_CTUBE_ENCODE_MAXTHREAD, may be 0) */
+static int ws_ctube_encoder_start(struct ws_ctube_encoder *encoder, int nthread)
+{
+	for (int i = 0; i < nthread; i++) {
+		if (pthread_create(&encoder->tids[i], NULL, ws_ctube_encoder_main, (void *)encoder) != 0) {
+			_ws_ctube_encoder_cancel(encoder, i);
+			return -1;
+		}
 	}
+	encoder->nthread = nthread;
+	return 0;
+}
 
-	/* send with timeout, but reset to old timeout afterwards */
-	if (getsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &old_timeout, &timeval_size) < 0) {
-		goto err;
-	}
-	if (setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, timeout, sizeof(*timeout)) < 0) {
-		goto err;
-	}
-	if (ws_ctube_socket_send_all(conn, response, strlen(response)) != 0) {
-		goto err;
-	}
-	if (setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &old_timeout, sizeof(old_timeout)) < 0) {
-		goto err;
-	}
+/** stop the workers: no job may be running */
+static void ws_ctube_encoder_stop(struct ws_ctube_encoder *encoder)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-	return 0;
+	_ws_ctube_encoder_cancel(encoder, encoder->nthread);
+	encoder->nthread = 0;
 
-err:
-	if (WS_DEBUG) {
-		perror("ws_ctube_ws_handshake()");
-	}
-	return -1;
+	pthread_setcancelstate(oldstate, &statevar);
 }
 
+#endif /* WS_CTUBE_ENCODER_H */
 
 
 
 
+#ifndef WS_CTUBE_ALLOC_H
+#define WS_CTUBE_ALLOC_H
 
 
-#define WS_CTUBE_DEBUG 0
-#define WS_CTUBE_BUFLEN 4096
+/** alignment of payload buffers */
+#define WS_CTUBE_PAYLOAD_ALIGN 64
 
-typedef void (*cleanup_func)(void *);
+/** allocators used by a ws_ctube */
+struct ws_ctube_mem {
+	/* small control objects: the ctube, descriptors, slabs, tables */
+	struct ws_ctube_allocator ctrl;
+	/* broadcast data buffers */
+	struct ws_ctube_allocator payload;
+};
 
-static void _ws_ctube_cleanup_unlock_mutex(void *mutex)
+/** whether the hooks of allocator are set (both or neither must be) */
+static inline int ws_ctube_allocator_is_custom(const struct ws_ctube_allocator *allocator)
 {
-	pthread_mutex_unlock((pthread_mutex_t *)mutex);
+	return allocator->alloc != NULL;
 }
 
-/** push a work item (start/stop connection) onto the FIFO connq */
-static int ws_ctube_connq_push(struct ws_ctube *ctube, struct ws_ctube_conn_struct *conn, enum ws_ctube_qaction act)
+/** allocate size bytes aligned to align (a power of 2) with allocator or malloc() */
+static void *ws_ctube_mem_alloc(const struct ws_ctube_allocator *allocator, size_t size, size_t align)
+{
+	void *ptr;
+
+	if (ws_ctube_allocator_is_custom(allocator)) {
+		return allocator->alloc(size, align, allocator->user);
+	}
+
+	if (align <= __alignof__(max_align_t)) {
+		return malloc(size);
+	}
+	if (posix_memalign(&ptr, align, size) != 0) {
+		return NULL;
+	}
+	return ptr;
+}
+
+/** free ptr from ws_ctube_mem_alloc() called with the same allocator, size and align */
+static void ws_ctube_mem_free(const struct ws_ctube_allocator *allocator, void *ptr, size_t size, size_t align)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (ws_ctube_allocator_is_custom(allocator)) {
+		allocator->free(ptr, size, align, allocator->user);
+	} else {
+		free(ptr);
+	}
+}
+
+#endif /* WS_CTUBE_ALLOC_H */
+
+
+
+
+#ifndef WS_CTUBE_SLAB_H
+#define WS_CTUBE_SLAB_H
+
+
+#define WS_CTUBE_SLAB_ALIGN WS_CTUBE_CACHE_LINE
+
+struct ws_ctube_slab;
+
+/** called on each object once, when its slab is created or destroyed */
+typedef void (*ws_ctube_slab_obj_fn)(void *obj);
+
+/**
+ * precedes each object in its slot, padded to a whole cache line so that the
+ * object starts on one
+ */
+struct ws_ctube_slab_hdr {
+	struct ws_ctube_slab *slab;
+	int slot;
+} __attribute__((aligned(WS_CTUBE_SLAB_ALIGN)));
+
+struct ws_ctube_slab {
+	char *slots;
+	/** bytes per slot (header + object, rounded up to WS_CTUBE_SLAB_ALIGN) */
+	size_t slot_size;
+	int capacity;
+
+	/* stack of free slot indices */
+	int *free_slots;
+	int nfree;
+	pthread_mutex_t mutex;
+
+	/* slots and free_slots are allocated from this */
+	const struct ws_ctube_allocator *allocator;
+	/* may be NULL */
+	ws_ctube_slab_obj_fn obj_destroy;
+};
+
+static inline struct ws_ctube_slab_hdr *_ws_ctube_slab_hdr(const void *obj)
+{
+	return (struct ws_ctube_slab_hdr *)((char *)obj - sizeof(struct ws_ctube_slab_hdr));
+}
+
+/**
+ * @param obj_init if not NULL, called on every object now
+ * @param obj_destroy if not NULL, called on every object by ws_ctube_slab_destroy()
+ */
+static int ws_ctube_slab_init(struct ws_ctube_slab *slab, size_t obj_size, int capacity, const struct ws_ctube_allocator *allocator,
+			      ws_ctube_slab_obj_fn obj_init, ws_ctube_slab_obj_fn obj_destroy)
+{
+	struct ws_ctube_slab_hdr *hdr;
+
+	slab->slot_size = (sizeof(*hdr) + obj_size + WS_CTUBE_SLAB_ALIGN - 1) / WS_CTUBE_SLAB_ALIGN * WS_CTUBE_SLAB_ALIGN;
+	slab->capacity = capacity;
+	slab->allocator = allocator;
+	slab->obj_destroy = obj_destroy;
+
+	slab->slots = (typeof(slab->slots))ws_ctube_mem_alloc(allocator, slab->slot_size * capacity, WS_CTUBE_SLAB_ALIGN);
+	if (slab->slots == NULL) {
+		goto out_noslots;
+	}
+
+	slab->free_slots = (typeof(slab->free_slots))ws_ctube_mem_alloc(allocator, capacity * sizeof(*slab->free_slots), __alignof__(*slab->free_slots));
+	if (slab->free_slots == NULL) {
+		goto out_nofree;
+	}
+
+	/* hand out low slots first */
+	for (int i = 0; i < capacity; i++) {
+		hdr = (struct ws_ctube_slab_hdr *)(slab->slots + i * slab->slot_size);
+		hdr->slab = slab;
+		hdr->slot = i;
+		slab->free_slots[i] = capacity - 1 - i;
+		if (obj_init != NULL) {
+			obj_init((char *)hdr + sizeof(*hdr));
+		}
+	}
+	slab->nfree = capacity;
+
+	pthread_mutex_init(&slab->mutex, NULL);
+	return 0;
+
+out_nofree:
+	ws_ctube_mem_free(allocator, slab->slots, slab->slot_size * capacity, WS_CTUBE_SLAB_ALIGN);
+out_noslots:
+	return -1;
+}
+
+static void ws_ctube_slab_destroy(struct ws_ctube_slab *slab)
+{
+	if (slab->obj_destroy != NULL) {
+		for (int i = 0; i < slab->capacity; i++) {
+			slab->obj_destroy(slab->slots + i * slab->slot_size + sizeof(struct ws_ctube_slab_hdr));
+		}
+	}
+	slab->obj_destroy = NULL;
+	ws_ctube_mem_free(slab->allocator, slab->slots, slab->slot_size * slab->capacity, WS_CTUBE_SLAB_ALIGN);
+	slab->slots = NULL;
+	ws_ctube_mem_free(slab->allocator, slab->free_slots, slab->capacity * sizeof(*slab->free_slots), __alignof__(*slab->free_slots));
+	slab->free_slots = NULL;
+	slab->allocator = NULL;
+
+	slab->slot_size = 0;
+	slab->capacity = 0;
+	slab->nfree = 0;
+	pthread_mutex_destroy(&slab->mutex);
+}
+
+/** @return uninitialized object or NULL if all slots are in use */
+static void *ws_ctube_slab_alloc(struct ws_ctube_slab *slab)
+{
+	int slot;
+
+	pthread_mutex_lock(&slab->mutex);
+	if (slab->nfree == 0) {
+		pthread_mutex_unlock(&slab->mutex);
+		return NULL;
+	}
+	slot = slab->free_slots[--slab->nfree];
+	pthread_mutex_unlock(&slab->mutex);
+
+	return slab->slots + slot * slab->slot_size + sizeof(struct ws_ctube_slab_hdr);
+}
+
+/** return obj from ws_ctube_slab_alloc() to its slab */
+static void ws_ctube_slab_free(void *obj)
+{
+	struct ws_ctube_slab_hdr *hdr = _ws_ctube_slab_hdr(obj);
+	struct ws_ctube_slab *slab = hdr->slab;
+
+	pthread_mutex_lock(&slab->mutex);
+	slab->free_slots[slab->nfree++] = hdr->slot;
+	pthread_mutex_unlock(&slab->mutex);
+}
+
+/** slot index of obj: unique among allocated objects of its slab */
+static inline int ws_ctube_slab_slot(const void *obj)
+{
+	return _ws_ctube_slab_hdr(obj)->slot;
+}
+
+#endif /* WS_CTUBE_SLAB_H */
+
+
+
+
+#ifndef WS_CTUBE_HUGE_PAGE_H
+#define WS_CTUBE_HUGE_PAGE_H
+
+
+#define WS_CTUBE_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/** 2 MB aligned anonymous mapping of size bytes advised for transparent huge pages */
+static void *_ws_ctube_huge_mmap_thp(size_t size)
+{
+	char *map;
+	char *aligned;
+	size_t head;
+	const size_t map_size = size + WS_CTUBE_HUGE_PAGE_SIZE;
+
+	map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* trim to an aligned range so that every 2 MB is huge page eligible */
+	aligned = (char *)(((uintptr_t)map + WS_CTUBE_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(WS_CTUBE_HUGE_PAGE_SIZE - 1));
+	head = aligned - map;
+	if (head > 0) {
+		munmap(map, head);
+	}
+	munmap(aligned + size, map_size - head - size);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+/**
+ * allocate size bytes backed by huge pages
+ *
+ * @return buffer to give back with ws_ctube_huge_free() or NULL if huge pages
+ * are unavailable or size is not a whole number of huge pages
+ */
+static void *ws_ctube_huge_alloc(size_t size)
+{
+	void *buf;
+
+	if (size == 0 || size % WS_CTUBE_HUGE_PAGE_SIZE != 0) {
+		return NULL;
+	}
+
+#ifdef MAP_HUGETLB
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buf != MAP_FAILED) {
+		return buf;
+	}
+#endif
+
+	return _ws_ctube_huge_mmap_thp(size);
+}
+
+static void ws_ctube_huge_free(void *buf, size_t size)
+{
+	if (buf != NULL) {
+		munmap(buf, size);
+	}
+}
+
+#endif /* WS_CTUBE_HUGE_PAGE_H */
+
+
+
+
+#ifndef WS_CTUBE_GRID_H
+#define WS_CTUBE_GRID_H
+
+
+/** set packed (row-major) strides for grid */
+static void ws_ctube_grid_pack_strides(struct ws_ctube_grid *grid)
+{
+	size_t stride = grid->elem_size;
+
+	for (int i = grid->ndim - 1; i >= 0; i--) {
+		grid->strides[i] = stride;
+		stride *= grid->dims[i];
+	}
+}
+
+/** bytes of grid if packed, not counting levels */
+static inline size_t ws_ctube_grid_size(const struct ws_ctube_grid *grid)
+{
+	size_t size = grid->elem_size;
+
+	for (int i = 0; i < grid->ndim; i++) {
+		size *= grid->dims[i];
+	}
+	return size;
+}
+
+/** the next level down from view: half as many elements along each axis */
+static void _ws_ctube_grid_halve(struct ws_ctube_grid *view)
+{
+	for (int i = 0; i < view->ndim; i++) {
+		view->dims[i] = (view->dims[i] + 1) / 2;
+	}
+	ws_ctube_grid_pack_strides(view);
+}
+
+/** number of levels of grid worth building: at most grid->nlevel, until 1 element */
+static int ws_ctube_grid_nlevel(const struct ws_ctube_grid *grid)
+{
+	struct ws_ctube_grid view = *grid;
+	int nlevel = 0;
+
+	while (nlevel < grid->nlevel && ws_ctube_grid_size(&view) > view.elem_size) {
+		_ws_ctube_grid_halve(&view);
+		nlevel++;
+	}
+	return nlevel;
+}
+
+/**
+ * layout of a level of the pyramid of packed grid (level 0 is grid itself)
+ *
+ * @param view set to the packed layout of that level
+ * @return offset of the level in bytes from the start of the grid
+ */
+static size_t ws_ctube_grid_level(const struct ws_ctube_grid *grid, int level, struct ws_ctube_grid *view)
+{
+	size_t offset = 0;
+
+	*view = *grid;
+	view->nlevel = 0;
+	ws_ctube_grid_pack_strides(view);
+	for (int l = 0; l < level; l++) {
+		offset += ws_ctube_grid_size(view);
+		_ws_ctube_grid_halve(view);
+	}
+	return offset;
+}
+
+/** copy the grid at src with layout grid into packed dst */
+static void ws_ctube_grid_pack(char *dst, const char *src, const struct ws_ctube_grid *grid)
+{
+	const int pad = WS_CTUBE_GRID_MAXDIM - grid->ndim;
+	const size_t elem_size = grid->elem_size;
+	size_t dims[WS_CTUBE_GRID_MAXDIM];
+	size_t stride[WS_CTUBE_GRID_MAXDIM];
+
+	/* as a 3D grid whose leading axes have length 1 */
+	for (int i = 0; i < WS_CTUBE_GRID_MAXDIM; i++) {
+		dims[i] = 1;
+		stride[i] = 0;
+	}
+	for (int i = 0; i < grid->ndim; i++) {
+		dims[pad + i] = grid->dims[i];
+		stride[pad + i] = grid->strides[i];
+	}
+
+	const size_t row_size = dims[2] * elem_size;
+	for (size_t z = 0; z < dims[0]; z++) {
+		for (size_t y = 0; y < dims[1]; y++) {
+			const char *row = src + z * stride[0] + y * stride[1];
+			if (stride[2] == elem_size) {
+				memcpy(dst, row, row_size);
+			} else {
+				for (size_t x = 0; x < dims[2]; x++) {
+					memcpy(dst + x * elem_size, row + x * stride[2], elem_size);
+				}
+			}
+			dst += row_size;
+		}
+	}
+}
+
+/*
+ * row kernels: combine pairs of elements of 2 (2D) or 4 (3D) input rows of
+ * n_in elements into one output row of (n_in + 1) / 2 elements. The loops
+ * are kept simple enough for the compiler to vectorize; an odd last element
+ * is combined with itself. Integer means round to nearest for unsigned types
+ * and toward zero for signed ones.
+ */
+#define _WS_CTUBE_GRID_MIN(a, b) ((b) < (a) ? (b) : (a))
+#define _WS_CTUBE_GRID_MAX(a, b) ((a) < (b) ? (b) : (a))
+
+#define _WS_CTUBE_GRID_KERNELS(name, T, ACC, ROUND) \
+static void _ws_ctube_grid_row2_##name(T *__restrict dst, const T *r0, const T *r1, size_t n_in, enum ws_ctube_lod_filter filter) \
+{ \
+	const size_t n = n_in / 2; \
+	size_t x; \
+\
+	switch (filter) { \
+	case WS_CTUBE_LOD_MIN: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MIN(r0[2 * x], r0[2 * x + 1]); \
+			const T b = _WS_CTUBE_GRID_MIN(r1[2 * x], r1[2 * x + 1]); \
+			dst[x] = _WS_CTUBE_GRID_MIN(a, b); \
+		} \
+		break; \
+	case WS_CTUBE_LOD_MAX: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MAX(r0[2 * x], r0[2 * x + 1]); \
+			const T b = _WS_CTUBE_GRID_MAX(r1[2 * x], r1[2 * x + 1]); \
+			dst[x] = _WS_CTUBE_GRID_MAX(a, b); \
+		} \
+		break; \
+	default: \
+		for (x = 0; x < n; x++) { \
+			const ACC sum = (ACC)r0[2 * x] + (ACC)r0[2 * x + 1] + (ACC)r1[2 * x] + (ACC)r1[2 * x + 1]; \
+			dst[x] = (T)((sum + 2 * (ROUND)) / 4); \
+		} \
+		break; \
+	} \
+\
+	if (n_in % 2 != 0) { \
+		const T tail[2][2] = {{r0[n_in - 1], r0[n_in - 1]}, {r1[n_in - 1], r1[n_in - 1]}}; \
+		_ws_ctube_grid_row2_##name(dst + n, tail[0], tail[1], 2, filter); \
+	} \
+} \
+\
+static void _ws_ctube_grid_row4_##name(T *__restrict dst, const T *r0, const T *r1, const T *r2, const T *r3, size_t n_in, enum ws_ctube_lod_filter filter) \
+{ \
+	const size_t n = n_in / 2; \
+	size_t x; \
+\
+	switch (filter) { \
+	case WS_CTUBE_LOD_MIN: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MIN(_WS_CTUBE_GRID_MIN(r0[2 * x], r0[2 * x + 1]), _WS_CTUBE_GRID_MIN(r1[2 * x], r1[2 * x + 1])); \
+			const T b = _WS_CTUBE_GRID_MIN(_WS_CTUBE_GRID_MIN(r2[2 * x], r2[2 * x + 1]), _WS_CTUBE_GRID_MIN(r3[2 * x], r3[2 * x + 1])); \
+			dst[x] = _WS_CTUBE_GRID_MIN(a, b); \
+		} \
+		break; \
+	case WS_CTUBE_LOD_MAX: \
+		for (x = 0; x < n; x++) { \
+			const T a = _WS_CTUBE_GRID_MAX(_WS_CTUBE_GRID_MAX(r0[2 * x], r0[2 * x + 1]), _WS_CTUBE_GRID_MAX(r1[2 * x], r1[2 * x + 1])); \
+			const T b = _WS_CTUBE_GRID_MAX(_WS_CTUBE_GRID_MAX(r2[2 * x], r2[2 * x + 1]), _WS_CTUBE_GRID_MAX(r3[2 * x], r3[2 * x + 1])); \
+			dst[x] = _WS_CTUBE_GRID_MAX(a, b); \
+		} \
+		break; \
+	default: \
+		for (x = 0; x < n; x++) { \
+			const ACC sum = (ACC)r0[2 * x] + (ACC)r0[2 * x + 1] + (ACC)r1[2 * x] + (ACC)r1[2 * x + 1] \
+				+ (ACC)r2[2 * x] + (ACC)r2[2 * x + 1] + (ACC)r3[2 * x] + (ACC)r3[2 * x + 1]; \
+			dst[x] = (T)((sum + 4 * (ROUND)) / 8); \
+		} \
+		break; \
+	} \
+\
+	if (n_in % 2 != 0) { \
+		const T tail[4][2] = { \
+			{r0[n_in - 1], r0[n_in - 1]}, {r1[n_in - 1], r1[n_in - 1]}, \
+			{r2[n_in - 1], r2[n_in - 1]}, {r3[n_in - 1], r3[n_in - 1]}}; \
+		_ws_ctube_grid_row4_##name(dst + n, tail[0], tail[1], tail[2], tail[3], 2, filter); \
+	} \
+}
+
+_WS_CTUBE_GRID_KERNELS(u8, uint8_t, unsigned, 1)
+_WS_CTUBE_GRID_KERNELS(i8, int8_t, int, 0)
+_WS_CTUBE_GRID_KERNELS(u16, uint16_t, unsigned, 1)
+_WS_CTUBE_GRID_KERNELS(i16, int16_t, int, 0)
+_WS_CTUBE_GRID_KERNELS(u32, uint32_t, uint64_t, 1)
+_WS_CTUBE_GRID_KERNELS(i32, int32_t, int64_t, 0)
+_WS_CTUBE_GRID_KERNELS(f32, float, float, 0)
+_WS_CTUBE_GRID_KERNELS(f64, double, double, 0)
+
+#define _WS_CTUBE_GRID_ROW_CASE(TYPE, name, T) \
+	case TYPE: \
+		if (nrow == 4) { \
+			_ws_ctube_grid_row4_##name((T *)dst, (const T *)rows[0], (const T *)rows[1], (const T *)rows[2], (const T *)rows[3], n_in, filter); \
+		} else { \
+			_ws_ctube_grid_row2_##name((T *)dst, (const T *)rows[0], (const T *)rows[1], n_in, filter); \
+		} \
+		break;
+
+/** combine nrow (2 or 4) rows of n_in elements of grid into dst */
+static void _ws_ctube_grid_row(const struct ws_ctube_grid *grid, void *dst, const char *const *rows, int nrow, size_t n_in)
+{
+	const enum ws_ctube_lod_filter filter = grid->filter;
+
+	switch (grid->type) {
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_U8, u8, uint8_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_I8, i8, int8_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_U16, u16, uint16_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_I16, i16, int16_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_U32, u32, uint32_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_I32, i32, int32_t)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_F32, f32, float)
+	_WS_CTUBE_GRID_ROW_CASE(WS_CTUBE_ELEM_F64, f64, double)
+	default:
+		/* unknown type: keep the first element of each block */
+		for (size_t x = 0; 2 * x < n_in; x++) {
+			memcpy((char *)dst + x * grid->elem_size, rows[0] + 2 * x * grid->elem_size, grid->elem_size);
+		}
+		break;
+	}
+}
+
+/**
+ * build the level after a packed level of a grid
+ *
+ * @param dst receives the next level, packed
+ * @param src the level with layout view, from ws_ctube_grid_level()
+ * @param view the layout of src (type and filter from the grid)
+ */
+static void ws_ctube_grid_downsample(char *dst, const char *src, const struct ws_ctube_grid *view)
+{
+	const int pad = WS_CTUBE_GRID_MAXDIM - view->ndim;
+	const char *rows[4];
+	size_t dims[WS_CTUBE_GRID_MAXDIM];
+
+	/* as a 3D grid whose leading axes have length 1 */
+	for (int i = 0; i < WS_CTUBE_GRID_MAXDIM; i++) {
+		dims[i] = i < pad ? 1 : view->dims[i - pad];
+	}
+
+	const size_t row_size = dims[2] * view->elem_size;
+	const size_t out_row_size = (dims[2] + 1) / 2 * view->elem_size;
+	for (size_t z = 0; 2 * z < dims[0]; z++) {
+		const size_t z1 = 2 * z + 1 < dims[0] ? 2 * z + 1 : 2 * z;
+		for (size_t y = 0; 2 * y < dims[1]; y++) {
+			const size_t y1 = 2 * y + 1 < dims[1] ? 2 * y + 1 : 2 * y;
+
+			rows[0] = src + (2 * z * dims[1] + 2 * y) * row_size;
+			rows[1] = src + (2 * z * dims[1] + y1) * row_size;
+			rows[2] = src + (z1 * dims[1] + 2 * y) * row_size;
+			rows[3] = src + (z1 * dims[1] + y1) * row_size;
+
+			/* 1D grids combine a row with itself */
+			_ws_ctube_grid_row(view, dst, rows, view->ndim == 3 ? 4 : 2, dims[2]);
+			dst += out_row_size;
+		}
+	}
+}
+
+#endif /* WS_CTUBE_GRID_H */
+
+
+
+
+#ifndef WS_CTUBE_QUANT_H
+#define WS_CTUBE_QUANT_H
+
+
+/** starts every quantized message (24 bytes, so the values stay aligned) */
+struct ws_ctube_quant_header {
+	/* enum ws_ctube_quant_format */
+	uint8_t format;
+	uint8_t reserved[7];
+	/* range of the U8 and U16 formats: value = min + q * (max - min) / qmax */
+	double min;
+	double max;
+};
+
+/** bytes per value of format */
+static inline size_t ws_ctube_quant_elem_size(enum ws_ctube_quant_format format)
+{
+	return format == WS_CTUBE_QUANT_U8 ? 1 : 2;
+}
+
+/** bytes of the message quantizing count values to format */
+static inline size_t ws_ctube_quant_size(enum ws_ctube_quant_format format, size_t count)
+{
+	return sizeof(struct ws_ctube_quant_header) + count * ws_ctube_quant_elem_size(format);
+}
+
+/*
+ * scalar conversions, branch-free so that the loops below vectorize: each
+ * case is computed and one is selected
+ */
+
+/** float to IEEE half precision, rounding to nearest even */
+static inline uint16_t _ws_ctube_f16(float x)
+{
+	uint32_t f, sign, denorm_bits;
+	float denorm;
+
+	memcpy(&f, &x, sizeof(f));
+	sign = f & 0x80000000u;
+	f ^= sign;
+
+	/* NaN stays NaN, too large becomes infinity */
+	const uint32_t special = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+	/* too small for a normal half: let float addition round it off */
+	memcpy(&denorm, &f, sizeof(denorm));
+	denorm += 0.5f;
+	memcpy(&denorm_bits, &denorm, sizeof(denorm_bits));
+	denorm_bits -= 0x3f000000u;
+	/* rebias the exponent and round the mantissa */
+	const uint32_t normal = (f + 0xc8000fffu + ((f >> 13) & 1)) >> 13;
+
+	/* selected with masks: a branch here would keep the add above from
+	 * being vectorized (it could raise a floating-point exception) */
+	const uint32_t big = 0u - (f >= 0x47800000u);
+	const uint32_t small = 0u - (f < 0x38800000u);
+	const uint32_t o = (special & big) | (denorm_bits & small) | (normal & ~(big | small));
+	return (uint16_t)(o | sign >> 16);
+}
+
+/** float to bfloat16 (its upper 16 bits), rounding to nearest even */
+static inline uint16_t _ws_ctube_bf16(float x)
+{
+	uint32_t f;
+
+	memcpy(&f, &x, sizeof(f));
+	const uint32_t rounded = (f + 0x7fffu + ((f >> 16) & 1)) >> 16;
+	/* NaN stays NaN (quiet) instead of rounding to infinity */
+	return (uint16_t)((f & 0x7fffffffu) > 0x7f800000u ? (f >> 16) | 0x40 : rounded);
+}
+
+/*
+ * array kernels for input type T, whose bits are the signed integer type K
+ * with exponent bits EXP. Only finite values count towards the range, which
+ * is found on integer keys ordered like the values (floating-point min and
+ * max do not vectorize without -ffast-math). NaN quantizes to 0 and values
+ * outside the range are clamped
+ */
+#define _WS_CTUBE_QUANT_KERNELS(name, T, K, K_MIN, K_MAX, EXP) \
+static void _ws_ctube_quant_range_##name(const T *in, size_t n, double *min, double *max) \
+{ \
+	K lo = K_MAX; \
+	K hi = K_MIN; \
+	T lo_val, hi_val; \
+\
+	for (size_t i = 0; i < n; i++) { \
+		K bits; \
+		memcpy(&bits, &in[i], sizeof(bits)); \
+		const K key = bits ^ ((bits >> (8 * sizeof(K) - 1)) & K_MAX); \
+		const K inf = (K)0 - (K)((bits & (EXP)) == (EXP)); \
+		const K a = (key & ~inf) | (K_MAX & inf); \
+		const K b = (key & ~inf) | (K_MIN & inf); \
+		lo = a < lo ? a : lo; \
+		hi = b > hi ? b : hi; \
+	} \
+	if (lo > hi) { \
+		/* nothing finite */ \
+		*min = 0; \
+		*max = 0; \
+		return; \
+	} \
+\
+	lo ^= (lo >> (8 * sizeof(K) - 1)) & K_MAX; \
+	hi ^= (hi >> (8 * sizeof(K) - 1)) & K_MAX; \
+	memcpy(&lo_val, &lo, sizeof(lo_val)); \
+	memcpy(&hi_val, &hi, sizeof(hi_val)); \
+	*min = (double)lo_val; \
+	*max = (double)hi_val; \
+} \
+\
+static void _ws_ctube_quant_f16_##name(uint16_t *__restrict out, const T *in, size_t n) \
+{ \
+	for (size_t i = 0; i < n; i++) { \
+		out[i] = _ws_ctube_f16((float)in[i]); \
+	} \
+} \
+\
+static void _ws_ctube_quant_bf16_##name(uint16_t *__restrict out, const T *in, size_t n) \
+{ \
+	for (size_t i = 0; i < n; i++) { \
+		out[i] = _ws_ctube_bf16((float)in[i]); \
+	} \
+} \
+\
+static void _ws_ctube_quant_u8_##name(uint8_t *__restrict out, const T *in, size_t n, double min, double max) \
+{ \
+	const T offset = (T)min; \
+	const T scale = max > min ? (T)(UINT8_MAX / (max - min)) : 0; \
+\
+	for (size_t i = 0; i < n; i++) { \
+		T q = (in[i] - offset) * scale + (T)0.5; \
+		q = q > 0 ? q : 0; \
+		q = q < UINT8_MAX ? q : UINT8_MAX; \
+		out[i] = (uint8_t)q; \
+	} \
+} \
+\
+static void _ws_ctube_quant_u16_##name(uint16_t *__restrict out, const T *in, size_t n, double min, double max) \
+{ \
+	const T offset = (T)min; \
+	const T scale = max > min ? (T)(UINT16_MAX / (max - min)) : 0; \
+\
+	for (size_t i = 0; i < n; i++) { \
+		T q = (in[i] - offset) * scale + (T)0.5; \
+		q = q > 0 ? q : 0; \
+		q = q < UINT16_MAX ? q : UINT16_MAX; \
+		out[i] = (uint16_t)q; \
+	} \
+}
+
+_WS_CTUBE_QUANT_KERNELS(f32, float, int32_t, INT32_MIN, INT32_MAX, 0x7f800000)
+_WS_CTUBE_QUANT_KERNELS(f64, double, int64_t, INT64_MIN, INT64_MAX, INT64_C(0x7ff0000000000000))
+
+#define _WS_CTUBE_QUANT_CASE(name, T) \
+	switch (quant->format) { \
+	case WS_CTUBE_QUANT_F16: \
+		_ws_ctube_quant_f16_##name((uint16_t *)values, (const T *)in, count); \
+		break; \
+	case WS_CTUBE_QUANT_BF16: \
+		_ws_ctube_quant_bf16_##name((uint16_t *)values, (const T *)in, count); \
+		break; \
+	case WS_CTUBE_QUANT_U8: \
+	case WS_CTUBE_QUANT_U16: \
+		if (hdr.min == 0 && hdr.max == 0) { \
+			_ws_ctube_quant_range_##name((const T *)in, count, &hdr.min, &hdr.max); \
+		} \
+		if (quant->format == WS_CTUBE_QUANT_U8) { \
+			_ws_ctube_quant_u8_##name((uint8_t *)values, (const T *)in, count, hdr.min, hdr.max); \
+		} else { \
+			_ws_ctube_quant_u16_##name((uint16_t *)values, (const T *)in, count, hdr.min, hdr.max); \
+		} \
+		break; \
+	}
+
+/**
+ * write the quantized message of count values (of quant->type, F32 or F64)
+ *
+ * @param out receives ws_ctube_quant_size() bytes, aligned to 8 bytes
+ * @param in the values
+ * @param count number of values
+ * @param quant how to convert them
+ *
+ * Not inlined: its callers use pthread_cleanup_push(), whose setjmp() keeps
+ * the loops of a function from being vectorized
+ */
+static __attribute__((noinline)) void ws_ctube_quantize(char *out, const void *in, size_t count, const struct ws_ctube_quant *quant)
+{
+	struct ws_ctube_quant_header hdr;
+	char *values = out + sizeof(hdr);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.format = (uint8_t)quant->format;
+	if (quant->format == WS_CTUBE_QUANT_U8 || quant->format == WS_CTUBE_QUANT_U16) {
+		hdr.min = quant->min;
+		hdr.max = quant->max;
+	}
+
+	if (quant->type == WS_CTUBE_ELEM_F64) {
+		_WS_CTUBE_QUANT_CASE(f64, double)
+	} else {
+		_WS_CTUBE_QUANT_CASE(f32, float)
+	}
+
+	memcpy(out, &hdr, sizeof(hdr));
+}
+
+#endif /* WS_CTUBE_QUANT_H */
+
+
+
+
+#ifndef WS_CTUBE_ENCODING_H
+#define WS_CTUBE_ENCODING_H
+
+
+enum ws_ctube_encoding {
+	/* the data as broadcast, without a tag */
+	WS_CTUBE_ENCODING_RAW,
+	/* XOR deltas from the last frame sent, see delta.h */
+	WS_CTUBE_ENCODING_DELTA,
+	/* raw deflate streams, see deflate.h */
+	WS_CTUBE_ENCODING_DEFLATE,
+	WS_CTUBE_NENCODING
+};
+
+/** names of the encodings, in the order of enum ws_ctube_encoding */
+static const char *const ws_ctube_encoding_names[WS_CTUBE_NENCODING] = {
+	"raw",
+	"delta",
+	"deflate",
+};
+
+/** tag byte: the rest of the message is the data as a raw client gets it */
+#define WS_CTUBE_TAG_FRAME 0
+/** tag byte: a delta from the last frame follows */
+#define WS_CTUBE_TAG_DELTA 1
+/** tag byte: a complete raw deflate stream of the data follows */
+#define WS_CTUBE_TAG_DEFLATE 2
+
+/** @return the encoding called name (len bytes), or -1 if there is none */
+static int ws_ctube_encoding_find(const char *name, size_t len)
+{
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		if (strlen(ws_ctube_encoding_names[i]) == len && strncmp(ws_ctube_encoding_names[i], name, len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+#endif /* WS_CTUBE_ENCODING_H */
+
+
+
+
+#ifndef WS_CTUBE_DELTA_H
+#define WS_CTUBE_DELTA_H
+
+
+/** unchanged gaps shorter than this are sent with the changed bytes around them */
+#define WS_CTUBE_DELTA_MIN_SKIP 8
+/** bytes of one LEB128 encoded size_t at most */
+#define WS_CTUBE_DELTA_LEN_MAX 10
+
+/* compiled to the widest vector compare available (e.g. one AVX2 op) */
+typedef uint64_t _ws_ctube_delta_vec __attribute__((vector_size(32)));
+
+/** index of the first byte from pos on where prev and cur differ, or size */
+static size_t _ws_ctube_delta_next_diff(const char *prev, const char *cur, size_t pos, size_t size)
+{
+	_ws_ctube_delta_vec a, b, x;
+
+	/* skip unchanged blocks a vector at a time */
+	for (; pos + sizeof(a) <= size; pos += sizeof(a)) {
+		memcpy(&a, prev + pos, sizeof(a));
+		memcpy(&b, cur + pos, sizeof(b));
+		x = a ^ b;
+		if ((x[0] | x[1] | x[2] | x[3]) != 0) {
+			break;
+		}
+	}
+
+	while (pos < size && prev[pos] == cur[pos]) {
+		pos++;
+	}
+	return pos;
+}
+
+/** index of the first byte from pos on where prev and cur are equal, or size */
+static inline size_t _ws_ctube_delta_next_same(const char *prev, const char *cur, size_t pos, size_t size)
+{
+	while (pos < size && prev[pos] != cur[pos]) {
+		pos++;
+	}
+	return pos;
+}
+
+/** write len LEB128 encoded to out: @return bytes written */
+static inline size_t _ws_ctube_delta_put_len(char *out, size_t len)
+{
+	size_t n = 0;
+
+	while (len >= 0x80) {
+		out[n++] = (char)(0x80 | (len & 0x7f));
+		len >>= 7;
+	}
+	out[n++] = (char)len;
+	return n;
+}
+
+/**
+ * encode the part of the delta from prev to cur that covers bytes begin to
+ * size - 1 of the frames. Unless it is the last part, it ends with a run of
+ * no changed bytes if needed, so that the next part can start at size
+ *
+ * @param out receives the part of the delta
+ * @param max bytes available at out
+ * @param prev earlier frame
+ * @param cur current frame
+ * @param begin first byte of the frames covered
+ * @param size one past the last byte of the frames covered
+ * @param last whether size is the end of the frames
+ *
+ * @return bytes written to out, or (size_t)-1 if it needs more than max bytes
+ */
+static size_t ws_ctube_delta_encode_part(char *out, size_t max, const char *prev, const char *cur, size_t begin, size_t size, int last)
+{
+	size_t n = 0;
+	size_t pos = begin;
+	size_t start, end, next;
+
+	for (;;) {
+		start = _ws_ctube_delta_next_diff(prev, cur, pos, size);
+		if (start == size) {
+			break;
+		}
+
+		/* extend the run of changed bytes over short unchanged gaps */
+		end = start;
+		for (;;) {
+			end = _ws_ctube_delta_next_same(prev, cur, end, size);
+			next = _ws_ctube_delta_next_diff(prev, cur, end, size);
+			if (next == size || next - end >= WS_CTUBE_DELTA_MIN_SKIP) {
+				break;
+			}
+			end = next;
+		}
+
+		const size_t len = end - start;
+		if (n + 2 * WS_CTUBE_DELTA_LEN_MAX + len > max) {
+			return (size_t)-1;
+		}
+		n += _ws_ctube_delta_put_len(out + n, start - pos);
+		n += _ws_ctube_delta_put_len(out + n, len);
+
+		char *xor_out = out + n;
+		const char *p = prev + start;
+		const char *c = cur + start;
+		for (size_t i = 0; i < len; i++) {
+			xor_out[i] = p[i] ^ c[i];
+		}
+		n += len;
+		pos = end;
+	}
+
+	if (!last && pos < size) {
+		if (n + 2 * WS_CTUBE_DELTA_LEN_MAX > max) {
+			return (size_t)-1;
+		}
+		n += _ws_ctube_delta_put_len(out + n, size - pos);
+		n += _ws_ctube_delta_put_len(out + n, 0);
+	}
+
+	return n;
+}
+
+/**
+ * encode the delta from prev to cur
+ *
+ * @param out receives the delta
+ * @param max bytes available at out
+ * @param prev earlier frame of size bytes
+ * @param cur current frame of size bytes
+ * @param size bytes of each frame
+ *
+ * @return bytes of delta written to out, or (size_t)-1 if it needs more than
+ * max bytes
+ */
+static inline size_t ws_ctube_delta_encode(char *out, size_t max, const char *prev, const char *cur, size_t size)
+{
+	return ws_ctube_delta_encode_part(out, max, prev, cur, 0, size, 1);
+}
+
+#endif /* WS_CTUBE_DELTA_H */
+
+
+
+
+#ifndef WS_CTUBE_DEFLATE_H
+#define WS_CTUBE_DEFLATE_H
+
+
+/*
+ * define WS_CTUBE_DEFLATE 1 before including ws_ctube.h to offer
+ * permessage-deflate to clients (and link with -lz)
+ */
+#ifndef WS_CTUBE_DEFLATE
+#define WS_CTUBE_DEFLATE 0
+#endif /* WS_CTUBE_DEFLATE */
+
+/** zlib compression level of broadcasts (1 fastest to 9 smallest) */
+#ifndef WS_CTUBE_DEFLATE_LEVEL
+#define WS_CTUBE_DEFLATE_LEVEL 1
+#endif /* WS_CTUBE_DEFLATE_LEVEL */
+
+/** bytes at the end of a compressed message that are not sent */
+#define WS_CTUBE_DEFLATE_TAIL 4
+/** bytes ws_ctube_deflate_part() may need for size bytes that do not compress */
+#define WS_CTUBE_DEFLATE_BOUND(size) ((size) + ((size) >> 8) + 64)
+
+#if WS_CTUBE_DEFLATE
+# include <zlib.h>
+#endif /* WS_CTUBE_DEFLATE */
+
+/**
+ * compress part of a message for permessage-deflate, on its own. The parts
+ * compressed in order and concatenated, without the last
+ * WS_CTUBE_DEFLATE_TAIL bytes (always 0x00 0x00 0xff 0xff), are the message
+ * to send
+ *
+ * @param out receives the compressed part
+ * @param max bytes available at out
+ * @param in part of the message
+ * @param size bytes of the part (less than UINT_MAX)
+ *
+ * @return bytes of compressed part, or (size_t)-1 if it needs more than max
+ * bytes (or deflate is not compiled in)
+ */
+static size_t ws_ctube_deflate_part(char *out, size_t max, const char *in, size_t size)
+{
+#if WS_CTUBE_DEFLATE
+	static const unsigned char tail[WS_CTUBE_DEFLATE_TAIL] = {0x00, 0x00, 0xff, 0xff};
+	z_stream zs;
+	size_t retval = (size_t)-1;
+
+	if (size >= UINT_MAX || max >= UINT_MAX) {
+		return retval;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, WS_CTUBE_DEFLATE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return retval;
+	}
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = (uInt)size;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = (uInt)max;
+
+	/* output left over means the flush did not complete */
+	if (deflate(&zs, Z_SYNC_FLUSH) == Z_OK && zs.avail_in == 0 && zs.avail_out > 0) {
+		const size_t n = max - zs.avail_out;
+		if (n >= WS_CTUBE_DEFLATE_TAIL && memcmp(out + n - WS_CTUBE_DEFLATE_TAIL, tail, WS_CTUBE_DEFLATE_TAIL) == 0) {
+			retval = n;
+		}
+	}
+
+	deflateEnd(&zs);
+	return retval;
+#else /* WS_CTUBE_DEFLATE */
+	(void)out;
+	(void)max;
+	(void)in;
+	(void)size;
+	return (size_t)-1;
+#endif /* WS_CTUBE_DEFLATE */
+}
+
+/**
+ * decompress a message received with permessage-deflate
+ *
+ * @param out receives the message
+ * @param max bytes available at out
+ * @param in compressed message
+ * @param size bytes of compressed message
+ *
+ * @return bytes of message, or (size_t)-1 if it is corrupt or longer than max
+ * bytes (or deflate is not compiled in)
+ */
+static size_t ws_ctube_inflate(char *out, size_t max, const char *in, size_t size)
+{
+#if WS_CTUBE_DEFLATE
+	static const unsigned char tail[WS_CTUBE_DEFLATE_TAIL] = {0x00, 0x00, 0xff, 0xff};
+	z_stream zs;
+	size_t retval = (size_t)-1;
+	int ret;
+
+	if (size >= UINT_MAX || max >= UINT_MAX) {
+		return retval;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		return retval;
+	}
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = (uInt)size;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = (uInt)max;
+
+	/* the message, then the tail the sender stripped */
+	ret = inflate(&zs, Z_SYNC_FLUSH);
+	if ((ret == Z_OK || ret == Z_BUF_ERROR) && zs.avail_in == 0 && zs.avail_out > 0) {
+		zs.next_in = (Bytef *)tail;
+		zs.avail_in = WS_CTUBE_DEFLATE_TAIL;
+		ret = inflate(&zs, Z_SYNC_FLUSH);
+	}
+	if (ret == Z_STREAM_END || (ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0)) {
+		retval = max - zs.avail_out;
+	}
+
+	inflateEnd(&zs);
+	return retval;
+#else /* WS_CTUBE_DEFLATE */
+	(void)out;
+	(void)max;
+	(void)in;
+	(void)size;
+	return (size_t)-1;
+#endif /* WS_CTUBE_DEFLATE */
+}
+
+#endif /* WS_CTUBE_DEFLATE_H */
+
+
+#ifndef WS_CTUBE_CRYPT_H
+#define WS_CTUBE_CRYPT_H
+
+
+void ws_ctube_b64_encode(unsigned char *out, const unsigned char *in, size_t in_bytes);
+void ws_ctube_sha1sum(unsigned char *out, const unsigned char *in, size_t len);
+
+#endif /* WS_CTUBE_CRYPT_H */
+
+
+
+
+#ifndef WS_CTUBE_SOCKET_H
+#define WS_CTUBE_SOCKET_H
+
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * send all characters in buf through a socket
+ *
+ * @param fd file descriptor
+ * @param buf buffer
+ * @param buf_size size of buffer in bytes
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static inline int ws_ctube_socket_send_all(const int fd, const char *buf, ssize_t buf_size)
+{
+	while (buf_size > 0) {
+		ssize_t nsent = send(fd, buf, buf_size, MSG_NOSIGNAL);
+		if (nsent < 1) {
+			return -1;
+		}
+		buf += nsent;
+		buf_size -= nsent;
+	}
+
+	return 0;
+}
+
+/**
+ * receive all characters up to buf_size or when delim is encountered
+ *
+ * @param fd file descriptor
+ * @param buf buffer to read into
+ * @param buf_size size of buffer (including '\0' if delim is not NULL)
+ * @param delim should be a null-terminated string or NULL
+ * if delim is NULL, receive up to buf_size bytes
+ * if delim is not NULL, receive up to buf_size - 1 bytes or until delim is found
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static inline int ws_ctube_socket_recv_all(const int fd, char *const buf, const ssize_t buf_size, const char *delim)
+{
+	char *remain_buf = buf;
+	ssize_t remain_size;
+
+	if (buf_size <= 0) {
+		return 0;
+	}
+
+	if (delim != NULL) {
+		remain_size = buf_size - 1;
+		buf[buf_size - 1] = '\0';
+	} else {
+		remain_size = buf_size;
+	}
+
+	while (remain_size > 0) {
+		ssize_t nrecv = recv(fd, remain_buf, remain_size, MSG_NOSIGNAL);
+		if (nrecv < 1) {
+			return -1;
+		}
+		remain_buf += nrecv;
+		remain_size -= nrecv;
+
+		/* look for delim */
+		if (delim != NULL && remain_size > 0) {
+			*remain_buf = '\0';
+			char *dpos = strstr(buf, delim);
+			if (dpos == NULL) {
+				continue;
+			}
+
+			dpos += strlen(delim);
+			*dpos = '\0';
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static inline int ws_ctube_bind_server(int server_sock, int port)
+{
+	struct sockaddr_in sa;
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	sa.sin_port = htons(port);
+	return bind(server_sock, (struct sockaddr *)&sa, sizeof(sa));
+}
+
+#endif /* WS_CTUBE_SOCKET_H */
+
+
+#ifndef WS_CTUBE_WS_BASE_H
+#define WS_CTUBE_WS_BASE_H
+
+
+#define WS_CTUBE_FRAME_HDR_SIZE 2
+#define WS_CTUBE_MAX_PAYLD_SIZE 125
+
+/* frame opcodes */
+#define WS_CTUBE_OP_CONT 0x0
+#define WS_CTUBE_OP_TEXT 0x1
+#define WS_CTUBE_OP_BINARY 0x2
+#define WS_CTUBE_OP_CLOSE 0x8
+#define WS_CTUBE_OP_PING 0x9
+#define WS_CTUBE_OP_PONG 0xa
+
+/**
+ * make a websocket frame
+ *
+ * @param frame pointer to buffer where frame shall be written; needs to have
+ * size of at least WS_CTUBE_FRAME_HDR_SIZE + WS_CTUBE_MAX_PAYLD_SIZE bytes
+ * @param msg pointer to data
+ * @param msg_size bytes of message
+ * @param first whether this is the first frame in a sequence
+ *
+ * @return number of bytes of msg contained in frame
+ */
+int ws_ctube_ws_mkframe(char *frame, const char *msg, size_t msg_size, int first);
+
+int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size);
+
+/**
+ * send a message in several parts, each part as one or more data frames
+ *
+ * @param conn socket
+ * @param msg pointer to this part of the message (may be empty, e.g. to end it)
+ * @param msg_size bytes of this part
+ * @param first whether this is the first part of the message
+ * @param last whether this is the last part of the message
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int ws_ctube_ws_send_part(int conn, const char *msg, size_t msg_size, int first, int last);
+
+/**
+ * send a message compressed by ws_ctube_deflate_part() to a client that negotiated
+ * permessage-deflate
+ *
+ * @param conn socket
+ * @param msg compressed message
+ * @param msg_size bytes of compressed message
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int ws_ctube_ws_send_deflated(int conn, const char *msg, size_t msg_size);
+
+/**
+ * receive one frame from a client and unmask its payload
+ *
+ * @param conn socket
+ * @param opcode set to the opcode of the frame (WS_CTUBE_OP_*)
+ * @param fin set to whether this is the final frame of its message
+ * @param rsv1 set to whether RSV1 is set (a compressed message if first)
+ * @param msg buffer for the payload
+ * @param msg_size set to bytes of payload
+ * @param max_msg_size bytes available at msg
+ *
+ * @return 0 on success, -1 on error, closed connection, unmasked or RSV2/RSV3
+ * set, or payload larger than max_msg_size
+ */
+int ws_ctube_ws_recv(int conn, int *opcode, int *fin, int *rsv1, char *msg, size_t *msg_size, size_t max_msg_size);
+int ws_ctube_ws_is_ping(const char *msg, int msg_size);
+int ws_ctube_ws_pong(int conn, const char *msg, int msg_size);
+
+/**
+ * complete the server side of the websocket opening handshake
+ *
+ * @param conn socket
+ * @param timeout for receiving the request and sending the response
+ * @param path set to the request path of the GET line (including any query,
+ * truncated to path_size - 1 bytes and null terminated)
+ * @param path_size bytes available at path
+ * @param deflate on entry whether permessage-deflate may be negotiated, set
+ * to whether it was
+ * @param protocols names of the subprotocols the server speaks
+ * @param nprotocol number of protocols
+ * @param protocol set to the index in protocols of the subprotocol chosen
+ * (the first one the client offers), or -1 if none was
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int ws_ctube_ws_handshake(int conn, const struct timeval *timeout, char *path, size_t path_size, int *deflate, const char *const *protocols, int nprotocol, int *protocol);
+
+#endif /* WS_CTUBE_WS_BASE_H */
+
+
+#ifndef WS_CTUBE_STRUCT_H
+#define WS_CTUBE_STRUCT_H
+
+
+/**
+ * max number of unreferenced ws_ctube_data kept around for reuse per size
+ * class (in addition to one per client)
+ */
+#define WS_CTUBE_DATA_POOL_LEN 4
+/** number of buffer size classes in ws_ctube_data_pool */
+#define WS_CTUBE_DATA_POOL_NCLASS 48
+/** smallest buffer size class (2^6 bytes) */
+#define WS_CTUBE_DATA_POOL_MIN_CLASS 6
+
+/** deltas from different earlier broadcasts kept per ws_ctube_data */
+#define WS_CTUBE_DELTA_NCACHE 4
+/** a client in delta mode is sent a keyframe at least every this many frames */
+#define WS_CTUBE_DELTA_KEYFRAME 64
+
+/** conn_slab holds this many conn_structs per allowed client */
+#define WS_CTUBE_CONN_SLAB_FACTOR 2
+
+/** bytes per copy-on-write chunk of live data */
+#define WS_CTUBE_LIVE_CHUNK_SIZE 65536
+
+/**
+ * define as 1 before including ws_ctube.h to count references to the current
+ * broadcast in per-thread shards (see ws_ctube_sharded_ref_count): worth it
+ * with hundreds of clients, at the cost of ~1 KB per pooled ws_ctube_data
+ */
+#ifndef WS_CTUBE_SHARDED_REFC
+#define WS_CTUBE_SHARDED_REFC 0
+#endif /* WS_CTUBE_SHARDED_REFC */
+
+/**
+ * copy-on-write state of data broadcast from live memory: before the producer
+ * modifies a chunk that writers may still be sending, the chunk is copied to
+ * snapshot and writers send the copy instead
+ */
+struct ws_ctube_live {
+	/* only chunks that get copied are backed by physical memory */
+	char *snapshot;
+	size_t snapshot_size;
+
+	size_t nchunk;
+	/* whether each chunk has been copied to snapshot */
+	unsigned char *copied;
+
+	/* copied is allocated from this */
+	const struct ws_ctube_allocator *allocator;
+};
+
+static int ws_ctube_live_init(struct ws_ctube_live *live, size_t data_size, const struct ws_ctube_allocator *allocator)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+
+	live->nchunk = (data_size + WS_CTUBE_LIVE_CHUNK_SIZE - 1) / WS_CTUBE_LIVE_CHUNK_SIZE;
+	live->allocator = allocator;
+	live->copied = (typeof(live->copied))ws_ctube_mem_alloc(allocator, live->nchunk, 1);
+	if (live->copied == NULL) {
+		goto out_nocopied;
+	}
+	memset(live->copied, 0, live->nchunk);
+
+	live->snapshot_size = data_size;
+	live->snapshot = (typeof(live->snapshot))mmap(NULL, data_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (live->snapshot == MAP_FAILED) {
+		goto out_nosnapshot;
+	}
+
+	return 0;
+
+out_nosnapshot:
+	ws_ctube_mem_free(allocator, live->copied, live->nchunk, 1);
+out_nocopied:
+	return -1;
+}
+
+static void ws_ctube_live_destroy(struct ws_ctube_live *live)
+{
+	munmap(live->snapshot, live->snapshot_size);
+	live->snapshot = NULL;
+	live->snapshot_size = 0;
+
+	ws_ctube_mem_free(live->allocator, live->copied, live->nchunk, 1);
+	live->copied = NULL;
+	live->nchunk = 0;
+	live->allocator = NULL;
+}
+
+/**
+ * producer side: copy chunk i of base to snapshot unless already copied
+ *
+ * @return 1 if copied now, 0 otherwise
+ */
+static inline int ws_ctube_live_copy_chunk(struct ws_ctube_live *live, const char *base, size_t i)
+{
+	if (live->copied[i]) {
+		return 0;
+	}
+
+	const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+	size_t len = live->snapshot_size - off;
+	if (len > WS_CTUBE_LIVE_CHUNK_SIZE) {
+		len = WS_CTUBE_LIVE_CHUNK_SIZE;
+	}
+
+	memcpy(live->snapshot + off, base + off, len);
+	__atomic_store_n(&live->copied[i], (unsigned char)1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * writer side: get a consistent copy of chunk i as it was when broadcast
+ *
+ * @param buf scratch space of WS_CTUBE_LIVE_CHUNK_SIZE bytes
+ *
+ * @return pointer to the chunk (either in snapshot or buf)
+ */
+static inline const char *ws_ctube_live_read_chunk(struct ws_ctube_live *live, const char *base, size_t i, char *buf, size_t len)
+{
+	const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+
+	if (__atomic_load_n(&live->copied[i], __ATOMIC_ACQUIRE)) {
+		return live->snapshot + off;
+	}
+
+	/* seqlock-style: if the chunk still isn't copied after reading it, the
+	 * producer cannot have started modifying it */
+	memcpy(buf, base + off, len);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&live->copied[i], __ATOMIC_RELAXED)) {
+		return live->snapshot + off;
+	}
+	return buf;
+}
+
+struct ws_ctube_data_pool;
+
+/** delta to a ws_ctube_data from an earlier broadcast, see delta.h */
+struct ws_ctube_delta {
+	/* id of the earlier broadcast, 0 if the slot is unused */
+	unsigned long base_id;
+	/* (size_t)-1 if the delta would be no smaller than a keyframe */
+	size_t size;
+	/* buffer of capacity bytes (kept when recycled) from mem->payload */
+	char *buf;
+	size_t capacity;
+};
+
+/** a ws_ctube_data in an encoding that is the same for every client */
+struct ws_ctube_encoded {
+	/* 0 if not encoded yet, 1 if buf holds it, -1 if not worth it */
+	int state;
+	size_t size;
+	/* buffer of capacity bytes (kept when recycled) from mem->payload */
+	char *buf;
+	size_t capacity;
+};
+
+/** holds data to be sent/received over the network */
+struct ws_ctube_data {
+	/* read-only while published: read by every writer */
+	void *data;
+	size_t data_size;
+	/** bytes allocated for data (may exceed data_size when recycled) */
+	size_t data_capacity;
+	/* whether data was allocated by ws_ctube_huge_alloc() instead of mem */
+	int huge;
+
+	/* the descriptor and data buffer are allocated from this */
+	const struct ws_ctube_mem *mem;
+
+	/* if not NULL, data is recycled into pool instead of freed */
+	struct ws_ctube_data_pool *pool;
+
+	/* if not NULL, data is owned by the caller and released with
+	 * release_fn(data, release_user) instead of freed */
+	void (*release_fn)(void *data, void *user);
+	void *release_user;
+
+	/* if not NULL, data is live caller memory protected by copy-on-write */
+	struct ws_ctube_live *live;
+
+	/* layout of data if published as a packed grid, else ndim is 0 */
+	struct ws_ctube_grid grid;
+
+	/* deltas to this broadcast, each computed once by the first writer
+	 * that needs it and shared by all writers at the same base_id; under
+	 * mutex */
+	struct ws_ctube_delta delta[WS_CTUBE_DELTA_NCACHE];
+	/* this broadcast in each encoding that does not depend on the client
+	 * (raw and delta slots are unused), each made once by the first
+	 * writer that needs it and shared by all writers; under mutex */
+	struct ws_ctube_encoded encoded[WS_CTUBE_NENCODING];
+
+	pthread_mutex_t mutex;
+	struct ws_ctube_list_node lnode;
+	struct ws_ctube_reclaim_node rnode;
+	/* queued to the recorder (holding a reference) when published */
+	struct ws_ctube_record_node record;
+
+	/* changed by every writer: kept off the line of the fields above */
+#if WS_CTUBE_SHARDED_REFC
+	struct ws_ctube_sharded_ref_count refc;
+#else /* WS_CTUBE_SHARDED_REFC */
+	struct ws_ctube_ref_count refc ws_ctube_cache_aligned;
+#endif /* WS_CTUBE_SHARDED_REFC */
+};
+
+/**
+ * allocate a data buffer of data_size bytes for ws_ctube_data, with huge pages
+ * if try_huge and possible
+ */
+static int _ws_ctube_data_alloc_buf(struct ws_ctube_data *ws_ctube_data, size_t data_size, int try_huge)
+{
+	void *buf = NULL;
+
+	ws_ctube_data->huge = 0;
+	if (try_huge) {
+		buf = ws_ctube_huge_alloc(data_size);
+		ws_ctube_data->huge = buf != NULL;
+	}
+	if (buf == NULL) {
+		buf = ws_ctube_mem_alloc(&ws_ctube_data->mem->payload, data_size, WS_CTUBE_PAYLOAD_ALIGN);
+	}
+
+	ws_ctube_data->data = buf;
+	if (buf == NULL) {
+		ws_ctube_data->data_size = 0;
+		ws_ctube_data->data_capacity = 0;
+		return -1;
+	}
+
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	return 0;
+}
+
+static int ws_ctube_data_init(struct ws_ctube_data *ws_ctube_data, const struct ws_ctube_mem *mem, const void *data, size_t data_size)
+{
+	ws_ctube_data->mem = mem;
+	ws_ctube_data->data = NULL;
+	ws_ctube_data->huge = 0;
+	if (data_size > 0) {
+		if (_ws_ctube_data_alloc_buf(ws_ctube_data, data_size, 0) != 0) {
+			goto out_nodata;
+		}
+
+		if (data != NULL) {
+			memcpy(ws_ctube_data->data, data, data_size);
+		}
+	}
+
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	ws_ctube_data->pool = NULL;
+	ws_ctube_data->release_fn = NULL;
+	ws_ctube_data->release_user = NULL;
+	ws_ctube_data->live = NULL;
+	ws_ctube_data->grid.ndim = 0;
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		ws_ctube_data->delta[i].base_id = 0;
+		ws_ctube_data->delta[i].size = 0;
+		ws_ctube_data->delta[i].buf = NULL;
+		ws_ctube_data->delta[i].capacity = 0;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		ws_ctube_data->encoded[i].state = 0;
+		ws_ctube_data->encoded[i].size = 0;
+		ws_ctube_data->encoded[i].buf = NULL;
+		ws_ctube_data->encoded[i].capacity = 0;
+	}
+
+	pthread_mutex_init(&ws_ctube_data->mutex, NULL);
+	ws_ctube_list_node_init(&ws_ctube_data->lnode);
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_init(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	ws_ctube_ref_count_init(&ws_ctube_data->refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+	return 0;
+
+out_nodata:
+	return -1;
+}
+
+/**
+ * make a bufferless ws_ctube_data reference caller-owned data without copying;
+ * release_fn(data, release_user) is called when it is destroyed or recycled
+ */
+static void ws_ctube_data_set_owned(
+	struct ws_ctube_data *ws_ctube_data,
+	void *data,
+	size_t data_size,
+	void (*release_fn)(void *data, void *user),
+	void *release_user)
+{
+	ws_ctube_data->data = data;
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	ws_ctube_data->release_fn = release_fn;
+	ws_ctube_data->release_user = release_user;
+}
+
+/** make a bufferless ws_ctube_data reference live caller memory with copy-on-write */
+static int ws_ctube_data_set_live(struct ws_ctube_data *ws_ctube_data, void *data, size_t data_size)
+{
+	const struct ws_ctube_allocator *ctrl = &ws_ctube_data->mem->ctrl;
+	struct ws_ctube_live *live = (typeof(live))ws_ctube_mem_alloc(ctrl, sizeof(*live), __alignof__(*live));
+	if (live == NULL) {
+		goto out_noalloc;
+	}
+	if (ws_ctube_live_init(live, data_size, ctrl) != 0) {
+		goto out_nolive;
+	}
+
+	ws_ctube_data->data = data;
+	ws_ctube_data->data_size = data_size;
+	ws_ctube_data->data_capacity = data_size;
+	ws_ctube_data->live = live;
+	return 0;
+
+out_nolive:
+	ws_ctube_mem_free(ctrl, live, sizeof(*live), __alignof__(*live));
+out_noalloc:
+	return -1;
+}
+
+/**
+ * give back caller memory referenced by ws_ctube_data, leaving it bufferless
+ *
+ * @return 1 if ws_ctube_data referenced caller memory, 0 otherwise
+ */
+static int _ws_ctube_data_unborrow(struct ws_ctube_data *ws_ctube_data)
+{
+	if (ws_ctube_data->live != NULL) {
+		/* live memory belongs to the caller */
+		ws_ctube_live_destroy(ws_ctube_data->live);
+		ws_ctube_mem_free(&ws_ctube_data->mem->ctrl, ws_ctube_data->live, sizeof(*ws_ctube_data->live), __alignof__(*ws_ctube_data->live));
+		ws_ctube_data->live = NULL;
+	} else if (ws_ctube_data->release_fn != NULL) {
+		ws_ctube_data->release_fn(ws_ctube_data->data, ws_ctube_data->release_user);
+		ws_ctube_data->release_fn = NULL;
+		ws_ctube_data->release_user = NULL;
+	} else {
+		return 0;
+	}
+
+	ws_ctube_data->data = NULL;
+	ws_ctube_data->data_size = 0;
+	ws_ctube_data->data_capacity = 0;
+	return 1;
+}
+
+/** free the buffer owned by ws_ctube_data */
+static void _ws_ctube_data_free_buf(struct ws_ctube_data *ws_ctube_data)
+{
+	if (ws_ctube_data->huge) {
+		ws_ctube_huge_free(ws_ctube_data->data, ws_ctube_data->data_capacity);
+	} else {
+		ws_ctube_mem_free(&ws_ctube_data->mem->payload, ws_ctube_data->data, ws_ctube_data->data_capacity, WS_CTUBE_PAYLOAD_ALIGN);
+	}
+	ws_ctube_data->data = NULL;
+	ws_ctube_data->huge = 0;
+}
+
+/** bytes of the buffers ws_ctube_data keeps for deltas and encodings */
+static inline size_t ws_ctube_data_encoding_bytes(const struct ws_ctube_data *ws_ctube_data)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		n += ws_ctube_data->delta[i].capacity;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		n += ws_ctube_data->encoded[i].capacity;
+	}
+	return n;
+}
+
+/**
+ * free the buffers ws_ctube_data keeps for deltas and encodings (the caller
+ * accounts for them)
+ */
+static void _ws_ctube_data_free_encodings(struct ws_ctube_data *ws_ctube_data)
+{
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		struct ws_ctube_delta *delta = &ws_ctube_data->delta[i];
+		if (delta->buf != NULL) {
+			ws_ctube_mem_free(&ws_ctube_data->mem->payload, delta->buf, delta->capacity, WS_CTUBE_PAYLOAD_ALIGN);
+		}
+		delta->base_id = 0;
+		delta->buf = NULL;
+		delta->capacity = 0;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		struct ws_ctube_encoded *encoded = &ws_ctube_data->encoded[i];
+		if (encoded->buf != NULL) {
+			ws_ctube_mem_free(&ws_ctube_data->mem->payload, encoded->buf, encoded->capacity, WS_CTUBE_PAYLOAD_ALIGN);
+		}
+		encoded->state = 0;
+		encoded->buf = NULL;
+		encoded->capacity = 0;
+	}
+}
+
+static void ws_ctube_data_destroy(struct ws_ctube_data *ws_ctube_data)
+{
+	if (!_ws_ctube_data_unborrow(ws_ctube_data)) {
+		_ws_ctube_data_free_buf(ws_ctube_data);
+	}
+
+	ws_ctube_data->data_size = 0;
+	ws_ctube_data->data_capacity = 0;
+	ws_ctube_data->pool = NULL;
+
+	_ws_ctube_data_free_encodings(ws_ctube_data);
+
+	pthread_mutex_destroy(&ws_ctube_data->mutex);
+	ws_ctube_list_node_destroy(&ws_ctube_data->lnode);
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_destroy(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	ws_ctube_ref_count_destroy(&ws_ctube_data->refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** ensure ws_ctube_data can hold data_size bytes (contents are not preserved) */
+static int ws_ctube_data_reserve(struct ws_ctube_data *ws_ctube_data, size_t data_size)
+{
+	if (ws_ctube_data->data_capacity < data_size) {
+		_ws_ctube_data_free_buf(ws_ctube_data);
+		return _ws_ctube_data_alloc_buf(ws_ctube_data, data_size, 0);
+	}
+
+	ws_ctube_data->data_size = data_size;
+	return 0;
+}
+
+/** copy data into ws_ctube_data */
+static inline int ws_ctube_data_cp(struct ws_ctube_data *ws_ctube_data, const void *data, size_t data_size)
+{
+	int retval = 0;
+
+	pthread_mutex_lock(&ws_ctube_data->mutex);
+	if (ws_ctube_data_reserve(ws_ctube_data, data_size) != 0) {
+		retval = -1;
+		goto out;
+	}
+
+	memcpy(ws_ctube_data->data, data, data_size);
+
+out:
+	pthread_mutex_unlock(&ws_ctube_data->mutex);
+	return retval;
+}
+
+/**
+ * an encoding of the first size bytes of cur (and prev, for deltas) split into
+ * chunks for a ws_ctube_encoder: each chunk is encoded into its own region of
+ * out, then the outputs are packed together
+ */
+struct _ws_ctube_chunked_job {
+	struct ws_ctube_encode_job job;
+	const char *prev;
+	const char *cur;
+	size_t size;
+	size_t chunk_size;
+	char *out;
+	size_t region_size;
+	/* bytes each chunk wrote to its region, or (size_t)-1 if too many */
+	size_t out_size[WS_CTUBE_ENCODE_MAXCHUNK];
+};
+
+/**
+ * set up cj to encode size bytes, with a region of chunk_size bytes per chunk
+ * (the caller may enlarge region_size before allocating out)
+ */
+static void _ws_ctube_chunked_job_init(struct _ws_ctube_chunked_job *cj, const char *prev, const char *cur, size_t size)
+{
+	cj->prev = prev;
+	cj->cur = cur;
+	cj->size = size;
+	cj->job.nchunk = ws_ctube_encode_nchunk(size, &cj->chunk_size);
+	cj->region_size = cj->chunk_size;
+	cj->out = NULL;
+}
+
+/** first and one past the last byte of chunk of cj */
+static inline void _ws_ctube_chunked_range(const struct _ws_ctube_chunked_job *cj, int chunk, size_t *begin, size_t *end)
+{
+	*begin = (size_t)chunk * cj->chunk_size;
+	*end = chunk == cj->job.nchunk - 1 ? cj->size : *begin + cj->chunk_size;
+}
+
+static void _ws_ctube_delta_chunk(struct ws_ctube_encode_job *job, int chunk)
+{
+	struct _ws_ctube_chunked_job *cj = ws_ctube_container_of(job, typeof(*cj), job);
+	size_t begin, end;
+
+	_ws_ctube_chunked_range(cj, chunk, &begin, &end);
+	cj->out_size[chunk] = ws_ctube_delta_encode_part(cj->out + chunk * cj->region_size, end - begin, cj->prev, cj->cur, begin, end, end == cj->size);
+}
+
+static void _ws_ctube_deflate_chunk(struct ws_ctube_encode_job *job, int chunk)
+{
+	struct _ws_ctube_chunked_job *cj = ws_ctube_container_of(job, typeof(*cj), job);
+	size_t begin, end;
+
+	_ws_ctube_chunked_range(cj, chunk, &begin, &end);
+	cj->out_size[chunk] = ws_ctube_deflate_part(cj->out + chunk * cj->region_size, cj->region_size, cj->cur + begin, end - begin);
+}
+
+/**
+ * pack the outputs of the chunks of cj together at cj->out
+ *
+ * @return their total bytes, or (size_t)-1 if a chunk failed
+ */
+static size_t _ws_ctube_chunked_pack(struct _ws_ctube_chunked_job *cj)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < cj->job.nchunk; i++) {
+		if (cj->out_size[i] == (size_t)-1) {
+			return (size_t)-1;
+		}
+		memmove(cj->out + n, cj->out + i * cj->region_size, cj->out_size[i]);
+		n += cj->out_size[i];
+	}
+	return n;
+}
+
+/** bytes a buffer for chunked output needs */
+static inline size_t _ws_ctube_chunked_capacity(const struct _ws_ctube_chunked_job *cj)
+{
+	return cj->job.nchunk * cj->region_size;
+}
+
+/** bytes of ws_ctube_data buffer owned by ctube (caller memory is not counted) */
+static inline size_t ws_ctube_data_pooled_bytes(const struct ws_ctube_data *ws_ctube_data)
+{
+	if (ws_ctube_data->live != NULL || ws_ctube_data->release_fn != NULL) {
+		return 0;
+	}
+	return ws_ctube_data->data_capacity;
+}
+
+/** allocate an uninitialized ws_ctube_data descriptor from mem */
+static struct ws_ctube_data *ws_ctube_data_alloc(const struct ws_ctube_mem *mem)
+{
+	return (struct ws_ctube_data *)ws_ctube_mem_alloc(&mem->ctrl, sizeof(struct ws_ctube_data), __alignof__(struct ws_ctube_data));
+}
+
+static void ws_ctube_data_free(struct ws_ctube_data *ws_ctube_data)
+{
+	const struct ws_ctube_mem *mem = ws_ctube_data->mem;
+
+	ws_ctube_data_destroy(ws_ctube_data);
+	ws_ctube_mem_free(&mem->ctrl, ws_ctube_data, sizeof(*ws_ctube_data), __alignof__(*ws_ctube_data));
+}
+
+/**
+ * recycles unreferenced ws_ctube_data so that their descriptors and buffers
+ * can be reused without calling the allocator.
+ *
+ * Buffers are kept in power-of-2 size classes: class k holds buffers of
+ * 2^k bytes (class 0 holds bufferless descriptors, e.g. for caller-owned
+ * data). Rounding up mostly costs address space since pages of a buffer that
+ * are never written to are never faulted in.
+ */
+struct ws_ctube_data_pool {
+	/** maximum number of ws_ctube_data kept for reuse per size class */
+	int max_len;
+	/** buffers of at least this many bytes are allocated with huge pages (0: never) */
+	size_t huge_threshold;
+	/** descriptors and buffers are allocated from this */
+	const struct ws_ctube_mem *mem;
+	/** ws_ctube_data that cannot be kept are freed by this */
+	struct ws_ctube_reclaimer *reclaimer;
+
+	/** if nonzero, buffers are only kept for reuse while in_use + cached fit */
+	size_t budget;
+
+	/* buffer accounting (updated atomically by the producer and writers) */
+	/** bytes of buffers taken from the pool and not yet recycled */
+	size_t in_use ws_ctube_cache_aligned;
+	size_t in_use_peak;
+	/** bytes of buffers kept in free_list for reuse */
+	size_t cached;
+
+	/* producers blocked on the budget wait for in_use to drop */
+	int nwaiting;
+	pthread_mutex_t budget_mutex;
+	pthread_cond_t budget_cond;
+
+	struct ws_ctube_list free_list[WS_CTUBE_DATA_POOL_NCLASS] ws_ctube_cache_aligned;
+};
+
+/** size class of buffers able to hold data_size bytes */
+static inline int ws_ctube_data_pool_class(size_t data_size)
+{
+	if (data_size == 0) {
+		return 0;
+	}
+	if (data_size <= ((size_t)1 << WS_CTUBE_DATA_POOL_MIN_CLASS)) {
+		return WS_CTUBE_DATA_POOL_MIN_CLASS;
+	}
+	return 8 * sizeof(unsigned long long) - __builtin_clzll((unsigned long long)data_size - 1);
+}
+
+static inline size_t ws_ctube_data_pool_class_size(int k)
+{
+	return k == 0 ? 0 : (size_t)1 << k;
+}
+
+/** bytes of the buffer that ws_ctube_data_pool_get() uses for data_size bytes */
+static inline size_t ws_ctube_data_pool_capacity(size_t data_size)
+{
+	const int k = ws_ctube_data_pool_class(data_size);
+	return k >= WS_CTUBE_DATA_POOL_NCLASS ? data_size : ws_ctube_data_pool_class_size(k);
+}
+
+static int ws_ctube_data_pool_init(struct ws_ctube_data_pool *pool, const struct ws_ctube_mem *mem, struct ws_ctube_reclaimer *reclaimer, int max_len, size_t huge_threshold, size_t budget)
+{
+	for (int k = 0; k < WS_CTUBE_DATA_POOL_NCLASS; k++) {
+		ws_ctube_list_init(&pool->free_list[k]);
+	}
+	pool->max_len = max_len;
+	/* a custom payload allocator takes precedence over huge pages */
+	pool->huge_threshold = ws_ctube_allocator_is_custom(&mem->payload) ? 0 : huge_threshold;
+	pool->mem = mem;
+	pool->reclaimer = reclaimer;
+
+	pool->in_use = 0;
+	pool->in_use_peak = 0;
+	pool->cached = 0;
+	pool->budget = budget;
+
+	pool->nwaiting = 0;
+	pthread_mutex_init(&pool->budget_mutex, NULL);
+	pthread_cond_init(&pool->budget_cond, NULL);
+	return 0;
+}
+
+static void ws_ctube_data_pool_destroy(struct ws_ctube_data_pool *pool)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+
+	for (int k = 0; k < WS_CTUBE_DATA_POOL_NCLASS; k++) {
+		while ((node = ws_ctube_list_pop_front(&pool->free_list[k])) != NULL) {
+			data = ws_ctube_container_of(node, typeof(*data), lnode);
+			ws_ctube_data_free(data);
+		}
+		ws_ctube_list_destroy(&pool->free_list[k]);
+	}
+	pool->max_len = 0;
+	pool->huge_threshold = 0;
+	pool->mem = NULL;
+	pool->reclaimer = NULL;
+
+	pool->in_use = 0;
+	pool->in_use_peak = 0;
+	pool->cached = 0;
+	pool->budget = 0;
+
+	pool->nwaiting = 0;
+	pthread_mutex_destroy(&pool->budget_mutex);
+	pthread_cond_destroy(&pool->budget_cond);
+}
+
+/** account for capacity bytes of buffer taken from pool */
+static void _ws_ctube_data_pool_take(struct ws_ctube_data_pool *pool, size_t capacity)
+{
+	const size_t in_use = __atomic_add_fetch(&pool->in_use, capacity, __ATOMIC_SEQ_CST);
+	size_t peak = __atomic_load_n(&pool->in_use_peak, __ATOMIC_RELAXED);
+
+	while (in_use > peak && !__atomic_compare_exchange_n(&pool->in_use_peak, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** wake producers waiting for buffers to be given back to pool */
+static void _ws_ctube_data_pool_notify(struct ws_ctube_data_pool *pool)
+{
+	if (__atomic_load_n(&pool->nwaiting, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->budget_mutex);
+		pthread_mutex_unlock(&pool->budget_mutex);
+		pthread_cond_broadcast(&pool->budget_cond);
+	}
+}
+
+/**
+ * account for capacity bytes of buffer about to be taken from pool, but only
+ * if in_use stays within limit. Atomic, so producers racing for the same
+ * headroom cannot all fit in it
+ *
+ * @return 0 if reserved, -1 otherwise
+ */
+static int ws_ctube_data_pool_reserve(struct ws_ctube_data_pool *pool, size_t capacity, size_t limit)
+{
+	size_t in_use = __atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST);
+	size_t peak;
+
+	do {
+		if (capacity > limit || in_use > limit - capacity) {
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&pool->in_use, &in_use, in_use + capacity, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	in_use += capacity;
+	peak = __atomic_load_n(&pool->in_use_peak, __ATOMIC_RELAXED);
+	while (in_use > peak && !__atomic_compare_exchange_n(&pool->in_use_peak, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+/** give back capacity bytes reserved or taken from pool */
+static void ws_ctube_data_pool_unreserve(struct ws_ctube_data_pool *pool, size_t capacity)
+{
+	__atomic_sub_fetch(&pool->in_use, capacity, __ATOMIC_SEQ_CST);
+	if (capacity > 0) {
+		_ws_ctube_data_pool_notify(pool);
+	}
+}
+
+/**
+ * account in the pool of ws_ctube_data for capacity bytes of buffer for its
+ * deltas or encodings. With a budget, they are only given what leaves room for a next
+ * broadcast of the same size: producers waiting on the budget must not be
+ * stuck behind the encodings of the current one, which are given back with it
+ *
+ * @return 0 if accounted for, -1 if they do not fit
+ */
+static int _ws_ctube_data_reserve_encoding(struct ws_ctube_data *ws_ctube_data, size_t capacity)
+{
+	struct ws_ctube_data_pool *pool = ws_ctube_data->pool;
+	const size_t pooled = ws_ctube_data_pooled_bytes(ws_ctube_data);
+
+	if (pool->budget == 0) {
+		_ws_ctube_data_pool_take(pool, capacity);
+		return 0;
+	}
+	if (pooled >= pool->budget) {
+		return -1;
+	}
+	return ws_ctube_data_pool_reserve(pool, capacity, pool->budget - pooled);
+}
+
+/**
+ * make *buf, a buffer of *buf_capacity bytes for an encoding of ws_ctube_data,
+ * hold at least capacity bytes (contents are not preserved), accounted for in
+ * its pool like its data buffer. Under ws_ctube_data->mutex, while holding a
+ * reference
+ *
+ * @return 0 on success, -1 if no memory (within the budget)
+ */
+static int _ws_ctube_data_grow_encoding(struct ws_ctube_data *ws_ctube_data, char **buf, size_t *buf_capacity, size_t capacity)
+{
+	const struct ws_ctube_allocator *payload = &ws_ctube_data->mem->payload;
+
+	if (*buf_capacity >= capacity) {
+		return 0;
+	}
+
+	if (*buf != NULL) {
+		ws_ctube_mem_free(payload, *buf, *buf_capacity, WS_CTUBE_PAYLOAD_ALIGN);
+		ws_ctube_data_pool_unreserve(ws_ctube_data->pool, *buf_capacity);
+		*buf = NULL;
+		*buf_capacity = 0;
+	}
+
+	if (_ws_ctube_data_reserve_encoding(ws_ctube_data, capacity) != 0) {
+		return -1;
+	}
+	*buf = (char *)ws_ctube_mem_alloc(payload, capacity, WS_CTUBE_PAYLOAD_ALIGN);
+	if (*buf == NULL) {
+		ws_ctube_data_pool_unreserve(ws_ctube_data->pool, capacity);
+		return -1;
+	}
+	*buf_capacity = capacity;
+	return 0;
+}
+
+/**
+ * the delta to the first size bytes of ws_ctube_data from base (broadcast
+ * base_id, of at least size bytes), computed by the first caller (in chunks
+ * shared with encoder's workers, if encoder is not NULL) and shared with
+ * later ones. Stays valid while the caller holds its reference.
+ *
+ * @return the delta, or NULL if a keyframe should be sent instead (the delta
+ * would be no smaller, all slots hold deltas from other broadcasts, or no
+ * memory within the budget)
+ */
+static const struct ws_ctube_delta *ws_ctube_data_get_delta(struct ws_ctube_data *ws_ctube_data, const struct ws_ctube_data *base, unsigned long base_id, size_t size, struct ws_ctube_encoder *encoder)
+{
+	struct ws_ctube_delta *delta = NULL;
+	struct ws_ctube_delta *slot;
+	struct _ws_ctube_chunked_job cj;
+
+	pthread_mutex_lock(&ws_ctube_data->mutex);
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		slot = &ws_ctube_data->delta[i];
+		if (slot->base_id == base_id) {
+			delta = slot;
+			goto out;
+		}
+		if (slot->base_id == 0 && delta == NULL) {
+			delta = slot;
+		}
+	}
+	if (delta == NULL) {
+		goto out;
+	}
+
+	_ws_ctube_chunked_job_init(&cj, (const char *)base->data, (const char *)ws_ctube_data->data, size);
+	if (_ws_ctube_data_grow_encoding(ws_ctube_data, &delta->buf, &delta->capacity, _ws_ctube_chunked_capacity(&cj)) != 0) {
+		delta = NULL;
+		goto out;
+	}
+
+	cj.out = delta->buf;
+	ws_ctube_encoder_run(encoder, &cj.job, _ws_ctube_delta_chunk, cj.job.nchunk);
+	delta->base_id = base_id;
+	delta->size = _ws_ctube_chunked_pack(&cj);
+	if (delta->size != (size_t)-1 && delta->size >= size) {
+		/* no smaller than a keyframe */
+		delta->size = (size_t)-1;
+	}
+
+out:
+	pthread_mutex_unlock(&ws_ctube_data->mutex);
+	return delta != NULL && delta->size != (size_t)-1 ? delta : NULL;
+}
+
+/**
+ * the first size bytes of ws_ctube_data in encoding, made by the first caller
+ * (in chunks shared with encoder's workers, if encoder is not NULL) and shared
+ * with later ones. Stays valid while the caller holds its reference.
+ *
+ * For WS_CTUBE_ENCODING_DEFLATE, this is the message to send with
+ * permessage-deflate: the WS_CTUBE_DEFLATE_TAIL bytes it leaves out still
+ * follow it in buf.
+ *
+ * @return the encoded data, or NULL if the data should be sent as is
+ * (encoding does not make it smaller, encoding is made per client, or no
+ * memory within the budget)
+ */
+static const struct ws_ctube_encoded *ws_ctube_data_get_encoded(struct ws_ctube_data *ws_ctube_data, enum ws_ctube_encoding encoding, size_t size, struct ws_ctube_encoder *encoder)
+{
+	struct ws_ctube_encoded *encoded = &ws_ctube_data->encoded[encoding];
+	struct _ws_ctube_chunked_job cj;
+	ws_ctube_encode_fn encode;
+
+	pthread_mutex_lock(&ws_ctube_data->mutex);
+	if (encoded->state != 0) {
+		goto out;
+	}
+
+	encoded->state = -1;
+	if (size == 0) {
+		goto out;
+	}
+
+	_ws_ctube_chunked_job_init(&cj, NULL, (const char *)ws_ctube_data->data, size);
+	switch (encoding) {
+	case WS_CTUBE_ENCODING_DEFLATE:
+		cj.region_size = WS_CTUBE_DEFLATE_BOUND(cj.chunk_size);
+		encode = _ws_ctube_deflate_chunk;
+		break;
+	default:
+		goto out;
+	}
+
+	if (_ws_ctube_data_grow_encoding(ws_ctube_data, &encoded->buf, &encoded->capacity, _ws_ctube_chunked_capacity(&cj)) != 0) {
+		goto out;
+	}
+
+	cj.out = encoded->buf;
+	ws_ctube_encoder_run(encoder, &cj.job, encode, cj.job.nchunk);
+	encoded->size = _ws_ctube_chunked_pack(&cj);
+	if (encoded->size == (size_t)-1) {
+		goto out;
+	}
+
+	if (encoding == WS_CTUBE_ENCODING_DEFLATE) {
+		/* the tail of the last chunk is not sent */
+		encoded->size -= WS_CTUBE_DEFLATE_TAIL;
+	}
+	if (encoded->size < size) {
+		encoded->state = 1;
+	}
+
+out:
+	pthread_mutex_unlock(&ws_ctube_data->mutex);
+	return encoded->state == 1 ? encoded : NULL;
+}
+
+/** allocate a new ws_ctube_data with a buffer of size class k for pool */
+static struct ws_ctube_data *_ws_ctube_data_pool_alloc(struct ws_ctube_data_pool *pool, int k)
+{
+	const size_t size = ws_ctube_data_pool_class_size(k);
+	const int huge = pool->huge_threshold > 0 && size >= pool->huge_threshold;
+
+	struct ws_ctube_data *data = ws_ctube_data_alloc(pool->mem);
+	if (data == NULL) {
+		goto out_noalloc;
+	}
+	if (ws_ctube_data_init(data, pool->mem, NULL, 0) != 0) {
+		goto out_noinit;
+	}
+	if (size > 0 && _ws_ctube_data_alloc_buf(data, size, huge) != 0) {
+		goto out_nobuf;
+	}
+
+	data->pool = pool;
+	return data;
+
+out_nobuf:
+	ws_ctube_data_destroy(data);
+out_noinit:
+	ws_ctube_mem_free(&pool->mem->ctrl, data, sizeof(*data), __alignof__(*data));
+out_noalloc:
+	return NULL;
+}
+
+/**
+ * get an unreferenced ws_ctube_data able to hold data_size bytes from pool,
+ * allocating a new one if none are available. With data_size 0, a bufferless
+ * descriptor is returned.
+ *
+ * @param reserved whether ws_ctube_data_pool_reserve() already accounted for
+ * the ws_ctube_data_pool_capacity(data_size) bytes of buffer (given back if
+ * this fails)
+ *
+ * @return ws_ctube_data with ref count 0 and data_size set or NULL on failure
+ */
+static struct ws_ctube_data *ws_ctube_data_pool_get(struct ws_ctube_data_pool *pool, size_t data_size, int reserved)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+	const int k = ws_ctube_data_pool_class(data_size);
+	size_t encoding_bytes = 0;
+
+	if (ws_ctube_unlikely(k >= WS_CTUBE_DATA_POOL_NCLASS)) {
+		/* too big to pool */
+		data = ws_ctube_data_alloc(pool->mem);
+		if (data == NULL) {
+			goto out_noalloc;
+		}
+		if (ws_ctube_data_init(data, pool->mem, NULL, data_size) != 0) {
+			ws_ctube_mem_free(&pool->mem->ctrl, data, sizeof(*data), __alignof__(*data));
+			goto out_noalloc;
+		}
+		/* accounted for, but freed instead of kept when recycled */
+		data->pool = pool;
+		if (!reserved) {
+			_ws_ctube_data_pool_take(pool, data->data_capacity);
+		}
+		return data;
+	}
+
+	node = ws_ctube_list_pop_front(&pool->free_list[k]);
+	if (node != NULL) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		encoding_bytes = ws_ctube_data_encoding_bytes(data);
+		__atomic_sub_fetch(&pool->cached, data->data_capacity + encoding_bytes, __ATOMIC_SEQ_CST);
+	} else {
+		data = _ws_ctube_data_pool_alloc(pool, k);
+		if (data == NULL) {
+			goto out_noalloc;
+		}
+	}
+
+	if (!reserved) {
+		_ws_ctube_data_pool_take(pool, data->data_capacity);
+	}
+	/* its encoding buffers are in use again if the budget has room */
+	if (encoding_bytes > 0 && _ws_ctube_data_reserve_encoding(data, encoding_bytes) != 0) {
+		_ws_ctube_data_free_encodings(data);
+	}
+	data->data_size = data_size;
+	data->grid.ndim = 0;
+	for (int i = 0; i < WS_CTUBE_DELTA_NCACHE; i++) {
+		data->delta[i].base_id = 0;
+	}
+	for (int i = 0; i < WS_CTUBE_NENCODING; i++) {
+		data->encoded[i].state = 0;
+	}
+	return data;
+
+out_noalloc:
+	if (reserved) {
+		ws_ctube_data_pool_unreserve(pool, ws_ctube_data_pool_capacity(data_size));
+	}
+	return NULL;
+}
+
+/**
+ * allocate and prefault count buffers able to hold data_size bytes so that
+ * the first broadcasts do not pay for allocation and page faults
+ */
+static int ws_ctube_data_pool_prealloc(struct ws_ctube_data_pool *pool, size_t data_size, int count)
+{
+	struct ws_ctube_data *data;
+	const int k = ws_ctube_data_pool_class(data_size);
+
+	if (k >= WS_CTUBE_DATA_POOL_NCLASS) {
+		return -1;
+	}
+
+	for (int i = 0; i < count && pool->free_list[k].len < pool->max_len; i++) {
+		data = _ws_ctube_data_pool_alloc(pool, k);
+		if (data == NULL) {
+			return -1;
+		}
+		memset(data->data, 0, data->data_capacity);
+		__atomic_add_fetch(&pool->cached, data->data_capacity, __ATOMIC_SEQ_CST);
+		ws_ctube_list_push_back(&pool->free_list[k], &data->lnode);
+	}
+	return 0;
+}
+
+/**
+ * keep unborrowed ws_ctube_data in pool for reuse if there is room (within
+ * max_len and the budget)
+ *
+ * @return 1 if kept, 0 otherwise
+ */
+static int _ws_ctube_data_pool_keep(struct ws_ctube_data_pool *pool, struct ws_ctube_data *ws_ctube_data)
+{
+	const int k = ws_ctube_data_pool_class(ws_ctube_data->data_capacity);
+	const size_t capacity = ws_ctube_data->data_capacity + ws_ctube_data_encoding_bytes(ws_ctube_data);
+	struct ws_ctube_list *free_list;
+	int keep;
+
+	if (k >= WS_CTUBE_DATA_POOL_NCLASS) {
+		return 0;
+	}
+
+	free_list = &pool->free_list[k];
+	pthread_mutex_lock(&free_list->mutex);
+	keep = free_list->len < pool->max_len;
+	pthread_mutex_unlock(&free_list->mutex);
+
+	/* do not keep memory that the budget needs for in-flight data */
+	if (keep && pool->budget > 0 && __atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST) + __atomic_load_n(&pool->cached, __ATOMIC_SEQ_CST) > pool->budget) {
+		keep = 0;
+	}
+	if (!keep) {
+		return 0;
+	}
+
+	__atomic_add_fetch(&pool->cached, capacity, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&pool->in_use, capacity, __ATOMIC_SEQ_CST);
+	ws_ctube_list_push_back(free_list, &ws_ctube_data->lnode);
+
+	if (capacity > 0) {
+		_ws_ctube_data_pool_notify(pool);
+	}
+	return 1;
+}
+
+/** runs on the reclaimer thread: give back caller memory, then keep or free */
+static void _ws_ctube_data_reclaim(struct ws_ctube_reclaim_node *node)
+{
+	struct ws_ctube_data *ws_ctube_data = ws_ctube_container_of(node, typeof(*ws_ctube_data), rnode);
+	struct ws_ctube_data_pool *pool = ws_ctube_data->pool;
+
+	if (_ws_ctube_data_unborrow(ws_ctube_data) && _ws_ctube_data_pool_keep(pool, ws_ctube_data)) {
+		return;
+	}
+
+	const size_t capacity = ws_ctube_data->data_capacity + ws_ctube_data_encoding_bytes(ws_ctube_data);
+	ws_ctube_data_free(ws_ctube_data);
+	ws_ctube_data_pool_unreserve(pool, capacity);
+}
+
+/**
+ * release routine for ws_ctube_data: return to its pool if there is room.
+ * Anything expensive (freeing buffers, giving back caller memory) is deferred
+ * to the pool's reclaimer thread, so this is cheap for the releasing thread.
+ */
+static void ws_ctube_data_recycle(struct ws_ctube_data *ws_ctube_data)
+{
+	struct ws_ctube_data_pool *pool = ws_ctube_data->pool;
+
+	if (pool == NULL) {
+		ws_ctube_data_free(ws_ctube_data);
+		return;
+	}
+
+	if (ws_ctube_data->live == NULL && ws_ctube_data->release_fn == NULL && _ws_ctube_data_pool_keep(pool, ws_ctube_data)) {
+		return;
+	}
+
+	ws_ctube_reclaimer_push(pool->reclaimer, &ws_ctube_data->rnode, _ws_ctube_data_reclaim);
+}
+
+/** the caller must already hold a reference (or the lock it is published under) */
+static inline void ws_ctube_data_acquire(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_acquire(ws_ctube_data, refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	ws_ctube_ref_count_acquire(ws_ctube_data, refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** recycles ws_ctube_data when the last reference is released */
+static inline void ws_ctube_data_release(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_release(ws_ctube_data, refc, ws_ctube_data_recycle);
+#else /* WS_CTUBE_SHARDED_REFC */
+	ws_ctube_ref_count_release(ws_ctube_data, refc, ws_ctube_data_recycle);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** number of references: only exact while it is not the current out_data */
+static inline long ws_ctube_data_refs(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	return ws_ctube_sharded_ref_count_load(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	return ws_ctube_ref_count_load(&ws_ctube_data->refc);
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/**
+ * called under out_data_mutex when ws_ctube_data becomes (share) or stops
+ * being (unshare) the current out_data that every writer acquires
+ */
+static inline void ws_ctube_data_share(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_share(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	(void)ws_ctube_data;
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+static inline void ws_ctube_data_unshare(struct ws_ctube_data *ws_ctube_data)
+{
+#if WS_CTUBE_SHARDED_REFC
+	ws_ctube_sharded_ref_count_unshare(&ws_ctube_data->refc);
+#else /* WS_CTUBE_SHARDED_REFC */
+	(void)ws_ctube_data;
+#endif /* WS_CTUBE_SHARDED_REFC */
+}
+
+/** max bytes of a channel name, including the terminating null */
+#define WS_CTUBE_CHANNEL_NAME_LEN 64
+
+/**
+ * a named stream with its own latest-data slot: clients whose request path
+ * is /<name> are sent what is published to it and only wake for it
+ */
+struct ws_ctube_channel {
+	struct ws_ctube *ctube;
+	char name[WS_CTUBE_CHANNEL_NAME_LEN];
+	/* in ctube->channel_list (unused for the default channel) */
+	struct ws_ctube_list_node lnode;
+
+	/* written by the producer on each publish, read by the writers of the
+	 * channel's clients */
+
+	/* current ws_ctube_data representing data to be sent */
+	struct ws_ctube_data *out_data ws_ctube_cache_aligned;
+	/* unique among all channels of the ctube, 0 before the first publish */
+	unsigned long out_data_id;
+	pthread_mutex_t out_data_mutex;
+	pthread_cond_t out_data_cond;
+
+	/* called for each client that connects, see
+	 * ws_ctube_channel_set_snapshot(); snapshot_size is the size of the
+	 * last snapshot, to try first. All three under out_data_mutex */
+	ws_ctube_snapshot_fn snapshot_fn;
+	void *snapshot_user;
+	size_t snapshot_size;
+
+	/* producer only: time of previous broadcast for rate-limiting */
+	struct timespec prev_bcast_time ws_ctube_cache_aligned;
+};
+
+static int ws_ctube_channel_init(struct ws_ctube_channel *channel, struct ws_ctube *ctube, const char *name)
+{
+	if (strlen(name) >= sizeof(channel->name)) {
+		return -1;
+	}
+
+	channel->ctube = ctube;
+	strcpy(channel->name, name);
+	ws_ctube_list_node_init(&channel->lnode);
+
+	channel->out_data = NULL;
+	channel->out_data_id = 0;
+	pthread_mutex_init(&channel->out_data_mutex, NULL);
+	pthread_cond_init(&channel->out_data_cond, NULL);
+
+	channel->snapshot_fn = NULL;
+	channel->snapshot_user = NULL;
+	channel->snapshot_size = 0;
+
+	channel->prev_bcast_time.tv_sec = 0;
+	channel->prev_bcast_time.tv_nsec = 0;
+	return 0;
+}
+
+static void ws_ctube_channel_destroy(struct ws_ctube_channel *channel)
+{
+	if (channel->out_data != NULL) {
+		ws_ctube_data_unshare(channel->out_data);
+		ws_ctube_data_release(channel->out_data);
+		channel->out_data = NULL;
+	}
+	channel->out_data_id = 0;
+	pthread_mutex_destroy(&channel->out_data_mutex);
+	pthread_cond_destroy(&channel->out_data_cond);
+
+	channel->snapshot_fn = NULL;
+	channel->snapshot_user = NULL;
+	channel->snapshot_size = 0;
+
+	channel->ctube = NULL;
+	channel->name[0] = '\0';
+	ws_ctube_list_node_destroy(&channel->lnode);
+}
+
+/**
+ * part of grids that a client wants instead of the whole grid: elements with
+ * lo[i] <= index < hi[i] along each of the first ndim axes (later axes whole),
+ * or no box if ndim is 0, from a downsampled level (level, or the finest
+ * level at which the box has at most fit elements along every axis if fit is
+ * not 0). Box indices are of the full grid
+ */
+struct ws_ctube_roi {
+	int ndim;
+	size_t lo[WS_CTUBE_GRID_MAXDIM];
+	size_t hi[WS_CTUBE_GRID_MAXDIM];
+	int level;
+	size_t fit;
+};
+
+/**
+ * represents a client connection and owns their associated reader/writer
+ * threads; allocated from ctube->conn_slab
+ */
+struct ws_ctube_conn_struct {
+	int fd;
+	struct ws_ctube *ctube;
+
+	/* subscription, chosen from the request path and changed by control
+	 * messages from the client: the writer only waits on channel while
+	 * subscribed (not NULL) and not paused. Changed under sub_mutex,
+	 * bumping sub_gen so that a waiting writer notices */
+	struct ws_ctube_channel *channel;
+	int paused;
+	/* box of grids to send, also under sub_mutex */
+	struct ws_ctube_roi roi;
+	/* what the client is sent, chosen in the handshake */
+	enum ws_ctube_encoding encoding;
+	/* whether permessage-deflate was negotiated in the handshake */
+	int deflate;
+	unsigned long sub_gen;
+	pthread_mutex_t sub_mutex;
+	pthread_cond_t sub_cond;
+
+	/* to prevent double shutdown */
+	int stopping;
+	/* threads are stopped by the reclaimer after the client disconnects */
+	struct ws_ctube_reclaim_node rnode;
+
+	/* writer only: the last frame the client was sent in delta mode (a
+	 * reference, or NULL), its id and frames sent since a keyframe */
+	struct ws_ctube_data *delta_base;
+	unsigned long delta_base_id;
+	int delta_nframe;
+
+	/* snapshot of the channel taken for the client when it connected
+	 * (a reference, or NULL), until the writer sends it first; its own
+	 * id and the out_data_id of the last publish it includes */
+	struct ws_ctube_data *snapshot;
+	unsigned long snapshot_id;
+	unsigned long snapshot_out_data_id;
+
+	/* out_data_id and pooled buffer bytes of the broadcast being sent by
+	 * the writer (0 if idle); read by the producer to find laggards */
+	unsigned long sending_id;
+	size_t sending_bytes;
+	/* set once the connection is dropped to meet the memory budget */
+	int dropped;
+
+	/** reader thread */
+	pthread_t reader_tid;
+	/** writer thread */
+	pthread_t writer_tid;
+
+	struct ws_ctube_ref_count refc;
+};
+
+static int ws_ctube_conn_struct_init(struct ws_ctube_conn_struct *conn, int fd, struct ws_ctube *ctube)
+{
+	conn->fd = fd;
+	conn->ctube = ctube;
+
+	conn->channel = NULL;
+	conn->paused = 0;
+	conn->roi.ndim = 0;
+	conn->roi.level = 0;
+	conn->roi.fit = 0;
+	conn->encoding = WS_CTUBE_ENCODING_RAW;
+	conn->deflate = 0;
+	conn->sub_gen = 0;
+
+	conn->stopping = 0;
+
+	conn->delta_base = NULL;
+	conn->delta_base_id = 0;
+	conn->delta_nframe = 0;
+
+	conn->snapshot = NULL;
+	conn->snapshot_id = 0;
+	conn->snapshot_out_data_id = 0;
+
+	conn->sending_id = 0;
+	conn->sending_bytes = 0;
+	conn->dropped = 0;
+
+	ws_ctube_ref_count_init(&conn->refc);
+	return 0;
+}
+
+static void ws_ctube_conn_struct_destroy(struct ws_ctube_conn_struct *conn)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	close(conn->fd);
+	pthread_setcancelstate(oldstate, &statevar);
+
+	conn->fd = -1;
+	conn->ctube = NULL;
+
+	conn->channel = NULL;
+	conn->paused = 0;
+	conn->roi.ndim = 0;
+	conn->encoding = WS_CTUBE_ENCODING_RAW;
+	conn->deflate = 0;
+	conn->sub_gen = 0;
+
+	conn->stopping = 0;
+
+	ws_ctube_ref_count_destroy(&conn->refc);
+}
+
+/** set up once per conn_slab slot: kept while the slot is reused */
+static void ws_ctube_conn_struct_slot_init(void *obj)
+{
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)obj;
+	pthread_mutex_init(&conn->sub_mutex, NULL);
+	pthread_cond_init(&conn->sub_cond, NULL);
+}
+
+static void ws_ctube_conn_struct_slot_destroy(void *obj)
+{
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)obj;
+	pthread_mutex_destroy(&conn->sub_mutex);
+	pthread_cond_destroy(&conn->sub_cond);
+}
+
+static void ws_ctube_conn_struct_free(struct ws_ctube_conn_struct *conn)
+{
+	ws_ctube_conn_struct_destroy(conn);
+	ws_ctube_slab_free(conn);
+}
+
+/** @return nonzero if conn was already stopping (prevents double stop) */
+static inline int ws_ctube_conn_struct_set_stopping(struct ws_ctube_conn_struct *conn)
+{
+	return __atomic_exchange_n(&conn->stopping, (int)1, __ATOMIC_SEQ_CST);
+}
+
+enum ws_ctube_qaction {
+	WS_CTUBE_CONN_START,
+	WS_CTUBE_CONN_STOP
+};
+
+/**
+ * a work item in FIFO queue: start or stop a connection to client; allocated
+ * from ctube->qentry_slab
+ */
+struct ws_ctube_conn_qentry {
+	struct ws_ctube_conn_struct *conn;
+	enum ws_ctube_qaction act;
+	struct ws_ctube_mpsc_node qnode;
+};
+
+static int ws_ctube_conn_qentry_init(struct ws_ctube_conn_qentry *qentry, struct ws_ctube_conn_struct *conn, enum ws_ctube_qaction act)
+{
+	ws_ctube_ref_count_acquire(conn, refc);
+	qentry->conn = conn;
+	qentry->act = act;
+	qentry->qnode.next = NULL;
+	return 0;
+}
+
+static void ws_ctube_conn_qentry_destroy(struct ws_ctube_conn_qentry *qentry)
+{
+	ws_ctube_ref_count_release(qentry->conn, refc, ws_ctube_conn_struct_free);
+	qentry->conn = NULL;
+	qentry->qnode.next = NULL;
+}
+
+static void ws_ctube_conn_qentry_free(struct ws_ctube_conn_qentry *qentry)
+{
+	ws_ctube_conn_qentry_destroy(qentry);
+	ws_ctube_slab_free(qentry);
+}
+
+/**
+ * connected clients indexed by the slab slot of their conn_struct; only
+ * modified by the connection handler thread, which holds mutex while doing so.
+ * Other threads must hold mutex to read conns.
+ */
+struct ws_ctube_conn_table {
+	struct ws_ctube_conn_struct **conns;
+	int capacity;
+	/** number of connected clients */
+	int len;
+	pthread_mutex_t mutex;
+
+	/* conns is allocated from this */
+	const struct ws_ctube_allocator *allocator;
+};
+
+static int ws_ctube_conn_table_init(struct ws_ctube_conn_table *table, int capacity, const struct ws_ctube_allocator *allocator)
+{
+	table->conns = (typeof(table->conns))ws_ctube_mem_alloc(allocator, capacity * sizeof(*table->conns), __alignof__(*table->conns));
+	if (table->conns == NULL) {
+		return -1;
+	}
+	memset(table->conns, 0, capacity * sizeof(*table->conns));
+	table->capacity = capacity;
+	table->allocator = allocator;
+	table->len = 0;
+	pthread_mutex_init(&table->mutex, NULL);
+	return 0;
+}
+
+static void ws_ctube_conn_table_destroy(struct ws_ctube_conn_table *table)
+{
+	ws_ctube_mem_free(table->allocator, table->conns, table->capacity * sizeof(*table->conns), __alignof__(*table->conns));
+	table->conns = NULL;
+	table->capacity = 0;
+	table->len = 0;
+	table->allocator = NULL;
+	pthread_mutex_destroy(&table->mutex);
+}
+
+static void ws_ctube_conn_table_add(struct ws_ctube_conn_table *table, struct ws_ctube_conn_struct *conn)
+{
+	ws_ctube_ref_count_acquire(conn, refc);
+	pthread_mutex_lock(&table->mutex);
+	table->conns[ws_ctube_slab_slot(conn)] = conn;
+	table->len++;
+	pthread_mutex_unlock(&table->mutex);
+}
+
+/** @return conn if it was in table (its reference must then be released) */
+static struct ws_ctube_conn_struct *ws_ctube_conn_table_remove(struct ws_ctube_conn_table *table, int slot)
+{
+	struct ws_ctube_conn_struct *conn;
+
+	pthread_mutex_lock(&table->mutex);
+	conn = table->conns[slot];
+	if (conn != NULL) {
+		table->conns[slot] = NULL;
+		table->len--;
+	}
+	pthread_mutex_unlock(&table->mutex);
+	return conn;
+}
+
+/** main struct for ws_ctube */
+struct ws_ctube {
+	/* read-mostly: set up by ws_ctube_init() */
+
+	/* allocators from opts: the ctube itself is allocated from mem.ctrl */
+	struct ws_ctube_mem mem;
+
+	int server_sock;
+	int port;
+	int max_nclient;
+
+	/* to have timeout on operations */
+	struct timespec timeout_spec;
+	struct timeval timeout_val;
+
+	/* what to do when a buffer would exceed data_pool.budget */
+	enum ws_ctube_budget_policy budget_policy;
+
+	/* rate-limit broadcasting (per channel) */
+	double max_bcast_fps;
+
+	/* number of encoder workers to start */
+	int encode_threads;
+
+	/* default channel: ws_ctube_broadcast() etc. publish to it and it is
+	 * sent to clients whose request path names no open channel */
+	struct ws_ctube_channel channel;
+	/* channels from ws_ctube_channel_open(), protected by the list mutex */
+	struct ws_ctube_list channel_list;
+	/* source of channel out_data_id */
+	unsigned long out_data_seq;
+
+	/* producer only */
+
+	/* reserved but not yet committed ws_ctube_data */
+	struct ws_ctube_data *reserved_data ws_ctube_cache_aligned;
+	/* ws_ctube_data broadcast from live memory that writers may still be
+	 * sending */
+	struct ws_ctube_list live_list;
+
+	/* recycled ws_ctube_data for ws_ctube_reserve()/ws_ctube_commit():
+	 * taken by the producer and given back by writers (its hot members
+	 * are in their own cache lines) */
+	struct ws_ctube_data_pool data_pool;
+
+	/* broadcasts refused and connections dropped because of the budget */
+	unsigned long nbudget_rejected ws_ctube_cache_aligned;
+	unsigned long nbudget_dropped;
+	/* pooled bytes of every channel's out_data and of reserved_data:
+	 * memory the producers hold on to while waiting for the budget */
+	size_t pinned_bytes;
+	/* records ws_ctube_replay() could not broadcast */
+	unsigned long nreplay_skipped;
+
+	/* the FIFO work queue: connection handler starts/stops client
+	 * connections based on queued actions; pushed to lock-free by the
+	 * server and reader threads, connq_pred is set to wake the handler */
+	struct ws_ctube_mpsc_queue connq;
+	int connq_pred ws_ctube_cache_aligned;
+	pthread_mutex_t connq_mutex;
+	pthread_cond_t connq_cond;
+
+	/* conn_structs and qentries come from fixed-capacity slabs so that
+	 * connection churn does not touch the allocator; allocated by the
+	 * server and reader threads, freed by the handler and reclaimer */
+	struct ws_ctube_slab conn_slab ws_ctube_cache_aligned;
+	struct ws_ctube_slab qentry_slab ws_ctube_cache_aligned;
+	/* connection handler only (and budget drops) */
+	struct ws_ctube_conn_table conn_table ws_ctube_cache_aligned;
+
+	/* frees data and stops disconnected clients off the hot paths */
+	struct ws_ctube_reclaimer reclaimer;
+
+	/* appends every broadcast to the log at record_path, if not NULL */
+	struct ws_ctube_recorder recorder;
+	const char *record_path;
+	size_t record_segment_size;
+	size_t record_backlog;
+
+	/* writes every broadcast to the ring at shm_path, if not NULL */
+	struct ws_ctube_shm shm;
+	const char *shm_path;
+	size_t shm_size;
+
+	/* helps writers encode large broadcasts (deltas, compression) */
+	struct ws_ctube_encoder encoder;
+
+	/* cold */
+
+	/* currently unused (for incoming data) */
+	struct ws_ctube_list in_data_list ws_ctube_cache_aligned;
+	int in_data_pred;
+	pthread_mutex_t in_data_mutex;
+	pthread_cond_t in_data_cond;
+
+	/* allows ws_ctube_open() to know if server successfully started or not */
+	int server_inited;
+	pthread_mutex_t server_init_mutex;
+	pthread_cond_t server_init_cond;
+
+	/** connection handler thread */
+	pthread_t handler_tid;
+	/** server thread */
+	pthread_t server_tid;
+};
+
+static int ws_ctube_init(struct ws_ctube *ctube, const struct ws_ctube_opts *opts)
+{
+	const int max_nclient = opts->max_nclient;
+	const unsigned int timeout_ms = opts->timeout_ms;
+
+	ctube->mem.ctrl = opts->ctrl_alloc;
+	ctube->mem.payload = opts->payload_alloc;
+
+	ctube->server_sock = -1;
+	ctube->port = opts->port;
+	ctube->max_nclient = max_nclient;
+
+	ctube->timeout_spec.tv_sec = timeout_ms / 1000;
+	ctube->timeout_spec.tv_nsec = (timeout_ms % 1000) * 1000000;
+	ctube->timeout_val.tv_sec = timeout_ms / 1000;
+	ctube->timeout_val.tv_usec = (timeout_ms % 1000) * 1000;
+
+	ws_ctube_list_init(&ctube->in_data_list);
+	ctube->in_data_pred = 0;
+	pthread_mutex_init(&ctube->in_data_mutex, NULL);
+	pthread_cond_init(&ctube->in_data_cond, NULL);
+
+	ws_ctube_channel_init(&ctube->channel, ctube, "");
+	ws_ctube_list_init(&ctube->channel_list);
+	ctube->out_data_seq = 0;
+
+	ws_ctube_reclaimer_init(&ctube->reclaimer);
+	ws_ctube_recorder_init(&ctube->recorder);
+	ctube->record_path = opts->record_path;
+	ctube->record_segment_size = opts->record_segment_size;
+	ctube->record_backlog = opts->record_backlog;
+	ws_ctube_shm_init(&ctube->shm);
+	ctube->shm_path = opts->shm_path;
+	ctube->shm_size = opts->shm_size;
+	ws_ctube_data_pool_init(&ctube->data_pool, &ctube->mem, &ctube->reclaimer, max_nclient + WS_CTUBE_DATA_POOL_LEN, opts->hugepage_threshold, opts->mem_budget);
+	ctube->reserved_data = NULL;
+	ws_ctube_list_init(&ctube->live_list);
+
+	ctube->budget_policy = opts->budget_policy;
+	ctube->nbudget_rejected = 0;
+	ctube->nbudget_dropped = 0;
+	ctube->pinned_bytes = 0;
+	ctube->nreplay_skipped = 0;
+
+	ctube->max_bcast_fps = opts->max_broadcast_fps;
+
+	ctube->encode_threads = opts->encode_threads;
+	ws_ctube_encoder_init(&ctube->encoder);
+
+	/* room for connected clients plus as many connecting/disconnecting
+	 * ones; at most one start and one stop qentry per conn_struct */
+	if (ws_ctube_slab_init(&ctube->conn_slab, sizeof(struct ws_ctube_conn_struct), WS_CTUBE_CONN_SLAB_FACTOR * max_nclient, &ctube->mem.ctrl,
+				ws_ctube_conn_struct_slot_init, ws_ctube_conn_struct_slot_destroy) != 0) {
+		goto out_noconnslab;
+	}
+	if (ws_ctube_slab_init(&ctube->qentry_slab, sizeof(struct ws_ctube_conn_qentry), 2 * WS_CTUBE_CONN_SLAB_FACTOR * max_nclient, &ctube->mem.ctrl, NULL, NULL) != 0) {
+		goto out_noqentryslab;
+	}
+	if (ws_ctube_conn_table_init(&ctube->conn_table, WS_CTUBE_CONN_SLAB_FACTOR * max_nclient, &ctube->mem.ctrl) != 0) {
+		goto out_noconntable;
+	}
+
+	ws_ctube_mpsc_queue_init(&ctube->connq);
+	ctube->connq_pred = 0;
+	pthread_mutex_init(&ctube->connq_mutex, NULL);
+	pthread_cond_init(&ctube->connq_cond, NULL);
+
+	ctube->server_inited = 0;
+	pthread_mutex_init(&ctube->server_init_mutex, NULL);
+	pthread_cond_init(&ctube->server_init_cond, NULL);
+
+	/* prefault buffers for the expected broadcast size */
+	if (opts->prealloc_size > 0 && ws_ctube_data_pool_prealloc(&ctube->data_pool, opts->prealloc_size, opts->prealloc_count) != 0) {
+		fprintf(stderr, "ws_ctube_init(): warning: prealloc failed\n");
+		fflush(stderr);
+	}
+
+	return 0;
+
+out_noconntable:
+	ws_ctube_slab_destroy(&ctube->qentry_slab);
+out_noqentryslab:
+	ws_ctube_slab_destroy(&ctube->conn_slab);
+out_noconnslab:
+	ws_ctube_encoder_destroy(&ctube->encoder);
+	ws_ctube_list_destroy(&ctube->live_list);
+	ws_ctube_data_pool_destroy(&ctube->data_pool);
+	ws_ctube_shm_destroy(&ctube->shm);
+	ws_ctube_recorder_destroy(&ctube->recorder);
+	ws_ctube_reclaimer_destroy(&ctube->reclaimer);
+	ws_ctube_list_destroy(&ctube->channel_list);
+	ws_ctube_channel_destroy(&ctube->channel);
+	ws_ctube_list_destroy(&ctube->in_data_list);
+	pthread_mutex_destroy(&ctube->in_data_mutex);
+	pthread_cond_destroy(&ctube->in_data_cond);
+	return -1;
+}
+
+static void _ws_ctube_data_list_clear(struct ws_ctube_list *dlist)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+
+	while ((node = ws_ctube_list_pop_front(dlist)) != NULL) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		ws_ctube_data_free(data);
+	}
+}
+
+static void _ws_ctube_live_list_clear(struct ws_ctube_list *live_list)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+
+	while ((node = ws_ctube_list_pop_front(live_list)) != NULL) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		ws_ctube_data_release(data);
+	}
+}
+
+static void _ws_ctube_channel_list_clear(struct ws_ctube *ctube)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_channel *channel;
+
+	while ((node = ws_ctube_list_pop_front(&ctube->channel_list)) != NULL) {
+		channel = ws_ctube_container_of(node, typeof(*channel), lnode);
+		ws_ctube_channel_destroy(channel);
+		ws_ctube_mem_free(&ctube->mem.ctrl, channel, sizeof(*channel), __alignof__(*channel));
+	}
+}
+
+static void _ws_ctube_connq_clear(struct ws_ctube_mpsc_queue *connq)
+{
+	struct ws_ctube_mpsc_node *node;
+	struct ws_ctube_conn_qentry *qentry;
+
+	while ((node = ws_ctube_mpsc_queue_pop(connq)) != NULL) {
+		qentry = ws_ctube_container_of(node, typeof(*qentry), qnode);
+		ws_ctube_conn_qentry_free(qentry);
+	}
+}
+
+static void ws_ctube_destroy(struct ws_ctube *ctube)
+{
+	ctube->server_sock = -1;
+	ctube->port = -1;
+	ctube->max_nclient = -1;
+
+	ctube->timeout_spec.tv_sec = 0;
+	ctube->timeout_spec.tv_nsec = 0;
+	ctube->timeout_val.tv_sec = 0;
+	ctube->timeout_val.tv_usec = 0;
+
+	_ws_ctube_data_list_clear(&ctube->in_data_list);
+	ws_ctube_list_destroy(&ctube->in_data_list);
+	ctube->in_data_pred = 0;
+	pthread_mutex_destroy(&ctube->in_data_mutex);
+	pthread_cond_destroy(&ctube->in_data_cond);
+
+	/* their out_data go back to the pool */
+	_ws_ctube_channel_list_clear(ctube);
+	ws_ctube_list_destroy(&ctube->channel_list);
+	ws_ctube_channel_destroy(&ctube->channel);
+	ctube->out_data_seq = 0;
+
+	if (ctube->reserved_data != NULL) {
+		ws_ctube_data_recycle(ctube->reserved_data);
+		ctube->reserved_data = NULL;
+	}
+
+	/* live data go back to the pool too, so clear before destroying it */
+	_ws_ctube_live_list_clear(&ctube->live_list);
+	ws_ctube_list_destroy(&ctube->live_list);
+
+	ws_ctube_data_pool_destroy(&ctube->data_pool);
+	/* stopped by now: nothing is queued */
+	ws_ctube_recorder_destroy(&ctube->recorder);
+	ctube->record_path = NULL;
+	ws_ctube_shm_destroy(&ctube->shm);
+	ctube->shm_path = NULL;
+	ws_ctube_reclaimer_destroy(&ctube->reclaimer);
+
+	ctube->max_bcast_fps = 0;
+	ctube->pinned_bytes = 0;
+
+	ctube->encode_threads = 0;
+	ws_ctube_encoder_destroy(&ctube->encoder);
+
+	_ws_ctube_connq_clear(&ctube->connq);
+	ws_ctube_mpsc_queue_destroy(&ctube->connq);
+	ctube->connq_pred = 0;
+	pthread_mutex_destroy(&ctube->connq_mutex);
+	pthread_cond_destroy(&ctube->connq_cond);
+
+	/* all conn_structs and qentries are back in their slabs by now */
+	ws_ctube_conn_table_destroy(&ctube->conn_table);
+	ws_ctube_slab_destroy(&ctube->qentry_slab);
+	ws_ctube_slab_destroy(&ctube->conn_slab);
+
+	ctube->server_inited = 0;
+	pthread_mutex_destroy(&ctube->server_init_mutex);
+	pthread_cond_destroy(&ctube->server_init_cond);
+}
+
+#endif /* WS_CTUBE_STRUCT_H */
+
+
+
+
+
+
+static volatile int ws_ctube_b64_encode_inited = 0;
+static volatile unsigned char ws_ctube_b64_encode_table[64];
+static const uint32_t ws_ctube_b64_mask = 63;
+
+/**
+ * 0-25: A-Z
+ * 26-51: a-z
+ * 52-61: 0-9
+ * 62: +
+ * 63: /
+ */
+static void ws_ctube_init_b64_encode_table()
+{
+	/* prevent double init */
+	if (__atomic_exchange_n(&ws_ctube_b64_encode_inited, (int)1, __ATOMIC_SEQ_CST))
+		return;
+
+	for (int i = 0; i < 26; i++) {
+		ws_ctube_b64_encode_table[i] = 'A' + i;
+		ws_ctube_b64_encode_table[26 + i] = 'a' + i;
+	}
+	for (int i = 0; i < 10; i++) {
+		ws_ctube_b64_encode_table[52 + i] = '0' + i;
+	}
+	ws_ctube_b64_encode_table[62] = '+';
+	ws_ctube_b64_encode_table[63] = '/';
+}
+
+/* 3*8 -> 4*6 base64 encoding */
+static void ws_ctube_b64_encode_triplet(unsigned char *out, unsigned char in0, unsigned char in1, unsigned char in2)
+{
+	uint32_t triplet = ((uint32_t)in0 << 16) + ((uint32_t)in1 << 8) + (uint32_t)in2;
+	for (int i = 0; i < 4; i++) {
+		uint32_t b64_val = (triplet >> (6*(3 - i))) & ws_ctube_b64_mask;
+		out[i] = ws_ctube_b64_encode_table[b64_val];
+	}
+}
+
+/**
+ * gives the base64 encoding of in. out must be large enough to hold output + 1
+ * for null terminator
+ */
+void ws_ctube_b64_encode(unsigned char *out, const unsigned char *in, size_t in_bytes)
+{
+#ifndef __cplusplus
+	_Static_assert(sizeof(uint8_t) == sizeof(unsigned char), "ws_ctube_b64_encode(): unsigned char not 8 bits");
+#endif /* __cplusplus */
+
+	ws_ctube_init_b64_encode_table();
+
+	while (in_bytes >= 3) {
+		ws_ctube_b64_encode_triplet(out, in[0], in[1], in[2]);
+		in_bytes -= 3;
+		in += 3;
+		out += 4;
+	}
+
+	if (in_bytes == 0) {
+		out[0] = '\0';
+	} else if (in_bytes == 1) {
+		ws_ctube_b64_encode_triplet(out, in[0], 0, 0);
+		out[2] = '=';
+		out[3] = '=';
+		out[4] = '\0';
+	} else if (in_bytes == 2) {
+		ws_ctube_b64_encode_triplet(out, in[0], in[1], 0);
+		out[3] = '=';
+		out[4] = '\0';
+	}
+}
+
+static inline uint32_t ws_ctube_left_rotate(uint32_t w, uint32_t amount)
+{
+	return (w << amount) | (w >> (32 - amount));
+}
+
+/** see sha1 standard */
+static inline void ws_ctube_sha1_wordgen(uint32_t *const word)
+{
+	for (int i = 16; i < 80; i++) {
+		word[i] = ws_ctube_left_rotate(word[i-3] ^ word[i-8] ^ word[i-14] ^ word[i-16], 1);
+	}
+}
+
+/** generate words 14,15 from input length (see sha1 standard) */
+static inline void ws_ctube_sha1_total_len_cpy(uint32_t *words, const uint64_t total_bits)
+{
+	const uint64_t mask = 0xFF;
+
+	words[14] = 0;
+	words[15] = 0;
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 4; j++) {
+			uint32_t byte = (total_bits >> 8*(8 - (4*i+j) - 1)) & mask;
+			words[14 + i] |= byte << 8*(4 - j - 1);
+		}
+	}
+}
+
+/** copy byte stream into sha1 32-byte words */
+static inline void ws_ctube_sha1_cp_to_words(uint32_t *const words, const uint8_t *const in, const size_t len, int pad)
+{
+	size_t i, w_ind, byte_ind;
+
+	for (i = 0, w_ind = 0, byte_ind = 0; i < len; i++, w_ind = i / 4, byte_ind = i % 4) {
+		uint32_t tmp = in[i];
+		words[w_ind] |= tmp << 8*(4 - byte_ind - 1);
+	}
+	if (pad) {
+		uint32_t one = 0x80;
+		words[w_ind] |= one << 8*(4 - byte_ind - 1);
+	}
+}
+
+/** genearte all sha1 words (see sha1 standard) */
+static inline void ws_ctube_sha1_mkwords(uint32_t *const words, const uint8_t *const in, const size_t len, const int mode, const uint64_t total_bits)
+{
+	for (int i = 0; i < 16; i++) {
+		words[i] = 0;
+	}
+
+	switch (mode) {
+	case 0:
+		if (len < 56) {
+			ws_ctube_sha1_cp_to_words(words, in, len, 1);
+			ws_ctube_sha1_total_len_cpy(words, total_bits);
+		} else if (len < 64) {
+			ws_ctube_sha1_cp_to_words(words, in, len, 1);
+		} else {
+			ws_ctube_sha1_cp_to_words(words, in, 64, 0);
+		}
+		break;
+
+	case 1:
+		/* needs total_len appended only */
+		ws_ctube_sha1_total_len_cpy(words, total_bits);
+		break;
+	}
+
+	ws_ctube_sha1_wordgen(words);
+}
+
+/**
+ * computes the sha1 hash of in and stores the result in out. out must be able
+ * to hold the 20 byte output of sha1
+ */
+void ws_ctube_sha1sum(unsigned char *out, const unsigned char *in, size_t len_bytes)
+{
+#ifndef __cplusplus
+	_Static_assert(sizeof(uint8_t) == sizeof(unsigned char), "ws_ctube_sha1sum(): unsigned char not 8 bits");
+#endif /* __cplusplus */
+
+	const uint8_t *in_byte = (uint8_t *)in;
+	uint8_t *const out_byte = (uint8_t *)out;
+	const uint64_t total_bits = ((uint64_t)8 * (uint64_t)len_bytes);
+
+	const uint32_t K[4] = {
+		0x5A827999,
+		0x6ED9EBA1,
+		0x8F1BBCDC,
+		0xCA62C1D6
+	};
+
+	uint32_t h[5] = {
+		0x67452301,
+		0xEFCDAB89,
+		0x98BADCFE,
+		0x10325476,
+		0xC3D2E1F0
+	};
+
+	uint32_t words[80];
+	int mode = 0;
+	while(1) {
+		ws_ctube_sha1_mkwords(words, in_byte, len_bytes, mode, total_bits);
+
+		uint32_t A = h[0];
+		uint32_t B = h[1];
+		uint32_t C = h[2];
+		uint32_t D = h[3];
+		uint32_t E = h[4];
+
+		for (int i = 0; i < 20; i++) {
+			uint32_t temp = ws_ctube_left_rotate(A, 5) + ((B & C) | ((~B) & D)) + E + words[i] + K[0];
+			E = D;
+			D = C;
+			C = ws_ctube_left_rotate(B, 30);
+			B = A;
+			A = temp;
+		}
+		for (int i = 20; i < 40; i++) {
+			uint32_t temp = ws_ctube_left_rotate(A, 5) + (B ^ C ^ D) + E + words[i] + K[1];
+			E = D;
+			D = C;
+			C = ws_ctube_left_rotate(B, 30);
+			B = A;
+			A = temp;
+		}
+		for (int i = 40; i < 60; i++) {
+			uint32_t temp = ws_ctube_left_rotate(A, 5) + ((B & C) | (B & D) | (C & D)) + E + words[i] + K[2];
+			E = D;
+			D = C;
+			C = ws_ctube_left_rotate(B, 30);
+			B = A;
+			A = temp;
+		}
+		for (int i = 60; i < 80; i++) {
+			uint32_t temp = ws_ctube_left_rotate(A, 5) + (B ^ C ^ D) + E + words[i] + K[3];
+			E = D;
+			D = C;
+			C = ws_ctube_left_rotate(B, 30);
+			B = A;
+			A = temp;
+		}
+
+		h[0] += A;
+		h[1] += B;
+		h[2] += C;
+		h[3] += D;
+		h[4] += E;
+
+		if (mode != 0) {
+			break;
+		}
+		if (len_bytes < 56) {
+			break;
+		} else if (len_bytes < 64) {
+			mode = 1;
+		} else {
+			len_bytes -= 64;
+			in_byte += 64;
+		}
+	}
+
+	uint32_t mask = 0xFF;
+	for (int i = 0; i < 5; i++) {
+		for (int j = 0; j < 4; j++) {
+			out_byte[4*i + j] = (h[i] >> 8*(4 - j - 1)) & mask;
+		}
+	}
+}
+
+
+
+
+
+
+
+#define WS_DEBUG 0
+#define WS_BUFLEN 4096
+
+static void ws_print_frame(const char *prefix, char *frame, int len)
+{
+	if (!WS_DEBUG) {
+		return;
+	}
+
+	printf("%s\n", prefix);
+	for (int i = 0; i < len; i++) {
+		for (int j = 7; j >= 0; j--) {
+			uint8_t mask = ((uint8_t)1 << j);
+			uint8_t val = ((frame[i] & mask) >> j);
+			printf("%u", val);
+		}
+		printf("|");
+		if (i % 4 == 3) {
+			printf("\n");
+		}
+	}
+	printf("\n\n");
+	fflush(stdout);
+}
+
+/** create data frame according to websocket standard */
+int ws_ctube_ws_mkframe(char *frame, const char *msg, size_t msg_size, int first)
+{
+	int payld_size;
+
+	first = !!first;
+	if (msg_size > WS_CTUBE_MAX_PAYLD_SIZE) {
+		frame[0] = 2*first;
+		payld_size = WS_CTUBE_MAX_PAYLD_SIZE;
+	} else {
+		frame[0] = 0b10000000 + 2*first;
+		payld_size = msg_size;
+	}
+
+	frame[1] = payld_size;
+	memcpy(&frame[WS_CTUBE_FRAME_HDR_SIZE], msg, payld_size);
+
+	return payld_size;
+}
+
+/** send part of a message in data frames, RSV1 set on the first if rsv1 */
+static int ws_send_frames(int conn, const char *msg, size_t msg_size, int first, int last, int rsv1)
+{
+	int payld_size;
+	char frame[WS_BUFLEN];
+
+	/* an empty part is sent as an empty frame so that it can end a message */
+	do {
+		payld_size = ws_ctube_ws_mkframe(frame, msg, msg_size, first);
+		if (!last) {
+			/* more parts follow: never set FIN */
+			frame[0] &= 0b01111111;
+		}
+		if (first && rsv1) {
+			frame[0] |= 0b01000000;
+		}
+		const int frame_len = payld_size + WS_CTUBE_FRAME_HDR_SIZE;
+		ws_print_frame("ws_ctube_ws_send_part()", frame, frame_len);
+		if (ws_ctube_socket_send_all(conn, frame, frame_len) != 0) {
+			return -1;
+		}
+		first = 0;
+		msg += payld_size;
+		msg_size -= payld_size;
+	} while (msg_size > 0);
+
+	return 0;
+}
+
+/** send part of a message in data frames according to websocket standard */
+int ws_ctube_ws_send_part(int conn, const char *msg, size_t msg_size, int first, int last)
+{
+	return ws_send_frames(conn, msg, msg_size, first, last, 0);
+}
+
+/** send a message compressed by ws_ctube_deflate_part() (RSV1 set) */
+int ws_ctube_ws_send_deflated(int conn, const char *msg, size_t msg_size)
+{
+	return ws_send_frames(conn, msg, msg_size, 1, 1, 1);
+}
+
+/** send data in data frames according to websocket standard */
+int ws_ctube_ws_send(int conn, const char *msg, size_t msg_size)
+{
+	return ws_ctube_ws_send_part(conn, msg, msg_size, 1, 1);
+}
+
+/** receive frame according to websocket standard */
+int ws_ctube_ws_recv(int conn, int *opcode, int *fin, int *rsv1, char *msg, size_t *msg_size, size_t max_msg_size)
+{
+	unsigned char hdr[8];
+	unsigned char mask[4];
+	uint64_t payld_size;
+
+	if (ws_ctube_socket_recv_all(conn, (char *)hdr, 2, NULL) != 0) {
+		return -1;
+	}
+	ws_print_frame("ws_ctube_ws_recv()", (char *)hdr, 2);
+
+	*fin = hdr[0] >> 7;
+	*rsv1 = (hdr[0] >> 6) & 1;
+	*opcode = hdr[0] & 0x0f;
+
+	/* only permessage-deflate (RSV1) can be negotiated and clients must mask */
+	if ((hdr[0] & 0x30) != 0 || (hdr[1] & 0x80) == 0) {
+		return -1;
+	}
+
+	payld_size = hdr[1] & 0x7f;
+	if (payld_size == 126) {
+		if (ws_ctube_socket_recv_all(conn, (char *)hdr, 2, NULL) != 0) {
+			return -1;
+		}
+		payld_size = ((uint64_t)hdr[0] << 8) | hdr[1];
+	} else if (payld_size == 127) {
+		if (ws_ctube_socket_recv_all(conn, (char *)hdr, 8, NULL) != 0) {
+			return -1;
+		}
+		payld_size = 0;
+		for (int i = 0; i < 8; i++) {
+			payld_size = (payld_size << 8) | hdr[i];
+		}
+	}
+	if (payld_size > max_msg_size) {
+		return -1;
+	}
+
+	if (ws_ctube_socket_recv_all(conn, (char *)mask, 4, NULL) != 0) {
+		return -1;
+	}
+	if (ws_ctube_socket_recv_all(conn, msg, payld_size, NULL) != 0) {
+		return -1;
+	}
+	for (uint64_t i = 0; i < payld_size; i++) {
+		msg[i] ^= mask[i % 4];
+	}
+
+	*msg_size = payld_size;
+	return 0;
+}
+
+int ws_ctube_ws_is_ping(const char *msg, int msg_size)
+{
+	/* TODO */
+	(void)msg;
+	(void)msg_size;
+	return 0;
+}
+
+int ws_ctube_ws_pong(int conn, const char *msg, int msg_size)
+{
+	/* TODO */
+	(void)conn;
+	(void)msg;
+	(void)msg_size;
+	return 0;
+}
+
+/** copy the request path from the GET line of handshake */
+static int ws_request_path(const char *rbuf, char *path, size_t path_size)
+{
+	const char *begin, *end;
+	size_t len;
+
+	if (strncmp(rbuf, "GET ", strlen("GET ")) != 0) {
+		return -1;
+	}
+
+	begin = rbuf + strlen("GET ");
+	end = strpbrk(begin, " \r");
+	if (end == NULL) {
+		return -1;
+	}
+
+	len = end - begin;
+	if (len > path_size - 1) {
+		len = path_size - 1;
+	}
+	memcpy(path, begin, len);
+	path[len] = '\0';
+
+	if (WS_DEBUG) {
+		printf("path\n%s\n", path);
+	}
+	return 0;
+}
+
+/** extract the client key from handshake */
+static char *ws_client_key(char *rbuf)
+{
+	char *client_key, *client_key_end;
+
+	client_key = strstr(rbuf, "Sec-WebSocket-Key: ");
+	if (client_key == NULL) {
+		return NULL;
+	}
+
+	client_key += strlen("Sec-WebSocket-Key: ");
+	client_key_end = strstr(client_key, "\r");
+	if (client_key_end == NULL) {
+		return NULL;
+	}
+
+	*client_key_end = '\0';
+	if (WS_DEBUG) {
+		printf("wskey\n%s\n", client_key);
+	}
+	return client_key;
+}
+
+/** skip spaces around str, which is modified */
+static char *ws_trim(char *str)
+{
+	char *end;
+
+	while (*str == ' ' || *str == '\t') {
+		str++;
+	}
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+	*end = '\0';
+	return str;
+}
+
+/**
+ * whether the client offers permessage-deflate with parameters we can accept:
+ * every message is compressed on its own, with zlib's full window
+ */
+static int ws_deflate_offered(const char *rbuf)
+{
+	const char *ext, *ext_end;
+	char value[WS_BUFLEN];
+	char *offer, *param, *offer_save, *param_save;
+	size_t len;
+	int ok;
+
+	ext = strstr(rbuf, "Sec-WebSocket-Extensions: ");
+	if (ext == NULL) {
+		return 0;
+	}
+	ext += strlen("Sec-WebSocket-Extensions: ");
+	ext_end = strstr(ext, "\r");
+	if (ext_end == NULL) {
+		return 0;
+	}
+
+	len = ext_end - ext;
+	if (len > sizeof(value) - 1) {
+		len = sizeof(value) - 1;
+	}
+	memcpy(value, ext, len);
+	value[len] = '\0';
+
+	/* offers are separated by ',' and their parameters by ';' */
+	for (offer = strtok_r(value, ",", &offer_save); offer != NULL; offer = strtok_r(NULL, ",", &offer_save)) {
+		param = strtok_r(offer, ";", &param_save);
+		if (param == NULL || strcmp(ws_trim(param), "permessage-deflate") != 0) {
+			continue;
+		}
+
+		ok = 1;
+		while ((param = strtok_r(NULL, ";", &param_save)) != NULL) {
+			param = ws_trim(param);
+			if (strncmp(param, "server_max_window_bits=", strlen("server_max_window_bits=")) == 0) {
+				param += strlen("server_max_window_bits=");
+				param += param[0] == '"';
+				ok = ok && atoi(param) == 15;
+			} else if (strcmp(param, "server_no_context_takeover") != 0
+				   && strcmp(param, "client_no_context_takeover") != 0
+				   && strncmp(param, "client_max_window_bits", strlen("client_max_window_bits")) != 0) {
+				ok = 0;
+			}
+		}
+		if (ok) {
+			if (WS_DEBUG) {
+				printf("permessage-deflate\n");
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * the first subprotocol the client offers that is one of protocols
+ *
+ * @return its index in protocols, or -1 if there is none
+ */
+static int ws_protocol_offered(const char *rbuf, const char *const *protocols, int nprotocol)
+{
+	const char *hdr, *hdr_end;
+	char value[WS_BUFLEN];
+	char *offer, *offer_save;
+	size_t len;
+
+	hdr = strstr(rbuf, "Sec-WebSocket-Protocol: ");
+	if (hdr == NULL) {
+		return -1;
+	}
+	hdr += strlen("Sec-WebSocket-Protocol: ");
+	hdr_end = strstr(hdr, "\r");
+	if (hdr_end == NULL) {
+		return -1;
+	}
+
+	len = hdr_end - hdr;
+	if (len > sizeof(value) - 1) {
+		len = sizeof(value) - 1;
+	}
+	memcpy(value, hdr, len);
+	value[len] = '\0';
+
+	/* in the client's order of preference */
+	for (offer = strtok_r(value, ",", &offer_save); offer != NULL; offer = strtok_r(NULL, ",", &offer_save)) {
+		offer = ws_trim(offer);
+		for (int i = 0; i < nprotocol; i++) {
+			if (strcmp(offer, protocols[i]) == 0) {
+				if (WS_DEBUG) {
+					printf("protocol\n%s\n", offer);
+				}
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+/** compute server response key per websocket standard */
+static int ws_server_response_key(char *server_key, const char *client_key)
+{
+	size_t sha1_hash_len = 20;
+	char magic_client_key[WS_BUFLEN];
+	char client_sha1[WS_BUFLEN];
+
+	if (snprintf(magic_client_key, WS_BUFLEN, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", client_key) >= WS_BUFLEN) {
+		return -1;
+	}
+
+	ws_ctube_sha1sum((unsigned char *)client_sha1, (unsigned char *)magic_client_key, strlen(magic_client_key));
+	ws_ctube_b64_encode((unsigned char *)server_key, (unsigned char *)client_sha1, sha1_hash_len);
+
+	return 0;
+}
+
+int ws_ctube_ws_handshake(int conn, const struct timeval *timeout, char *path, size_t path_size, int *deflate, const char *const *protocols, int nprotocol, int *protocol)
+{
+	char rbuf[WS_BUFLEN];
+	char *client_key;
+	char server_key[WS_BUFLEN];
+	char protocol_response[WS_BUFLEN];
+	char response[3*WS_BUFLEN];
+
+	const char *const response_fmt = "HTTP/1.1 101 Switching Protocols\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Accept: %s\r\n"
+				"%s%s\r\n";
+	/* clients must not keep context between messages either, so that
+	 * each control message can be decompressed on its own */
+	const char *const deflate_response = "Sec-WebSocket-Extensions: permessage-deflate; "
+				"server_no_context_takeover; client_no_context_takeover\r\n";
+
+	/* receive with timeout, but reset to old timeout afterwards */
+	struct timeval old_timeout;
+	socklen_t timeval_size = sizeof(old_timeout);
+	if (getsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &old_timeout, &timeval_size) < 0) {
+		goto err;
+	}
+	if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, timeout, sizeof(*timeout)) < 0) {
+		goto err;
+	}
+	if (ws_ctube_socket_recv_all(conn, rbuf, WS_BUFLEN, "\r\n\r\n") != 0) {
+		goto err;
+	}
+	if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &old_timeout, sizeof(old_timeout)) < 0) {
+		goto err;
+	}
+
+	/* ensure null termination of received data */
+	rbuf[WS_BUFLEN - 1] = '\0';
+
+	if (WS_DEBUG) {
+		printf("get\n%s\n", rbuf);
+	}
+
+	if (ws_request_path(rbuf, path, path_size) != 0) {
+		goto err;
+	}
+
+	/* before ws_client_key() cuts rbuf short */
+	*deflate = *deflate && ws_deflate_offered(rbuf);
+	*protocol = ws_protocol_offered(rbuf, protocols, nprotocol);
+
+	client_key = ws_client_key(rbuf);
+	if (client_key == NULL) {
+		goto err;
+	}
+	if (ws_server_response_key(server_key, client_key) != 0) {
+		goto err;
+	}
+
+	protocol_response[0] = '\0';
+	if (*protocol >= 0) {
+		snprintf(protocol_response, sizeof(protocol_response), "Sec-WebSocket-Protocol: %s\r\n", protocols[*protocol]);
+	}
+
+	snprintf(response, sizeof(response)/sizeof(response[0]), response_fmt, server_key, *deflate ? deflate_response : "", protocol_response);
+	if (WS_DEBUG) {
+		printf("server response\n%s\n", response);
+	}
+
+	/* send with timeout, but reset to old timeout afterwards */
+	if (getsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &old_timeout, &timeval_size) < 0) {
+		goto err;
+	}
+	if (setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, timeout, sizeof(*timeout)) < 0) {
+		goto err;
+	}
+	if (ws_ctube_socket_send_all(conn, response, strlen(response)) != 0) {
+		goto err;
+	}
+	if (setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &old_timeout, sizeof(old_timeout)) < 0) {
+		goto err;
+	}
+
+	return 0;
+
+err:
+	if (WS_DEBUG) {
+		perror("ws_ctube_ws_handshake()");
+	}
+	return -1;
+}
+
+
+
+
+
+
+
+#define WS_CTUBE_DEBUG 0
+#define WS_CTUBE_BUFLEN 4096
+/* longer request paths are truncated (and name no channel) */
+#define WS_CTUBE_PATH_LEN 256
+/* ms the budget DROP policy waits for dropped clients to give memory back */
+#define WS_CTUBE_BUDGET_DROP_WAIT_MS 20
+/* times ws_ctube_replay() tries to publish a record, 1 ms apart */
+#define WS_CTUBE_REPLAY_RETRY 100
+
+typedef void (*cleanup_func)(void *);
+
+static void _ws_ctube_cleanup_unlock_mutex(void *mutex)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+/** push a work item (start/stop connection) onto the FIFO connq */
+static int ws_ctube_connq_push(struct ws_ctube *ctube, struct ws_ctube_conn_struct *conn, enum ws_ctube_qaction act)
+{
+	int retval = 0;
+	struct ws_ctube_conn_qentry *qentry = (typeof(qentry))ws_ctube_slab_alloc(&ctube->qentry_slab);
+
+	if (qentry == NULL) {
+		retval = -1;
+		goto out_noalloc;
+	}
+	pthread_cleanup_push(ws_ctube_slab_free, qentry);
+
+	if (ws_ctube_conn_qentry_init(qentry, conn, act) != 0) {
+		retval = -1;
+		goto out_noinit;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_conn_qentry_destroy, qentry);
+
+	ws_ctube_mpsc_queue_push(&ctube->connq, &qentry->qnode);
+
+	/* wake handler unless a wakeup is already pending */
+	if (!__atomic_exchange_n(&ctube->connq_pred, (int)1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ctube->connq_mutex);
+		pthread_mutex_unlock(&ctube->connq_mutex);
+		pthread_cond_signal(&ctube->connq_cond);
+	}
+
+	pthread_cleanup_pop(retval); /* conn_qentry_destory */
+out_noinit:
+	pthread_cleanup_pop(retval); /* ws_ctube_slab_free */
+out_noalloc:
+	return retval;
+}
+
+/**
+ * the open channel named by exactly the first len bytes of name (which need
+ * not be null terminated) or NULL; channel_list.mutex must be held
+ */
+static struct ws_ctube_channel *_ws_ctube_channel_find_locked(struct ws_ctube *ctube, const char *name, size_t len)
+{
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_channel *channel;
+
+	ws_ctube_list_for_each(&ctube->channel_list, node) {
+		channel = ws_ctube_container_of(node, typeof(*channel), lnode);
+		if (strlen(channel->name) == len && memcmp(channel->name, name, len) == 0) {
+			return channel;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * the channel named by a request path ("/<name>", optionally followed by a
+ * query), or the default channel if no such channel is open
+ */
+static struct ws_ctube_channel *_ws_ctube_channel_find(struct ws_ctube *ctube, const char *path)
+{
+	struct ws_ctube_channel *channel;
+	size_t len;
+
+	if (path[0] == '/') {
+		path++;
+	}
+	len = strcspn(path, "?#");
+	if (len == 0 || len >= WS_CTUBE_CHANNEL_NAME_LEN) {
+		return &ctube->channel;
+	}
+
+	pthread_mutex_lock(&ctube->channel_list.mutex);
+	channel = _ws_ctube_channel_find_locked(ctube, path, len);
+	pthread_mutex_unlock(&ctube->channel_list.mutex);
+
+	return channel != NULL ? channel : &ctube->channel;
+}
+
+/**
+ * find the parameter called name in the query of a request path
+ *
+ * @param value_len set to the bytes of its value (0 if it has none)
+ *
+ * @return its value (not null terminated), or NULL if there is no such
+ * parameter
+ */
+static const char *_ws_ctube_path_param(const char *path, const char *name, size_t *value_len)
+{
+	const size_t name_len = strlen(name);
+	const char *param = strchr(path, '?');
+	size_t len;
+
+	while (param != NULL) {
+		param++;
+		len = strcspn(param, "&=#");
+		if (len == name_len && strncmp(param, name, len) == 0) {
+			param += len;
+			param += *param == '=';
+			*value_len = strcspn(param, "&#");
+			return param;
+		}
+		param = strchr(param, '&');
+	}
+	return NULL;
+}
+
+/**
+ * the encoding a client asked for: its subprotocol (protocol, an encoding or
+ * -1 if none was negotiated), else "?encoding=<name>" in its request path,
+ * else delta if just "?delta" is there. Unknown names get raw
+ */
+static enum ws_ctube_encoding _ws_ctube_conn_encoding(const char *path, int protocol)
+{
+	const char *name;
+	size_t len;
+	int encoding;
+
+	if (protocol >= 0) {
+		return (enum ws_ctube_encoding)protocol;
+	}
+
+	name = _ws_ctube_path_param(path, "encoding", &len);
+	if (name != NULL) {
+		encoding = ws_ctube_encoding_find(name, len);
+		return encoding >= 0 ? (enum ws_ctube_encoding)encoding : WS_CTUBE_ENCODING_RAW;
+	}
+	if (_ws_ctube_path_param(path, "delta", &len) != NULL) {
+		return WS_CTUBE_ENCODING_DELTA;
+	}
+	return WS_CTUBE_ENCODING_RAW;
+}
+
+/**
+ * wake the writer of conn after its sub_gen was bumped, wherever it waits: on
+ * conn itself or for the next broadcast of channel (if not NULL)
+ */
+static void _ws_ctube_conn_wake_writer(struct ws_ctube_conn_struct *conn, struct ws_ctube_channel *channel)
+{
+	pthread_cond_signal(&conn->sub_cond);
+
+	if (channel != NULL) {
+		pthread_mutex_lock(&channel->out_data_mutex);
+		pthread_mutex_unlock(&channel->out_data_mutex);
+		pthread_cond_broadcast(&channel->out_data_cond);
+	}
+}
+
+/** change what conn is sent: channel (NULL to unsubscribe) and whether it is paused */
+static void _ws_ctube_conn_subscribe(struct ws_ctube_conn_struct *conn, struct ws_ctube_channel *channel, int paused)
+{
+	struct ws_ctube_channel *old;
+
+	pthread_mutex_lock(&conn->sub_mutex);
+	old = conn->channel;
+	__atomic_store_n(&conn->channel, channel, __ATOMIC_RELEASE);
+	conn->paused = paused;
+	__atomic_add_fetch(&conn->sub_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&conn->sub_mutex);
+
+	_ws_ctube_conn_wake_writer(conn, old);
+}
+
+/** what part of grids conn is sent */
+static void _ws_ctube_conn_get_roi(struct ws_ctube_conn_struct *conn, struct ws_ctube_roi *roi)
+{
+	pthread_mutex_lock(&conn->sub_mutex);
+	*roi = conn->roi;
+	pthread_mutex_unlock(&conn->sub_mutex);
+}
+
+/** change what part of grids conn is sent; it is sent the latest data again */
+static void _ws_ctube_conn_set_roi(struct ws_ctube_conn_struct *conn, const struct ws_ctube_roi *roi)
+{
+	struct ws_ctube_channel *channel;
+
+	pthread_mutex_lock(&conn->sub_mutex);
+	channel = conn->channel;
+	conn->roi = *roi;
+	__atomic_add_fetch(&conn->sub_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&conn->sub_mutex);
+
+	_ws_ctube_conn_wake_writer(conn, channel);
+}
+
+/**
+ * parse up to max decimal numbers separated by spaces
+ *
+ * @return how many numbers, or -1 if malformed
+ */
+static int _ws_ctube_parse_sizes(size_t *val, int max, const char *msg, size_t len)
+{
+	int n = 0;
+
+	for (;;) {
+		while (len > 0 && msg[0] == ' ') {
+			msg++;
+			len--;
+		}
+		if (len == 0) {
+			break;
+		}
+		if (n == max || msg[0] < '0' || msg[0] > '9') {
+			return -1;
+		}
+
+		val[n] = 0;
+		for (; len > 0 && msg[0] >= '0' && msg[0] <= '9'; msg++, len--) {
+			if (val[n] > ((size_t)-1 - 9) / 10) {
+				return -1;
+			}
+			val[n] = 10 * val[n] + (size_t)(msg[0] - '0');
+		}
+		if (len > 0 && msg[0] != ' ') {
+			return -1;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/** whether the len bytes of msg are keyword, or keyword then a space and more */
+static inline int _ws_ctube_control_is(const char *msg, size_t len, const char *keyword)
+{
+	const size_t n = strlen(keyword);
+
+	return len >= n && memcmp(msg, keyword, n) == 0 && (len == n || msg[n] == ' ');
+}
+
+/**
+ * apply a control message from a client: "subscribe <name>" (no name for
+ * the default channel; unknown names are ignored), "unsubscribe", "pause",
+ * "resume", or for grids "roi <lo0> <hi0> ..." (no numbers for whole
+ * grids), "lod <level>" or "fit <elements>" (0 to stop fitting)
+ */
+static void _ws_ctube_conn_control(struct ws_ctube_conn_struct *conn, const char *msg, size_t len)
+{
+	struct ws_ctube *ctube = conn->ctube;
+	struct ws_ctube_channel *channel;
+	struct ws_ctube_roi roi;
+	size_t val[2 * WS_CTUBE_GRID_MAXDIM];
+	int n;
+
+	/* ignore trailing whitespace, e.g. a newline */
+	while (len > 0 && (msg[len - 1] == ' ' || msg[len - 1] == '\n' || msg[len - 1] == '\r')) {
+		len--;
+	}
+
+	if (len == strlen("pause") && memcmp(msg, "pause", len) == 0) {
+		pthread_mutex_lock(&conn->sub_mutex);
+		channel = conn->channel;
+		pthread_mutex_unlock(&conn->sub_mutex);
+		_ws_ctube_conn_subscribe(conn, channel, 1);
+
+	} else if (len == strlen("resume") && memcmp(msg, "resume", len) == 0) {
+		pthread_mutex_lock(&conn->sub_mutex);
+		channel = conn->channel;
+		pthread_mutex_unlock(&conn->sub_mutex);
+		_ws_ctube_conn_subscribe(conn, channel, 0);
+
+	} else if (len == strlen("unsubscribe") && memcmp(msg, "unsubscribe", len) == 0) {
+		_ws_ctube_conn_subscribe(conn, NULL, 0);
+
+	} else if (_ws_ctube_control_is(msg, len, "subscribe")) {
+		msg += strlen("subscribe");
+		len -= strlen("subscribe");
+		while (len > 0 && msg[0] == ' ') {
+			msg++;
+			len--;
+		}
+		if (len > 0 && msg[0] == '/') {
+			msg++;
+			len--;
+		}
+
+		if (len == 0) {
+			channel = &ctube->channel;
+		} else if (len >= WS_CTUBE_CHANNEL_NAME_LEN || memchr(msg, '\0', len) != NULL) {
+			/* sent by the client: no channel has such a name */
+			channel = NULL;
+		} else {
+			pthread_mutex_lock(&ctube->channel_list.mutex);
+			channel = _ws_ctube_channel_find_locked(ctube, msg, len);
+			pthread_mutex_unlock(&ctube->channel_list.mutex);
+		}
+		if (channel != NULL) {
+			_ws_ctube_conn_subscribe(conn, channel, 0);
+		}
+
+	} else if (_ws_ctube_control_is(msg, len, "roi")) {
+		n = _ws_ctube_parse_sizes(val, 2 * WS_CTUBE_GRID_MAXDIM, msg + strlen("roi"), len - strlen("roi"));
+		if (n >= 0 && n % 2 == 0) {
+			_ws_ctube_conn_get_roi(conn, &roi);
+			roi.ndim = n / 2;
+			for (int i = 0; i < roi.ndim; i++) {
+				roi.lo[i] = val[2 * i];
+				roi.hi[i] = val[2 * i + 1];
+			}
+			_ws_ctube_conn_set_roi(conn, &roi);
+		}
+
+	} else if (_ws_ctube_control_is(msg, len, "lod")) {
+		n = _ws_ctube_parse_sizes(val, 1, msg + strlen("lod"), len - strlen("lod"));
+		if (n == 1) {
+			_ws_ctube_conn_get_roi(conn, &roi);
+			roi.level = val[0] < WS_CTUBE_GRID_MAXLEVEL ? (int)val[0] : WS_CTUBE_GRID_MAXLEVEL;
+			roi.fit = 0;
+			_ws_ctube_conn_set_roi(conn, &roi);
+		}
+
+	} else if (_ws_ctube_control_is(msg, len, "fit")) {
+		n = _ws_ctube_parse_sizes(val, 1, msg + strlen("fit"), len - strlen("fit"));
+		if (n == 1) {
+			_ws_ctube_conn_get_roi(conn, &roi);
+			roi.fit = val[0];
+			_ws_ctube_conn_set_roi(conn, &roi);
+		}
+	}
+}
+
+/** handles incoming data from client */
+static void *ws_ctube_reader_main(void *arg)
+{
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
+	struct ws_ctube *ctube = conn->ctube;
+	char buf[WS_CTUBE_BUFLEN];
+	char inflated[WS_CTUBE_BUFLEN];
+	size_t len = 0;
+	size_t frame_len, inflated_len;
+	int opcode, fin, rsv1;
+	int compressed = 0;
+
+	/* clients only send short control messages: longer ones (or any
+	 * protocol error) disconnect the client */
+	for (;;) {
+		/* a control frame may come between the frames of a message: its
+		 * payload lands after the message so far and is not kept */
+		if (ws_ctube_ws_recv(conn->fd, &opcode, &fin, &rsv1, buf + len, &frame_len, sizeof(buf) - len) != 0) {
+			break;
+		}
+		if (opcode == WS_CTUBE_OP_CLOSE) {
+			break;
+		}
+		if (opcode > WS_CTUBE_OP_CLOSE) {
+			/* TODO: answer pings (only the writer sends) */
+			continue;
+		}
+
+		/* only the first frame of a message says it is compressed */
+		if (opcode == WS_CTUBE_OP_CONT ? rsv1 : rsv1 && !conn->deflate) {
+			break;
+		}
+		if (opcode != WS_CTUBE_OP_CONT) {
+			compressed = rsv1;
+		}
+
+		len += frame_len;
+		if (fin) {
+			if (compressed) {
+				inflated_len = ws_ctube_inflate(inflated, sizeof(inflated), buf, len);
+				if (inflated_len == (size_t)-1) {
+					break;
+				}
+				_ws_ctube_conn_control(conn, inflated, inflated_len);
+			} else {
+				_ws_ctube_conn_control(conn, buf, len);
+			}
+			len = 0;
+		}
+	}
+
+	ws_ctube_connq_push(ctube, conn, WS_CTUBE_CONN_STOP);
+	if (WS_CTUBE_DEBUG) {
+		printf("ws_ctube_reader_main(): disconnected client\n");
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+/** ensures data is released even if writer is cancelled */
+static void _ws_ctube_cleanup_release_ws_ctube_data(void *arg)
+{
+	struct ws_ctube_data *ws_ctube_data = (struct ws_ctube_data *)arg;
+	ws_ctube_data_release(ws_ctube_data);
+}
+
+/**
+ * send live out_data chunk by chunk, taking copy-on-write snapshots into
+ * account, as a message (or the rest of one if !first)
+ */
+static int _ws_ctube_send_live(int fd, struct ws_ctube_data *out_data, int first)
+{
+	int retval = 0;
+	struct ws_ctube_live *live = out_data->live;
+	const char *base = (const char *)out_data->data;
+	char buf[WS_CTUBE_LIVE_CHUNK_SIZE];
+
+	for (size_t i = 0; i < live->nchunk; i++) {
+		const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+		size_t len = out_data->data_size - off;
+		if (len > WS_CTUBE_LIVE_CHUNK_SIZE) {
+			len = WS_CTUBE_LIVE_CHUNK_SIZE;
+		}
+
+		const char *chunk = ws_ctube_live_read_chunk(live, base, i, buf, len);
+		if (ws_ctube_ws_send_part(fd, chunk, len, first && i == 0, i == live->nchunk - 1) != 0) {
+			retval = -1;
+			break;
+		}
+	}
+
+	return retval;
+}
+
+/**
+ * clip roi (in indices of the full grid) to a level of the grid
+ *
+ * @param view layout of the level, from ws_ctube_grid_level()
+ * @param level which level
+ * @param lo set to the first index of the box along each axis of view
+ * @param hi set to one past the last index of the box along each axis of view
+ *
+ * @return 0 if the box is not empty, -1 otherwise
+ */
+static int _ws_ctube_roi_clip(const struct ws_ctube_grid *view, int level, const struct ws_ctube_roi *roi, size_t *lo, size_t *hi)
+{
+	for (int i = 0; i < view->ndim; i++) {
+		lo[i] = 0;
+		hi[i] = view->dims[i];
+		if (i < roi->ndim) {
+			/* widened to whole elements of the level */
+			const size_t roi_lo = roi->lo[i] >> level;
+			const size_t roi_hi = (roi->hi[i] >> level) + ((roi->hi[i] & (((size_t)1 << level) - 1)) != 0);
+			lo[i] = roi_lo < hi[i] ? roi_lo : hi[i];
+			hi[i] = roi_hi < hi[i] ? roi_hi : hi[i];
+		}
+		if (lo[i] >= hi[i]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * the level of grid to send for roi: roi->level, or with roi->fit the finest
+ * level at which the box has at most roi->fit elements along every axis
+ */
+static int _ws_ctube_roi_level(const struct ws_ctube_grid *grid, const struct ws_ctube_roi *roi)
+{
+	struct ws_ctube_grid view;
+	size_t lo[WS_CTUBE_GRID_MAXDIM];
+	size_t hi[WS_CTUBE_GRID_MAXDIM];
+	int level;
+
+	if (roi->fit == 0) {
+		return roi->level < grid->nlevel ? roi->level : grid->nlevel;
+	}
+
+	for (level = 0; level < grid->nlevel; level++) {
+		ws_ctube_grid_level(grid, level, &view);
+		if (_ws_ctube_roi_clip(&view, level, roi, lo, hi) != 0) {
+			break;
+		}
+
+		int fits = 1;
+		for (int i = 0; i < view.ndim; i++) {
+			fits = fits && hi[i] - lo[i] <= roi->fit;
+		}
+		if (fits) {
+			break;
+		}
+	}
+	return level;
+}
+
+/**
+ * send the grid in out_data at the level and box asked for by roi as a
+ * message (or the rest of one if !first), row by row straight from the shared
+ * buffer. An empty box is not sent unless it ends a message
+ */
+static int _ws_ctube_send_grid(int fd, const struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi, int first)
+{
+	struct ws_ctube_grid view;
+	size_t lo[WS_CTUBE_GRID_MAXDIM];
+	size_t hi[WS_CTUBE_GRID_MAXDIM];
+	size_t stride[WS_CTUBE_GRID_MAXDIM];
+
+	const int level = _ws_ctube_roi_level(&out_data->grid, roi);
+	const char *base = (const char *)out_data->data + ws_ctube_grid_level(&out_data->grid, level, &view);
+	const int pad = WS_CTUBE_GRID_MAXDIM - view.ndim;
+
+	if (roi->ndim == 0) {
+		return ws_ctube_ws_send_part(fd, base, ws_ctube_grid_size(&view), first, 1);
+	}
+	if (_ws_ctube_roi_clip(&view, level, roi, lo + pad, hi + pad) != 0) {
+		return first ? 0 : ws_ctube_ws_send_part(fd, base, 0, 0, 1);
+	}
+
+	/* as a 3D grid whose leading axes have length 1 */
+	for (int i = 0; i < WS_CTUBE_GRID_MAXDIM; i++) {
+		if (i < pad) {
+			lo[i] = 0;
+			hi[i] = 1;
+			stride[i] = 0;
+		} else {
+			stride[i] = view.strides[i - pad];
+		}
+	}
+
+	/* rows are contiguous in the packed grid */
+	const size_t row_size = (hi[2] - lo[2]) * view.elem_size;
+	for (size_t z = lo[0]; z < hi[0]; z++) {
+		for (size_t y = lo[1]; y < hi[1]; y++) {
+			const char *row = base + z * stride[0] + y * stride[1] + lo[2] * stride[2];
+			const int first_row = z == lo[0] && y == lo[1];
+			const int last_row = z == hi[0] - 1 && y == hi[1] - 1;
+			if (ws_ctube_ws_send_part(fd, row, row_size, first && first_row, last_row) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * send what a client asking for roi gets of out_data, without deltas, as a
+ * message (or the rest of one if !first)
+ */
+static int _ws_ctube_send_whole(int fd, struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi, int first)
+{
+	if (out_data->live != NULL) {
+		return _ws_ctube_send_live(fd, out_data, first);
+	} else if (out_data->grid.ndim > 0) {
+		return _ws_ctube_send_grid(fd, out_data, roi, first);
+	}
+	return ws_ctube_ws_send_part(fd, (const char *)out_data->data, out_data->data_size, first, 1);
+}
+
+/** bytes a client not in delta mode would be sent of out_data as a whole */
+static inline size_t _ws_ctube_frame_size(const struct ws_ctube_data *out_data)
+{
+	if (out_data->grid.ndim > 0) {
+		/* without the levels */
+		return ws_ctube_grid_size(&out_data->grid);
+	}
+	return out_data->data_size;
+}
+
+/** forget the last frame sent in delta mode: the next one is a keyframe */
+static void _ws_ctube_drop_delta_base(struct ws_ctube_conn_struct *conn)
+{
+	if (conn->delta_base != NULL) {
+		ws_ctube_data_release(conn->delta_base);
+		conn->delta_base = NULL;
+		conn->delta_base_id = 0;
+	}
+}
+
+/**
+ * whether a client asking for roi is sent the frame of out_data as is (the
+ * first _ws_ctube_frame_size() bytes of its buffer), so that deltas and
+ * compression can be computed once for all such clients
+ */
+static int _ws_ctube_sends_frame(const struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi)
+{
+	if (out_data->live != NULL) {
+		/* copy-on-write chunks are read as they are sent */
+		return 0;
+	}
+	if (out_data->grid.ndim > 0) {
+		return roi->ndim == 0 && _ws_ctube_roi_level(&out_data->grid, roi) == 0;
+	}
+	return 1;
+}
+
+/**
+ * send out_data to a client in the raw encoding: compressed once for all
+ * clients that negotiated permessage-deflate, if that makes it smaller
+ */
+static int _ws_ctube_send_maybe_deflated(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi)
+{
+	const struct ws_ctube_encoded *deflated;
+
+	if (conn->deflate && _ws_ctube_sends_frame(out_data, roi)) {
+		deflated = ws_ctube_data_get_encoded(out_data, WS_CTUBE_ENCODING_DEFLATE, _ws_ctube_frame_size(out_data), &conn->ctube->encoder);
+		if (deflated != NULL) {
+			return ws_ctube_ws_send_deflated(conn->fd, deflated->buf, deflated->size);
+		}
+	}
+	return _ws_ctube_send_whole(conn->fd, out_data, roi, 1);
+}
+
+/**
+ * send out_data to a client in the deflate encoding: one message of a 1 byte
+ * tag, then either a raw deflate stream of the frame, made once for all
+ * clients (tag WS_CTUBE_TAG_DEFLATE), or what _ws_ctube_send_whole() sends
+ * (tag WS_CTUBE_TAG_FRAME) if compressing does not make it smaller
+ */
+static int _ws_ctube_send_deflate_stream(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, const struct ws_ctube_roi *roi)
+{
+	/* an empty final block: decompressors expect the stream to end */
+	static const char final_block[] = {0x03, 0x00};
+	const struct ws_ctube_encoded *deflated = NULL;
+	char tag = WS_CTUBE_TAG_FRAME;
+	int retval;
+
+	if (_ws_ctube_sends_frame(out_data, roi)) {
+		deflated = ws_ctube_data_get_encoded(out_data, WS_CTUBE_ENCODING_DEFLATE, _ws_ctube_frame_size(out_data), &conn->ctube->encoder);
+	}
+	if (deflated != NULL) {
+		tag = WS_CTUBE_TAG_DEFLATE;
+	}
+
+	retval = ws_ctube_ws_send_part(conn->fd, &tag, 1, 1, 0);
+	if (retval != 0) {
+		return retval;
+	}
+	if (deflated == NULL) {
+		return _ws_ctube_send_whole(conn->fd, out_data, roi, 0);
+	}
+
+	/* with the sync flush tail that permessage-deflate leaves out */
+	retval = ws_ctube_ws_send_part(conn->fd, deflated->buf, deflated->size + WS_CTUBE_DEFLATE_TAIL, 0, 0);
+	if (retval == 0) {
+		retval = ws_ctube_ws_send_part(conn->fd, final_block, sizeof(final_block), 0, 1);
+	}
+	return retval;
+}
+
+/**
+ * send out_data in delta mode: one message of a 1 byte tag, then either what
+ * _ws_ctube_send_whole() sends (tag WS_CTUBE_TAG_FRAME) or the delta to
+ * it from the last frame sent (tag WS_CTUBE_TAG_DELTA). Keeps a
+ * reference to out_data as the base of the next delta if it can be one
+ */
+static int _ws_ctube_send_delta(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, unsigned long out_data_id, const struct ws_ctube_roi *roi)
+{
+	const struct ws_ctube_data *base = conn->delta_base;
+	const struct ws_ctube_delta *delta = NULL;
+	const int applies = _ws_ctube_sends_frame(out_data, roi);
+	const size_t frame_size = _ws_ctube_frame_size(out_data);
+	char tag = WS_CTUBE_TAG_FRAME;
+	int retval;
+
+	if (applies && base != NULL && frame_size > 0 && conn->delta_nframe < WS_CTUBE_DELTA_KEYFRAME
+	    && _ws_ctube_frame_size(base) == frame_size) {
+		delta = ws_ctube_data_get_delta(out_data, base, conn->delta_base_id, frame_size, &conn->ctube->encoder);
+	}
+	if (delta != NULL) {
+		tag = WS_CTUBE_TAG_DELTA;
+	}
+
+	retval = ws_ctube_ws_send_part(conn->fd, &tag, 1, 1, 0);
+	if (retval == 0) {
+		if (delta != NULL) {
+			/* an empty delta (nothing changed) ends with an empty frame */
+			retval = ws_ctube_ws_send_part(conn->fd, delta->buf, delta->size, 0, 1);
+		} else {
+			retval = _ws_ctube_send_whole(conn->fd, out_data, roi, 0);
+		}
+	}
+
+	_ws_ctube_drop_delta_base(conn);
+	if (applies) {
+		ws_ctube_data_acquire(out_data);
+		conn->delta_base = out_data;
+		conn->delta_base_id = out_data_id;
+		conn->delta_nframe = delta != NULL ? conn->delta_nframe + 1 : 0;
+	}
+	return retval;
+}
+
+/** send out_data (of id out_data_id) to a client in its encoding */
+static int _ws_ctube_send_encoded(struct ws_ctube_conn_struct *conn, struct ws_ctube_data *out_data, unsigned long out_data_id, const struct ws_ctube_roi *roi)
+{
+	switch (conn->encoding) {
+	case WS_CTUBE_ENCODING_DELTA:
+		return _ws_ctube_send_delta(conn, out_data, out_data_id, roi);
+	case WS_CTUBE_ENCODING_DEFLATE:
+		return _ws_ctube_send_deflate_stream(conn, out_data, roi);
+	default:
+		return _ws_ctube_send_maybe_deflated(conn, out_data, roi);
+	}
+}
+
+/** sends broadcast data to client */
+static void *ws_ctube_writer_main(void *arg)
+{
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
+	struct ws_ctube_channel *channel;
+	struct ws_ctube_data *out_data = NULL;
+	unsigned long out_data_id = 0;
+	unsigned long sub_gen = 0;
+	struct ws_ctube_roi roi;
+	int send_retval;
+
+	/* a snapshot is sent first, then what was published after it */
+	if (conn->snapshot != NULL) {
+		out_data = conn->snapshot;
+		conn->snapshot = NULL;
+		out_data_id = conn->snapshot_out_data_id;
+		/* a snapshot is not a grid: no roi applies */
+		roi.ndim = 0;
+		roi.level = 0;
+		roi.fit = 0;
+
+		__atomic_store_n(&conn->sending_bytes, ws_ctube_data_pooled_bytes(out_data), __ATOMIC_RELAXED);
+		__atomic_store_n(&conn->sending_id, conn->snapshot_id, __ATOMIC_RELEASE);
+
+		pthread_cleanup_push(_ws_ctube_cleanup_release_ws_ctube_data, out_data);
+		_ws_ctube_send_encoded(conn, out_data, conn->snapshot_id, &roi);
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_release_ws_ctube_data */
+		__atomic_store_n(&conn->sending_id, (unsigned long)0, __ATOMIC_RELEASE);
+		ws_ctube_data_release(out_data);
+	}
+
+	for (;;) {
+		/* paused or unsubscribed clients are left out of the fan-out:
+		 * their writer waits here instead of on a channel */
+		pthread_mutex_lock(&conn->sub_mutex);
+		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &conn->sub_mutex);
+		while (conn->paused || conn->channel == NULL) {
+			pthread_cond_wait(&conn->sub_cond, &conn->sub_mutex);
+		}
+		channel = conn->channel;
+		roi = conn->roi;
+		/* send the latest data again after a change, e.g. of roi */
+		if (sub_gen != conn->sub_gen) {
+			sub_gen = conn->sub_gen;
+			out_data_id = 0;
+		}
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
+		pthread_mutex_unlock(&conn->sub_mutex);
+
+		/* wait until new data is needed to be broadcast by checking data
+		 * id (ids are unique across channels), or the subscription changes */
+		pthread_mutex_lock(&channel->out_data_mutex);
+		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
+		while ((channel->out_data == NULL || out_data_id == channel->out_data_id) && sub_gen == __atomic_load_n(&conn->sub_gen, __ATOMIC_ACQUIRE)) {
+			pthread_cond_wait(&channel->out_data_cond, &channel->out_data_mutex);
+		}
+
+		out_data = NULL;
+		if (sub_gen == __atomic_load_n(&conn->sub_gen, __ATOMIC_ACQUIRE)) {
+			ws_ctube_data_acquire(channel->out_data);
+			out_data = channel->out_data;
+			out_data_id = channel->out_data_id;
+		}
+
+		/* let the producer find laggards for the memory budget */
+		if (out_data != NULL) {
+			__atomic_store_n(&conn->sending_bytes, ws_ctube_data_pooled_bytes(out_data), __ATOMIC_RELAXED);
+			__atomic_store_n(&conn->sending_id, out_data_id, __ATOMIC_RELEASE);
+		}
+
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
+		pthread_mutex_unlock(&channel->out_data_mutex);
+
+		/* subscription changed: wait again */
+		if (out_data == NULL) {
+			continue;
+		}
+
+		/* broadcast data in a cancellable way */
+		pthread_cleanup_push(_ws_ctube_cleanup_release_ws_ctube_data, out_data);
+		send_retval = _ws_ctube_send_encoded(conn, out_data, out_data_id, &roi);
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_release_ws_ctube_data */
+		__atomic_store_n(&conn->sending_id, (unsigned long)0, __ATOMIC_RELEASE);
+		ws_ctube_data_release(out_data);
+
+		/* TODO: error handling of failed broadcast */
+		if (send_retval != 0) {
+			continue;
+		}
+	}
+
+	return NULL;
+}
+
+static void _ws_ctube_cancel_reader(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
+	pthread_cancel(conn->reader_tid);
+	pthread_join(conn->reader_tid, NULL);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+static void _ws_ctube_cancel_writer(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
+	pthread_cancel(conn->writer_tid);
+	pthread_join(conn->writer_tid, NULL);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+/** start reader/writer threads for a client */
+static int ws_ctube_conn_struct_start(struct ws_ctube_conn_struct *conn)
+{
+	int retval = 0;
+
+	if (pthread_create(&conn->reader_tid, NULL, ws_ctube_reader_main, (void *)conn) != 0) {
+		fprintf(stderr, "ws_ctube_conn_struct_start(): create reader failed\n");
+		retval = -1;
+		goto out_noreader;
+	}
+	pthread_cleanup_push(_ws_ctube_cancel_reader, conn);
+
+	if (pthread_create(&conn->writer_tid, NULL, ws_ctube_writer_main, (void *)conn) != 0) {
+		fprintf(stderr, "ws_ctube_conn_struct_start(): create writer failed\n");
+		retval = -1;
+		goto out_nowriter;
+	}
+	pthread_cleanup_push(_ws_ctube_cancel_writer, conn);
+
+	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_writer */
+out_nowriter:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_reader */
+out_noreader:
+	return retval;
+}
+
+/** cancels reader/writer threads for a client */
+static void ws_ctube_conn_struct_stop(struct ws_ctube_conn_struct *conn)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	pthread_cancel(conn->reader_tid);
+	pthread_cancel(conn->writer_tid);
+
+	pthread_join(conn->reader_tid, NULL);
+	pthread_join(conn->writer_tid, NULL);
+
+	/* held by the writer between broadcasts */
+	_ws_ctube_drop_delta_base(conn);
+	/* not sent yet if the writer did not get to it */
+	if (conn->snapshot != NULL) {
+		ws_ctube_data_release(conn->snapshot);
+		conn->snapshot = NULL;
+	}
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+/** runs on the reclaimer thread: stop a disconnected client's threads */
+static void _ws_ctube_conn_struct_reclaim(struct ws_ctube_reclaim_node *node)
+{
+	struct ws_ctube_conn_struct *conn = ws_ctube_container_of(node, typeof(*conn), rnode);
+
+	ws_ctube_conn_struct_stop(conn);
+	ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+}
+
+/**
+ * get a snapshot made by snapshot_fn into a pooled ws_ctube_data (referenced)
+ *
+ * @param size bytes to try first or 0 to ask snapshot_fn; set to the bytes of
+ * the snapshot
+ *
+ * @return the snapshot, or NULL if there is none (or it does not fit within
+ * the memory budget)
+ */
+static struct ws_ctube_data *_ws_ctube_snapshot_take(struct ws_ctube *ctube, ws_ctube_snapshot_fn snapshot_fn, void *user, size_t *size)
+{
+	struct ws_ctube_data_pool *pool = &ctube->data_pool;
+	struct ws_ctube_data *snapshot;
+	size_t n;
+
+	/* the state may grow between asking for the size and writing it */
+	for (int attempt = 0; attempt < 3; attempt++) {
+		if (*size == 0) {
+			*size = snapshot_fn(NULL, 0, user);
+			if (*size == 0) {
+				return NULL;
+			}
+		}
+
+		/* for one client only: never worth blocking or dropping others */
+		if (pool->budget == 0) {
+			_ws_ctube_data_pool_take(pool, ws_ctube_data_pool_capacity(*size));
+		} else if (ws_ctube_data_pool_reserve(pool, ws_ctube_data_pool_capacity(*size), pool->budget) != 0) {
+			__atomic_add_fetch(&ctube->nbudget_rejected, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		snapshot = ws_ctube_data_pool_get(pool, *size, 1);
+		if (ws_ctube_unlikely(snapshot == NULL)) {
+			return NULL;
+		}
+
+		n = snapshot_fn(snapshot->data, snapshot->data_capacity, user);
+		if (n > 0 && n <= snapshot->data_capacity) {
+			snapshot->data_size = n;
+			*size = n;
+			ws_ctube_data_acquire(snapshot);
+			return snapshot;
+		}
+		ws_ctube_data_recycle(snapshot);
+		*size = n;
+		if (n == 0) {
+			return NULL;
+		}
+	}
+
+	fprintf(stderr, "_ws_ctube_snapshot_take(): error: snapshot keeps growing\n");
+	fflush(stderr);
+	return NULL;
+}
+
+/**
+ * take the snapshot of conn->channel, if it has a snapshot_fn, for the writer
+ * of a client that just connected to send first. The writer must not be
+ * running yet
+ */
+static void _ws_ctube_conn_snapshot(struct ws_ctube_conn_struct *conn)
+{
+	struct ws_ctube_channel *channel = conn->channel;
+	ws_ctube_snapshot_fn snapshot_fn;
+	void *user;
+	size_t size;
+	unsigned long out_data_id;
+
+	/* the id is read first: whatever was published up to it was applied
+	 * to the state before the snapshot is written (and later publishes
+	 * are sent after it), so that no update is missed */
+	pthread_mutex_lock(&channel->out_data_mutex);
+	snapshot_fn = channel->snapshot_fn;
+	user = channel->snapshot_user;
+	size = channel->snapshot_size;
+	out_data_id = channel->out_data_id;
+	pthread_mutex_unlock(&channel->out_data_mutex);
+
+	if (snapshot_fn == NULL) {
+		return;
+	}
+
+	/* not under out_data_mutex: snapshot_fn may wait on a lock held by a
+	 * thread that publishes to channel */
+	conn->snapshot = _ws_ctube_snapshot_take(conn->ctube, snapshot_fn, user, &size);
+	if (conn->snapshot == NULL) {
+		return;
+	}
+	/* ids are unique across snapshots too, for deltas from it */
+	conn->snapshot_id = __atomic_add_fetch(&conn->ctube->out_data_seq, 1, __ATOMIC_RELAXED);
+	conn->snapshot_out_data_id = out_data_id;
+
+	/* a hint for the next client */
+	pthread_mutex_lock(&channel->out_data_mutex);
+	if (channel->snapshot_fn == snapshot_fn) {
+		channel->snapshot_size = size;
+	}
+	pthread_mutex_unlock(&channel->out_data_mutex);
+}
+
+/** process work item from FIFO connq (start/stop connection) */
+static void ws_ctube_handler_process_queue(struct ws_ctube *ctube)
+{
+	struct ws_ctube_conn_table *conn_table = &ctube->conn_table;
+	struct ws_ctube_conn_qentry *qentry;
+	struct ws_ctube_mpsc_node *node;
+	struct ws_ctube_conn_struct *conn;
+	char path[WS_CTUBE_PATH_LEN];
+	int protocol;
+
+	while ((node = ws_ctube_mpsc_queue_pop(&ctube->connq)) != NULL) {
+		qentry = ws_ctube_container_of(node, typeof(*qentry), qnode);
+		conn = qentry->conn;
+
+		pthread_cleanup_push((cleanup_func)ws_ctube_conn_qentry_free, qentry);
+
+		switch (qentry->act) {
+		case WS_CTUBE_CONN_START:
+			/* refuse new connections if limit exceeded*/
+			if (conn_table->len >= ctube->max_nclient) {
+				fprintf(stderr, "ws_ctube_handler_process_queue(): max_nclient reached\n");
+				fflush(stderr);
+				break;
+			}
+
+			/* do websocket handshake */
+			conn->deflate = WS_CTUBE_DEFLATE;
+			if (ws_ctube_ws_handshake(conn->fd, &ctube->timeout_val, path, sizeof(path), &conn->deflate,
+						  ws_ctube_encoding_names, WS_CTUBE_NENCODING, &protocol) == 0) {
+				/* the writer is not running yet */
+				conn->channel = _ws_ctube_channel_find(ctube, path);
+				conn->encoding = _ws_ctube_conn_encoding(path, protocol);
+				_ws_ctube_conn_snapshot(conn);
+				ws_ctube_conn_struct_start(conn);
+				ws_ctube_conn_table_add(conn_table, conn);
+			}
+			break;
+
+		case WS_CTUBE_CONN_STOP:
+			/* prevent double stop */
+			if (!ws_ctube_conn_struct_set_stopping(conn)) {
+				if (ws_ctube_conn_table_remove(conn_table, ws_ctube_slab_slot(conn)) != NULL) {
+					ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+				}
+
+				/* joining its threads can take a while: let the
+				 * reclaimer do it so other clients are not held up */
+				ws_ctube_ref_count_acquire(conn, refc);
+				ws_ctube_reclaimer_push(&ctube->reclaimer, &conn->rnode, _ws_ctube_conn_struct_reclaim);
+			}
+			break;
+		}
+
+		pthread_cleanup_pop(1); /* ws_ctube_conn_qentry_free */
+	}
+}
+
+/** stop all client connections and cleanup */
+static void _ws_ctube_cleanup_conn_table(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube_conn_table *conn_table = (struct ws_ctube_conn_table *)arg;
+	struct ws_ctube_conn_struct *conn;
+
+	for (int slot = 0; slot < conn_table->capacity; slot++) {
+		conn = ws_ctube_conn_table_remove(conn_table, slot);
+		if (conn == NULL) {
+			continue;
+		}
+
+		/* prevent double stop */
+		if (!ws_ctube_conn_struct_set_stopping(conn)) {
+			ws_ctube_conn_struct_stop(conn);
+		}
+
+		ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+	}
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+/** connection handler thread: handles new clients via handshake or cleans up disconnected clients */
+static void *ws_ctube_handler_main(void *arg)
+{
+	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+
+	pthread_cleanup_push(_ws_ctube_cleanup_conn_table, &ctube->conn_table);
+
+	for (;;) {
+		/* wait for work items in FIFO connq */
+		pthread_mutex_lock(&ctube->connq_mutex);
+		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->connq_mutex);
+		while (!__atomic_load_n(&ctube->connq_pred, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&ctube->connq_cond, &ctube->connq_mutex);
+		}
+		pthread_mutex_unlock(&ctube->connq_mutex);
+		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
+
+		/* cleared before draining: pushes from now on wake us again */
+		__atomic_store_n(&ctube->connq_pred, (int)0, __ATOMIC_SEQ_CST);
+
+		ws_ctube_handler_process_queue(ctube);
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* closes client socket on error */
+static void _ws_ctube_cleanup_close_client_conn(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	int *fd = (int *)arg;
+	if (*fd >= 0) {
+		close(*fd);
+	}
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+static int ws_ctube_server_accept_new_conn(struct ws_ctube *ctube, const int server_sock)
+{
+	int retval = 0;
+
+	int conn_fd = accept(server_sock, NULL, NULL);
+	pthread_cleanup_push(_ws_ctube_cleanup_close_client_conn, &conn_fd);
+
+	/* create new conn_struct for client (refused if all slots are in use) */
+	struct ws_ctube_conn_struct *conn = (typeof(conn))ws_ctube_slab_alloc(&ctube->conn_slab);
+	if (conn == NULL) {
+		retval = -1;
+		goto out_noalloc;
+	}
+	pthread_cleanup_push(ws_ctube_slab_free, conn);
+
+	if (ws_ctube_conn_struct_init(conn, conn_fd, ctube) != 0) {
+		retval = -1;
+		goto out_noinit;
+	}
+	/* ws_ctube_conn_struct_destroy() closes conn_fd now; this prevents _ws_ctube_cleanup_close_client_conn() from closing it */
+	conn_fd = -1;
+	pthread_cleanup_push((cleanup_func)ws_ctube_conn_struct_destroy, conn);
+
+	/* push work item to connection handler to do handshake and start reader/writer */
+	if (ws_ctube_connq_push(ctube, conn, WS_CTUBE_CONN_START) != 0) {
+		retval = -1;
+		goto out_nopush;
+	}
+
+out_nopush:
+	pthread_cleanup_pop(retval); /* ws_ctube_conn_struct_destroy */
+out_noinit:
+	pthread_cleanup_pop(retval); /* ws_ctube_slab_free */
+out_noalloc:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_close_client_conn */
+	return retval;
+}
+
+static void ws_ctube_serve_forever(struct ws_ctube *ctube)
+{
+	const int server_sock = ctube->server_sock;
+
+	for (;;) {
+		if (ws_ctube_server_accept_new_conn(ctube, server_sock) != 0) {
+			fprintf(stderr, "ws_ctube_serve_forever(): error\n");
+			fflush(stderr);
+		}
+	}
+}
+
+/** alert main thread if the server fails to init by setting flag */
+static void _ws_ctube_server_init_fail(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+	pthread_mutex_lock(&ctube->server_init_mutex);
+	ctube->server_inited = -1;
+	pthread_mutex_unlock(&ctube->server_init_mutex);
+	pthread_cond_signal(&ctube->server_init_cond);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+static void _ws_ctube_close_server_sock(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+	close(ctube->server_sock);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+static void *ws_ctube_server_main(void *arg)
+{
+	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+	pthread_cleanup_push(_ws_ctube_server_init_fail, ctube);
+
+	/* create server socket */
+	int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_sock < 0) {
+		perror("ws_ctube_server_main()");
+		goto out_nosock;
+	}
+	ctube->server_sock = server_sock;
+	pthread_cleanup_push(_ws_ctube_close_server_sock, ctube);
+
+	/* allow reuse */
+#ifdef __linux__
+	int optname = SO_REUSEADDR | SO_REUSEPORT;
+#else
+	int optname = SO_REUSEADDR;
+#endif
+	int yes = 1;
+	if (setsockopt(server_sock, SOL_SOCKET, optname, &yes, sizeof(yes)) < 0) {
+		perror("ws_ctube_server_main()");
+		goto out_err;
+	}
+
+	/* set server socket address/port */
+	if (ws_ctube_bind_server(server_sock, ctube->port) < 0) {
+		perror("ws_ctube_server_main()");
+		goto out_err;
+	}
+
+	/* set listening */
+	if (listen(server_sock, ctube->max_nclient) < 0) {
+		perror("ws_ctube_server_main()");
+		goto out_err;
+	}
+
+	/* success: alert main thread by setting flag */
+	pthread_mutex_lock(&ctube->server_init_mutex);
+	ctube->server_inited = 1;
+	pthread_mutex_unlock(&ctube->server_init_mutex);
+	pthread_cond_signal(&ctube->server_init_cond);
+	ws_ctube_serve_forever(ctube);
+
+	/* code doesn't get here unless error */
+out_err:
+	pthread_cleanup_pop(1); /* _ws_ctube_close_server_sock */
+out_nosock:
+	pthread_cleanup_pop(1); /* _ws_ctube_server_init_fail */
+	return NULL;
+}
+
+static void _ws_ctube_cancel_handler(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+	pthread_cancel(ctube->handler_tid);
+	pthread_join(ctube->handler_tid, NULL);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+static void _ws_ctube_cancel_server(void *arg)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+	pthread_cancel(ctube->server_tid);
+	pthread_join(ctube->server_tid, NULL);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+/* start connection handler and server threads */
+static int ws_ctube_start(struct ws_ctube *ctube)
+{
+	int retval = 0;
+
+	if (ws_ctube_encoder_start(&ctube->encoder, ctube->encode_threads) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create encoder failed\n");
+		retval = -1;
+		goto out_noencoder;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_encoder_stop, &ctube->encoder);
+
+	if (ws_ctube_reclaimer_start(&ctube->reclaimer) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create reclaimer failed\n");
+		retval = -1;
+		goto out_noreclaimer;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_reclaimer_stop, &ctube->reclaimer);
+
+	if (ctube->record_path != NULL && ws_ctube_recorder_start(&ctube->recorder, ctube->record_path, ctube->record_segment_size, ctube->record_backlog) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create recorder failed\n");
+		retval = -1;
+		goto out_norecorder;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_recorder_stop, &ctube->recorder);
+
+	if (ctube->shm_path != NULL && ws_ctube_shm_start(&ctube->shm, ctube->shm_path, ctube->shm_size) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create shm ring failed\n");
+		retval = -1;
+		goto out_noshm;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_shm_stop, &ctube->shm);
+
+	if (pthread_create(&ctube->handler_tid, NULL, ws_ctube_handler_main, (void *)ctube) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create handler failed\n");
+		retval = -1;
+		goto out_nohandler;
+	}
+	pthread_cleanup_push(_ws_ctube_cancel_handler, ctube);
+
+	if (pthread_create(&ctube->server_tid, NULL, ws_ctube_server_main, (void *)ctube) != 0) {
+		fprintf(stderr, "ws_ctube_start(): create server failed\n");
+		retval = -1;
+		goto out_noserver;
+	}
+	pthread_cleanup_push(_ws_ctube_cancel_server, ctube);
+
+	/* wait for server thread to report success/failure to start */
+	pthread_mutex_lock(&ctube->server_init_mutex);
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->server_init_mutex);
+	if (ctube->timeout_spec.tv_nsec > 0 || ctube->timeout_spec.tv_sec > 0) {
+		while (!ctube->server_inited) {
+			pthread_cond_timedwait(&ctube->server_init_cond, &ctube->server_init_mutex, &ctube->timeout_spec);
+		}
+	} else {
+		while (!ctube->server_inited) {
+			pthread_cond_wait(&ctube->server_init_cond, &ctube->server_init_mutex);
+		}
+	}
+	if (ctube->server_inited <= 0) {
+		fprintf(stderr, "ws_ctube_start(): server failed to init\n");
+		retval = -1;
+		goto out_noinit;
+	}
+	pthread_mutex_unlock(&ctube->server_init_mutex);
+
+out_noinit:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_server */
+out_noserver:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_handler */
+out_nohandler:
+	pthread_cleanup_pop(retval); /* ws_ctube_shm_stop */
+out_noshm:
+	pthread_cleanup_pop(retval); /* ws_ctube_recorder_stop */
+out_norecorder:
+	pthread_cleanup_pop(retval); /* ws_ctube_reclaimer_stop */
+out_noreclaimer:
+	pthread_cleanup_pop(retval); /* ws_ctube_encoder_stop */
+out_noencoder:
+	return retval;
+}
+
+/** stop connection handler and server threads */
+static void ws_ctube_stop(struct ws_ctube *ctube)
+{
+	int oldstate, statevar;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+	pthread_cancel(ctube->handler_tid);
+	pthread_cancel(ctube->server_tid);
+
+	pthread_join(ctube->handler_tid, NULL);
+	pthread_join(ctube->server_tid, NULL);
+
+	/* readers get what was written before */
+	ws_ctube_shm_stop(&ctube->shm);
+	/* writes what is still queued, then lets go of it */
+	ws_ctube_recorder_stop(&ctube->recorder);
+	/* stops clients and frees data queued by the other threads */
+	ws_ctube_reclaimer_stop(&ctube->reclaimer);
+	/* last: no writer is left to run an encode job */
+	ws_ctube_encoder_stop(&ctube->encoder);
+
+	pthread_setcancelstate(oldstate, &statevar);
+}
+
+void ws_ctube_opts_init(struct ws_ctube_opts *opts)
+{
+	opts->port = 0;
+	opts->max_nclient = 1;
+	opts->timeout_ms = 0;
+	opts->max_broadcast_fps = 0;
+
+	opts->prealloc_size = 0;
+	opts->prealloc_count = 2;
+	opts->hugepage_threshold = 0;
+
+	opts->ctrl_alloc.alloc = NULL;
+	opts->ctrl_alloc.free = NULL;
+	opts->ctrl_alloc.user = NULL;
+	opts->payload_alloc = opts->ctrl_alloc;
+
+	opts->mem_budget = 0;
+	opts->budget_policy = WS_CTUBE_BUDGET_REJECT;
+
+	opts->encode_threads = 0;
+
+	opts->record_path = NULL;
+	opts->record_segment_size = (size_t)64 << 20;
+	opts->record_backlog = (size_t)256 << 20;
+	opts->shm_path = NULL;
+	opts->shm_size = (size_t)64 << 20;
+}
+
+/** free ctube memory with the allocator it came from */
+static void _ws_ctube_free(struct ws_ctube *ctube)
+{
+	const struct ws_ctube_allocator ctrl = ctube->mem.ctrl;
+	ws_ctube_mem_free(&ctrl, ctube, sizeof(*ctube), __alignof__(*ctube));
+}
+
+/** @return 0 if both or neither hooks of allocator are set, -1 otherwise */
+static int _ws_ctube_check_allocator(const struct ws_ctube_allocator *allocator)
+{
+	return (allocator->alloc == NULL) == (allocator->free == NULL) ? 0 : -1;
+}
+
+struct ws_ctube *ws_ctube_open_opts(const struct ws_ctube_opts *opts)
+{
+	int err = 0;
+	struct ws_ctube *ctube;
+
+	/* input sanity checks */
+	if (opts == NULL) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid opts\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->port < 1) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid port\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->max_nclient < 1) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid max_nclient\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->timeout_ms < 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid timeout_ms\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->max_broadcast_fps < 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid max_broadcast_fps\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->prealloc_count < 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid prealloc_count\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (_ws_ctube_check_allocator(&opts->ctrl_alloc) != 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid ctrl_alloc\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (_ws_ctube_check_allocator(&opts->payload_alloc) != 0) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid payload_alloc\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->budget_policy != WS_CTUBE_BUDGET_REJECT && opts->budget_policy != WS_CTUBE_BUDGET_DROP && opts->budget_policy != WS_CTUBE_BUDGET_BLOCK) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid budget_policy\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->encode_threads < 0 || opts->encode_threads > WS_CTUBE_ENCODE_MAXTHREAD) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid encode_threads\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->record_path != NULL && (opts->record_path[0] == '\0' || opts->record_segment_size == 0)) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid record_path or record_segment_size\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+	if (opts->shm_path != NULL && (opts->shm_path[0] == '\0' || opts->shm_size == 0)) {
+		fprintf(stderr, "ws_ctube_open_opts(): invalid shm_path or shm_size\n");
+		fflush(stderr);
+		err = -1;
+		goto out_noalloc;
+	}
+
+	ctube = (typeof(ctube))ws_ctube_mem_alloc(&opts->ctrl_alloc, sizeof(*ctube), __alignof__(*ctube));
+	if (ctube == NULL) {
+		err = -1;
+		goto out_noalloc;
+	}
+	ctube->mem.ctrl = opts->ctrl_alloc;
+	pthread_cleanup_push((cleanup_func)_ws_ctube_free, ctube);
+
+	if (ws_ctube_init(ctube, opts) != 0) {
+		err = -1;
+		goto out_noinit;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_destroy, ctube);
+
+	if (ws_ctube_start(ctube) != 0) {
+		err = -1;
+		goto out_nostart;
+	}
+
+out_nostart:
+	pthread_cleanup_pop(err);
+out_noinit:
+	pthread_cleanup_pop(err);
+out_noalloc:
+	if (err) {
+		return NULL;
+	} else {
+		return ctube;
+	}
+}
+
+struct ws_ctube *ws_ctube_open(
+	int port,
+	int max_nclient,
+	int timeout_ms,
+	double max_broadcast_fps)
+{
+	struct ws_ctube_opts opts;
+
+	ws_ctube_opts_init(&opts);
+	opts.port = port;
+	opts.max_nclient = max_nclient;
+	opts.timeout_ms = timeout_ms;
+	opts.max_broadcast_fps = max_broadcast_fps;
+
+	return ws_ctube_open_opts(&opts);
+}
+
+void ws_ctube_close(struct ws_ctube *ctube)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_close(): error: ctube is NULL\n");
+		fflush(stderr);
+		return;
+	}
+
+	ws_ctube_stop(ctube);
+	ws_ctube_destroy(ctube);
+	_ws_ctube_free(ctube);
+}
+
+/**
+ * check whether publishing to channel now would exceed max_bcast_fps;
+ * channel->out_data_mutex must be held
+ *
+ * @param cur_time set to the current time if rate limiting is enabled
+ *
+ * @return 0 if broadcasting is allowed, -1 otherwise
+ */
+static int _ws_ctube_bcast_ratelim(struct ws_ctube_channel *channel, struct timespec *cur_time)
+{
+	const double max_bcast_fps = channel->ctube->max_bcast_fps;
+	if (max_bcast_fps <= 0) {
+		return 0;
+	}
+
+#ifdef CLOCK_MONOTONIC
+	if (ws_ctube_unlikely(clock_gettime(CLOCK_MONOTONIC, cur_time) != 0)) {
+		clock_gettime(CLOCK_REALTIME, cur_time);
+	}
+#else
+	clock_gettime(CLOCK_REALTIME, cur_time);
+#endif /* CLOCK_MONOTONIC */
+
+	double dt = (cur_time->tv_sec - channel->prev_bcast_time.tv_sec) +
+		1e-9 * (cur_time->tv_nsec - channel->prev_bcast_time.tv_nsec);
+
+	if (dt < 1.0 / max_bcast_fps) {
+		return -1;
+	}
+	return 0;
+}
+
+/** runs on the recorder thread: copy a broadcast into the log, then release it */
+static void _ws_ctube_record_data(struct ws_ctube_record_node *node, char *payload)
+{
+	struct ws_ctube_data *out_data = ws_ctube_container_of(node, typeof(*out_data), record);
+	struct ws_ctube_live *live = out_data->live;
+	const char *base = (const char *)out_data->data;
+	char buf[WS_CTUBE_LIVE_CHUNK_SIZE];
+
+	if (payload != NULL && live != NULL) {
+		/* as of the broadcast, like the writers send it */
+		for (size_t i = 0; i < live->nchunk; i++) {
+			const size_t off = i * WS_CTUBE_LIVE_CHUNK_SIZE;
+			size_t len = node->size - off;
+			if (len > WS_CTUBE_LIVE_CHUNK_SIZE) {
+				len = WS_CTUBE_LIVE_CHUNK_SIZE;
+			}
+			memcpy(payload + off, ws_ctube_live_read_chunk(live, base, i, buf, len), len);
+		}
+	} else if (payload != NULL) {
+		memcpy(payload, base, node->size);
+	}
+
+	ws_ctube_data_release(out_data);
+}
+
+/**
+ * have out_data (of id out_data_id, just published to channel) recorded:
+ * the recorder shares the producer's buffer, nothing is copied here
+ */
+static void _ws_ctube_record(struct ws_ctube_channel *channel, struct ws_ctube_data *out_data, unsigned long out_data_id)
+{
+	struct ws_ctube_record_node *node = &out_data->record;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	node->id = out_data_id;
+	node->time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	node->channel = channel->name;
+	/* what a raw client is sent (of a grid, without its levels, which
+	 * replaying builds again from its layout) */
+	node->size = _ws_ctube_frame_size(out_data);
+	node->grid = out_data->grid.ndim > 0 ? &out_data->grid : NULL;
+
+	ws_ctube_data_acquire(out_data);
+	if (ws_ctube_recorder_push(&channel->ctube->recorder, node, _ws_ctube_record_data) != 0) {
+		ws_ctube_data_release(out_data);
+	}
+}
+
+/**
+ * copy out_data (of id out_data_id, just published to channel) into the
+ * shared memory ring: the one copy other processes on the host read from.
+ * Called once out_data_mutex is unlocked, so that writers and the next
+ * publish are not held up by the copy; releases the reference
+ * _ws_ctube_set_out_data() took for it
+ */
+static void _ws_ctube_shm_write(struct ws_ctube_channel *channel, struct ws_ctube_data *out_data, unsigned long out_data_id)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	/* live data is as of the broadcast until ws_ctube_live_touch(), which
+	 * is not called before the publish returns; of a grid, without its
+	 * levels */
+	ws_ctube_shm_write(&channel->ctube->shm, channel->name, out_data->data, _ws_ctube_frame_size(out_data),
+			   out_data_id, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+	ws_ctube_data_release(out_data);
+}
+
+/**
+ * make out_data the current channel->out_data, releasing the old one;
+ * channel->out_data_mutex must be held and writers should be woken afterwards
+ *
+ * @param record whether to have out_data recorded if the recorder is running
+ * (not when it is being replayed from the log)
+ *
+ * @return the id of out_data if it is to be passed to _ws_ctube_shm_write()
+ * after unlocking out_data_mutex (holding a reference for that), else 0
+ */
+static unsigned long _ws_ctube_set_out_data(struct ws_ctube_channel *channel, struct ws_ctube_data *out_data, const struct timespec *cur_time, int record)
 {
-	int retval = 0;
-	struct ws_ctube_conn_qentry *qentry = (typeof(qentry))malloc(sizeof(*qentry));
+	struct ws_ctube *ctube = channel->ctube;
+	unsigned long shm_id = 0;
 
-	if (qentry == NULL) {
-		retval = -1;
-		goto out_noalloc;
+	/* release old out_data if held */
+	if (channel->out_data != NULL) {
+		__atomic_sub_fetch(&ctube->pinned_bytes, ws_ctube_data_pooled_bytes(channel->out_data), __ATOMIC_RELAXED);
+		ws_ctube_data_unshare(channel->out_data);
+		ws_ctube_data_release(channel->out_data);
 	}
-	pthread_cleanup_push(free, qentry);
 
-	if (ws_ctube_conn_qentry_init(qentry, conn, act) != 0) {
-		retval = -1;
-		goto out_noinit;
-	}
-	pthread_cleanup_push((cleanup_func)ws_ctube_conn_qentry_destroy, qentry);
+	ws_ctube_data_acquire(out_data);
+	ws_ctube_data_share(out_data);
+	__atomic_add_fetch(&ctube->pinned_bytes, ws_ctube_data_pooled_bytes(out_data), __ATOMIC_RELAXED);
+	channel->out_data = out_data;
+	/* unique id for out_data, increasing across channels */
+	__atomic_store_n(&channel->out_data_id, __atomic_add_fetch(&ctube->out_data_seq, 1, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
 
-	ws_ctube_list_push_back(&ctube->connq, &qentry->lnode);
-	pthread_mutex_lock(&ctube->connq_mutex);
-	ctube->connq_pred = 1;
-	pthread_mutex_unlock(&ctube->connq_mutex);
-	pthread_cond_signal(&ctube->connq_cond);
+	if (record && __atomic_load_n(&ctube->recorder.running, __ATOMIC_RELAXED)) {
+		_ws_ctube_record(channel, out_data, channel->out_data_id);
+	}
+	if (__atomic_load_n(&ctube->shm.running, __ATOMIC_RELAXED)) {
+		ws_ctube_data_acquire(out_data);
+		shm_id = channel->out_data_id;
+	}
 
-	pthread_cleanup_pop(retval); /* conn_qentry_destory */
-out_noinit:
-	pthread_cleanup_pop(retval); /* free */
-out_noalloc:
-	return retval;
+	/* record broadcast time for rate-limiting next time */
+	if (ctube->max_bcast_fps > 0) {
+		channel->prev_bcast_time = *cur_time;
+	}
+	return shm_id;
 }
 
-/** handles incoming data from client */
-static void *ws_ctube_reader_main(void *arg)
+/**
+ * disconnect the clients being sent the oldest broadcasts (other than the
+ * current one) until giving back at least need bytes is under way
+ *
+ * @return bytes the dropped clients were being sent: at most what is given
+ * back once their writers stop, as others may hold the same buffers
+ */
+static size_t _ws_ctube_budget_drop_laggiest(struct ws_ctube *ctube, size_t need)
 {
-	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
-	struct ws_ctube *ctube = conn->ctube;
-	char buf[WS_CTUBE_BUFLEN];
+	struct ws_ctube_conn_table *conn_table = &ctube->conn_table;
+	struct ws_ctube_conn_struct *conn;
+	struct ws_ctube_channel *channel;
+	unsigned long oldest_id;
+	unsigned long id;
+	size_t oldest_bytes;
+	size_t freed = 0;
+
+	pthread_mutex_lock(&conn_table->mutex);
+	while (freed < need) {
+		/* find the oldest broadcast still being sent */
+		oldest_id = 0;
+		oldest_bytes = 0;
+		for (int slot = 0; slot < conn_table->capacity; slot++) {
+			conn = conn_table->conns[slot];
+			if (conn == NULL || conn->dropped) {
+				continue;
+			}
+			id = __atomic_load_n(&conn->sending_id, __ATOMIC_ACQUIRE);
+			channel = __atomic_load_n(&conn->channel, __ATOMIC_ACQUIRE);
+			if (id != 0 && (channel == NULL || id != __atomic_load_n(&channel->out_data_id, __ATOMIC_ACQUIRE)) && (oldest_id == 0 || id < oldest_id)) {
+				oldest_id = id;
+				oldest_bytes = __atomic_load_n(&conn->sending_bytes, __ATOMIC_RELAXED);
+			}
+		}
+		if (oldest_id == 0) {
+			break;
+		}
 
-	for (;;) {
-		/* TODO: handle ping/pong */
-		if (recv(conn->fd, buf, WS_CTUBE_BUFLEN, MSG_NOSIGNAL) < 1) {
-			ws_ctube_connq_push(ctube, conn, WS_CTUBE_CONN_STOP);
-			if (WS_CTUBE_DEBUG) {
-				printf("ws_ctube_reader_main(): disconnected client\n");
-				fflush(stdout);
+		/* its memory is given back once all its writers stop: shutting
+		 * down the socket fails their send and makes the reader queue
+		 * the disconnect */
+		for (int slot = 0; slot < conn_table->capacity; slot++) {
+			conn = conn_table->conns[slot];
+			if (conn == NULL || conn->dropped || __atomic_load_n(&conn->sending_id, __ATOMIC_ACQUIRE) != oldest_id) {
+				continue;
 			}
-			return NULL;
+			conn->dropped = 1;
+			shutdown(conn->fd, SHUT_RDWR);
+			__atomic_add_fetch(&ctube->nbudget_dropped, 1, __ATOMIC_RELAXED);
 		}
+		freed += oldest_bytes;
 	}
+	pthread_mutex_unlock(&conn_table->mutex);
 
-	return NULL;
+	return freed;
 }
 
-/** ensures data is released even if writer is cancelled */
-static void _ws_ctube_cleanup_release_ws_ctube_data(void *arg)
+/** ensures nwaiting is restored even if producer is cancelled */
+static void _ws_ctube_cleanup_budget_wait(void *arg)
 {
-	struct ws_ctube_data *ws_ctube_data = (struct ws_ctube_data *)arg;
-	ws_ctube_ref_count_release(ws_ctube_data, refc, ws_ctube_data_free);
+	struct ws_ctube_data_pool *pool = (struct ws_ctube_data_pool *)arg;
+	__atomic_sub_fetch(&pool->nwaiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->budget_mutex);
 }
 
-/** sends broadcast data to client */
-static void *ws_ctube_writer_main(void *arg)
+/**
+ * block until at most limit bytes of buffers of pool are in use, or until
+ * deadline (CLOCK_REALTIME) if it is not NULL
+ *
+ * @return 0 once at most limit bytes are in use, -1 if deadline passed first
+ */
+static int _ws_ctube_budget_wait(struct ws_ctube_data_pool *pool, size_t limit, const struct timespec *deadline)
 {
-	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
-	struct ws_ctube *ctube = conn->ctube;
-	struct ws_ctube_data *out_data = NULL;
-	unsigned long out_data_id = 0;
-	int send_retval;
-
-	for (;;) {
-		/* wait until new data is needed to be broadcast by checking data id */
-		pthread_mutex_lock(&ctube->out_data_mutex);
-		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->out_data_mutex);
-		while (out_data_id == ctube->out_data_id) {
-			pthread_cond_wait(&ctube->out_data_cond, &ctube->out_data_mutex);
-		}
-
-		ws_ctube_ref_count_acquire(ctube->out_data, refc);
-		out_data = ctube->out_data;
-		out_data_id = ctube->out_data_id;
-
-		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
-		pthread_mutex_unlock(&ctube->out_data_mutex);
+	int retval = 0;
 
-		/* broadcast data in a cancellable way */
-		pthread_cleanup_push(_ws_ctube_cleanup_release_ws_ctube_data, out_data);
-		send_retval = ws_ctube_ws_send(conn->fd, (char *)out_data->data, out_data->data_size);
-		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_release_ws_ctube_data */
-		ws_ctube_ref_count_release(out_data, refc, ws_ctube_data_free);
+	pthread_mutex_lock(&pool->budget_mutex);
+	__atomic_add_fetch(&pool->nwaiting, 1, __ATOMIC_SEQ_CST);
+	pthread_cleanup_push(_ws_ctube_cleanup_budget_wait, pool);
 
-		/* TODO: error handling of failed broadcast */
-		if (send_retval != 0) {
-			continue;
+	while (__atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST) > limit) {
+		if (deadline == NULL) {
+			pthread_cond_wait(&pool->budget_cond, &pool->budget_mutex);
+		} else if (pthread_cond_timedwait(&pool->budget_cond, &pool->budget_mutex, deadline) == ETIMEDOUT) {
+			retval = -1;
+			break;
 		}
 	}
 
-	return NULL;
+	pthread_cleanup_pop(1); /* _ws_ctube_cleanup_budget_wait */
+	return retval;
 }
 
-static void _ws_ctube_cancel_reader(void *arg)
+/**
+ * reserve a buffer of capacity bytes within the memory budget, applying the
+ * budget policy if it does not fit. The reservation is handed to
+ * ws_ctube_data_pool_get() (reserved set) or given back with
+ * ws_ctube_data_pool_unreserve(). Producer only, and never under a channel's
+ * out_data_mutex: BLOCK waits for writers that take it.
+ *
+ * @return 0 if reserved, -1 otherwise
+ */
+static int _ws_ctube_budget_admit(struct ws_ctube *ctube, size_t capacity)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	struct ws_ctube_data_pool *pool = &ctube->data_pool;
+	const size_t budget = pool->budget;
+	const size_t pinned = __atomic_load_n(&ctube->pinned_bytes, __ATOMIC_RELAXED);
+	struct timespec deadline;
+	size_t limit;
+	int retval = 0;
 
-	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
-	pthread_cancel(conn->reader_tid);
-	pthread_join(conn->reader_tid, NULL);
+	if (budget == 0) {
+		_ws_ctube_data_pool_take(pool, capacity);
+		return 0;
+	}
 
-	pthread_setcancelstate(oldstate, &statevar);
-}
+	if (ws_ctube_data_pool_reserve(pool, capacity, budget) == 0) {
+		return 0;
+	}
 
-static void _ws_ctube_cancel_writer(void *arg)
-{
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	switch (ctube->budget_policy) {
+	case WS_CTUBE_BUDGET_REJECT:
+		retval = -1;
+		break;
 
-	struct ws_ctube_conn_struct *conn = (struct ws_ctube_conn_struct *)arg;
-	pthread_cancel(conn->writer_tid);
-	pthread_join(conn->writer_tid, NULL);
+	case WS_CTUBE_BUDGET_DROP:
+		if (capacity > budget || _ws_ctube_budget_drop_laggiest(ctube, __atomic_load_n(&pool->in_use, __ATOMIC_SEQ_CST) + capacity - budget) == 0) {
+			retval = -1;
+			break;
+		}
+		/* what the dropped clients were sent only counts once it is
+		 * given back: another client's delta base, the recorder or
+		 * the current out_data may still hold it */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)WS_CTUBE_BUDGET_DROP_WAIT_MS * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		do {
+			retval = _ws_ctube_budget_wait(pool, budget - capacity, &deadline);
+		} while (retval == 0 && ws_ctube_data_pool_reserve(pool, capacity, budget) != 0);
+		break;
 
-	pthread_setcancelstate(oldstate, &statevar);
+	case WS_CTUBE_BUDGET_BLOCK:
+		/* the current out_data of each channel and any reservation
+		 * are not given back while waiting: do not wait for them */
+		limit = budget >= capacity + pinned ? budget : pinned + capacity;
+		/* producers woken together race for the memory given back */
+		do {
+			_ws_ctube_budget_wait(pool, limit - capacity, NULL);
+		} while (ws_ctube_data_pool_reserve(pool, capacity, limit) != 0);
+		break;
+	}
+
+	if (retval != 0) {
+		__atomic_add_fetch(&ctube->nbudget_rejected, 1, __ATOMIC_RELAXED);
+	}
+	return retval;
 }
 
-/** start reader/writer threads for a client */
-static int ws_ctube_conn_struct_start(struct ws_ctube_conn_struct *conn)
+/**
+ * copy data into a pooled ws_ctube_data and make it the current out_data of
+ * channel. If grid is not NULL, data is a grid with that layout and data_size
+ * is the bytes of it packed along with its grid->nlevel levels. If quant is
+ * not NULL, data are values converted by quant into data_size bytes. record
+ * is passed on to _ws_ctube_set_out_data()
+ */
+static int _ws_ctube_publish(struct ws_ctube_channel *channel, const void *data, size_t data_size, const struct ws_ctube_grid *grid, const struct ws_ctube_quant *quant, int record)
 {
+	struct ws_ctube *ctube = channel->ctube;
+	const size_t capacity = ws_ctube_data_pool_capacity(data_size);
 	int retval = 0;
+	struct timespec cur_time;
+	struct ws_ctube_data *out_data;
+	unsigned long shm_id;
 
-	if (pthread_create(&conn->reader_tid, NULL, ws_ctube_reader_main, (void *)conn) != 0) {
-		fprintf(stderr, "ws_ctube_conn_struct_start(): create reader failed\n");
+	/* not under out_data_mutex: the writers that give back what the
+	 * budget waits for need it to move on */
+	if (_ws_ctube_budget_admit(ctube, capacity) != 0) {
 		retval = -1;
-		goto out_noreader;
+		goto out_nolock;
 	}
-	pthread_cleanup_push(_ws_ctube_cancel_reader, conn);
 
-	if (pthread_create(&conn->writer_tid, NULL, ws_ctube_writer_main, (void *)conn) != 0) {
-		fprintf(stderr, "ws_ctube_conn_struct_start(): create writer failed\n");
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		ws_ctube_data_pool_unreserve(&ctube->data_pool, capacity);
 		retval = -1;
-		goto out_nowriter;
+		goto out_nolock;
 	}
-	pthread_cleanup_push(_ws_ctube_cancel_writer, conn);
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
 
-	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_writer */
-out_nowriter:
-	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_reader */
-out_noreader:
-	return retval;
-}
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		ws_ctube_data_pool_unreserve(&ctube->data_pool, capacity);
+		retval = -1;
+		goto out_ratelim;
+	}
 
-/** cancels reader/writer threads for a client */
-static void ws_ctube_conn_struct_stop(struct ws_ctube_conn_struct *conn)
-{
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	/* get recycled out_data (no allocation in steady state) */
+	out_data = ws_ctube_data_pool_get(&ctube->data_pool, data_size, 1);
+	if (ws_ctube_unlikely(out_data == NULL)) {
+		retval = -1;
+		goto out_nodata;
+	}
 
-	pthread_cancel(conn->reader_tid);
-	pthread_cancel(conn->writer_tid);
+	if (grid != NULL) {
+		out_data->grid = *grid;
+		ws_ctube_grid_pack_strides(&out_data->grid);
+		ws_ctube_grid_pack((char *)out_data->data, (const char *)data, grid);
+
+		/* build the pyramid once for all clients */
+		for (int level = 0; level < grid->nlevel; level++) {
+			struct ws_ctube_grid view;
+			const size_t offset = ws_ctube_grid_level(&out_data->grid, level, &view);
+			char *src = (char *)out_data->data + offset;
+			ws_ctube_grid_downsample(src + ws_ctube_grid_size(&view), src, &view);
+		}
+	} else if (quant != NULL) {
+		const size_t count = (data_size - sizeof(struct ws_ctube_quant_header)) / ws_ctube_quant_elem_size(quant->format);
+		ws_ctube_quantize((char *)out_data->data, data, count, quant);
+	} else {
+		memcpy(out_data->data, data, data_size);
+	}
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, record);
 
-	pthread_join(conn->reader_tid, NULL);
-	pthread_join(conn->writer_tid, NULL);
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
+	}
 
-	pthread_setcancelstate(oldstate, &statevar);
+out_nodata:
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
+	return retval;
 }
 
-static void _ws_ctube_conn_list_add(struct ws_ctube_list *conn_list, struct ws_ctube_conn_struct *conn)
+int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_size)
 {
-	ws_ctube_ref_count_acquire(conn, refc);
-	ws_ctube_list_push_back(conn_list, &conn->lnode);
-}
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_broadcast(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
 
-static void _ws_ctube_conn_list_remove(struct ws_ctube_list *conn_list, struct ws_ctube_conn_struct *conn)
-{
-	ws_ctube_list_unlink(conn_list, &conn->lnode);
-	ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+	return _ws_ctube_publish(&ctube->channel, data, data_size, NULL, NULL, 1);
 }
 
-/** process work item from FIFO connq (start/stop connection) */
-static void ws_ctube_handler_process_queue(struct ws_ctube_list *connq, struct ws_ctube_list *conn_list, int max_nclient)
+int ws_ctube_broadcast_owned(struct ws_ctube *ctube, void *data, size_t data_size, ws_ctube_release_fn release_fn, void *user)
 {
-	struct ws_ctube_conn_qentry *qentry;
-	struct ws_ctube_list_node *node;
-	struct ws_ctube_conn_struct *conn;
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(release_fn == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_owned(): error: release_fn is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
 
-	while ((node = ws_ctube_list_pop_front(connq)) != NULL) {
-		qentry = ws_ctube_container_of(node, typeof(*qentry), lnode);
-		conn = qentry->conn;
+	struct ws_ctube_channel *channel = &ctube->channel;
+	int retval = 0;
+	struct timespec cur_time;
+	struct ws_ctube_data *out_data;
+	unsigned long shm_id;
 
-		pthread_cleanup_push((cleanup_func)ws_ctube_conn_qentry_free, qentry);
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		retval = -1;
+		goto out_nolock;
+	}
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
 
-		switch (qentry->act) {
-		case WS_CTUBE_CONN_START:
-			pthread_mutex_lock(&conn_list->mutex);
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		retval = -1;
+		goto out_ratelim;
+	}
 
-			/* refuse new connections if limit exceeded*/
-			if (conn_list->len >= max_nclient) {
-				pthread_mutex_unlock(&conn_list->mutex);
-				fprintf(stderr, "ws_ctube_handler_process_queue(): max_nclient reached\n");
-				fflush(stderr);
-				break;
-			} else {
-				pthread_mutex_unlock(&conn_list->mutex);
-			}
+	/* get bufferless out_data */
+	out_data = ws_ctube_data_pool_get(&ctube->data_pool, 0, 0);
+	if (ws_ctube_unlikely(out_data == NULL)) {
+		retval = -1;
+		goto out_nodata;
+	}
 
-			/* do websocket handshake */
-			if (ws_ctube_ws_handshake(conn->fd, &conn->ctube->timeout_val) == 0) {
-				ws_ctube_conn_struct_start(conn);
-				_ws_ctube_conn_list_add(conn_list, conn);
-			}
-			break;
+	/* reference caller's data: no copy */
+	ws_ctube_data_set_owned(out_data, data, data_size, release_fn, user);
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, 1);
 
-		case WS_CTUBE_CONN_STOP:
-			pthread_mutex_lock(&conn->stopping_mutex);
-			/* prevent double stop */
-			if (!conn->stopping) {
-				conn->stopping = 1;
-				pthread_mutex_unlock(&conn->stopping_mutex);
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
+	}
 
-				_ws_ctube_conn_list_remove(conn_list, conn);
-				ws_ctube_conn_struct_stop(conn);
-			} else {
-				pthread_mutex_unlock(&conn->stopping_mutex);
-			}
-			break;
+out_nodata:
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
+	return retval;
+}
+
+/**
+ * stop tracking live data that no writer holds or can acquire anymore (i.e.
+ * only the live_list reference remains and it is not the current out_data)
+ */
+static void _ws_ctube_live_retire(struct ws_ctube *ctube)
+{
+	struct ws_ctube_list_node *node, *next;
+	struct ws_ctube_data *data;
+
+	for (node = ctube->live_list.head.next; node != &ctube->live_list.head; node = next) {
+		next = node->next;
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+
+		if (data != ctube->channel.out_data && ws_ctube_data_refs(data) == 1) {
+			ws_ctube_list_unlink(&ctube->live_list, node);
+			ws_ctube_data_release(data);
 		}
+	}
+}
+
+int ws_ctube_broadcast_live(struct ws_ctube *ctube, void *data, size_t data_size)
+{
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_live(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_broadcast_live(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_broadcast_live(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_channel *channel = &ctube->channel;
+	int retval = 0;
+	struct timespec cur_time;
+	struct ws_ctube_data *out_data;
+	unsigned long shm_id;
 
-		pthread_cleanup_pop(1); /* ws_ctube_conn_qentry_free */
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
+		retval = -1;
+		goto out_nolock;
 	}
-}
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
 
-/** stop all client connections and cleanup */
-static void _ws_ctube_cleanup_conn_list(void *arg)
-{
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
+		retval = -1;
+		goto out_ratelim;
+	}
 
-	struct ws_ctube_list *conn_list = (struct ws_ctube_list *)arg;
-	struct ws_ctube_list_node *node;
-	struct ws_ctube_conn_struct *conn;
+	/* get bufferless out_data */
+	out_data = ws_ctube_data_pool_get(&ctube->data_pool, 0, 0);
+	if (ws_ctube_unlikely(out_data == NULL)) {
+		retval = -1;
+		goto out_nodata;
+	}
+	pthread_cleanup_push((cleanup_func)ws_ctube_data_recycle, out_data);
 
-	while ((node = ws_ctube_list_pop_front(conn_list)) != NULL) {
-		conn = ws_ctube_container_of(node, typeof(*conn), lnode);
+	/* reference live data: chunks are only copied once touched */
+	if (ws_ctube_unlikely(ws_ctube_data_set_live(out_data, data, data_size) != 0)) {
+		retval = -1;
+		goto out_noinit;
+	}
 
-		pthread_mutex_lock(&conn->stopping_mutex);
-		/* prevent double stop */
-		if (!conn->stopping) {
-			conn->stopping = 1;
-			pthread_mutex_unlock(&conn->stopping_mutex);
-			ws_ctube_conn_struct_stop(conn);
-		} else {
-			pthread_mutex_unlock(&conn->stopping_mutex);
-		}
+	/* live_list reference: kept until no writer can be sending it */
+	ws_ctube_data_acquire(out_data);
+	ws_ctube_list_push_back(&ctube->live_list, &out_data->lnode);
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, 1);
 
-		ws_ctube_ref_count_release(conn, refc, ws_ctube_conn_struct_free);
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
 	}
 
-	pthread_setcancelstate(oldstate, &statevar);
+	_ws_ctube_live_retire(ctube);
+
+out_noinit:
+	pthread_cleanup_pop(retval); /* ws_ctube_data_recycle */
+out_nodata:
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
+	return retval;
 }
 
-/** connection handler thread: handles new clients via handshake or cleans up disconnected clients */
-static void *ws_ctube_handler_main(void *arg)
+void ws_ctube_live_touch(struct ws_ctube *ctube, const void *addr, size_t len)
 {
-	struct ws_ctube *ctube = (struct ws_ctube *)arg;
+	struct ws_ctube_list_node *node;
+	struct ws_ctube_data *data;
+	int ncopied = 0;
 
-	struct ws_ctube_list conn_list;
-	ws_ctube_list_init(&conn_list);
-	pthread_cleanup_push(_ws_ctube_cleanup_conn_list, &conn_list);
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_live_touch(): error: ctube is NULL\n");
+		fflush(stderr);
+		return;
+	}
+	if (ws_ctube_likely(ctube->live_list.len == 0) || len == 0) {
+		return;
+	}
 
-	for (;;) {
-		/* wait for work items in FIFO connq */
-		pthread_mutex_lock(&ctube->connq_mutex);
-		pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->connq_mutex);
-		while (!ctube->connq_pred) {
-			pthread_cond_wait(&ctube->connq_cond, &ctube->connq_mutex);
+	_ws_ctube_live_retire(ctube);
+
+	ws_ctube_list_for_each(&ctube->live_list, node) {
+		data = ws_ctube_container_of(node, typeof(*data), lnode);
+		const char *base = (const char *)data->data;
+		const char *begin = (const char *)addr;
+		const char *end = begin + len;
+
+		/* clip to overlap with live data */
+		if (end <= base || begin >= base + data->data_size) {
+			continue;
+		}
+		if (begin < base) {
+			begin = base;
+		}
+		if (end > base + data->data_size) {
+			end = base + data->data_size;
 		}
-		ctube->connq_pred = 0;
-		pthread_mutex_unlock(&ctube->connq_mutex);
-		pthread_cleanup_pop(0); /* _ws_ctube_cleanup_unlock_mutex */
 
-		ws_ctube_handler_process_queue(&ctube->connq, &conn_list, ctube->max_nclient);
+		const size_t first = (begin - base) / WS_CTUBE_LIVE_CHUNK_SIZE;
+		const size_t last = (end - 1 - base) / WS_CTUBE_LIVE_CHUNK_SIZE;
+		for (size_t i = first; i <= last; i++) {
+			ncopied += ws_ctube_live_copy_chunk(data->live, base, i);
+		}
 	}
 
-	pthread_cleanup_pop(1);
-	return NULL;
+	/* copied flags must be visible before the caller modifies the memory */
+	if (ncopied > 0) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
 }
 
-/* closes client socket on error */
-static void _ws_ctube_cleanup_close_client_conn(void *arg)
+void *ws_ctube_reserve(struct ws_ctube *ctube, size_t data_size)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_reserve(): error: ctube is NULL\n");
+		fflush(stderr);
+		return NULL;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_reserve(): error: data_size is 0\n");
+		fflush(stderr);
+		return NULL;
+	}
 
-	int *fd = (int *)arg;
-	if (*fd >= 0) {
-		close(*fd);
+	/* reuse previous uncommitted reservation if possible */
+	struct ws_ctube_data *reserved_data = ctube->reserved_data;
+	if (reserved_data != NULL) {
+		if (reserved_data->data_capacity >= data_size) {
+			reserved_data->data_size = data_size;
+			return reserved_data->data;
+		}
+		__atomic_sub_fetch(&ctube->pinned_bytes, reserved_data->data_capacity, __ATOMIC_RELAXED);
+		ws_ctube_data_recycle(reserved_data);
+		ctube->reserved_data = NULL;
 	}
 
-	pthread_setcancelstate(oldstate, &statevar);
+	if (_ws_ctube_budget_admit(ctube, ws_ctube_data_pool_capacity(data_size)) != 0) {
+		return NULL;
+	}
+
+	reserved_data = ws_ctube_data_pool_get(&ctube->data_pool, data_size, 1);
+	if (ws_ctube_unlikely(reserved_data == NULL)) {
+		return NULL;
+	}
+
+	__atomic_add_fetch(&ctube->pinned_bytes, reserved_data->data_capacity, __ATOMIC_RELAXED);
+	ctube->reserved_data = reserved_data;
+	return reserved_data->data;
 }
 
-static int ws_ctube_server_accept_new_conn(struct ws_ctube *ctube, const int server_sock)
+int ws_ctube_commit(struct ws_ctube *ctube, void *data)
 {
-	int retval = 0;
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_commit(): error: ctube is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(ctube->reserved_data == NULL || data != ctube->reserved_data->data)) {
+		fprintf(stderr, "ws_ctube_commit(): error: data was not reserved\n");
+		fflush(stderr);
+		return -1;
+	}
 
-	int conn_fd = accept(server_sock, NULL, NULL);
-	pthread_cleanup_push(_ws_ctube_cleanup_close_client_conn, &conn_fd);
+	struct ws_ctube_channel *channel = &ctube->channel;
+	struct ws_ctube_data *out_data = ctube->reserved_data;
+	int retval = 0;
+	struct timespec cur_time;
+	unsigned long shm_id;
 
-	/* create new conn_struct for client */
-	struct ws_ctube_conn_struct *conn = (typeof(conn))malloc(sizeof(*conn));
-	if (conn == NULL) {
+	if (pthread_mutex_trylock(&channel->out_data_mutex) != 0) {
 		retval = -1;
-		goto out_noalloc;
+		goto out_nolock;
 	}
-	pthread_cleanup_push(free, conn);
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &channel->out_data_mutex);
 
-	if (ws_ctube_conn_struct_init(conn, conn_fd, ctube) != 0) {
+	/* rate limit broadcasting if set */
+	if (_ws_ctube_bcast_ratelim(channel, &cur_time) != 0) {
 		retval = -1;
-		goto out_noinit;
+		goto out_ratelim;
 	}
-	/* ws_ctube_conn_struct_destroy() closes conn_fd now; this prevents _ws_ctube_cleanup_close_client_conn() from closing it */
-	conn_fd = -1;
-	pthread_cleanup_push((cleanup_func)ws_ctube_conn_struct_destroy, conn);
 
-	/* push work item to connection handler to do handshake and start reader/writer */
-	if (ws_ctube_connq_push(ctube, conn, WS_CTUBE_CONN_START) != 0) {
-		retval = -1;
-		goto out_nopush;
+	/* pinned as out_data from now on */
+	__atomic_sub_fetch(&ctube->pinned_bytes, out_data->data_capacity, __ATOMIC_RELAXED);
+	shm_id = _ws_ctube_set_out_data(channel, out_data, &cur_time, 1);
+	ctube->reserved_data = NULL;
+
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	pthread_cond_broadcast(&channel->out_data_cond);
+	if (shm_id != 0) {
+		_ws_ctube_shm_write(channel, out_data, shm_id);
 	}
 
-out_nopush:
-	pthread_cleanup_pop(retval); /* ws_ctube_conn_struct_destroy */
-out_noinit:
-	pthread_cleanup_pop(retval); /* free */
-out_noalloc:
-	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_close_client_conn */
+out_ratelim:
+	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
+out_nolock:
 	return retval;
 }
 
-static void ws_ctube_serve_forever(struct ws_ctube *ctube)
+struct ws_ctube_channel *ws_ctube_channel_open(struct ws_ctube *ctube, const char *name)
 {
-	const int server_sock = ctube->server_sock;
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_channel_open(): error: ctube is NULL\n");
+		fflush(stderr);
+		return NULL;
+	}
+	if (name == NULL) {
+		return &ctube->channel;
+	}
+	if (ws_ctube_unlikely(name[0] == '\0' || strlen(name) >= WS_CTUBE_CHANNEL_NAME_LEN || strpbrk(name, "/?#") != NULL)) {
+		fprintf(stderr, "ws_ctube_channel_open(): error: invalid name\n");
+		fflush(stderr);
+		return NULL;
+	}
 
-	for (;;) {
-		if (ws_ctube_server_accept_new_conn(ctube, server_sock) != 0) {
-			fprintf(stderr, "ws_ctube_serve_forever(): error\n");
-			fflush(stderr);
-		}
+	struct ws_ctube_channel *channel;
+
+	/* the handler looks channels up concurrently under the list mutex */
+	pthread_mutex_lock(&ctube->channel_list.mutex);
+	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->channel_list.mutex);
+
+	channel = _ws_ctube_channel_find_locked(ctube, name, strlen(name));
+	if (channel != NULL) {
+		goto out_found;
 	}
+
+	channel = (typeof(channel))ws_ctube_mem_alloc(&ctube->mem.ctrl, sizeof(*channel), __alignof__(*channel));
+	if (channel == NULL) {
+		goto out_noalloc;
+	}
+	ws_ctube_channel_init(channel, ctube, name);
+	_ws_ctube_list_add_after(ctube->channel_list.head.prev, &channel->lnode);
+	ctube->channel_list.len++;
+
+out_noalloc:
+out_found:
+	pthread_cleanup_pop(1); /* _ws_ctube_cleanup_unlock_mutex */
+	return channel;
 }
 
-/** alert main thread if the server fails to init by setting flag */
-static void _ws_ctube_server_init_fail(void *arg)
+int ws_ctube_channel_set_snapshot(struct ws_ctube_channel *channel, ws_ctube_snapshot_fn snapshot_fn, void *user)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
-	struct ws_ctube *ctube = (struct ws_ctube *)arg;
-	pthread_mutex_lock(&ctube->server_init_mutex);
-	ctube->server_inited = -1;
-	pthread_mutex_unlock(&ctube->server_init_mutex);
-	pthread_cond_signal(&ctube->server_init_cond);
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_channel_set_snapshot(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
 
-	pthread_setcancelstate(oldstate, &statevar);
+	pthread_mutex_lock(&channel->out_data_mutex);
+	channel->snapshot_fn = snapshot_fn;
+	channel->snapshot_user = user;
+	channel->snapshot_size = 0;
+	pthread_mutex_unlock(&channel->out_data_mutex);
+	return 0;
 }
 
-static void _ws_ctube_close_server_sock(void *arg)
+int ws_ctube_publish(struct ws_ctube_channel *channel, const void *data, size_t data_size)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_publish(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_publish(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data_size == 0)) {
+		fprintf(stderr, "ws_ctube_publish(): error: data_size is 0\n");
+		fflush(stderr);
+		return -1;
+	}
 
-	struct ws_ctube *ctube = (struct ws_ctube *)arg;
-	close(ctube->server_sock);
+	return _ws_ctube_publish(channel, data, data_size, NULL, NULL, 1);
+}
 
-	pthread_setcancelstate(oldstate, &statevar);
+/** bytes per element of type, or 0 for WS_CTUBE_ELEM_RAW */
+static size_t _ws_ctube_elem_size(enum ws_ctube_elem_type type)
+{
+	switch (type) {
+	case WS_CTUBE_ELEM_U8:
+	case WS_CTUBE_ELEM_I8:
+		return 1;
+	case WS_CTUBE_ELEM_U16:
+	case WS_CTUBE_ELEM_I16:
+		return 2;
+	case WS_CTUBE_ELEM_U32:
+	case WS_CTUBE_ELEM_I32:
+	case WS_CTUBE_ELEM_F32:
+		return 4;
+	case WS_CTUBE_ELEM_F64:
+		return 8;
+	default:
+		return 0;
+	}
 }
 
-static void *ws_ctube_server_main(void *arg)
+/** @return NULL if grid is a layout ws_ctube_publish_grid() takes, else what is wrong with it */
+static const char *_ws_ctube_grid_invalid(const struct ws_ctube_grid *grid)
 {
-	struct ws_ctube *ctube = (struct ws_ctube *)arg;
-	pthread_cleanup_push(_ws_ctube_server_init_fail, ctube);
+	size_t size = grid->elem_size;
 
-	/* create server socket */
-	int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_sock < 0) {
-		perror("ws_ctube_server_main()");
-		goto out_nosock;
+	if (grid->ndim < 1 || grid->ndim > WS_CTUBE_GRID_MAXDIM || grid->elem_size == 0) {
+		return "invalid grid";
 	}
-	ctube->server_sock = server_sock;
-	pthread_cleanup_push(_ws_ctube_close_server_sock, ctube);
+	if (grid->nlevel < 0 || grid->nlevel > WS_CTUBE_GRID_MAXLEVEL || (unsigned)grid->filter > WS_CTUBE_LOD_MAX) {
+		return "invalid grid levels";
+	}
+	if (grid->type != WS_CTUBE_ELEM_RAW && grid->elem_size != _ws_ctube_elem_size(grid->type)) {
+		return "elem_size does not match type";
+	}
+	for (int i = 0; i < grid->ndim; i++) {
+		if (grid->dims[i] == 0 || size > (size_t)-1 / grid->dims[i]) {
+			return "invalid grid dims";
+		}
+		size *= grid->dims[i];
+	}
+	return NULL;
+}
 
-	/* allow reuse */
-#ifdef __linux__
-	int optname = SO_REUSEADDR | SO_REUSEPORT;
-#else
-	int optname = SO_REUSEADDR;
-#endif
-	int yes = 1;
-	if (setsockopt(server_sock, SOL_SOCKET, optname, &yes, sizeof(yes)) < 0) {
-		perror("ws_ctube_server_main()");
-		goto out_err;
+/**
+ * publish the grid at data with the valid layout grid, building its levels.
+ * record is passed on to _ws_ctube_set_out_data()
+ */
+static int _ws_ctube_publish_grid(struct ws_ctube_channel *channel, const void *data, const struct ws_ctube_grid *grid, int record)
+{
+	struct ws_ctube_grid layout = *grid;
+	struct ws_ctube_grid view;
+	size_t data_size;
+	int packed = 1;
+
+	for (int i = 0; i < layout.ndim; i++) {
+		packed = packed && layout.strides[i] == 0;
+	}
+	if (packed) {
+		ws_ctube_grid_pack_strides(&layout);
 	}
 
-	/* set server socket address/port */
-	if (ws_ctube_bind_server(server_sock, ctube->port) < 0) {
-		perror("ws_ctube_server_main()");
-		goto out_err;
+	/* levels are smaller than the grid, so this cannot overflow */
+	layout.nlevel = ws_ctube_grid_nlevel(&layout);
+	data_size = ws_ctube_grid_level(&layout, layout.nlevel, &view) + ws_ctube_grid_size(&view);
+
+	return _ws_ctube_publish(channel, data, data_size, &layout, NULL, record);
+}
+
+int ws_ctube_publish_grid(struct ws_ctube_channel *channel, const void *data, const struct ws_ctube_grid *grid)
+{
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(grid == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: invalid grid\n");
+		fflush(stderr);
+		return -1;
 	}
 
-	/* set listening */
-	if (listen(server_sock, ctube->max_nclient) < 0) {
-		perror("ws_ctube_server_main()");
-		goto out_err;
+	const char *invalid = _ws_ctube_grid_invalid(grid);
+	if (ws_ctube_unlikely(invalid != NULL)) {
+		fprintf(stderr, "ws_ctube_publish_grid(): error: %s\n", invalid);
+		fflush(stderr);
+		return -1;
 	}
 
-	/* success: alert main thread by setting flag */
-	pthread_mutex_lock(&ctube->server_init_mutex);
-	ctube->server_inited = 1;
-	pthread_mutex_unlock(&ctube->server_init_mutex);
-	pthread_cond_signal(&ctube->server_init_cond);
-	ws_ctube_serve_forever(ctube);
+	return _ws_ctube_publish_grid(channel, data, grid, 1);
+}
+
+int ws_ctube_publish_quantized(struct ws_ctube_channel *channel, const void *data, size_t count, const struct ws_ctube_quant *quant)
+{
+	if (ws_ctube_unlikely(channel == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: channel is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(data == NULL)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: data is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(count == 0 || count > ((size_t)-1 - sizeof(struct ws_ctube_quant_header)) / 2)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: invalid count\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(quant == NULL || (quant->type != WS_CTUBE_ELEM_F32 && quant->type != WS_CTUBE_ELEM_F64)
+			      || (unsigned)quant->format > WS_CTUBE_QUANT_U16)) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: invalid quant\n");
+		fflush(stderr);
+		return -1;
+	}
+	/* a fixed range must be finite and not empty, unless left to each publish */
+	if (ws_ctube_unlikely(!(quant->min == 0 && quant->max == 0) && !(quant->min < quant->max && quant->max - quant->min < INFINITY))) {
+		fprintf(stderr, "ws_ctube_publish_quantized(): error: invalid quant range\n");
+		fflush(stderr);
+		return -1;
+	}
 
-	/* code doesn't get here unless error */
-out_err:
-	pthread_cleanup_pop(1); /* _ws_ctube_close_server_sock */
-out_nosock:
-	pthread_cleanup_pop(1); /* _ws_ctube_server_init_fail */
-	return NULL;
+	return _ws_ctube_publish(channel, data, ws_ctube_quant_size(quant->format, count), NULL, quant, 1);
 }
 
-static void _ws_ctube_cancel_handler(void *arg)
+void ws_ctube_get_stats(struct ws_ctube *ctube, struct ws_ctube_stats *stats)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
-	struct ws_ctube *ctube = (struct ws_ctube *)arg;
-	pthread_cancel(ctube->handler_tid);
-	pthread_join(ctube->handler_tid, NULL);
+	if (ws_ctube_unlikely(ctube == NULL)) {
+		fprintf(stderr, "ws_ctube_get_stats(): error: ctube is NULL\n");
+		fflush(stderr);
+		return;
+	}
+	if (ws_ctube_unlikely(stats == NULL)) {
+		fprintf(stderr, "ws_ctube_get_stats(): error: stats is NULL\n");
+		fflush(stderr);
+		return;
+	}
 
-	pthread_setcancelstate(oldstate, &statevar);
+	stats->bytes_in_flight = __atomic_load_n(&ctube->data_pool.in_use, __ATOMIC_SEQ_CST);
+	stats->bytes_in_flight_peak = __atomic_load_n(&ctube->data_pool.in_use_peak, __ATOMIC_SEQ_CST);
+	stats->bytes_cached = __atomic_load_n(&ctube->data_pool.cached, __ATOMIC_SEQ_CST);
+	stats->nbudget_rejected = __atomic_load_n(&ctube->nbudget_rejected, __ATOMIC_SEQ_CST);
+	stats->nbudget_dropped = __atomic_load_n(&ctube->nbudget_dropped, __ATOMIC_SEQ_CST);
+	stats->nrecorded = __atomic_load_n(&ctube->recorder.nrecorded, __ATOMIC_SEQ_CST);
+	stats->nrecord_dropped = __atomic_load_n(&ctube->recorder.ndropped, __ATOMIC_SEQ_CST);
+	stats->nshm_written = __atomic_load_n(&ctube->shm.nwritten, __ATOMIC_SEQ_CST);
+	stats->nshm_dropped = __atomic_load_n(&ctube->shm.ndropped, __ATOMIC_SEQ_CST);
+	stats->nreplay_skipped = __atomic_load_n(&ctube->nreplay_skipped, __ATOMIC_SEQ_CST);
 }
 
-static void _ws_ctube_cancel_server(void *arg)
+void ws_ctube_replay_opts_init(struct ws_ctube_replay_opts *opts)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
-	struct ws_ctube *ctube = (struct ws_ctube *)arg;
-	pthread_cancel(ctube->server_tid);
-	pthread_join(ctube->server_tid, NULL);
-
-	pthread_setcancelstate(oldstate, &statevar);
+	opts->speed = 1;
+	opts->start_ns = 0;
+	opts->end_ns = 0;
 }
 
-/* start connection handler and server threads */
-static int ws_ctube_start(struct ws_ctube *ctube)
+/** read-only mapping of a file of a log */
+struct _ws_ctube_replay_file {
+	const char *map;
+	size_t size;
+};
+
+/**
+ * map the file called name
+ *
+ * @return 0 on success, -1 otherwise (errno is ENOENT if there is no such file)
+ */
+static int _ws_ctube_replay_open(struct _ws_ctube_replay_file *file, const char *name)
 {
-	int retval = 0;
+	struct stat st;
+	void *map;
+	int fd;
+	int retval = -1;
 
-	if (pthread_create(&ctube->handler_tid, NULL, ws_ctube_handler_main, (void *)ctube) != 0) {
-		fprintf(stderr, "ws_ctube_start(): create handler failed\n");
-		retval = -1;
-		goto out_nohandler;
-	}
-	pthread_cleanup_push(_ws_ctube_cancel_handler, ctube);
+	file->map = NULL;
+	file->size = 0;
 
-	if (pthread_create(&ctube->server_tid, NULL, ws_ctube_server_main, (void *)ctube) != 0) {
-		fprintf(stderr, "ws_ctube_start(): create server failed\n");
-		retval = -1;
-		goto out_noserver;
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		goto out_noopen;
 	}
-	pthread_cleanup_push(_ws_ctube_cancel_server, ctube);
-
-	/* wait for server thread to report success/failure to start */
-	pthread_mutex_lock(&ctube->server_init_mutex);
-	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->server_init_mutex);
-	if (ctube->timeout_spec.tv_nsec > 0 || ctube->timeout_spec.tv_sec > 0) {
-		while (!ctube->server_inited) {
-			pthread_cond_timedwait(&ctube->server_init_cond, &ctube->server_init_mutex, &ctube->timeout_spec);
-		}
-	} else {
-		while (!ctube->server_inited) {
-			pthread_cond_wait(&ctube->server_init_cond, &ctube->server_init_mutex);
-		}
+	if (fstat(fd, &st) != 0) {
+		goto out_nomap;
 	}
-	if (ctube->server_inited <= 0) {
-		fprintf(stderr, "ws_ctube_start(): server failed to init\n");
-		retval = -1;
-		goto out_noinit;
+	if (st.st_size == 0) {
+		retval = 0;
+		goto out_nomap;
 	}
-	pthread_mutex_unlock(&ctube->server_init_mutex);
 
-out_noinit:
-	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
-	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_server */
-out_noserver:
-	pthread_cleanup_pop(retval); /* _ws_ctube_cancel_handler */
-out_nohandler:
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		goto out_nomap;
+	}
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	file->map = (const char *)map;
+	file->size = (size_t)st.st_size;
+	retval = 0;
+
+out_nomap:
+	close(fd);
+out_noopen:
 	return retval;
 }
 
-/** stop connection handler and server threads */
-static void ws_ctube_stop(struct ws_ctube *ctube)
+static void _ws_ctube_replay_close(void *arg)
 {
-	int oldstate, statevar;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
-	pthread_cancel(ctube->handler_tid);
-	pthread_cancel(ctube->server_tid);
-
-	pthread_join(ctube->handler_tid, NULL);
-	pthread_join(ctube->server_tid, NULL);
+	struct _ws_ctube_replay_file *file = (struct _ws_ctube_replay_file *)arg;
 
-	pthread_setcancelstate(oldstate, &statevar);
+	if (file->map != NULL) {
+		munmap((void *)file->map, file->size);
+	}
+	file->map = NULL;
+	file->size = 0;
 }
 
-struct ws_ctube* ws_ctube_open(
-	int port,
-	int max_nclient,
-	int timeout_ms,
-	double max_broadcast_fps)
+/**
+ * find where to replay from for start_ns: the record of the last index entry
+ * at or before it (entries are in time order), else the start of the log
+ */
+static void _ws_ctube_replay_seek(const char *path, long long start_ns, uint32_t *segment, size_t *offset)
 {
-	int err = 0;
-	struct ws_ctube *ctube;
+	char name[PATH_MAX];
+	struct _ws_ctube_replay_file index;
+	struct ws_ctube_record_index entry;
+	size_t lo = 0;
+	size_t hi;
 
-	/* input sanity checks */
-	if (port < 1) {
-		fprintf(stderr, "ws_ctube_open(): invalid port\n");
-		fflush(stderr);
-		err = -1;
-		goto out_noalloc;
-	}
-	if (max_nclient < 1) {
-		fprintf(stderr, "ws_ctube_open(): invalid max_nclient\n");
-		fflush(stderr);
-		err = -1;
-		goto out_noalloc;
+	*segment = 0;
+	*offset = sizeof(struct ws_ctube_record_segment);
+
+	if (snprintf(name, sizeof(name), "%s.index", path) >= (int)sizeof(name) || _ws_ctube_replay_open(&index, name) != 0) {
+		return;
 	}
-	if (timeout_ms < 0) {
-		fprintf(stderr, "ws_ctube_open(): invalid timeout_ms\n");
-		fflush(stderr);
-		err = -1;
-		goto out_noalloc;
+
+	hi = index.size / sizeof(entry);
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		memcpy(&entry, index.map + mid * sizeof(entry), sizeof(entry));
+		if (entry.time_ns <= start_ns) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	if (max_broadcast_fps < 0) {
-		fprintf(stderr, "ws_ctube_open(): invalid max_broadcast_fps\n");
-		fflush(stderr);
-		err = -1;
-		goto out_noalloc;
+	if (lo > 0) {
+		memcpy(&entry, index.map + (lo - 1) * sizeof(entry), sizeof(entry));
+		*segment = entry.segment;
+		*offset = (size_t)entry.offset;
 	}
 
-	ctube = (typeof(ctube))malloc(sizeof(*ctube));
-	if (ctube == NULL) {
-		err = -1;
-		goto out_noalloc;
-	}
-	pthread_cleanup_push((cleanup_func)free, ctube);
+	_ws_ctube_replay_close(&index);
+}
 
-	if (ws_ctube_init(ctube, port, max_nclient, timeout_ms, max_broadcast_fps) != 0) {
-		err = -1;
-		goto out_noinit;
-	}
-	pthread_cleanup_push((cleanup_func)ws_ctube_destroy, ctube);
+/** wait until a record recorded elapsed_ns after the first replayed one is due */
+static void _ws_ctube_replay_wait(const struct timespec *start_time, long long elapsed_ns, double speed)
+{
+	const long long ns = (long long)((double)elapsed_ns / speed);
+	struct timespec due;
 
-	if (ws_ctube_start(ctube) != 0) {
-		err = -1;
-		goto out_nostart;
+	if (ns <= 0) {
+		return;
 	}
 
-out_nostart:
-	pthread_cleanup_pop(err);
-out_noinit:
-	pthread_cleanup_pop(err);
-out_noalloc:
-	if (err) {
-		return NULL;
-	} else {
-		return ctube;
+	due.tv_sec = start_time->tv_sec + (time_t)(ns / 1000000000);
+	due.tv_nsec = start_time->tv_nsec + (long)(ns % 1000000000);
+	if (due.tv_nsec >= 1000000000) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000;
 	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
 }
 
-void ws_ctube_close(struct ws_ctube *ctube)
+/**
+ * layout of a grid record of size bytes
+ *
+ * @return 0 if it is one ws_ctube_publish_grid() takes, packed in size bytes
+ */
+static int _ws_ctube_replay_grid(struct ws_ctube_grid *grid, const struct ws_ctube_record_grid *rec, uint64_t size)
 {
-	if (ws_ctube_unlikely(ctube == NULL)) {
-		fprintf(stderr, "ws_ctube_close(): error: ctube is NULL\n");
-		fflush(stderr);
-		return;
+	memset(grid, 0, sizeof(*grid));
+	if (rec->ndim < 1 || rec->ndim > WS_CTUBE_GRID_MAXDIM || rec->nlevel > WS_CTUBE_GRID_MAXLEVEL
+	    || rec->type > (uint32_t)WS_CTUBE_ELEM_F64 || rec->filter > (uint32_t)WS_CTUBE_LOD_MAX || rec->elem_size > size) {
+		return -1;
+	}
+	grid->ndim = (int)rec->ndim;
+	grid->type = (enum ws_ctube_elem_type)rec->type;
+	grid->nlevel = (int)rec->nlevel;
+	grid->filter = (enum ws_ctube_lod_filter)rec->filter;
+	grid->elem_size = (size_t)rec->elem_size;
+	for (int i = 0; i < grid->ndim; i++) {
+		if (rec->dims[i] > size) {
+			return -1;
+		}
+		grid->dims[i] = (size_t)rec->dims[i];
+	}
+	if (_ws_ctube_grid_invalid(grid) != NULL || ws_ctube_grid_size(grid) != size) {
+		return -1;
 	}
+	return 0;
+}
 
-	ws_ctube_stop(ctube);
-	ws_ctube_destroy(ctube);
-	free(ctube);
+/**
+ * publish a replayed record, not to be recorded again: of a grid (with its
+ * levels built again) if grid is not NULL. Retried for up to
+ * WS_CTUBE_REPLAY_RETRY ms if that fails (long enough to wait out the rate
+ * limit of max_broadcast_fps >= 10), then counted as skipped
+ */
+static int _ws_ctube_replay_publish(struct ws_ctube_channel *channel, const void *data, size_t size, const struct ws_ctube_grid *grid)
+{
+	static const struct timespec retry_wait = {0, 1000000};
+	int retval;
+
+	for (int i = 0; size > 0 && i < WS_CTUBE_REPLAY_RETRY; i++) {
+		if (grid != NULL) {
+			retval = _ws_ctube_publish_grid(channel, data, grid, 0);
+		} else {
+			retval = _ws_ctube_publish(channel, data, size, NULL, NULL, 0);
+		}
+		if (retval == 0) {
+			return 0;
+		}
+		nanosleep(&retry_wait, NULL);
+	}
+	__atomic_add_fetch(&channel->ctube->nreplay_skipped, 1, __ATOMIC_RELAXED);
+	return -1;
 }
 
-int ws_ctube_broadcast(struct ws_ctube *ctube, const void *data, size_t data_size)
+long ws_ctube_replay(struct ws_ctube *ctube, const char *path, const struct ws_ctube_replay_opts *opts)
 {
 	if (ws_ctube_unlikely(ctube == NULL)) {
-		fprintf(stderr, "ws_ctube_broadcast(): error: ctube is NULL\n");
+		fprintf(stderr, "ws_ctube_replay(): error: ctube is NULL\n");
 		fflush(stderr);
 		return -1;
 	}
-	if (ws_ctube_unlikely(data == NULL)) {
-		fprintf(stderr, "ws_ctube_broadcast(): error: data is NULL\n");
+	if (ws_ctube_unlikely(path == NULL)) {
+		fprintf(stderr, "ws_ctube_replay(): error: path is NULL\n");
 		fflush(stderr);
 		return -1;
 	}
-	if (ws_ctube_unlikely(data_size == 0)) {
-		fprintf(stderr, "ws_ctube_broadcast(): error: data_size is 0\n");
+	if (ws_ctube_unlikely(opts != NULL && !(opts->speed >= 0))) {
+		fprintf(stderr, "ws_ctube_replay(): error: invalid speed\n");
 		fflush(stderr);
 		return -1;
 	}
 
-	int retval = 0;
-	if (pthread_mutex_trylock(&ctube->out_data_mutex) != 0) {
-		retval = -1;
-		goto out_nolock;
+	struct ws_ctube_replay_opts defaults;
+	struct _ws_ctube_replay_file file;
+	struct ws_ctube_record_segment seg;
+	struct ws_ctube_record_header hdr;
+	struct ws_ctube_record_grid rec_grid;
+	struct ws_ctube_grid grid;
+	size_t grid_len, left;
+	struct ws_ctube_channel *channel = NULL;
+	char name[PATH_MAX];
+	char channel_name[WS_CTUBE_CHANNEL_NAME_LEN];
+	uint32_t segment;
+	size_t offset;
+	struct timespec start_time;
+	long long first_ns = 0;
+	int started = 0;
+	int done = 0;
+	long nreplayed = 0;
+
+	if (opts == NULL) {
+		ws_ctube_replay_opts_init(&defaults);
+		opts = &defaults;
 	}
-	pthread_cleanup_push(_ws_ctube_cleanup_unlock_mutex, &ctube->out_data_mutex);
 
-	/* rate limit broadcasting if set */
-	struct timespec cur_time;
-	const double max_bcast_fps = ctube->max_bcast_fps;
-	if (max_bcast_fps > 0) {
+	if (opts->start_ns > 0) {
+		_ws_ctube_replay_seek(path, opts->start_ns, &segment, &offset);
+	} else {
+		segment = 0;
+		offset = sizeof(seg);
+	}
 
-#ifdef CLOCK_MONOTONIC
-		if (ws_ctube_unlikely(clock_gettime(CLOCK_MONOTONIC, &cur_time) != 0)) {
-			clock_gettime(CLOCK_REALTIME, &cur_time);
+	while (!done) {
+		if (snprintf(name, sizeof(name), "%s.%06lu", path, (unsigned long)segment) >= (int)sizeof(name)) {
+			fprintf(stderr, "ws_ctube_replay(): error: path too long\n");
+			fflush(stderr);
+			return -1;
 		}
-#else
-		clock_gettime(CLOCK_REALTIME, &cur_time);
-#endif /* CLOCK_MONOTONIC */
+		if (_ws_ctube_replay_open(&file, name) != 0) {
+			/* past the last file */
+			if (errno == ENOENT && (started || segment > 0)) {
+				break;
+			}
+			fprintf(stderr, "ws_ctube_replay(): error: cannot read %s: %s\n", name, strerror(errno));
+			fflush(stderr);
+			return -1;
+		}
+		pthread_cleanup_push(_ws_ctube_replay_close, &file);
 
-		double dt = (cur_time.tv_sec - ctube->prev_bcast_time.tv_sec) +
-			1e-9 * (cur_time.tv_nsec - ctube->prev_bcast_time.tv_nsec);
+		if (file.size >= sizeof(seg)) {
+			memcpy(&seg, file.map, sizeof(seg));
+		}
+		if (file.size < sizeof(seg) || memcmp(seg.magic, WS_CTUBE_RECORD_SEGMENT_MAGIC, sizeof(seg.magic)) != 0 || seg.version != WS_CTUBE_RECORD_VERSION) {
+			fprintf(stderr, "ws_ctube_replay(): error: %s is not a log file\n", name);
+			fflush(stderr);
+			nreplayed = -1;
+			done = 1;
+		}
 
-		if (dt < 1.0 / ctube->max_bcast_fps) {
-			retval = -1;
-			goto out_ratelim;
+		/* up to a record that is not complete (the end of the file); each
+		 * part is checked against what is left before the next is, so
+		 * that the remainder cannot wrap around */
+		while (!done && offset <= file.size && file.size - offset >= sizeof(hdr)) {
+			memcpy(&hdr, file.map + offset, sizeof(hdr));
+			left = file.size - offset - sizeof(hdr);
+			grid_len = (hdr.flags & WS_CTUBE_RECORD_GRID) ? sizeof(rec_grid) : 0;
+			if (hdr.magic != WS_CTUBE_RECORD_MAGIC || hdr.channel_len >= sizeof(channel_name)
+			    || grid_len > left || hdr.channel_len > left - grid_len
+			    || hdr.size > left - grid_len - hdr.channel_len) {
+				break;
+			}
+			const char *rec = file.map + offset + sizeof(hdr);
+			offset += (sizeof(hdr) + grid_len + hdr.channel_len + hdr.size + 7) & ~(size_t)7;
+			if (grid_len > 0) {
+				memcpy(&rec_grid, rec, sizeof(rec_grid));
+				rec += sizeof(rec_grid);
+			}
+
+			if (hdr.time_ns < opts->start_ns) {
+				continue;
+			}
+			if (opts->end_ns > 0 && hdr.time_ns >= opts->end_ns) {
+				done = 1;
+				break;
+			}
+
+			if (opts->speed > 0 && started) {
+				_ws_ctube_replay_wait(&start_time, hdr.time_ns - first_ns, opts->speed);
+			} else if (!started) {
+				clock_gettime(CLOCK_MONOTONIC, &start_time);
+				first_ns = hdr.time_ns;
+			}
+			started = 1;
+
+			memcpy(channel_name, rec, hdr.channel_len);
+			channel_name[hdr.channel_len] = '\0';
+			if (channel == NULL || strcmp(channel->name, channel_name) != 0) {
+				channel = ws_ctube_channel_open(ctube, channel_name[0] != '\0' ? channel_name : NULL);
+			}
+			if (channel == NULL || (grid_len > 0 && _ws_ctube_replay_grid(&grid, &rec_grid, hdr.size) != 0)) {
+				__atomic_add_fetch(&ctube->nreplay_skipped, 1, __ATOMIC_RELAXED);
+			} else if (_ws_ctube_replay_publish(channel, rec + hdr.channel_len, hdr.size, grid_len > 0 ? &grid : NULL) == 0) {
+				nreplayed++;
+			}
 		}
-	}
 
-	/* release old out_data if held */
-	if (ctube->out_data != NULL) {
-		ws_ctube_ref_count_release(ctube->out_data, refc, ws_ctube_data_free);
+		pthread_cleanup_pop(1); /* _ws_ctube_replay_close */
+		segment++;
+		offset = sizeof(seg);
 	}
 
-	/* alloc new out_data */
-	ctube->out_data = (typeof(ctube->out_data))malloc(sizeof(*ctube->out_data));
-	if (ws_ctube_unlikely(ctube->out_data == NULL)) {
-		retval = -1;
-		goto out_nodata;
+	return nreplayed;
+}
+
+struct ws_ctube_shm_reader *ws_ctube_shm_reader_open(const char *path)
+{
+	struct ws_ctube_shm_reader *reader;
+
+	if (ws_ctube_unlikely(path == NULL)) {
+		fprintf(stderr, "ws_ctube_shm_reader_open(): error: path is NULL\n");
+		fflush(stderr);
+		return NULL;
 	}
-	pthread_cleanup_push(free, ctube->out_data);
 
-	/* init and memcpy into out_data */
-	if (ws_ctube_unlikely(ws_ctube_data_init(ctube->out_data, data, data_size) != 0)) {
-		retval = -1;
+	reader = (struct ws_ctube_shm_reader *)malloc(sizeof(*reader));
+	if (reader == NULL) {
+		goto out_noreader;
+	}
+	if (ws_ctube_shm_reader_init(reader, path) != 0) {
 		goto out_noinit;
 	}
-	ws_ctube_ref_count_acquire(ctube->out_data, refc);
-	ctube->out_data_id++; /* unique id for out_data */
+	return reader;
 
-	/* record broadcast time for rate-limiting next time */
-	if (max_bcast_fps > 0) {
-		ctube->prev_bcast_time = cur_time;
+out_noinit:
+	free(reader);
+out_noreader:
+	return NULL;
+}
+
+void ws_ctube_shm_reader_close(struct ws_ctube_shm_reader *reader)
+{
+	if (ws_ctube_unlikely(reader == NULL)) {
+		fprintf(stderr, "ws_ctube_shm_reader_close(): error: reader is NULL\n");
+		fflush(stderr);
+		return;
 	}
 
-	pthread_mutex_unlock(&ctube->out_data_mutex);
-	pthread_cond_broadcast(&ctube->out_data_cond);
+	ws_ctube_shm_reader_destroy(reader);
+	free(reader);
+}
 
-out_noinit:
-	pthread_cleanup_pop(retval); /* free */
-out_nodata:
-out_ratelim:
-	pthread_cleanup_pop(retval); /* _ws_ctube_cleanup_unlock_mutex */
-out_nolock:
-	return retval;
+long ws_ctube_shm_read(struct ws_ctube_shm_reader *reader, void *buf, size_t max, struct ws_ctube_shm_msg *msg, int timeout_ms)
+{
+	if (ws_ctube_unlikely(reader == NULL)) {
+		fprintf(stderr, "ws_ctube_shm_read(): error: reader is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+	if (ws_ctube_unlikely(buf == NULL && max > 0)) {
+		fprintf(stderr, "ws_ctube_shm_read(): error: buf is NULL\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	struct ws_ctube_shm_msg unused;
+	struct timespec deadline, now, left;
+	uint32_t futex;
+	long size;
+
+	if (msg == NULL) {
+		msg = &unused;
+	}
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	for (;;) {
+		/* read before looking: a broadcast after it changes it */
+		futex = __atomic_load_n(&reader->hdr->futex, __ATOMIC_ACQUIRE);
+		size = ws_ctube_shm_reader_next(reader, buf, max, msg);
+		if (size != 0 || timeout_ms == 0) {
+			return size;
+		}
+
+		if (timeout_ms < 0) {
+			ws_ctube_shm_reader_wait(reader, futex, NULL);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = deadline.tv_sec - now.tv_sec;
+		left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000;
+		}
+		if (left.tv_sec < 0) {
+			return 0;
+		}
+		ws_ctube_shm_reader_wait(reader, futex, &left);
+	}
 }
 
 